@@ -0,0 +1,237 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <cpu_rt/parallel_for.h>
+#include <cpu_rt/render_scene.h>
+#include <cpu_rt/rng.h>
+#include <cpu_rt/traversal_stats.h>
+#include <nlohmann/json.hpp>
+
+using namespace cpu_rt;
+
+using Json = nlohmann::ordered_json;
+
+static_assert(k_traversalStatsEnabled, "bvh_stats needs the counters of cpu_rt_stats.");
+
+static constexpr uint32_t k_width = 960;
+static constexpr uint32_t k_height = 540;
+
+static constexpr uint32_t k_shadowRayFlags = k_rayFlagCullBackFacingTriangles |
+                                             k_rayFlagForceOpaque;
+
+// Primary rays with RayGenShader's field of view, from far enough down -z that the whole scene
+// is in view.
+static std::vector<Ray> GenerateCameraRays(const Aabb& sceneBounds) {
+  Float3 center = sceneBounds.Centroid();
+  Float3 extent = sceneBounds.Extent();
+
+  float distance = 0.5f * std::max(extent.x, extent.y) / 0.414f + 0.5f * extent.z;
+  Float3 cameraPos = center - Float3{0.f, 0.f, distance};
+
+  std::vector<Ray> rays(k_width * k_height);
+
+  for (uint32_t y = 0; y < k_height; ++y) {
+    for (uint32_t x = 0; x < k_width; ++x) {
+      uint32_t rngState = InitRngSeed(x, y, 0);
+
+      float lerpX = (static_cast<float>(x) + Rand(&rngState)) / static_cast<float>(k_width);
+      float lerpY = (static_cast<float>(y) + Rand(&rngState)) / static_cast<float>(k_height);
+
+      float viewportX = -1.78f + lerpX * 3.56f;
+      float viewportY = 1.f - lerpY * 2.f;
+
+      Ray& ray = rays[y * k_width + x];
+      ray.Origin = cameraPos;
+      ray.Direction = Float3{viewportX * 0.414f, viewportY * 0.414f, 1.f};
+      ray.TMin = 0.f;
+      ray.TMax = 10000.f;
+    }
+  }
+
+  return rays;
+}
+
+// Shadow rays from the primary hits to random points on the light.
+static std::vector<Ray> GenerateShadowRays(const RenderScene& renderScene,
+                                           const std::vector<Ray>& cameraRays) {
+  const QuadShape& light = renderScene.GetLight();
+
+  std::vector<Ray> shadowRays;
+
+  for (size_t i = 0; i < cameraRays.size(); ++i) {
+    const Ray& cameraRay = cameraRays[i];
+
+    HitInfo hit;
+    if (!renderScene.GetTlas().TraceRay(cameraRay, k_rayFlagCullBackFacingTriangles,
+                                        k_sceneInstanceMask, 0, 1, &hit))
+      continue;
+
+    Float3 hitPos = cameraRay.Origin + hit.T * cameraRay.Direction;
+
+    uint32_t rngState = JenkinsHash(static_cast<uint32_t>(i));
+    Float3 lightSamplePos = light.Center + (2.f * Rand(&rngState) - 1.f) * light.AxisU +
+                            (2.f * Rand(&rngState) - 1.f) * light.AxisV;
+
+    Float3 toLight = lightSamplePos - hitPos;
+    float lightDist = Length(toLight);
+
+    Ray shadowRay{};
+    shadowRay.Origin = hitPos;
+    shadowRay.Direction = toLight / lightDist;
+    shadowRay.TMin = 0.0001f;
+    shadowRay.TMax = lightDist;
+
+    shadowRays.push_back(shadowRay);
+  }
+
+  return shadowRays;
+}
+
+static Json ToJson(const BvhStats& stats) {
+  Json json;
+  json["nodeCount"] = stats.NodeCount;
+  json["leafCount"] = stats.LeafCount;
+  json["maxDepth"] = stats.MaxDepth;
+  json["averageLeafDepth"] = stats.AverageLeafDepth;
+  json["sahCost"] = stats.SahCost;
+  json["siblingOverlap"] = stats.SiblingOverlap;
+  json["leafSizeHistogram"] = stats.LeafSizeHistogram;
+  return json;
+}
+
+static double PerRay(uint64_t count, uint64_t rayCount) {
+  return rayCount > 0 ? static_cast<double>(count) / static_cast<double>(rayCount) : 0.0;
+}
+
+// Traces every ray with traceFn(ray) and returns the counters the pass added, with the nodes
+// each ray visited sampled from the tracing thread's counters.
+template<typename TraceFn>
+static TraversalStats CountPass(const std::vector<Ray>& rays, TraceFn&& traceFn,
+                                std::vector<uint32_t>* nodesPerRay) {
+  TraversalStats before = GetTraversalStats();
+
+  nodesPerRay->resize(rays.size());
+
+  ParallelFor(rays.size(), [&](size_t begin, size_t end) {
+    std::atomic<uint64_t>& nodesVisited =
+        GetThreadTraversalCounters()[static_cast<size_t>(TraversalCounter::NodesVisited)];
+
+    for (size_t i = begin; i < end; ++i) {
+      uint64_t nodesBefore = nodesVisited.load(std::memory_order_relaxed);
+      traceFn(rays[i]);
+      (*nodesPerRay)[i] = static_cast<uint32_t>(nodesVisited.load(std::memory_order_relaxed) -
+                                                nodesBefore);
+    }
+  });
+
+  TraversalStats after = GetTraversalStats();
+
+  TraversalStats pass{};
+  pass.Rays = after.Rays - before.Rays;
+  pass.ShadowRays = after.ShadowRays - before.ShadowRays;
+  pass.ShadowRaysOccluded = after.ShadowRaysOccluded - before.ShadowRaysOccluded;
+  pass.OccluderCacheHits = after.OccluderCacheHits - before.OccluderCacheHits;
+  pass.NodesVisited = after.NodesVisited - before.NodesVisited;
+  pass.TrianglesTested = after.TrianglesTested - before.TrianglesTested;
+  pass.ProceduralPrimitivesTested = after.ProceduralPrimitivesTested -
+                                    before.ProceduralPrimitivesTested;
+  return pass;
+}
+
+static Json ToJson(const TraversalStats& pass, uint64_t rayCount,
+                   std::vector<uint32_t> nodesPerRay) {
+  std::sort(nodesPerRay.begin(), nodesPerRay.end());
+
+  auto percentile = [&](double p) {
+    if (nodesPerRay.empty())
+      return 0u;
+    return nodesPerRay[static_cast<size_t>(p * static_cast<double>(nodesPerRay.size() - 1))];
+  };
+
+  Json json;
+  json["rays"] = rayCount;
+  json["nodesVisitedPerRay"] = PerRay(pass.NodesVisited, rayCount);
+  json["nodesVisitedPercentiles"] = {
+    { "p50", percentile(0.5) },
+    { "p90", percentile(0.9) },
+    { "p99", percentile(0.99) },
+    { "max", percentile(1.0) }
+  };
+  json["trianglesTestedPerRay"] = PerRay(pass.TrianglesTested, rayCount);
+  json["proceduralPrimitivesTestedPerRay"] = PerRay(pass.ProceduralPrimitivesTested, rayCount);
+
+  if (pass.ShadowRays > 0) {
+    json["earlyOutRate"] = PerRay(pass.ShadowRaysOccluded, pass.ShadowRays);
+    json["occluderCacheHitRate"] = PerRay(pass.OccluderCacheHits, pass.ShadowRays);
+  }
+
+  return json;
+}
+
+// Usage: bvh_stats [--prefer-fast-trace] [--minimize-memory] [scene.gltf]
+//
+// Builds the scene like cpu_bench, traces camera and shadow rays through it and prints the BVH
+// and traversal stats as JSON.
+int main(int argc, char** argv) {
+  const char* path = "assets/cornell_box.gltf";
+  uint32_t buildFlags = k_buildFlagNone;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--prefer-fast-trace") == 0) {
+      buildFlags |= k_buildFlagPreferFastTrace;
+    } else if (strcmp(argv[i], "--minimize-memory") == 0) {
+      buildFlags |= k_buildFlagMinimizeMemory;
+    } else {
+      path = argv[i];
+    }
+  }
+
+  utils::Scene scene = utils::LoadGltf(path);
+
+  auto buildStart = std::chrono::steady_clock::now();
+  RenderScene renderScene(scene, {}, buildFlags);
+  std::chrono::duration<double, std::milli> buildTime =
+      std::chrono::steady_clock::now() - buildStart;
+
+  const Blas& meshBlas = renderScene.GetMeshBlas();
+  const Tlas& tlas = renderScene.GetTlas();
+
+  std::vector<Ray> cameraRays = GenerateCameraRays(meshBlas.GetBounds());
+  std::vector<Ray> shadowRays = GenerateShadowRays(renderScene, cameraRays);
+
+  std::vector<uint32_t> nodesPerRay;
+
+  TraversalStats cameraPass = CountPass(cameraRays, [&](const Ray& ray) {
+    HitInfo hit;
+    tlas.TraceRay(ray, k_rayFlagCullBackFacingTriangles, ~0u, 0, 1, &hit,
+                  renderScene.GetIntersectionTable());
+  }, &nodesPerRay);
+  Json cameraJson = ToJson(cameraPass, cameraPass.Rays, nodesPerRay);
+
+  TraversalStats shadowPass = CountPass(shadowRays, [&](const Ray& ray) {
+    tlas.Occluded(ray, ray.TMax, ~k_lightInstanceMask, k_shadowRayFlags);
+  }, &nodesPerRay);
+  Json shadowJson = ToJson(shadowPass, shadowPass.ShadowRays, nodesPerRay);
+
+  Json meshJson = ToJson(meshBlas.GetStats());
+  meshJson["primitiveCount"] = meshBlas.GetPrimitiveCount();
+  meshJson["memoryBytes"] = meshBlas.GetMemoryUsage();
+
+  Json json;
+  json["scene"] = path;
+  json["buildFlags"] = buildFlags;
+  json["buildMs"] = buildTime.count();
+  json["meshBlas"] = meshJson;
+  json["tlas"] = ToJson(tlas.GetStats());
+  json["cameraRays"] = cameraJson;
+  json["shadowRays"] = shadowJson;
+
+  printf("%s\n", json.dump(2).c_str());
+
+  return 0;
+}
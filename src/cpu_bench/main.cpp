@@ -0,0 +1,641 @@
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include <cpu_rt/parallel_for.h>
+#include <cpu_rt/render_scene.h>
+#include <cpu_rt/rng.h>
+
+using namespace cpu_rt;
+
+static constexpr uint32_t k_width = 1920;
+static constexpr uint32_t k_height = 1080;
+
+static constexpr int k_numRuns = 10;
+
+static constexpr uint32_t k_cameraRayFlags = k_rayFlagCullBackFacingTriangles;
+
+static constexpr uint32_t k_shadowRayFlags = k_rayFlagCullBackFacingTriangles |
+                                             k_rayFlagAcceptFirstHitAndEndSearch |
+                                             k_rayFlagForceOpaque |
+                                             k_rayFlagSkipClosestHitShader;
+
+// Returns the best Mrays/s over k_numRuns runs.
+static double Benchmark(size_t rayCount, const std::function<void(size_t, size_t)>& fn) {
+  double bestSeconds = 0.0;
+
+  for (int run = 0; run < k_numRuns; ++run) {
+    auto start = std::chrono::steady_clock::now();
+    ParallelFor(rayCount, fn);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    if (run == 0 || elapsed.count() < bestSeconds)
+      bestSeconds = elapsed.count();
+  }
+
+  return static_cast<double>(rayCount) / bestSeconds * 1e-6;
+}
+
+// Primary rays as generated by RayGenShader, one per pixel.
+static std::vector<Ray> GenerateCameraRays() {
+  std::vector<Ray> rays(k_width * k_height);
+
+  for (uint32_t y = 0; y < k_height; ++y) {
+    for (uint32_t x = 0; x < k_width; ++x) {
+      uint32_t rngState = InitRngSeed(x, y, 0);
+
+      float lerpX = (static_cast<float>(x) + Rand(&rngState)) / static_cast<float>(k_width);
+      float lerpY = (static_cast<float>(y) + Rand(&rngState)) / static_cast<float>(k_height);
+
+      float viewportX = -1.33f + lerpX * 2.66f;
+      float viewportY = 1.f - lerpY * 2.f;
+
+      Ray& ray = rays[y * k_width + x];
+      ray.Origin = Float3{0.f, 1.f, -4.f};
+      ray.Direction = Float3{viewportX * 0.414f, viewportY * 0.414f, 1.f};
+      ray.TMin = 0.f;
+      ray.TMax = 10000.f;
+    }
+  }
+
+  return rays;
+}
+
+// Shadow rays from the primary hits to random points on the light, as in ClosestHitShader.
+static std::vector<Ray> GenerateShadowRays(const RenderScene& renderScene,
+                                           const std::vector<Ray>& cameraRays) {
+  const QuadShape& light = renderScene.GetLight();
+
+  std::vector<Ray> shadowRays;
+
+  for (size_t i = 0; i < cameraRays.size(); ++i) {
+    const Ray& cameraRay = cameraRays[i];
+
+    HitInfo hit;
+    if (!renderScene.GetTlas().TraceRay(cameraRay, k_rayFlagCullBackFacingTriangles,
+                                        k_sceneInstanceMask, 0, 1, &hit))
+      continue;
+
+    Float3 hitPos = cameraRay.Origin + hit.T * cameraRay.Direction;
+
+    uint32_t rngState = JenkinsHash(static_cast<uint32_t>(i));
+    Float3 lightSamplePos = light.Center + (2.f * Rand(&rngState) - 1.f) * light.AxisU +
+                            (2.f * Rand(&rngState) - 1.f) * light.AxisV;
+
+    Float3 toLight = lightSamplePos - hitPos;
+    float lightDist = Length(toLight);
+
+    Ray shadowRay{};
+    shadowRay.Origin = hitPos;
+    shadowRay.Direction = toLight / lightDist;
+    shadowRay.TMin = 0.0001f;
+    shadowRay.TMax = lightDist;
+
+    shadowRays.push_back(shadowRay);
+  }
+
+  return shadowRays;
+}
+
+static bool AreBitIdentical(const HitInfo& a, const HitInfo& b) {
+  auto bits = [](float f) { return std::bit_cast<uint32_t>(f); };
+
+  return bits(a.T) == bits(b.T) && bits(a.Barycentrics[0]) == bits(b.Barycentrics[0]) &&
+         bits(a.Barycentrics[1]) == bits(b.Barycentrics[1]) &&
+         bits(a.Normal.x) == bits(b.Normal.x) && bits(a.Normal.y) == bits(b.Normal.y) &&
+         bits(a.Normal.z) == bits(b.Normal.z) && a.PrimitiveIndex == b.PrimitiveIndex &&
+         a.GeometryIndex == b.GeometryIndex && a.InstanceIndex == b.InstanceIndex &&
+         a.InstanceID == b.InstanceID && a.HitGroupIndex == b.HitGroupIndex &&
+         a.HitKind == b.HitKind;
+}
+
+// Counts the rays whose closest hits are not bit-identical in the two scenes.
+static size_t CountHitMismatches(const RenderScene& a, const RenderScene& b,
+                                 const std::vector<Ray>& rays) {
+  std::atomic<size_t> numMismatches = 0;
+
+  ParallelFor(rays.size(), [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      HitInfo hitA;
+      HitInfo hitB;
+      bool foundA = a.GetTlas().TraceRay(rays[i], k_rayFlagNone, ~0u, 0, 1, &hitA,
+                                         a.GetIntersectionTable());
+      bool foundB = b.GetTlas().TraceRay(rays[i], k_rayFlagNone, ~0u, 0, 1, &hitB,
+                                         b.GetIntersectionTable());
+
+      if (foundA != foundB || !AreBitIdentical(hitA, hitB))
+        ++numMismatches;
+    }
+  });
+
+  return numMismatches;
+}
+
+// Counts the rays where two ways of tracing them disagree on whether there is a hit or on its
+// distance. Ties between primitives at the same distance may resolve either way.
+static size_t CountClosestHitMismatches(const std::vector<uint8_t>& foundA,
+                                        const std::vector<HitInfo>& hitsA,
+                                        const std::vector<uint8_t>& foundB,
+                                        const std::vector<HitInfo>& hitsB) {
+  size_t numMismatches = 0;
+
+  for (size_t i = 0; i < foundA.size(); ++i) {
+    if (foundA[i] != foundB[i] ||
+        (foundA[i] && std::bit_cast<uint32_t>(hitsA[i].T) != std::bit_cast<uint32_t>(hitsB[i].T)))
+      ++numMismatches;
+  }
+
+  return numMismatches;
+}
+
+static constexpr uint32_t k_fuzzTriangleCount = 2000;
+static constexpr uint32_t k_fuzzRayCount = 200000;
+static constexpr uint32_t k_fanRayCount = 200000;
+
+// Rays whose reference hit is this close to an edge or to TMin or TMax, relative to the
+// barycentrics or t, may resolve either way in float and are not compared.
+static constexpr double k_fuzzTolerance = 1e-5;
+
+// Largest relative error in t that the fuzz check accepts.
+static constexpr double k_fuzzMaxTError = 1e-4;
+
+// A state for sequence index of the fuzz check with seed. Xorshift never leaves a zero state,
+// so the state is kept odd.
+static uint32_t InitFuzzRng(uint32_t seed, uint32_t index) {
+  return JenkinsHash(JenkinsHash(seed) ^ index) | 1;
+}
+
+static float RandRange(uint32_t* rngState, float min, float max) {
+  return min + (max - min) * Rand(rngState);
+}
+
+static Float3 RandDirection(uint32_t* rngState) {
+  float z = RandRange(rngState, -1.f, 1.f);
+  float phi = RandRange(rngState, 0.f, 6.2831853f);
+  float r = std::sqrt(std::max(0.f, 1.f - z * z));
+  return Float3{r * std::cos(phi), r * std::sin(phi), z};
+}
+
+static std::unique_ptr<Tlas> BuildSingleInstanceTlas(const Blas& blas) {
+  InstanceDesc instanceDesc{};
+  instanceDesc.AccelerationStructure = &blas;
+  return std::make_unique<Tlas>(std::span(&instanceDesc, 1));
+}
+
+static std::unique_ptr<Blas> BuildTriangleBlas(const std::vector<Float3>& vertices,
+                              const std::vector<uint16_t>& indices, uint32_t buildFlags) {
+  GeometryDesc geometryDesc{};
+  geometryDesc.Triangles.VertexBuffer = reinterpret_cast<const uint8_t*>(vertices.data());
+  geometryDesc.Triangles.VertexStride = sizeof(Float3);
+  geometryDesc.Triangles.VertexCount = static_cast<uint32_t>(vertices.size());
+  geometryDesc.Triangles.IndexBuffer = indices.data();
+  geometryDesc.Triangles.IndexCount = static_cast<uint32_t>(indices.size());
+
+  return std::make_unique<Blas>(std::span(&geometryDesc, 1), BvhBuildSettings{}, buildFlags);
+}
+
+struct ReferenceHit {
+  double T;
+  bool FrontFace;
+};
+
+// The watertight test in double precision, with the barycentrics normalized. Sets *nearEdge if
+// the ray passes within k_fuzzTolerance of an edge, inside or out.
+static bool IntersectReference(const Ray& ray, const Float3& v0, const Float3& v1,
+                               const Float3& v2, ReferenceHit* hit, bool* nearEdge) {
+  const double d[3] = {ray.Direction.x, ray.Direction.y, ray.Direction.z};
+
+  int kz = std::abs(d[0]) > std::abs(d[1]) ? (std::abs(d[0]) > std::abs(d[2]) ? 0 : 2)
+                                           : (std::abs(d[1]) > std::abs(d[2]) ? 1 : 2);
+  int kx = (kz + 1) % 3;
+  int ky = (kx + 1) % 3;
+  if (d[kz] < 0.0)
+    std::swap(kx, ky);
+
+  double sx = d[kx] / d[kz];
+  double sy = d[ky] / d[kz];
+  double sz = 1.0 / d[kz];
+
+  auto shear = [&](const Float3& v, double* x, double* y, double* z) {
+    double rel[3] = {double{v.x} - ray.Origin.x, double{v.y} - ray.Origin.y,
+                     double{v.z} - ray.Origin.z};
+    *x = rel[kx] - sx * rel[kz];
+    *y = rel[ky] - sy * rel[kz];
+    *z = rel[kz];
+  };
+
+  double ax, ay, az, bx, by, bz, cx, cy, cz;
+  shear(v0, &ax, &ay, &az);
+  shear(v1, &bx, &by, &bz);
+  shear(v2, &cx, &cy, &cz);
+
+  double u = cx * by - cy * bx;
+  double v = ax * cy - ay * cx;
+  double w = bx * ay - by * ax;
+  double det = u + v + w;
+
+  if (det == 0.0) {
+    *nearEdge = true;
+    return false;
+  }
+
+  double minBarycentric = std::min({u / det, v / det, w / det});
+  if (std::abs(minBarycentric) < k_fuzzTolerance)
+    *nearEdge = true;
+  if (minBarycentric < 0.0)
+    return false;
+
+  hit->T = (u * az + v * bz + w * cz) * sz / det;
+  hit->FrontFace = det > 0.0;
+
+  double tolerance = k_fuzzTolerance * std::max(1.0, std::abs(hit->T));
+  if (std::abs(hit->T - ray.TMin) < tolerance || std::abs(hit->T - ray.TMax) < tolerance)
+    *nearEdge = true;
+
+  return hit->T >= ray.TMin && hit->T < ray.TMax;
+}
+
+// Traces random rays through a random triangle soup with TraceRay and Occluded and compares
+// them with a brute force double precision reference. Then shoots rays at the shared edges and
+// vertices of a closed octahedron from inside and outside, none of which may slip through.
+// Returns the number of failures.
+static size_t RunFuzzCheck(uint32_t seed, uint32_t buildFlags) {
+  uint32_t rngState = InitFuzzRng(seed, 0);
+
+  std::vector<Float3> vertices;
+  std::vector<uint16_t> indices;
+  for (uint32_t i = 0; i < k_fuzzTriangleCount; ++i) {
+    Float3 center{RandRange(&rngState, -1.f, 1.f), RandRange(&rngState, -1.f, 1.f),
+                  RandRange(&rngState, -1.f, 1.f)};
+    float size = RandRange(&rngState, 0.01f, 0.3f);
+
+    for (int corner = 0; corner < 3; ++corner) {
+      indices.push_back(static_cast<uint16_t>(vertices.size()));
+      vertices.push_back(center + size * RandDirection(&rngState));
+    }
+  }
+
+  std::unique_ptr<Blas> blas = BuildTriangleBlas(vertices, indices, buildFlags);
+  std::unique_ptr<Tlas> tlas = BuildSingleInstanceTlas(*blas);
+
+  std::atomic<size_t> numHits = 0;
+  std::atomic<size_t> numHitMismatches = 0;
+  std::atomic<size_t> numFaceMismatches = 0;
+  std::atomic<size_t> numOcclusionMismatches = 0;
+  std::atomic<size_t> numNearEdges = 0;
+  std::atomic<uint64_t> maxTErrorBits = 0;
+
+  ParallelFor(k_fuzzRayCount, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      uint32_t rayRngState = InitFuzzRng(seed, 1 + static_cast<uint32_t>(i));
+
+      Ray ray{};
+      ray.Origin = Float3{RandRange(&rayRngState, -1.5f, 1.5f),
+                          RandRange(&rayRngState, -1.5f, 1.5f),
+                          RandRange(&rayRngState, -1.5f, 1.5f)};
+      ray.Direction = RandDirection(&rayRngState) * RandRange(&rayRngState, 0.5f, 2.f);
+      ray.TMin = Rand(&rayRngState) < 0.5f ? 0.f : RandRange(&rayRngState, 0.f, 0.5f);
+      ray.TMax = Rand(&rayRngState) < 0.5f ? k_rayTMax : RandRange(&rayRngState, 0.5f, 3.f);
+
+      bool nearEdge = false;
+      bool refFound = false;
+      ReferenceHit refHit{};
+      uint32_t refPrimitive = k_invalidIndex;
+      double secondT = std::numeric_limits<double>::infinity();
+
+      for (uint32_t prim = 0; prim < k_fuzzTriangleCount; ++prim) {
+        ReferenceHit primHit;
+        if (!IntersectReference(ray, vertices[3 * prim], vertices[3 * prim + 1],
+                                vertices[3 * prim + 2], &primHit, &nearEdge))
+          continue;
+
+        if (!refFound || primHit.T < refHit.T) {
+          if (refFound)
+            secondT = refHit.T;
+          refFound = true;
+          refHit = primHit;
+          refPrimitive = prim;
+        } else {
+          secondT = std::min(secondT, primHit.T);
+        }
+      }
+
+      // Two hits at nearly the same distance may resolve either way as well.
+      if (refFound && secondT - refHit.T < k_fuzzTolerance * std::max(1.0, refHit.T))
+        nearEdge = true;
+
+      if (nearEdge) {
+        ++numNearEdges;
+        continue;
+      }
+
+      HitInfo hit;
+      bool found = tlas->TraceRay(ray, k_rayFlagNone, ~0u, 0, 1, &hit);
+      bool occluded = tlas->Occluded(ray, ray.TMax, ~0u);
+
+      if (refFound)
+        ++numHits;
+
+      if (occluded != refFound)
+        ++numOcclusionMismatches;
+
+      if (found != refFound || (found && hit.PrimitiveIndex != refPrimitive)) {
+        ++numHitMismatches;
+        continue;
+      }
+
+      if (!found)
+        continue;
+
+      if ((hit.HitKind == k_hitKindTriangleFrontFace) != refHit.FrontFace)
+        ++numFaceMismatches;
+
+      double tError = std::abs(hit.T - refHit.T) / std::max(1e-3, refHit.T);
+      uint64_t tErrorBits = std::bit_cast<uint64_t>(tError);
+      uint64_t maxBits = maxTErrorBits;
+      while (tErrorBits > maxBits && !maxTErrorBits.compare_exchange_weak(maxBits, tErrorBits)) {
+      }
+    }
+  });
+
+  double maxTError = std::bit_cast<double>(maxTErrorBits.load());
+
+  printf("Fuzz seed %u: %u triangles, %u rays, %zu hits, %zu near an edge skipped\n", seed,
+         k_fuzzTriangleCount, k_fuzzRayCount, numHits.load(), numNearEdges.load());
+  printf("%zu hit mismatches, %zu face mismatches, %zu occlusion mismatches, max relative t "
+         "error %.2g\n",
+         numHitMismatches.load(), numFaceMismatches.load(), numOcclusionMismatches.load(),
+         maxTError);
+
+  // An octahedron around the origin, whose eight faces share every edge and vertex. Its
+  // vertices are moved off the axes so that the edge tests round.
+  std::vector<Float3> fanVertices = {{1.f, 0.f, 0.f}, {-1.f, 0.f, 0.f}, {0.f, 1.f, 0.f},
+                                     {0.f, -1.f, 0.f}, {0.f, 0.f, 1.f}, {0.f, 0.f, -1.f}};
+  for (Float3& vertex : fanVertices) {
+    vertex = vertex * RandRange(&rngState, 0.5f, 1.5f) + 0.3f * RandDirection(&rngState);
+  }
+  std::vector<uint16_t> fanIndices;
+  for (uint16_t x : {uint16_t{0}, uint16_t{1}}) {
+    for (uint16_t y : {uint16_t{2}, uint16_t{3}}) {
+      for (uint16_t z : {uint16_t{4}, uint16_t{5}}) {
+        fanIndices.insert(fanIndices.end(), {x, y, z});
+      }
+    }
+  }
+
+  std::unique_ptr<Blas> fanBlas = BuildTriangleBlas(fanVertices, fanIndices, buildFlags);
+  std::unique_ptr<Tlas> fanTlas = BuildSingleInstanceTlas(*fanBlas);
+
+  std::atomic<size_t> numLeaks = 0;
+
+  ParallelFor(k_fanRayCount, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      uint32_t rayRngState = InitFuzzRng(seed, 1 + k_fuzzRayCount + static_cast<uint32_t>(i));
+
+      // A vertex, or a point on one of the edges between two vertices on different axes.
+      int a = static_cast<int>(Rand(&rayRngState) * 6.f) % 6;
+      int b = (a / 2 * 2 + 2 + static_cast<int>(Rand(&rayRngState) * 4.f) % 4) % 6;
+      float lerp = i % 8 == 0 ? 0.f : Rand(&rayRngState);
+      Float3 target = fanVertices[a] * (1.f - lerp) + fanVertices[b] * lerp;
+
+      // Rays from outside continue through the inside point, so they never just graze it.
+      Float3 inside{RandRange(&rayRngState, -0.2f, 0.2f), RandRange(&rayRngState, -0.2f, 0.2f),
+                    RandRange(&rayRngState, -0.2f, 0.2f)};
+      Float3 outside = target + 2.f * (target - inside);
+
+      Ray ray{};
+      ray.Origin = i % 2 == 0 ? inside : outside;
+      ray.Direction = target - ray.Origin;
+      ray.TMin = 0.f;
+      ray.TMax = k_rayTMax;
+
+      HitInfo hit;
+      if (!fanTlas->TraceRay(ray, k_rayFlagNone, ~0u, 0, 1, &hit) ||
+          !fanTlas->Occluded(ray, ray.TMax, ~0u))
+        ++numLeaks;
+    }
+  });
+
+  printf("Closed octahedron: %zu of %u rays at its edges and vertices leaked\n", numLeaks.load(),
+         k_fanRayCount);
+
+  bool tErrorOk = maxTError <= k_fuzzMaxTError;
+  return numHitMismatches + numFaceMismatches + numOcclusionMismatches + numLeaks +
+         (tErrorOk ? 0 : 1);
+}
+
+// Builds Tlases of growing numbers of instances of blas, spread over a grid, and prints their
+// memory. The Blas is shared, so only the Tlas grows, by the same amount per instance.
+static void RunInstanceMemoryCheck(const Blas& blas) {
+  const Aabb& bounds = blas.GetBounds();
+  Float3 spacing = 1.5f * (bounds.Max - bounds.Min);
+  size_t blasBytes = blas.GetMemoryUsage();
+
+  for (uint32_t instanceCount : {1000u, 10000u, 100000u}) {
+    auto gridSize = static_cast<uint32_t>(std::ceil(std::cbrt(instanceCount)));
+
+    std::vector<InstanceDesc> instanceDescs(instanceCount);
+    for (uint32_t i = 0; i < instanceCount; ++i) {
+      InstanceDesc& instanceDesc = instanceDescs[i];
+      instanceDesc.Transform.m[0][3] = spacing.x * static_cast<float>(i % gridSize);
+      instanceDesc.Transform.m[1][3] = spacing.y * static_cast<float>(i / gridSize % gridSize);
+      instanceDesc.Transform.m[2][3] = spacing.z * static_cast<float>(i / gridSize / gridSize);
+      instanceDesc.InstanceID = i;
+      instanceDesc.AccelerationStructure = &blas;
+    }
+
+    auto buildStart = std::chrono::steady_clock::now();
+    Tlas tlas(instanceDescs);
+    std::chrono::duration<double, std::milli> buildTime =
+        std::chrono::steady_clock::now() - buildStart;
+
+    size_t tlasBytes = tlas.GetMemoryUsage();
+    printf("%u instances: Tlas %zu bytes (%.1f per instance), Blas %zu bytes, built in %.2f ms; "
+           "%.1f MB with a Blas per instance\n",
+           instanceCount, tlasBytes, static_cast<double>(tlasBytes) / instanceCount, blasBytes,
+           buildTime.count(), static_cast<double>(blasBytes) * instanceCount * 1e-6);
+  }
+}
+
+// Usage: cpu_bench [--prefer-fast-trace] [--minimize-memory] [--bvh-cache dir] [--fuzz seed]
+//                  [--instances] [scene.gltf]
+//
+// With --bvh-cache, the mesh BVH is loaded from dir if a previous run saved it there, and the
+// loaded BVH is checked against a fresh build. --fuzz runs RunFuzzCheck with the given seed
+// and the build flags instead of the benchmark, and --instances runs RunInstanceMemoryCheck
+// with the mesh Blas of the scene.
+int main(int argc, char** argv) {
+  const char* path = "assets/cornell_box.gltf";
+  uint32_t buildFlags = k_buildFlagNone;
+  std::filesystem::path bvhCacheDir;
+  std::optional<uint32_t> fuzzSeed;
+  bool instances = false;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--prefer-fast-trace") == 0) {
+      buildFlags |= k_buildFlagPreferFastTrace;
+    } else if (strcmp(argv[i], "--minimize-memory") == 0) {
+      buildFlags |= k_buildFlagMinimizeMemory;
+    } else if (strcmp(argv[i], "--bvh-cache") == 0 && i + 1 < argc) {
+      bvhCacheDir = argv[++i];
+    } else if (strcmp(argv[i], "--fuzz") == 0 && i + 1 < argc) {
+      fuzzSeed = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+    } else if (strcmp(argv[i], "--instances") == 0) {
+      instances = true;
+    } else {
+      path = argv[i];
+    }
+  }
+
+  if (fuzzSeed)
+    return RunFuzzCheck(*fuzzSeed, buildFlags) == 0 ? 0 : 1;
+
+  utils::Scene scene = utils::LoadGltf(path);
+
+  auto buildStart = std::chrono::steady_clock::now();
+  RenderScene renderScene(scene, {}, buildFlags, bvhCacheDir);
+  std::chrono::duration<double, std::milli> buildTime =
+      std::chrono::steady_clock::now() - buildStart;
+
+  printf("%s: built in %.2f ms\n", path, buildTime.count());
+
+  if (instances) {
+    RunInstanceMemoryCheck(renderScene.GetMeshBlas());
+    return 0;
+  }
+
+  const Tlas& tlas = renderScene.GetTlas();
+
+  std::vector<Ray> cameraRays = GenerateCameraRays();
+  std::vector<Ray> shadowRays = GenerateShadowRays(renderScene, cameraRays);
+
+  size_t numCacheMismatches = 0;
+
+  if (!bvhCacheDir.empty()) {
+    RenderScene builtScene(scene, {}, buildFlags);
+
+    numCacheMismatches = CountHitMismatches(renderScene, builtScene, cameraRays) +
+                         CountHitMismatches(renderScene, builtScene, shadowRays);
+
+    printf("BVH cache: %zu hits differ from a fresh build\n", numCacheMismatches);
+  }
+
+  const RenderScene::LightIntersectionTable& intersectionTable =
+      renderScene.GetIntersectionTable();
+
+  // Camera rays one at a time, in packets of neighboring pixels, and in streams of whole
+  // ParallelFor chunks.
+  std::vector<HitInfo> singleHits(cameraRays.size());
+  std::vector<HitInfo> packetHits(cameraRays.size());
+  std::vector<HitInfo> streamHits(cameraRays.size());
+  std::vector<uint8_t> singleFound(cameraRays.size());
+  std::vector<uint8_t> packetFound(cameraRays.size());
+  std::vector<uint8_t> streamFound(cameraRays.size());
+
+  double singleMrays = Benchmark(cameraRays.size(), [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      singleFound[i] = tlas.TraceRay(cameraRays[i], k_cameraRayFlags, ~0u, 0, 1, &singleHits[i],
+                                     intersectionTable);
+    }
+  });
+
+  double packetMrays = Benchmark(cameraRays.size(), [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i += k_rayPacketSize) {
+      size_t count = std::min<size_t>(k_rayPacketSize, end - i);
+
+      uint32_t foundMask = tlas.TraceRayPacket(std::span(cameraRays).subspan(i, count),
+                                               k_cameraRayFlags, ~0u, 0, 1, &packetHits[i],
+                                               intersectionTable);
+      for (size_t j = 0; j < count; ++j) {
+        packetFound[i + j] = (foundMask >> j) & 1;
+      }
+    }
+  });
+
+  double streamMrays = Benchmark(cameraRays.size(), [&](size_t begin, size_t end) {
+    tlas.TraceRayStream(std::span(cameraRays).subspan(begin, end - begin), k_cameraRayFlags, ~0u,
+                        0, 1, std::span(streamHits).subspan(begin, end - begin),
+                        std::span(streamFound).subspan(begin, end - begin), intersectionTable);
+  });
+
+  size_t numCameraMismatches =
+      CountClosestHitMismatches(singleFound, singleHits, packetFound, packetHits) +
+      CountClosestHitMismatches(singleFound, singleHits, streamFound, streamHits);
+
+  printf("%zu camera rays, %zu mismatches\n", cameraRays.size(), numCameraMismatches);
+  printf("TraceRay: %.2f Mrays/s\n", singleMrays);
+  printf("TraceRayPacket: %.2f Mrays/s\n", packetMrays);
+  printf("TraceRayStream: %.2f Mrays/s\n", streamMrays);
+
+  std::vector<uint8_t> traceRayResults(shadowRays.size());
+  std::vector<uint8_t> occludedResults(shadowRays.size());
+
+  double traceRayMrays = Benchmark(shadowRays.size(), [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      HitInfo hit;
+      traceRayResults[i] = tlas.TraceRay(shadowRays[i], k_shadowRayFlags, ~k_lightInstanceMask, 0,
+                                         1, &hit);
+    }
+  });
+
+  double occludedMrays = Benchmark(shadowRays.size(), [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      occludedResults[i] = tlas.Occluded(shadowRays[i], shadowRays[i].TMax, ~k_lightInstanceMask,
+                                         k_shadowRayFlags);
+    }
+  });
+
+  std::vector<uint8_t> packetResults(shadowRays.size());
+  std::vector<uint8_t> streamResults(shadowRays.size());
+
+  double occludedPacketMrays = Benchmark(shadowRays.size(), [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i += k_rayPacketSize) {
+      size_t count = std::min<size_t>(k_rayPacketSize, end - i);
+
+      uint32_t occludedMask = tlas.OccludedPacket(std::span(shadowRays).subspan(i, count),
+                                                  ~k_lightInstanceMask, k_shadowRayFlags);
+      for (size_t j = 0; j < count; ++j) {
+        packetResults[i + j] = (occludedMask >> j) & 1;
+      }
+    }
+  });
+
+  double streamShadowMrays = Benchmark(shadowRays.size(), [&](size_t begin, size_t end) {
+    std::vector<HitInfo> hits(end - begin);
+    tlas.TraceRayStream(std::span(shadowRays).subspan(begin, end - begin), k_shadowRayFlags,
+                        ~k_lightInstanceMask, 0, 1, std::span(hits),
+                        std::span(streamResults).subspan(begin, end - begin));
+  });
+
+  size_t numOccluded = static_cast<size_t>(
+      std::count(occludedResults.begin(), occludedResults.end(), uint8_t{1}));
+  size_t numMismatches = 0;
+  for (size_t i = 0; i < shadowRays.size(); ++i) {
+    if (traceRayResults[i] != occludedResults[i] || packetResults[i] != occludedResults[i] ||
+        streamResults[i] != occludedResults[i])
+      ++numMismatches;
+  }
+
+  printf("%zu shadow rays, %zu occluded, %zu mismatches\n", shadowRays.size(), numOccluded,
+         numMismatches);
+  printf("TraceRay: %.2f Mrays/s\n", traceRayMrays);
+  printf("Occluded: %.2f Mrays/s\n", occludedMrays);
+  printf("OccludedPacket: %.2f Mrays/s\n", occludedPacketMrays);
+  printf("TraceRayStream: %.2f Mrays/s\n", streamShadowMrays);
+
+  return numMismatches == 0 && numCameraMismatches == 0 && numCacheMismatches == 0 ? 0 : 1;
+}
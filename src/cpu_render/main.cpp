@@ -0,0 +1,808 @@
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include <cpu_rt/bdpt_renderer.h>
+#include <cpu_rt/film_checkpoint.h>
+#include <cpu_rt/path_tracer.h>
+#include <cpu_rt/render_scene.h>
+#include <cpu_rt/restir_renderer.h>
+#include <cpu_rt/sppm_renderer.h>
+#include <utils/hdr_loader.h>
+
+using namespace cpu_rt;
+
+// The films of the two modes differ only by float rounding in the order path radiance is summed.
+static constexpr float k_maxRelativeDifference = 1e-4f;
+
+// Writes a little-endian PFM, which stores rows bottom to top.
+static bool WritePfm(const char* path, uint32_t width, uint32_t height,
+                     std::span<const Float3> film) {
+  FILE* file = fopen(path, "wb");
+  if (!file)
+    return false;
+
+  fprintf(file, "PF\n%u %u\n-1.0\n", width, height);
+
+  for (uint32_t y = height; y-- > 0;) {
+    fwrite(&film[static_cast<size_t>(y) * width], sizeof(Float3), width, file);
+  }
+
+  return fclose(file) == 0;
+}
+
+// Reads a PFM written by WritePfm, returning an empty film if it is not a width x height RGB one.
+static std::vector<Float3> ReadPfm(const char* path, uint32_t width, uint32_t height) {
+  FILE* file = fopen(path, "rb");
+  if (!file)
+    return {};
+
+  std::vector<Float3> film;
+
+  uint32_t fileWidth, fileHeight;
+  float scale;
+  if (fscanf(file, "PF %u %u %f", &fileWidth, &fileHeight, &scale) == 3 && fgetc(file) == '\n' &&
+      fileWidth == width && fileHeight == height && scale < 0.f) {
+    film.resize(static_cast<size_t>(width) * height);
+
+    for (uint32_t y = height; y-- > 0;) {
+      if (fread(&film[static_cast<size_t>(y) * width], sizeof(Float3), width, file) != width) {
+        film.clear();
+        break;
+      }
+    }
+  }
+
+  fclose(file);
+  return film;
+}
+
+// Time, paths and rays a render took, where a path is one of the payloads RayGenShader traces.
+struct RenderStats {
+  double Seconds = 0.0;
+  uint64_t PathCount = 0;
+  uint64_t RayCount = 0;
+
+  // Checkpoints taken, and the part of Seconds spent copying the film for them.
+  uint32_t CheckpointCount = 0;
+  double CheckpointSeconds = 0.0;
+
+  // The same when the RMSE against the reference first fell to the target, or a negative time if
+  // it never did.
+  double TargetSeconds = -1.0;
+  uint64_t TargetPathCount = 0;
+};
+
+static float GetMaxRelativeDifference(std::span<const Float3> a, std::span<const Float3> b) {
+  float maxDifference = 0.f;
+
+  for (size_t i = 0; i < a.size(); ++i) {
+    for (int c = 0; c < 3; ++c) {
+      float difference = std::abs(a[i][c] - b[i][c]) / std::max(std::abs(a[i][c]), 1e-6f);
+
+      // Also catches NaNs.
+      if (!(difference <= maxDifference))
+        maxDifference = difference;
+    }
+  }
+
+  return maxDifference;
+}
+
+// Skips the values that are not finite in either film, since a single NaN path poisons its pixel
+// for good, and returns their number in skipCount.
+static double GetRmse(std::span<const Float3> film, std::span<const Float3> reference,
+                      size_t* skipCount) {
+  double sum = 0.0;
+  size_t count = 0;
+
+  for (size_t i = 0; i < film.size(); ++i) {
+    for (int c = 0; c < 3; ++c) {
+      if (!std::isfinite(film[i][c]) || !std::isfinite(reference[i][c]))
+        continue;
+
+      double difference = film[i][c] - reference[i][c];
+      sum += difference * difference;
+      ++count;
+    }
+  }
+
+  *skipCount = 3 * film.size() - count;
+
+  return count > 0 ? std::sqrt(sum / static_cast<double>(count)) : 0.0;
+}
+
+// Renders until the film has at least sampleCount samples per pixel or every pixel has
+// converged. Only the Render calls are timed, not the RMSE checks between them. With
+// printConvergence, prints the RMSE after Render calls 1, 2, 4 and so on, which end the
+// iterations of a path guide. With a checkpointWriter, takes a checkpoint after the first Render
+// call that ends checkpointInterval seconds or more after the last one, unless that is still
+// being written. Copying the film holds up the render, so it is timed with the Render calls.
+static RenderStats Render(PathTracer* pathTracer, PathTracerMode mode, uint32_t sampleCount,
+                          const PathTracerSettings& settings, std::span<const Float3> reference,
+                          double targetRmse, const char* modeName, bool printConvergence,
+                          FilmCheckpointWriter* checkpointWriter, double checkpointInterval) {
+  RenderStats stats{};
+  uint32_t renderCount = 0;
+  uint64_t startRayCount = pathTracer->GetRayCount();
+  auto lastCheckpoint = std::chrono::steady_clock::now();
+
+  while (pathTracer->GetSampleCount() < sampleCount && !pathTracer->GetActivePixels().empty()) {
+    uint64_t pathCount = pathTracer->GetActivePixels().size() * k_cameraRaysPerPixel *
+                         settings.SampleIncrement;
+
+    auto start = std::chrono::steady_clock::now();
+    pathTracer->Render(mode);
+    auto end = std::chrono::steady_clock::now();
+
+    std::chrono::duration<double> sinceCheckpoint = end - lastCheckpoint;
+    if (checkpointWriter && sinceCheckpoint.count() >= checkpointInterval) {
+      if (FilmCheckpoint* checkpoint = checkpointWriter->GetNextCheckpoint()) {
+        pathTracer->GetCheckpoint(checkpoint);
+        checkpointWriter->StartWrite();
+
+        lastCheckpoint = std::chrono::steady_clock::now();
+        std::chrono::duration<double> copyTime = lastCheckpoint - end;
+
+        ++stats.CheckpointCount;
+        stats.CheckpointSeconds += copyTime.count();
+        end = lastCheckpoint;
+      }
+    }
+
+    std::chrono::duration<double> elapsed = end - start;
+
+    stats.Seconds += elapsed.count();
+    stats.PathCount += pathCount;
+
+    size_t skipCount;
+    if (targetRmse > 0.0 && stats.TargetSeconds < 0.0 &&
+        GetRmse(pathTracer->GetFilm(), reference, &skipCount) <= targetRmse) {
+      stats.TargetSeconds = stats.Seconds;
+      stats.TargetPathCount = stats.PathCount;
+    }
+
+    if (printConvergence && std::has_single_bit(++renderCount)) {
+      printf("%s: %u samples, %.3f s, RMSE %g\n", modeName, pathTracer->GetSampleCount(),
+             stats.Seconds, GetRmse(pathTracer->GetFilm(), reference, &skipCount));
+    }
+  }
+
+  stats.RayCount = pathTracer->GetRayCount() - startRayCount;
+  return stats;
+}
+
+static void PrintStats(const char* modeName, const PathTracer& pathTracer,
+                       const RenderStats& stats, std::span<const Float3> reference,
+                       double targetRmse) {
+  // A render resumed from a checkpoint that already holds all its samples traces none.
+  if (stats.PathCount == 0) {
+    printf("%s: %u samples, none traced\n", modeName, pathTracer.GetSampleCount());
+  } else {
+    printf("%s: %u samples, %.2f Mpaths/s\n", modeName, pathTracer.GetSampleCount(),
+           static_cast<double>(stats.PathCount) / stats.Seconds * 1e-6);
+  }
+
+  auto pixelCount = static_cast<uint32_t>(pathTracer.GetFilm().size());
+
+  uint64_t sampleSum = 0;
+  for (uint32_t pixel = 0; pixel < pixelCount; ++pixel) {
+    sampleSum += pathTracer.GetPixelSampleCount(pixel);
+  }
+
+  printf("%s: %.1f samples per pixel on average, %zu of %u pixels still active\n", modeName,
+         static_cast<double>(sampleSum) / pixelCount, pathTracer.GetActivePixels().size(),
+         pixelCount);
+
+  if (stats.PathCount > 0) {
+    printf("%s: %.2f rays per path\n", modeName,
+           static_cast<double>(stats.RayCount) / static_cast<double>(stats.PathCount));
+  }
+
+  if (stats.CheckpointCount > 0) {
+    printf("%s: %u checkpoints, %.2f ms each to copy the film\n", modeName,
+           stats.CheckpointCount, stats.CheckpointSeconds / stats.CheckpointCount * 1e3);
+  }
+
+  if (const RadianceCache* cache = pathTracer.GetRadianceCache()) {
+    const RadianceCacheStats& cacheStats = cache->GetStats();
+    printf("%s: radiance cache hit rate %.1f%%, %u of %u cells, %.1f MB, %llu failed inserts\n",
+           modeName, cacheStats.HitRate * 100.0, cacheStats.CellCount, cacheStats.Capacity,
+           static_cast<double>(cache->GetMemoryUsage()) / (1024.0 * 1024.0),
+           static_cast<unsigned long long>(cacheStats.InsertFailures));
+  }
+
+  if (const PathGuide* guide = pathTracer.GetPathGuide()) {
+    const PathGuideStats& guideStats = guide->GetStats();
+    printf("%s: path guide after %u iterations, %u leaves, %.1f directional nodes per leaf, "
+           "%.1f MB\n", modeName, guideStats.Iteration, guideStats.LeafCount,
+           guideStats.DirectionalNodeCount,
+           static_cast<double>(guide->GetMemoryUsage()) / (1024.0 * 1024.0));
+  }
+
+  if (reference.empty())
+    return;
+
+  size_t skipCount;
+  double rmse = GetRmse(pathTracer.GetFilm(), reference, &skipCount);
+  printf("%s RMSE: %g (%zu values skipped), efficiency 1 / (MSE * s): %g\n", modeName, rmse,
+         skipCount, 1.0 / (rmse * rmse * stats.Seconds));
+
+  if (targetRmse <= 0.0)
+    return;
+
+  if (stats.TargetSeconds >= 0.0) {
+    printf("%s: RMSE %g reached after %.3f s and %.2f Mpaths\n", modeName, targetRmse,
+           stats.TargetSeconds, static_cast<double>(stats.TargetPathCount) * 1e-6);
+  } else {
+    printf("%s: RMSE %g not reached\n", modeName, targetRmse);
+  }
+}
+
+// Each pixel's share of the samples of the pixels that never stopped.
+static std::vector<Float3> GetSampleHeatmap(const PathTracer& pathTracer) {
+  std::vector<Float3> heatmap(pathTracer.GetFilm().size());
+
+  for (size_t i = 0; i < heatmap.size(); ++i) {
+    float share = static_cast<float>(pathTracer.GetPixelSampleCount(static_cast<uint32_t>(i))) /
+                  static_cast<float>(std::max(1u, pathTracer.GetSampleCount()));
+    heatmap[i] = Float3{share, share, share};
+  }
+
+  return heatmap;
+}
+
+// Renders frameCount frames of direct lighting, printing the reservoirs of each and, given a
+// reference, its RMSE and that of the film so far.
+static void RenderRestir(RestirRenderer* renderer, uint32_t frameCount,
+                         std::span<const Float3> reference) {
+  double seconds = 0.0;
+
+  for (uint32_t frame = 0; frame < frameCount; ++frame) {
+    auto start = std::chrono::steady_clock::now();
+    renderer->Render();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    seconds += elapsed.count();
+
+    const RestirFrameStats& stats = renderer->GetFrameStats();
+    printf("Frame %u: %.1f ms, %.1f candidates and %.1f effective samples per reservoir", frame,
+           elapsed.count() * 1e3, stats.CandidateCount, stats.EffectiveSampleCount);
+
+    if (!reference.empty()) {
+      size_t skipCount;
+      printf(", RMSE %g, film RMSE %g", GetRmse(renderer->GetFrame(), reference, &skipCount),
+             GetRmse(renderer->GetFilm(), reference, &skipCount));
+    }
+
+    printf("\n");
+  }
+
+  printf("ReSTIR: %u frames, %.2f Mrays/s\n", frameCount,
+         static_cast<double>(renderer->GetRayCount()) / seconds * 1e-6);
+}
+
+// Runs iterationCount iterations of SPPM, printing the photons of each and, given a reference,
+// the RMSE of the film so far and when it first fell to targetRmse. Only the iterations are
+// timed.
+static void RenderSppm(SppmRenderer* renderer, uint32_t iterationCount,
+                       std::span<const Float3> reference, double targetRmse) {
+  double seconds = 0.0;
+  double targetSeconds = -1.0;
+
+  for (uint32_t iteration = 0; iteration < iterationCount; ++iteration) {
+    auto start = std::chrono::steady_clock::now();
+    renderer->Render();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    seconds += elapsed.count();
+
+    const SppmIterationStats& stats = renderer->GetIterationStats();
+    printf("Iteration %u: %.1f ms, %u photons stored, %.1f gathered per visible point, "
+           "radius %g", iteration, elapsed.count() * 1e3, stats.StoredPhotonCount,
+           stats.GatheredPhotonCount, stats.Radius);
+
+    if (!reference.empty()) {
+      size_t skipCount;
+      double rmse = GetRmse(renderer->GetFilm(), reference, &skipCount);
+      printf(", RMSE %g", rmse);
+
+      if (targetRmse > 0.0 && targetSeconds < 0.0 && rmse <= targetRmse)
+        targetSeconds = seconds;
+    }
+
+    printf("\n");
+  }
+
+  printf("SPPM: %u iterations, %.2f Mrays/s\n", iterationCount,
+         static_cast<double>(renderer->GetRayCount()) / seconds * 1e-6);
+
+  if (targetRmse <= 0.0)
+    return;
+
+  if (targetSeconds >= 0.0) {
+    printf("SPPM: RMSE %g reached after %.3f s\n", targetRmse, targetSeconds);
+  } else {
+    printf("SPPM: RMSE %g not reached\n", targetRmse);
+  }
+}
+
+// Renders sampleCount samples per pixel by BDPT, printing its throughput and, given a reference,
+// the RMSE of the film and when it first fell to targetRmse. With printConvergence, also prints
+// the RMSE after samples 1, 2, 4 and so on, like Render does. Only the samples are timed.
+static void RenderBdpt(BdptRenderer* renderer, uint32_t sampleCount,
+                       std::span<const Float3> reference, double targetRmse,
+                       bool printConvergence) {
+  double seconds = 0.0;
+  double targetSeconds = -1.0;
+
+  for (uint32_t sample = 1; sample <= sampleCount; ++sample) {
+    auto start = std::chrono::steady_clock::now();
+    renderer->Render();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    seconds += elapsed.count();
+
+    bool checkTarget = targetRmse > 0.0 && targetSeconds < 0.0;
+    bool printRmse = printConvergence && std::has_single_bit(sample);
+    if (!checkTarget && !printRmse)
+      continue;
+
+    size_t skipCount;
+    double rmse = GetRmse(renderer->GetFilm(), reference, &skipCount);
+
+    if (checkTarget && rmse <= targetRmse)
+      targetSeconds = seconds;
+
+    if (printRmse)
+      printf("BDPT: %u samples, %.3f s, RMSE %g\n", sample, seconds, rmse);
+  }
+
+  // A path is a camera subpath and a light subpath, with all their connections.
+  auto pathCount = static_cast<double>(renderer->GetFilm().size()) * sampleCount;
+  printf("BDPT: %u samples, %.2f Mpaths/s\n", sampleCount, pathCount / seconds * 1e-6);
+  printf("BDPT: %.2f rays per path\n", static_cast<double>(renderer->GetRayCount()) / pathCount);
+
+  if (reference.empty())
+    return;
+
+  size_t skipCount;
+  double rmse = GetRmse(renderer->GetFilm(), reference, &skipCount);
+  printf("BDPT RMSE: %g (%zu values skipped), efficiency 1 / (MSE * s): %g\n", rmse, skipCount,
+         1.0 / (rmse * rmse * seconds));
+
+  if (targetRmse <= 0.0)
+    return;
+
+  if (targetSeconds >= 0.0) {
+    printf("BDPT: RMSE %g reached after %.3f s\n", targetRmse, targetSeconds);
+  } else {
+    printf("BDPT: RMSE %g not reached\n", targetRmse);
+  }
+}
+
+// Usage: cpu_render [--mode megakernel|wavefront|compare|restir|sppm|bdpt] [--samples n]
+//                   [--size width height] [--sampler random|sobol|bluenoise] [--bounces n]
+//                   [--min-roulette-bounces n] [--light-sampler uniform|power|bvh]
+//                   [--reuse none|spatial|temporal|spatiotemporal] [--candidates n]
+//                   [--environment map.hdr] [--environment-sampling importance|uniform]
+//                   [--radiance-cache] [--cache-bounce n] [--photons n] [--sppm-radius r]
+//                   [--path-guide] [--convergence] [--adaptive threshold]
+//                   [--no-ray-sort] [--output film.pfm] [--heatmap counts.pfm]
+//                   [--reference film.pfm] [--target-rmse rmse]
+//                   [--checkpoint file] [--checkpoint-interval seconds] [scene.gltf]
+//
+// Path traces the scene with the CPU port of the raytracing sample and prints the throughput of
+// each mode. compare, the default, renders with both modes and checks that the films match. For
+// cache behaviour, run a single mode under a profiler with hardware counters, e.g. VTune's memory
+// access analysis or perf stat -e l2_rqsts.miss,l2_rqsts.references. --no-ray-sort traces the
+// wavefront bounce rays unsorted, to measure what sorting them gains on a given scene. --reference
+// prints the RMSE of each film against a converged render of the same size, e.g. one from
+// --output with many samples, to compare the convergence of the samplers. The reference should
+// come from another sampler, since a render shares its first samples with one from its own.
+//
+// Each mode also prints the mean path length in rays and, given a reference, its efficiency: the
+// inverse of MSE times render time, which weighs changes that trade variance for speed. One is
+// Russian roulette, which --min-roulette-bounces turns off when it is at least --bounces. The
+// Cornell box is all diffuse, so changes to GGX sampling show on assets/cornell_box_glossy.gltf,
+// which makes the boxes metal and the floor mostly metallic.
+//
+// --light-sampler picks how light samples choose among the emissive triangles of the scene,
+// e.g. those of assets/cornell_box_many_lights.gltf, which has about 2800 of them.
+//
+// --mode restir renders direct lighting alone with RestirRenderer, one frame per sample, each
+// pixel resampling its light sample from --candidates samples of its own and the reservoirs
+// --reuse names. A render with --bounces 0 and many samples is its ground truth. Given that as
+// the --reference, each frame prints its RMSE next to the M and effective sample size of its
+// reservoirs.
+//
+// --environment lights the scene with an equirectangular map from every direction rays leave
+// it in, e.g. with assets/outdoor_boxes.gltf and assets/sky.hdr. Loading prints how long the
+// sampling distribution took to build. --environment-sampling uniform samples the map uniformly
+// over the sphere instead of by its radiance, to compare their RMSE against one reference.
+//
+// --mode sppm renders by stochastic progressive photon mapping, one iteration per sample, each
+// tracing --photons photon paths from the lights and gathering them at the first surface with a
+// diffuse lobe that camera paths reach through metals, over a radius that starts at
+// --sppm-radius and shrinks. It resolves the caustics of near-mirror metals, e.g. those that the
+// boxes of assets/cornell_box_caustics.gltf throw onto the walls and ceiling, which path tracing
+// leaves as fireflies.
+//
+// --mode bdpt renders by bidirectional path tracing, one sample per pixel and --samples, each
+// connecting a camera and a light subpath of up to --bounces bounces in every way that gives a
+// path. It finds light that only reaches most of the scene through gaps, e.g. that of the quad of
+// assets/cornell_box_occluded.gltf, which a panel hides from all but the ceiling and the tops of
+// the walls, where the light samples of path tracing mostly hit the panel. With --convergence it
+// prints the RMSE against the --reference after samples 1, 2, 4 and so on, which set against
+// those of --mode megakernel compare the two at equal time.
+//
+// --radiance-cache ends paths in a world-space cache of diffuse radiance at diffuse hits after
+// --cache-bounce bounces, 1 by default, and prints how many lookups found a valid cell in the
+// last sample. With --reference and --target-rmse it shows the time the shorter paths save
+// against the bias of the cache, e.g. on assets/interior_rooms.gltf, whose far rooms are lit
+// only indirectly.
+//
+// --path-guide samples bounce rays from diffuse hits from a guide as well as the BSDF, which
+// learns where light comes from at each point in iterations of 1, 2, 4 and so on samples, and
+// prints its size. --convergence prints the RMSE against the --reference at the end of each
+// iteration, so that runs with and without --path-guide give convergence curves to compare,
+// e.g. on assets/interior_rooms.gltf, whose far rooms receive their light through doorways.
+//
+// --adaptive stops sampling each pixel once its relative error falls below the threshold, and
+// --samples becomes the most any pixel takes. --heatmap writes each pixel's sample count as a
+// fraction of that, and --target-rmse prints how long each mode took to reach the RMSE, so that
+// runs with and without --adaptive show what it saves.
+//
+// --checkpoint saves the film of --mode megakernel or wavefront to the file every
+// --checkpoint-interval seconds, 60 by default, and once the render ends. A render that finds
+// the file carries on from it, tracing the samples that it would have traced without the break,
+// up to --samples in all. Files are written on a thread of their own, so that the render only
+// pays for copying the film, which it prints the time of.
+int main(int argc, char** argv) {
+  const char* path = "assets/cornell_box.gltf";
+  const char* outputPath = nullptr;
+  const char* referencePath = nullptr;
+  const char* heatmapPath = nullptr;
+  const char* checkpointPath = nullptr;
+  const char* modeName = "compare";
+  const char* samplerName = "sobol";
+  const char* lightSamplerName = "bvh";
+  const char* reuseName = "spatiotemporal";
+  const char* environmentPath = nullptr;
+  const char* environmentSamplingName = "importance";
+  uint32_t width = 1024;
+  uint32_t height = 768;
+  uint32_t sampleCount = 10;
+  uint32_t numBounces = PathTracerSettings{}.NumBounces;
+  uint32_t minRouletteBounces = PathTracerSettings{}.MinRouletteBounces;
+  uint32_t candidateCount = RestirSettings{}.InitialCandidates;
+  uint32_t photonCount = SppmSettings{}.PhotonsPerIteration;
+  float sppmRadius = SppmSettings{}.InitialRadius;
+  float adaptiveThreshold = 0.f;
+  double targetRmse = 0.0;
+  double checkpointInterval = 60.0;
+  bool sortRays = true;
+  bool useRadianceCache = false;
+  uint32_t cacheBounce = RadianceCacheSettings{}.TerminationBounce;
+  bool usePathGuide = false;
+  bool printConvergence = false;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--mode") == 0 && i + 1 < argc) {
+      modeName = argv[++i];
+    } else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+      sampleCount = static_cast<uint32_t>(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--size") == 0 && i + 2 < argc) {
+      width = static_cast<uint32_t>(atoi(argv[++i]));
+      height = static_cast<uint32_t>(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--sampler") == 0 && i + 1 < argc) {
+      samplerName = argv[++i];
+    } else if (strcmp(argv[i], "--light-sampler") == 0 && i + 1 < argc) {
+      lightSamplerName = argv[++i];
+    } else if (strcmp(argv[i], "--reuse") == 0 && i + 1 < argc) {
+      reuseName = argv[++i];
+    } else if (strcmp(argv[i], "--candidates") == 0 && i + 1 < argc) {
+      candidateCount = static_cast<uint32_t>(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--environment") == 0 && i + 1 < argc) {
+      environmentPath = argv[++i];
+    } else if (strcmp(argv[i], "--environment-sampling") == 0 && i + 1 < argc) {
+      environmentSamplingName = argv[++i];
+    } else if (strcmp(argv[i], "--photons") == 0 && i + 1 < argc) {
+      photonCount = static_cast<uint32_t>(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--sppm-radius") == 0 && i + 1 < argc) {
+      sppmRadius = static_cast<float>(atof(argv[++i]));
+    } else if (strcmp(argv[i], "--radiance-cache") == 0) {
+      useRadianceCache = true;
+    } else if (strcmp(argv[i], "--cache-bounce") == 0 && i + 1 < argc) {
+      cacheBounce = static_cast<uint32_t>(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--path-guide") == 0) {
+      usePathGuide = true;
+    } else if (strcmp(argv[i], "--convergence") == 0) {
+      printConvergence = true;
+    } else if (strcmp(argv[i], "--bounces") == 0 && i + 1 < argc) {
+      numBounces = static_cast<uint32_t>(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--min-roulette-bounces") == 0 && i + 1 < argc) {
+      minRouletteBounces = static_cast<uint32_t>(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--adaptive") == 0 && i + 1 < argc) {
+      adaptiveThreshold = static_cast<float>(atof(argv[++i]));
+    } else if (strcmp(argv[i], "--no-ray-sort") == 0) {
+      sortRays = false;
+    } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+      outputPath = argv[++i];
+    } else if (strcmp(argv[i], "--heatmap") == 0 && i + 1 < argc) {
+      heatmapPath = argv[++i];
+    } else if (strcmp(argv[i], "--reference") == 0 && i + 1 < argc) {
+      referencePath = argv[++i];
+    } else if (strcmp(argv[i], "--target-rmse") == 0 && i + 1 < argc) {
+      targetRmse = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+      checkpointPath = argv[++i];
+    } else if (strcmp(argv[i], "--checkpoint-interval") == 0 && i + 1 < argc) {
+      checkpointInterval = atof(argv[++i]);
+    } else {
+      path = argv[i];
+    }
+  }
+
+  bool compare = strcmp(modeName, "compare") == 0;
+  bool restir = strcmp(modeName, "restir") == 0;
+  bool sppm = strcmp(modeName, "sppm") == 0;
+  bool bdpt = strcmp(modeName, "bdpt") == 0;
+
+  if (!compare && !restir && !sppm && !bdpt && strcmp(modeName, "megakernel") != 0 &&
+      strcmp(modeName, "wavefront") != 0) {
+    fprintf(stderr, "Unknown mode %s.\n", modeName);
+    return 1;
+  }
+
+  if ((restir || sppm || bdpt) && environmentPath) {
+    fprintf(stderr, "--mode %s does not sample environment lights.\n", modeName);
+    return 1;
+  }
+
+  if ((restir || sppm || bdpt) && useRadianceCache) {
+    fprintf(stderr, "--mode %s has no radiance cache.\n", modeName);
+    return 1;
+  }
+
+  if ((restir || sppm || bdpt) && usePathGuide) {
+    fprintf(stderr, "--mode %s has no path guide.\n", modeName);
+    return 1;
+  }
+
+  if (printConvergence && !referencePath) {
+    fprintf(stderr, "--convergence needs a --reference.\n");
+    return 1;
+  }
+
+  if (targetRmse > 0.0 && !referencePath) {
+    fprintf(stderr, "--target-rmse needs a --reference.\n");
+    return 1;
+  }
+
+  if (checkpointPath && strcmp(modeName, "megakernel") != 0 &&
+      strcmp(modeName, "wavefront") != 0) {
+    fprintf(stderr, "--checkpoint needs --mode megakernel or wavefront.\n");
+    return 1;
+  }
+
+  // Resuming would start them over, which gives another film than a render without the break.
+  if (checkpointPath && (useRadianceCache || usePathGuide)) {
+    fprintf(stderr, "--checkpoint does not save the radiance cache or path guide.\n");
+    return 1;
+  }
+
+  PathTracerSettings settings{};
+  settings.NumBounces = numBounces;
+  settings.MinRouletteBounces = minRouletteBounces;
+  settings.AdaptiveThreshold = adaptiveThreshold;
+  settings.SortRays = sortRays;
+  settings.UseRadianceCache = useRadianceCache;
+  settings.RadianceCache.TerminationBounce = cacheBounce;
+  settings.UsePathGuide = usePathGuide;
+
+  if (strcmp(samplerName, "random") == 0) {
+    settings.Sampler = SamplerType::Random;
+  } else if (strcmp(samplerName, "sobol") == 0) {
+    settings.Sampler = SamplerType::Sobol;
+  } else if (strcmp(samplerName, "bluenoise") == 0) {
+    settings.Sampler = SamplerType::BlueNoise;
+  } else {
+    fprintf(stderr, "Unknown sampler %s.\n", samplerName);
+    return 1;
+  }
+
+  if (strcmp(lightSamplerName, "uniform") == 0) {
+    settings.LightSampler = LightSamplerType::Uniform;
+  } else if (strcmp(lightSamplerName, "power") == 0) {
+    settings.LightSampler = LightSamplerType::Power;
+  } else if (strcmp(lightSamplerName, "bvh") == 0) {
+    settings.LightSampler = LightSamplerType::Bvh;
+  } else {
+    fprintf(stderr, "Unknown light sampler %s.\n", lightSamplerName);
+    return 1;
+  }
+
+  if (strcmp(environmentSamplingName, "importance") == 0) {
+    settings.EnvironmentSampling = EnvironmentSamplingType::Importance;
+  } else if (strcmp(environmentSamplingName, "uniform") == 0) {
+    settings.EnvironmentSampling = EnvironmentSamplingType::Uniform;
+  } else {
+    fprintf(stderr, "Unknown environment sampling %s.\n", environmentSamplingName);
+    return 1;
+  }
+
+  RestirSettings restirSettings{};
+  restirSettings.InitialCandidates = candidateCount;
+  restirSettings.LightSampler = settings.LightSampler;
+
+  if (strcmp(reuseName, "none") == 0) {
+    restirSettings.Reuse = RestirReuse::None;
+  } else if (strcmp(reuseName, "spatial") == 0) {
+    restirSettings.Reuse = RestirReuse::Spatial;
+  } else if (strcmp(reuseName, "temporal") == 0) {
+    restirSettings.Reuse = RestirReuse::Temporal;
+  } else if (strcmp(reuseName, "spatiotemporal") == 0) {
+    restirSettings.Reuse = RestirReuse::Spatiotemporal;
+  } else {
+    fprintf(stderr, "Unknown reuse %s.\n", reuseName);
+    return 1;
+  }
+
+  SppmSettings sppmSettings{};
+  sppmSettings.PhotonsPerIteration = photonCount;
+  sppmSettings.NumBounces = numBounces;
+  sppmSettings.InitialRadius = sppmRadius;
+  sppmSettings.LightSampler = settings.LightSampler;
+
+  BdptSettings bdptSettings{};
+  bdptSettings.NumBounces = numBounces;
+
+  std::vector<Float3> reference;
+  if (referencePath) {
+    reference = ReadPfm(referencePath, width, height);
+    if (reference.empty()) {
+      fprintf(stderr, "Failed to read a %ux%u film from %s.\n", width, height, referencePath);
+      return 1;
+    }
+  }
+
+  utils::Scene scene = utils::LoadGltf(path);
+  RenderScene renderScene(scene);
+
+  if (environmentPath) {
+    auto start = std::chrono::steady_clock::now();
+    utils::HdrImage image = utils::LoadHdr(environmentPath);
+    std::chrono::duration<double> loadTime = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    auto environment = std::make_unique<EnvironmentLight>(image.Width, image.Height,
+                                                          image.Pixels);
+    std::chrono::duration<double> buildTime = std::chrono::steady_clock::now() - start;
+
+    printf("%s: %ux%u, loaded in %.1f ms, sampling distribution built in %.1f ms, %.1f MB\n",
+           environmentPath, image.Width, image.Height, loadTime.count() * 1e3,
+           buildTime.count() * 1e3,
+           static_cast<double>(environment->GetMemoryUsage()) / (1024.0 * 1024.0));
+
+    renderScene.SetEnvironmentLight(std::move(environment));
+  }
+
+  if (restir) {
+    printf("%s: %ux%u\n", path, width, height);
+
+    RestirRenderer restirRenderer(renderScene, width, height, restirSettings);
+    RenderRestir(&restirRenderer, sampleCount, reference);
+
+    if (outputPath && !WritePfm(outputPath, width, height, restirRenderer.GetFilm())) {
+      fprintf(stderr, "Failed to write %s.\n", outputPath);
+      return 1;
+    }
+
+    return 0;
+  }
+
+  if (sppm) {
+    printf("%s: %ux%u\n", path, width, height);
+
+    SppmRenderer sppmRenderer(renderScene, width, height, sppmSettings);
+    RenderSppm(&sppmRenderer, sampleCount, reference, targetRmse);
+
+    if (outputPath && !WritePfm(outputPath, width, height, sppmRenderer.GetFilm())) {
+      fprintf(stderr, "Failed to write %s.\n", outputPath);
+      return 1;
+    }
+
+    return 0;
+  }
+
+  if (bdpt) {
+    printf("%s: %ux%u\n", path, width, height);
+
+    BdptRenderer bdptRenderer(renderScene, width, height, bdptSettings);
+    RenderBdpt(&bdptRenderer, sampleCount, reference, targetRmse, printConvergence);
+
+    if (outputPath && !WritePfm(outputPath, width, height, bdptRenderer.GetFilm())) {
+      fprintf(stderr, "Failed to write %s.\n", outputPath);
+      return 1;
+    }
+
+    return 0;
+  }
+
+  PathTracer megakernel(renderScene, width, height, settings);
+  PathTracer wavefront(renderScene, width, height, settings);
+
+  PathTracer& result = strcmp(modeName, "megakernel") == 0 ? megakernel : wavefront;
+
+  printf("%s: %ux%u\n", path, width, height);
+
+  std::unique_ptr<FilmCheckpointWriter> checkpointWriter;
+  if (checkpointPath) {
+    FilmCheckpoint checkpoint;
+    if (LoadFilmCheckpoint(checkpointPath, &checkpoint)) {
+      if (!result.Resume(checkpoint)) {
+        fprintf(stderr, "%s is a checkpoint of another scene, size or settings.\n",
+                checkpointPath);
+        return 1;
+      }
+
+      printf("%s: resuming after %u samples\n", checkpointPath, result.GetSampleCount());
+    } else if (std::filesystem::exists(checkpointPath)) {
+      printf("%s: not a whole checkpoint, starting over\n", checkpointPath);
+    }
+
+    checkpointWriter = std::make_unique<FilmCheckpointWriter>(checkpointPath);
+  }
+
+  if (compare || strcmp(modeName, "megakernel") == 0) {
+    RenderStats stats = Render(&megakernel, PathTracerMode::Megakernel, sampleCount, settings,
+                               reference, targetRmse, "Megakernel", printConvergence,
+                               checkpointWriter.get(), checkpointInterval);
+    PrintStats("Megakernel", megakernel, stats, reference, targetRmse);
+  }
+
+  if (compare || strcmp(modeName, "wavefront") == 0) {
+    RenderStats stats = Render(&wavefront, PathTracerMode::Wavefront, sampleCount, settings,
+                               reference, targetRmse, "Wavefront", printConvergence,
+                               checkpointWriter.get(), checkpointInterval);
+    PrintStats("Wavefront", wavefront, stats, reference, targetRmse);
+  }
+
+  if (checkpointWriter) {
+    checkpointWriter->Wait();
+    result.GetCheckpoint(checkpointWriter->GetNextCheckpoint());
+    checkpointWriter->StartWrite();
+    checkpointWriter->Wait();
+  }
+
+  if (outputPath && !WritePfm(outputPath, width, height, result.GetFilm())) {
+    fprintf(stderr, "Failed to write %s.\n", outputPath);
+    return 1;
+  }
+
+  if (heatmapPath && !WritePfm(heatmapPath, width, height, GetSampleHeatmap(result))) {
+    fprintf(stderr, "Failed to write %s.\n", heatmapPath);
+    return 1;
+  }
+
+  if (compare) {
+    float difference = GetMaxRelativeDifference(megakernel.GetFilm(), wavefront.GetFilm());
+    printf("Max relative difference: %g\n", difference);
+
+    if (!(difference <= k_maxRelativeDifference))
+      return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,128 @@
+#include "cpu_rt/atomic_file.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace cpu_rt {
+
+#ifdef _WIN32
+
+AtomicFileWriter::AtomicFileWriter(const std::filesystem::path& path)
+  : m_path(path), m_tempPath(path) {
+  m_tempPath += ".tmp";
+
+  m_file = CreateFileW(m_tempPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                       FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (m_file == INVALID_HANDLE_VALUE)
+    throw std::runtime_error("Could not create " + m_tempPath.string());
+}
+
+AtomicFileWriter::~AtomicFileWriter() {
+  if (m_file) {
+    CloseHandle(m_file);
+    DeleteFileW(m_tempPath.c_str());
+  }
+}
+
+void AtomicFileWriter::Write(const void* data, size_t size, uint64_t offset) {
+  auto bytes = static_cast<const uint8_t*>(data);
+
+  // WriteFile takes a 32-bit size, so larger writes go in chunks.
+  while (size > 0) {
+    DWORD chunkSize = static_cast<DWORD>(std::min<size_t>(size, 1u << 30));
+
+    OVERLAPPED overlapped{};
+    overlapped.Offset = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+    DWORD written;
+    if (!WriteFile(m_file, bytes, chunkSize, &written, &overlapped) || written != chunkSize)
+      throw std::runtime_error("Could not write " + m_tempPath.string());
+
+    bytes += chunkSize;
+    size -= chunkSize;
+    offset += chunkSize;
+  }
+}
+
+void AtomicFileWriter::Commit() {
+  // The contents reach the disk before the rename does, which MOVEFILE_WRITE_THROUGH waits for.
+  if (!FlushFileBuffers(m_file))
+    throw std::runtime_error("Could not write " + m_tempPath.string());
+
+  CloseHandle(m_file);
+  m_file = nullptr;
+
+  if (!MoveFileExW(m_tempPath.c_str(), m_path.c_str(),
+                   MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+    DeleteFileW(m_tempPath.c_str());
+    throw std::runtime_error("Could not replace " + m_path.string());
+  }
+}
+
+#else
+
+AtomicFileWriter::AtomicFileWriter(const std::filesystem::path& path)
+  : m_path(path), m_tempPath(path) {
+  m_tempPath += ".tmp";
+
+  m_file = open(m_tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (m_file < 0)
+    throw std::runtime_error("Could not create " + m_tempPath.string());
+}
+
+AtomicFileWriter::~AtomicFileWriter() {
+  if (m_file >= 0) {
+    close(m_file);
+    unlink(m_tempPath.c_str());
+  }
+}
+
+void AtomicFileWriter::Write(const void* data, size_t size, uint64_t offset) {
+  auto bytes = static_cast<const uint8_t*>(data);
+
+  // pwrite may write less than it is given.
+  while (size > 0) {
+    ssize_t written = pwrite(m_file, bytes, size, static_cast<off_t>(offset));
+    if (written <= 0)
+      throw std::runtime_error("Could not write " + m_tempPath.string());
+
+    bytes += written;
+    size -= static_cast<size_t>(written);
+    offset += static_cast<uint64_t>(written);
+  }
+}
+
+void AtomicFileWriter::Commit() {
+  // The contents reach the disk before the rename, and the rename before Commit returns.
+  if (fsync(m_file) != 0)
+    throw std::runtime_error("Could not write " + m_tempPath.string());
+
+  close(m_file);
+  m_file = -1;
+
+  if (rename(m_tempPath.c_str(), m_path.c_str()) != 0) {
+    unlink(m_tempPath.c_str());
+    throw std::runtime_error("Could not replace " + m_path.string());
+  }
+
+  std::filesystem::path dirPath = m_path.parent_path();
+  int dir = open(dirPath.empty() ? "." : dirPath.c_str(), O_RDONLY | O_CLOEXEC);
+  if (dir < 0 || fsync(dir) != 0) {
+    if (dir >= 0)
+      close(dir);
+    throw std::runtime_error("Could not replace " + m_path.string());
+  }
+  close(dir);
+}
+
+#endif
+
+} // namespace cpu_rt
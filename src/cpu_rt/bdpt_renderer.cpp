@@ -0,0 +1,440 @@
+#include "cpu_rt/bdpt_renderer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+#include "cpu_rt/camera.h"
+#include "cpu_rt/parallel_for.h"
+#include "cpu_rt/rng.h"
+#include "cpu_rt/shading.h"
+
+namespace cpu_rt {
+
+namespace {
+
+// Same as PathTracer's.
+constexpr uint32_t k_rayFlags = k_rayFlagCullBackFacingTriangles;
+constexpr uint32_t k_shadowRayFlags = k_rayFlagCullBackFacingTriangles |
+                                      k_rayFlagAcceptFirstHitAndEndSearch |
+                                      k_rayFlagForceOpaque | k_rayFlagSkipClosestHitShader;
+
+std::vector<float> GetLightPowers(std::span<const AreaLight> lights) {
+  std::vector<float> powers(lights.size());
+  for (size_t i = 0; i < lights.size(); ++i) {
+    powers[i] = lights[i].GetPower();
+  }
+  return powers;
+}
+
+// Turns a pdf in solid angle at from into one in area measure at to, which lies on a surface
+// with normal n unless n is nullptr, as for the camera.
+float ToAreaPdf(float pdf, const Float3& from, const Float3& to, const Float3* n) {
+  Float3 d = to - from;
+  float distSq = Dot(d, d);
+
+  if (n)
+    pdf *= std::abs(Dot(*n, d)) / std::sqrt(distSq);
+
+  return pdf / distSq;
+}
+
+bool IsBlack(const Float3& c) {
+  return !(c.x > 0.f || c.y > 0.f || c.z > 0.f);
+}
+
+} // namespace
+
+BdptRenderer::BdptRenderer(const RenderScene& scene, uint32_t width, uint32_t height,
+                           const BdptSettings& settings)
+  : m_scene(scene), m_width(width), m_height(height), m_settings(settings),
+    m_lightPowers(GetLightPowers(scene.GetLights())),
+    m_film(static_cast<size_t>(width) * height), m_sums(m_film.size()),
+    m_splats(m_film.size()) {}
+
+void BdptRenderer::Render() {
+  // A path of NumBounces + 2 segments has NumBounces + 3 vertices, of which the camera subpath
+  // takes all if it hits a light and the light subpath all but the camera.
+  uint32_t maxCameraVertices = m_settings.NumBounces + 3;
+  uint32_t maxLightVertices = m_settings.NumBounces + 2;
+
+  std::atomic<uint64_t> rayCount = 0;
+
+  ParallelFor(m_film.size(), [&](size_t begin, size_t end) {
+    std::vector<Vertex> cameraPath(maxCameraVertices);
+    std::vector<Vertex> lightPath(maxLightVertices);
+    uint32_t chunkRayCount = 0;
+
+    for (size_t pixel = begin; pixel < end; ++pixel) {
+      auto x = static_cast<uint32_t>(pixel % m_width);
+      auto y = static_cast<uint32_t>(pixel / m_width);
+
+      uint32_t rngState = InitRngSeed(x, y, m_sampleCount);
+
+      float jitterX = Rand(&rngState);
+      float jitterY = Rand(&rngState);
+      Ray cameraRay = GetCameraRay(m_width, m_height, x, y, jitterX, jitterY);
+      cameraRay.Direction = Normalize(cameraRay.Direction);
+
+      cameraPath[0] = Vertex{VertexType::Camera, k_invalidIndex, k_invalidIndex,
+                             k_cameraPosition, Float3{}, Float3{}, Float3{1.f, 1.f, 1.f}, 1.f,
+                             0.f};
+
+      uint32_t cameraCount = RandomWalk(cameraRay, Float3{1.f, 1.f, 1.f},
+                                        GetCameraDirectionPdf(cameraRay.Direction), true,
+                                        cameraPath.data(), 1, maxCameraVertices, &rngState,
+                                        &chunkRayCount);
+
+      // The light subpath leaves a point of a light picked by power by cosine, as SPPM's photons
+      // do.
+      float lightPmf;
+      uint32_t lightIndex = m_lightPowers.Sample(Rand(&rngState), &lightPmf);
+      const AreaLight& light = m_scene.GetLights()[lightIndex];
+
+      float pointU = Rand(&rngState);
+      float pointV = Rand(&rngState);
+      Float3 origin = light.SamplePoint(pointU, pointV);
+
+      Float3 lightNormal = light.GetNormal();
+      float sidePmf = 1.f;
+      if (light.TwoSided) {
+        if (Rand(&rngState) < 0.5f)
+          lightNormal = -lightNormal;
+        sidePmf = 0.5f;
+      }
+
+      Float3 b1, b2;
+      GetCoordinateSystem(lightNormal, &b1, &b2);
+
+      float dirU = Rand(&rngState);
+      float dirV = Rand(&rngState);
+      Float3 local = CosineSampleHemisphere(dirU, dirV);
+      Float3 dir = Normalize(local.x * b1 + local.y * lightNormal + local.z * b2);
+
+      float originPdf = lightPmf / light.GetArea();
+      lightPath[0] = Vertex{VertexType::Light, lightIndex, k_invalidIndex, origin,
+                            light.GetNormal(), Float3{}, light.Le / originPdf, originPdf, 0.f};
+
+      // Le cos / (pdfOrigin pdfDir), where the cosine pdf cancels the cosine.
+      Float3 beta = light.Le * (k_pi / (originPdf * sidePmf));
+
+      uint32_t lightCount = RandomWalk(Ray{origin, 0.0001f, dir, k_rayTMax}, beta,
+                                       sidePmf * local.y / k_pi, false, lightPath.data(), 1,
+                                       maxLightVertices, &rngState, &chunkRayCount);
+
+      Float3 sum{0.f, 0.f, 0.f};
+
+      for (uint32_t t = 1; t <= cameraCount; ++t) {
+        for (uint32_t s = 0; s <= lightCount; ++s) {
+          // A lone camera vertex is no path, and the pinhole cannot be hit, so a light sample
+          // seen straight from the camera is none either.
+          if (s + t < 2 || s + t > maxCameraVertices || (s == 1 && t == 1))
+            continue;
+
+          float filmX, filmY;
+          Float3 contribution = Connect(lightPath.data(), cameraPath.data(), s, t, &rngState,
+                                        &chunkRayCount, &filmX, &filmY);
+          if (IsBlack(contribution))
+            continue;
+
+          if (t > 1) {
+            sum += contribution;
+            continue;
+          }
+
+          Float3& splat = m_splats[static_cast<size_t>(filmY) * m_width +
+                                   static_cast<size_t>(filmX)];
+          std::atomic_ref(splat.x).fetch_add(contribution.x, std::memory_order_relaxed);
+          std::atomic_ref(splat.y).fetch_add(contribution.y, std::memory_order_relaxed);
+          std::atomic_ref(splat.z).fetch_add(contribution.z, std::memory_order_relaxed);
+        }
+      }
+
+      m_sums[pixel] += sum;
+    }
+
+    rayCount.fetch_add(chunkRayCount, std::memory_order_relaxed);
+  });
+
+  ++m_sampleCount;
+  m_rayCount += rayCount;
+
+  // Each sample traces as many light subpaths as there are pixels, which share the film between
+  // them, so that the splats of a sample already average over them.
+  auto sampleCount = static_cast<float>(m_sampleCount);
+  ParallelFor(m_film.size(), [&](size_t begin, size_t end) {
+    for (size_t pixel = begin; pixel < end; ++pixel) {
+      m_film[pixel] = (m_sums[pixel] + m_splats[pixel]) / sampleCount;
+    }
+  });
+}
+
+uint32_t BdptRenderer::RandomWalk(Ray ray, Float3 beta, float pdf, bool isCameraPath,
+                                  Vertex* path, uint32_t count, uint32_t maxCount,
+                                  uint32_t* rngState, uint32_t* rayCount) const {
+  while (count < maxCount) {
+    ++*rayCount;
+
+    HitInfo hit;
+    if (!m_scene.GetTlas().TraceRay(ray, k_rayFlags, ~0u, 0, 1, &hit,
+                                    m_scene.GetIntersectionTable()))
+      break;
+
+    Vertex& prev = path[count - 1];
+    Vertex& vertex = path[count];
+
+    vertex.Type = VertexType::Surface;
+    vertex.Position = ray.Origin + hit.T * ray.Direction;
+    vertex.Wo = -ray.Direction;
+    vertex.Beta = beta;
+    vertex.PdfRev = 0.f;
+
+    // The quad is the first light. It ends both subpaths, and only the light it gives the camera
+    // subpath counts, since a light subpath cannot connect through it.
+    if (hit.HitGroupIndex == m_scene.GetLightHitGroupIndex()) {
+      if (!isCameraPath)
+        break;
+
+      vertex.Light = 0;
+      vertex.MaterialIndex = k_invalidIndex;
+      vertex.Normal = m_scene.GetLights()[0].GetNormal();
+    } else {
+      vertex.Light = m_scene.GetTriangleLight(hit);
+      vertex.MaterialIndex = m_scene.GetMaterialIndex(hit.HitGroupIndex);
+      vertex.Normal = m_scene.GetShadingNormal(hit);
+    }
+
+    // A hit at a grazing angle has no density to weigh its strategies by.
+    vertex.PdfFwd = ToAreaPdf(pdf, prev.Position, vertex.Position, &vertex.Normal);
+    if (!(vertex.PdfFwd > 0.f))
+      break;
+
+    ++count;
+
+    if (vertex.MaterialIndex == k_invalidIndex || count == maxCount)
+      break;
+
+    const ShadingMaterial& material = m_scene.GetShadingMaterials()[vertex.MaterialIndex];
+
+    float randU = Rand(rngState);
+    float randV = Rand(rngState);
+
+    Float3 wi;
+    float bsdfPdf;
+    if (!SampleBsdf(vertex.Wo, vertex.Normal, material, randU, randV, &wi, &bsdfPdf))
+      break;
+
+    Float3 brdf = GetBrdf(vertex, wi);
+    beta = beta * brdf * Dot(wi, vertex.Normal) / bsdfPdf;
+    if (IsBlack(beta))
+      break;
+
+    // The BRDF is symmetric, so the reverse pdf only swaps the directions.
+    float reversePdf = GetBsdfPdf(wi, vertex.Wo, vertex.Normal, material);
+    prev.PdfRev = ToAreaPdf(reversePdf, vertex.Position, prev.Position,
+                            prev.Type == VertexType::Camera ? nullptr : &prev.Normal);
+
+    pdf = bsdfPdf;
+    ray = Ray{vertex.Position, 0.f, wi, k_rayTMax};
+  }
+
+  return count;
+}
+
+Float3 BdptRenderer::Connect(const Vertex* lightPath, const Vertex* cameraPath, uint32_t s,
+                             uint32_t t, uint32_t* rngState, uint32_t* rayCount, float* filmX,
+                             float* filmY) const {
+  Float3 black{0.f, 0.f, 0.f};
+
+  const Vertex& pt = cameraPath[t - 1];
+  Vertex sampled{};
+  Float3 contribution;
+
+  if (s == 0) {
+    // The camera subpath found a light by itself.
+    if (pt.Light == k_invalidIndex)
+      return black;
+
+    contribution = pt.Beta * GetEmission(pt, pt.Wo);
+  } else if (t == 1) {
+    // The light subpath, seen from the camera. The importance of the pinhole is the pdf of its
+    // direction in area measure, without the cosine at the camera, which has no surface.
+    const Vertex& qs = lightPath[s - 1];
+    if (qs.MaterialIndex == k_invalidIndex)
+      return black;
+
+    Float3 toCamera = k_cameraPosition - qs.Position;
+    float dist = Length(toCamera);
+    Float3 wi = toCamera / dist;
+
+    if (!GetCameraFilmPosition(m_width, m_height, -wi, filmX, filmY))
+      return black;
+
+    contribution = qs.Beta * GetBrdf(qs, wi) *
+                   (Dot(wi, qs.Normal) * GetCameraDirectionPdf(-wi) / (dist * dist));
+    if (IsBlack(contribution))
+      return black;
+
+    ++*rayCount;
+    if (!IsVisible(qs.Position, k_cameraPosition, ~0u))
+      return black;
+
+    sampled = Vertex{VertexType::Camera, k_invalidIndex, k_invalidIndex, k_cameraPosition,
+                     Float3{}, Float3{}, Float3{1.f, 1.f, 1.f}, 1.f, 0.f};
+  } else if (s == 1) {
+    // A light sample, drawn like the light subpaths' origins.
+    if (pt.MaterialIndex == k_invalidIndex)
+      return black;
+
+    float lightPmf;
+    uint32_t lightIndex = m_lightPowers.Sample(Rand(rngState), &lightPmf);
+    const AreaLight& light = m_scene.GetLights()[lightIndex];
+
+    float lightU = Rand(rngState);
+    float lightV = Rand(rngState);
+    Float3 lightSamplePos = light.SamplePoint(lightU, lightV);
+
+    Float3 toLight = lightSamplePos - pt.Position;
+    float dist = Length(toLight);
+    Float3 wi = toLight / dist;
+
+    float pdf = lightPmf * light.GetPdf(dist, wi);
+    if (!(pdf > 0.f))
+      return black;
+
+    sampled = Vertex{VertexType::Light, lightIndex, k_invalidIndex, lightSamplePos,
+                     light.GetNormal(), Float3{}, light.Le / pdf,
+                     lightPmf / light.GetArea(), 0.f};
+
+    contribution = pt.Beta * GetBrdf(pt, wi) * Dot(wi, pt.Normal) * sampled.Beta;
+    if (IsBlack(contribution))
+      return black;
+
+    // Shadow rays towards the quad skip it, as PathTracer's do.
+    ++*rayCount;
+    if (!IsVisible(pt.Position, lightSamplePos, lightIndex == 0 ? ~k_lightInstanceMask : ~0u))
+      return black;
+  } else {
+    const Vertex& qs = lightPath[s - 1];
+    if (qs.MaterialIndex == k_invalidIndex || pt.MaterialIndex == k_invalidIndex)
+      return black;
+
+    Float3 toLightVertex = qs.Position - pt.Position;
+    float dist = Length(toLightVertex);
+    Float3 wi = toLightVertex / dist;
+
+    float g = Dot(wi, pt.Normal) * -Dot(wi, qs.Normal) / (dist * dist);
+    contribution = qs.Beta * GetBrdf(qs, -wi) * GetBrdf(pt, wi) * pt.Beta * g;
+    if (IsBlack(contribution))
+      return black;
+
+    ++*rayCount;
+    if (!IsVisible(pt.Position, qs.Position, ~0u))
+      return black;
+  }
+
+  return contribution * GetMisWeight(lightPath, cameraPath, sampled, s, t);
+}
+
+float BdptRenderer::GetMisWeight(const Vertex* lightPath, const Vertex* cameraPath,
+                                 const Vertex& sampled, uint32_t s, uint32_t t) const {
+  if (s + t == 2)
+    return 1.f;
+
+  const Vertex* qs = s == 1 ? &sampled : (s > 1 ? &lightPath[s - 1] : nullptr);
+  const Vertex* qsMinus = s > 1 ? &lightPath[s - 2] : nullptr;
+  const Vertex* pt = t == 1 ? &sampled : &cameraPath[t - 1];
+  const Vertex* ptMinus = t > 1 ? &cameraPath[t - 2] : nullptr;
+
+  // The reverse pdfs of the vertices at the connection, as this strategy links them. The others
+  // are those the subpaths recorded.
+  float ptPdfRev = qs ? GetPdf(*qs, qsMinus, *pt) : GetLightOriginPdf(*pt);
+
+  float ptMinusPdfRev = 0.f;
+  if (ptMinus)
+    ptMinusPdfRev = qs ? GetPdf(*pt, qs, *ptMinus) : GetEmissionPdf(*pt, *ptMinus);
+
+  float qsPdfRev = qs ? GetPdf(*pt, ptMinus, *qs) : 0.f;
+  float qsMinusPdfRev = qsMinus ? GetPdf(*qs, pt, *qsMinus) : 0.f;
+
+  // Walks the connection towards the camera and then towards the light, where each step gives
+  // the pdf of the strategy that would have connected there relative to this one's.
+  float sum = 0.f;
+
+  float ratio = 1.f;
+  for (uint32_t i = t - 1; i > 0; --i) {
+    float pdfRev = i == t - 1 ? ptPdfRev : (i == t - 2 ? ptMinusPdfRev : cameraPath[i].PdfRev);
+    ratio *= pdfRev / cameraPath[i].PdfFwd;
+    sum += ratio * ratio;
+  }
+
+  ratio = 1.f;
+  for (uint32_t i = s; i-- > 0;) {
+    const Vertex& vertex = s == 1 ? sampled : lightPath[i];
+    float pdfRev = i == s - 1 ? qsPdfRev : (i == s - 2 ? qsMinusPdfRev : vertex.PdfRev);
+    ratio *= pdfRev / vertex.PdfFwd;
+    sum += ratio * ratio;
+  }
+
+  return 1.f / (1.f + sum);
+}
+
+float BdptRenderer::GetPdf(const Vertex& vertex, const Vertex* prev, const Vertex& next) const {
+  if (vertex.Type == VertexType::Light)
+    return GetEmissionPdf(vertex, next);
+
+  Float3 wi = Normalize(next.Position - vertex.Position);
+
+  float pdf;
+  if (vertex.Type == VertexType::Camera) {
+    pdf = GetCameraDirectionPdf(wi);
+  } else {
+    Float3 wo = Normalize(prev->Position - vertex.Position);
+    pdf = GetBsdfPdf(wo, wi, vertex.Normal,
+                     m_scene.GetShadingMaterials()[vertex.MaterialIndex]);
+  }
+
+  return ToAreaPdf(pdf, vertex.Position, next.Position,
+                   next.Type == VertexType::Camera ? nullptr : &next.Normal);
+}
+
+float BdptRenderer::GetEmissionPdf(const Vertex& vertex, const Vertex& next) const {
+  const AreaLight& light = m_scene.GetLights()[vertex.Light];
+
+  // Cosine-weighted about the side of the light, which two-sided lights pick at random.
+  float cosTheta = Dot(light.GetNormal(), Normalize(next.Position - vertex.Position));
+  float pdf = light.TwoSided ? 0.5f * std::abs(cosTheta) / k_pi : std::max(0.f, cosTheta) / k_pi;
+
+  return ToAreaPdf(pdf, vertex.Position, next.Position,
+                   next.Type == VertexType::Camera ? nullptr : &next.Normal);
+}
+
+float BdptRenderer::GetLightOriginPdf(const Vertex& vertex) const {
+  return m_lightPowers.GetPmf(vertex.Light) / m_scene.GetLights()[vertex.Light].GetArea();
+}
+
+Float3 BdptRenderer::GetEmission(const Vertex& vertex, const Float3& w) const {
+  const AreaLight& light = m_scene.GetLights()[vertex.Light];
+  if (light.TwoSided || Dot(light.GetNormal(), w) > 0.f)
+    return light.Le;
+
+  return Float3{0.f, 0.f, 0.f};
+}
+
+Float3 BdptRenderer::GetBrdf(const Vertex& vertex, const Float3& wi) const {
+  if (!(Dot(wi, vertex.Normal) > 0.f && Dot(vertex.Wo, vertex.Normal) > 0.f))
+    return Float3{0.f, 0.f, 0.f};
+
+  return Brdf(vertex.Wo, wi, vertex.Normal, m_scene.GetMaterials()[vertex.MaterialIndex]);
+}
+
+bool BdptRenderer::IsVisible(const Float3& from, const Float3& to, uint32_t instanceMask) const {
+  Float3 d = to - from;
+  float dist = Length(d);
+
+  Ray ray{from, 0.0001f, d / dist, dist * (1.f - k_shadowRayShortening)};
+  return !m_scene.GetTlas().Occluded(ray, ray.TMax, instanceMask, k_shadowRayFlags,
+                                     m_scene.GetIntersectionTable());
+}
+
+} // namespace cpu_rt
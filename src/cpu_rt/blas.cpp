@@ -0,0 +1,491 @@
+#include "cpu_rt/blas.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+#include "cpu_rt/atomic_file.h"
+#include "cpu_rt/hasher.h"
+
+namespace cpu_rt {
+
+namespace {
+
+struct BlasFileSection {
+  uint64_t Offset;
+  uint64_t Count;
+};
+
+// Followed by the sections, each aligned to k_blasFileAlignment from the start of the file.
+struct BlasFileHeader {
+  uint32_t Magic;
+  uint32_t Version;
+  uint64_t Key;
+
+  // The block layout depends on the SIMD width the library was built for.
+  uint32_t TriangleBlockWidth;
+  uint32_t Type;
+  uint32_t GeometryCount;
+  uint32_t PrimitiveCount;
+  Aabb Bounds;
+
+  BlasFileSection Nodes;
+  BlasFileSection CompressedNodes;
+  BlasFileSection TriangleBlocks;
+  BlasFileSection ProceduralPrims;
+
+  // Hash of the sections' contents.
+  uint64_t Checksum;
+};
+
+} // namespace
+
+static constexpr uint32_t k_blasFileMagic = 0x53414c42; // "BLAS"
+static constexpr uint32_t k_blasFileVersion = 1;
+static constexpr uint64_t k_blasFileAlignment = 64;
+
+static uint64_t AlignOffset(uint64_t offset) {
+  return (offset + k_blasFileAlignment - 1) & ~(k_blasFileAlignment - 1);
+}
+
+GeometryDesc GetTriangleGeometryDesc(const utils::Scene& scene, const utils::Primitive& prim,
+                                     std::optional<Matrix3x4> transform) {
+  const utils::BufferView* posBufferView = prim.Positions->BufferView;
+  const utils::BufferView* indexBufferView = prim.Indices->BufferView;
+
+  if (prim.Positions->ComponentType != utils::ComponentType::Float ||
+      prim.Indices->ComponentType != utils::ComponentType::UnsignedShort)
+    throw std::invalid_argument("Unsupported vertex or index format.");
+
+  GeometryDesc desc{};
+  desc.Type = GeometryType::Triangles;
+  desc.Triangles.Transform3x4 = transform;
+  desc.Triangles.VertexBuffer = scene.Buffers[posBufferView->BufferIndex].data() +
+                                posBufferView->Offset;
+  desc.Triangles.VertexStride = *posBufferView->Stride;
+  desc.Triangles.VertexCount = prim.Positions->Count;
+  desc.Triangles.IndexBuffer = reinterpret_cast<const uint16_t*>(
+      scene.Buffers[indexBufferView->BufferIndex].data() + indexBufferView->Offset);
+  desc.Triangles.IndexCount = prim.Indices->Count;
+
+  return desc;
+}
+
+static Float3 LoadVertex(const TrianglesDesc& desc, uint32_t index) {
+  Float3 v;
+  memcpy(&v, desc.VertexBuffer + static_cast<size_t>(index) * desc.VertexStride, sizeof(v));
+
+  if (desc.Transform3x4)
+    v = TransformPoint(*desc.Transform3x4, v);
+
+  return v;
+}
+
+Blas::Blas(std::span<const GeometryDesc> geometryDescs, const BvhBuildSettings& settings,
+           uint32_t buildFlags) {
+  m_geometryCount = static_cast<uint32_t>(geometryDescs.size());
+
+  if (!geometryDescs.empty())
+    m_type = geometryDescs[0].Type;
+
+  struct Triangle {
+    Float3 V[3];
+    uint32_t GeometryIndex;
+    uint32_t PrimitiveIndex;
+  };
+
+  std::vector<Triangle> triangles;
+  std::vector<ProceduralPrimitive> proceduralPrims;
+  std::vector<Aabb> primBounds;
+
+  for (uint32_t geometryIndex = 0; geometryIndex < m_geometryCount; ++geometryIndex) {
+    const GeometryDesc& geometryDesc = geometryDescs[geometryIndex];
+
+    if (geometryDesc.Type != m_type)
+      throw std::invalid_argument("A Blas cannot mix triangles and procedural primitives.");
+
+    if (m_type == GeometryType::ProceduralPrimitiveAabbs) {
+      const AabbsDesc& desc = geometryDesc.Aabbs;
+
+      for (uint32_t primIndex = 0; primIndex < desc.AabbCount; ++primIndex) {
+        ProceduralPrimitive prim{};
+        prim.Bounds = desc.Aabbs[primIndex];
+        prim.GeometryIndex = geometryIndex;
+        prim.PrimitiveIndex = primIndex;
+
+        proceduralPrims.push_back(prim);
+
+        primBounds.push_back(prim.Bounds);
+        m_bounds.Grow(prim.Bounds);
+      }
+      continue;
+    }
+
+    const TrianglesDesc& desc = geometryDesc.Triangles;
+
+    for (uint32_t primIndex = 0; primIndex < desc.IndexCount / 3; ++primIndex) {
+      Triangle tri{};
+      tri.GeometryIndex = geometryIndex;
+      tri.PrimitiveIndex = primIndex;
+
+      Aabb bounds = Aabb::Empty();
+
+      for (int i = 0; i < 3; ++i) {
+        tri.V[i] = LoadVertex(desc, desc.IndexBuffer[primIndex * 3 + i]);
+        bounds.Grow(tri.V[i]);
+      }
+
+      triangles.push_back(tri);
+
+      primBounds.push_back(bounds);
+      m_bounds.Grow(bounds);
+    }
+  }
+
+  m_primitiveCount = static_cast<uint32_t>(primBounds.size());
+
+  BvhBuildSettings bvhSettings = settings;
+
+  // Leaves are padded to whole blocks, so smaller leaves would only waste lanes.
+  if (m_type == GeometryType::Triangles) {
+    bvhSettings.LeafGranularity = k_triangleBlockWidth;
+    bvhSettings.MaxLeafSize = std::max(settings.MaxLeafSize, k_triangleBlockWidth);
+  }
+
+  bool compress = (buildFlags & k_buildFlagMinimizeMemory) != 0;
+
+  if (compress) {
+    bvhSettings.MaxLeafSize = std::min(bvhSettings.MaxLeafSize,
+                                       k_maxCompressedLeafItems * bvhSettings.LeafGranularity);
+  }
+
+  // Spatial splits need the triangles themselves to clip them, so they only apply to triangles.
+  if (m_type == GeometryType::Triangles && (buildFlags & k_buildFlagPreferFastTrace) != 0) {
+    std::vector<Float3> triangleVertices;
+    triangleVertices.reserve(triangles.size() * 3);
+
+    for (const Triangle& tri : triangles) {
+      triangleVertices.insert(triangleVertices.end(), std::begin(tri.V), std::end(tri.V));
+    }
+
+    m_bvh = BuildSpatialSplitBvh(triangleVertices, bvhSettings);
+  } else {
+    m_bvh = BuildBvh(primBounds, bvhSettings);
+  }
+
+  if (m_type == GeometryType::Triangles) {
+    constexpr float nan = std::numeric_limits<float>::quiet_NaN();
+
+    uint32_t blockCount = 0;
+    for (const BvhNode& node : m_bvh.Nodes) {
+      if (node.IsLeaf())
+        blockCount += GetTriangleBlockCount(node);
+    }
+    m_triangleBlockStorage.reserve(blockCount);
+
+    for (BvhNode& node : m_bvh.Nodes) {
+      if (!node.IsLeaf())
+        continue;
+
+      uint32_t firstPrim = node.LeftFirst;
+      node.LeftFirst = static_cast<uint32_t>(m_triangleBlockStorage.size());
+
+      for (uint32_t i = 0; i < GetTriangleBlockCount(node) * k_triangleBlockWidth; ++i) {
+        if (i % k_triangleBlockWidth == 0)
+          m_triangleBlockStorage.emplace_back();
+
+        TriangleBlock& block = m_triangleBlockStorage.back();
+        uint32_t lane = i % k_triangleBlockWidth;
+
+        if (i >= node.PrimCount) {
+          for (int axis = 0; axis < 3; ++axis) {
+            block.V0[axis][lane] = nan;
+            block.V1[axis][lane] = nan;
+            block.V2[axis][lane] = nan;
+          }
+          block.GeometryIndex[lane] = k_invalidIndex;
+          block.PrimitiveIndex[lane] = k_invalidIndex;
+          continue;
+        }
+
+        const Triangle& tri = triangles[m_bvh.PrimIndices[firstPrim + i]];
+
+        for (int axis = 0; axis < 3; ++axis) {
+          block.V0[axis][lane] = tri.V[0][axis];
+          block.V1[axis][lane] = tri.V[1][axis];
+          block.V2[axis][lane] = tri.V[2][axis];
+        }
+        block.GeometryIndex[lane] = tri.GeometryIndex;
+        block.PrimitiveIndex[lane] = tri.PrimitiveIndex;
+      }
+    }
+  } else {
+    m_proceduralPrimStorage.reserve(proceduralPrims.size());
+    for (uint32_t primIndex : m_bvh.PrimIndices) {
+      m_proceduralPrimStorage.push_back(proceduralPrims[primIndex]);
+    }
+  }
+
+  // Leaves index the primitive arrays directly, so the indirection is no longer needed.
+  m_bvh.PrimIndices = {};
+
+  if (compress)
+    Compress(bvhSettings.LeafGranularity);
+
+  SetViews();
+}
+
+void Blas::Compress(uint32_t leafGranularity) {
+  m_compressedBvh = CompressBvh(m_bvh, leafGranularity);
+  m_bvh = {};
+
+  // Compressed nodes address the items of their leaf children relative to one base, so the
+  // items are reordered to match.
+  if (m_type == GeometryType::Triangles) {
+    std::vector<TriangleBlock> blocks;
+    blocks.reserve(m_compressedBvh.ItemIndices.size());
+    for (uint32_t blockIndex : m_compressedBvh.ItemIndices) {
+      blocks.push_back(m_triangleBlockStorage[blockIndex]);
+    }
+    m_triangleBlockStorage = std::move(blocks);
+  } else {
+    std::vector<ProceduralPrimitive> prims;
+    prims.reserve(m_compressedBvh.ItemIndices.size());
+    for (uint32_t primIndex : m_compressedBvh.ItemIndices) {
+      prims.push_back(m_proceduralPrimStorage[primIndex]);
+    }
+    m_proceduralPrimStorage = std::move(prims);
+  }
+
+  m_compressedBvh.ItemIndices = {};
+}
+
+void Blas::SetViews() {
+  m_nodes = m_bvh.Nodes;
+  m_compressedNodes = m_compressedBvh.Nodes;
+  m_triangleBlocks = m_triangleBlockStorage;
+  m_proceduralPrims = m_proceduralPrimStorage;
+}
+
+size_t Blas::GetMemoryUsage() const {
+  if (m_mappedFile)
+    return sizeof(*this) + m_mappedFile->GetData().size();
+
+  return sizeof(*this) + m_bvh.Nodes.capacity() * sizeof(BvhNode) +
+         m_compressedBvh.Nodes.capacity() * sizeof(CompressedBvhNode) +
+         m_triangleBlockStorage.capacity() * sizeof(TriangleBlock) +
+         m_proceduralPrimStorage.capacity() * sizeof(ProceduralPrimitive);
+}
+
+template<typename T>
+static void UpdateChecksum(Hasher* hasher, std::span<const T> section) {
+  hasher->Update(section.data(), section.size_bytes());
+}
+
+BvhStats Blas::GetStats(const BvhBuildSettings& settings) const {
+  BvhBuildSettings statsSettings = settings;
+  if (m_type == GeometryType::Triangles)
+    statsSettings.LeafGranularity = k_triangleBlockWidth;
+
+  if (m_compressedNodes.empty())
+    return ComputeBvhStats(m_nodes, statsSettings);
+
+  return ComputeCompressedBvhStats(m_compressedNodes, statsSettings,
+                                   [&](uint32_t first, uint32_t count) {
+    if (m_type != GeometryType::Triangles)
+      return count;
+
+    uint32_t primCount = 0;
+    for (const TriangleBlock& block : m_triangleBlocks.subspan(first, count)) {
+      primCount += static_cast<uint32_t>(std::count_if(
+          std::begin(block.PrimitiveIndex), std::end(block.PrimitiveIndex),
+          [](uint32_t primIndex) { return primIndex != k_invalidIndex; }));
+    }
+    return primCount;
+  });
+}
+
+void Blas::Save(const std::filesystem::path& path, uint64_t key) const {
+  BlasFileHeader header{};
+  header.Magic = k_blasFileMagic;
+  header.Version = k_blasFileVersion;
+  header.Key = key;
+  header.TriangleBlockWidth = k_triangleBlockWidth;
+  header.Type = static_cast<uint32_t>(m_type);
+  header.GeometryCount = m_geometryCount;
+  header.PrimitiveCount = m_primitiveCount;
+  header.Bounds = m_bounds;
+
+  uint64_t fileSize = AlignOffset(sizeof(header));
+
+  auto addSection = [&]<typename T>(std::span<const T> data, BlasFileSection* section) {
+    section->Offset = fileSize;
+    section->Count = data.size();
+    fileSize = AlignOffset(fileSize + data.size_bytes());
+  };
+
+  addSection(m_nodes, &header.Nodes);
+  addSection(m_compressedNodes, &header.CompressedNodes);
+  addSection(m_triangleBlocks, &header.TriangleBlocks);
+  addSection(m_proceduralPrims, &header.ProceduralPrims);
+
+  Hasher checksum;
+  UpdateChecksum(&checksum, m_nodes);
+  UpdateChecksum(&checksum, m_compressedNodes);
+  UpdateChecksum(&checksum, m_triangleBlocks);
+  UpdateChecksum(&checksum, m_proceduralPrims);
+  header.Checksum = checksum.Finish();
+
+  // Renamed over the destination once it is on disk, so an interrupted save never leaves a
+  // truncated file behind.
+  AtomicFileWriter file(path);
+
+  file.Write(&header, sizeof(header), 0);
+  file.Write(m_nodes.data(), m_nodes.size_bytes(), header.Nodes.Offset);
+  file.Write(m_compressedNodes.data(), m_compressedNodes.size_bytes(),
+             header.CompressedNodes.Offset);
+  file.Write(m_triangleBlocks.data(), m_triangleBlocks.size_bytes(),
+             header.TriangleBlocks.Offset);
+  file.Write(m_proceduralPrims.data(), m_proceduralPrims.size_bytes(),
+             header.ProceduralPrims.Offset);
+
+  // Pads the file to its full size, so every section lies within it.
+  if (fileSize > 0) {
+    char zero = 0;
+    file.Write(&zero, 1, fileSize - 1);
+  }
+
+  file.Commit();
+}
+
+std::unique_ptr<Blas> Blas::Load(const std::filesystem::path& path, uint64_t key) {
+  std::unique_ptr<MappedFile> file = MappedFile::Open(path);
+  if (!file)
+    return nullptr;
+
+  std::span<const uint8_t> data = file->GetData();
+
+  BlasFileHeader header;
+  if (data.size() < sizeof(header))
+    return nullptr;
+
+  memcpy(&header, data.data(), sizeof(header));
+
+  if (header.Magic != k_blasFileMagic || header.Version != k_blasFileVersion ||
+      header.Key != key || header.TriangleBlockWidth != k_triangleBlockWidth ||
+      header.Type > static_cast<uint32_t>(GeometryType::ProceduralPrimitiveAabbs)) {
+    return nullptr;
+  }
+
+  std::unique_ptr<Blas> blas(new Blas());
+
+  auto getSection = [&]<typename T>(const BlasFileSection& section, std::span<const T>* view) {
+    if (section.Offset % k_blasFileAlignment != 0 || section.Offset > data.size() ||
+        section.Count > (data.size() - section.Offset) / sizeof(T)) {
+      return false;
+    }
+
+    *view = std::span(reinterpret_cast<const T*>(data.data() + section.Offset),
+                      static_cast<size_t>(section.Count));
+    return true;
+  };
+
+  if (!getSection(header.Nodes, &blas->m_nodes) ||
+      !getSection(header.CompressedNodes, &blas->m_compressedNodes) ||
+      !getSection(header.TriangleBlocks, &blas->m_triangleBlocks) ||
+      !getSection(header.ProceduralPrims, &blas->m_proceduralPrims)) {
+    return nullptr;
+  }
+
+  Hasher checksum;
+  UpdateChecksum(&checksum, blas->m_nodes);
+  UpdateChecksum(&checksum, blas->m_compressedNodes);
+  UpdateChecksum(&checksum, blas->m_triangleBlocks);
+  UpdateChecksum(&checksum, blas->m_proceduralPrims);
+
+  if (checksum.Finish() != header.Checksum)
+    return nullptr;
+
+  blas->m_type = static_cast<GeometryType>(header.Type);
+  blas->m_bounds = header.Bounds;
+  blas->m_geometryCount = header.GeometryCount;
+  blas->m_primitiveCount = header.PrimitiveCount;
+  blas->m_mappedFile = std::move(file);
+
+  return blas;
+}
+
+uint64_t GetBlasCacheKey(std::span<const GeometryDesc> geometryDescs,
+                         const BvhBuildSettings& settings, uint32_t buildFlags) {
+  Hasher hasher;
+  hasher.UpdateValue(k_blasFileVersion);
+  hasher.UpdateValue(buildFlags);
+
+  hasher.UpdateValue(settings.MaxLeafSize);
+  hasher.UpdateValue(settings.NumBins);
+  hasher.UpdateValue(settings.TraversalCost);
+  hasher.UpdateValue(settings.IntersectionCost);
+  hasher.UpdateValue(settings.LeafGranularity);
+  hasher.UpdateValue(settings.SpatialSplitOverlap);
+  hasher.UpdateValue(settings.MaxReferenceRatio);
+
+  for (const GeometryDesc& geometryDesc : geometryDescs) {
+    hasher.UpdateValue(geometryDesc.Type);
+
+    if (geometryDesc.Type == GeometryType::ProceduralPrimitiveAabbs) {
+      const AabbsDesc& desc = geometryDesc.Aabbs;
+      hasher.UpdateValue(desc.AabbCount);
+      hasher.Update(desc.Aabbs, desc.AabbCount * sizeof(Aabb));
+      continue;
+    }
+
+    const TrianglesDesc& desc = geometryDesc.Triangles;
+
+    hasher.UpdateValue(desc.Transform3x4.has_value());
+    if (desc.Transform3x4)
+      hasher.UpdateValue(*desc.Transform3x4);
+
+    hasher.UpdateValue(desc.VertexCount);
+    hasher.UpdateValue(desc.IndexCount);
+
+    // Only the positions count, and they may be interleaved with other attributes.
+    if (desc.VertexStride == sizeof(Float3)) {
+      hasher.Update(desc.VertexBuffer, desc.VertexCount * sizeof(Float3));
+    } else {
+      for (uint32_t i = 0; i < desc.VertexCount; ++i) {
+        hasher.Update(desc.VertexBuffer + i * desc.VertexStride, sizeof(Float3));
+      }
+    }
+
+    hasher.Update(desc.IndexBuffer, desc.IndexCount * sizeof(uint16_t));
+  }
+
+  return hasher.Finish();
+}
+
+std::unique_ptr<Blas> LoadOrBuildBlas(std::span<const GeometryDesc> geometryDescs,
+                                      const BvhBuildSettings& settings, uint32_t buildFlags,
+                                      const std::filesystem::path& cacheDir) {
+  uint64_t key = GetBlasCacheKey(geometryDescs, settings, buildFlags);
+
+  char fileName[32];
+  snprintf(fileName, sizeof(fileName), "%016llx.blas", static_cast<unsigned long long>(key));
+
+  std::filesystem::path path = cacheDir / fileName;
+
+  if (std::unique_ptr<Blas> blas = Blas::Load(path, key))
+    return blas;
+
+  auto blas = std::make_unique<Blas>(geometryDescs, settings, buildFlags);
+
+  std::filesystem::create_directories(cacheDir);
+  blas->Save(path, key);
+
+  return blas;
+}
+
+} // namespace cpu_rt
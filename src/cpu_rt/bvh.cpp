@@ -0,0 +1,630 @@
+#include "cpu_rt/bvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+namespace cpu_rt {
+
+namespace {
+
+struct Bin {
+  Aabb Bounds = Aabb::Empty();
+  uint32_t Count = 0;
+};
+
+struct Split {
+  int Axis = -1;
+  uint32_t Bin = 0;
+  float Cost = std::numeric_limits<float>::infinity();
+};
+
+struct SpatialBin {
+  Aabb Bounds = Aabb::Empty();
+
+  // References that start and end in the bin.
+  uint32_t Entries = 0;
+  uint32_t Exits = 0;
+};
+
+struct SpatialSplit {
+  int Axis = -1;
+  float Position = 0.f;
+  float Cost = std::numeric_limits<float>::infinity();
+
+  Aabb LeftBounds;
+  Aabb RightBounds;
+  uint32_t LeftCount = 0;
+  uint32_t RightCount = 0;
+};
+
+} // namespace
+
+static uint32_t GetBinIndex(float centroid, float minCentroid, float scale, uint32_t numBins) {
+  auto bin = static_cast<uint32_t>(std::max(0.f, (centroid - minCentroid) * scale));
+  return std::min(bin, numBins - 1);
+}
+
+// Number of intersection tests a leaf of count primitives costs.
+static float GetLeafTestCount(uint32_t count, const BvhBuildSettings& settings) {
+  return static_cast<float>((count + settings.LeafGranularity - 1) / settings.LeafGranularity);
+}
+
+static Split FindBestSplit(std::span<const Aabb> primBounds, std::span<const Float3> centroids,
+                           std::span<const uint32_t> primIndices, const Aabb& nodeBounds,
+                           const Aabb& centroidBounds, const BvhBuildSettings& settings) {
+  Split best{};
+
+  std::vector<Bin> bins(settings.NumBins);
+  std::vector<float> rightAreas(settings.NumBins);
+  std::vector<uint32_t> rightCounts(settings.NumBins);
+
+  for (int axis = 0; axis < 3; ++axis) {
+    float minCentroid = centroidBounds.Min[axis];
+    float extent = centroidBounds.Max[axis] - minCentroid;
+    if (extent <= 0.f)
+      continue;
+
+    float scale = static_cast<float>(settings.NumBins) / extent;
+
+    std::fill(bins.begin(), bins.end(), Bin{});
+
+    for (uint32_t primIndex : primIndices) {
+      Bin& bin = bins[GetBinIndex(centroids[primIndex][axis], minCentroid, scale,
+                                  settings.NumBins)];
+      bin.Bounds.Grow(primBounds[primIndex]);
+      ++bin.Count;
+    }
+
+    // Sweep from the right to get the cost of every right-hand partition, then from the left.
+    Aabb rightBounds = Aabb::Empty();
+    uint32_t rightCount = 0;
+
+    for (uint32_t i = settings.NumBins - 1; i > 0; --i) {
+      rightBounds.Grow(bins[i].Bounds);
+      rightCount += bins[i].Count;
+
+      rightAreas[i] = rightBounds.SurfaceArea();
+      rightCounts[i] = rightCount;
+    }
+
+    Aabb leftBounds = Aabb::Empty();
+    uint32_t leftCount = 0;
+
+    for (uint32_t i = 0; i < settings.NumBins - 1; ++i) {
+      leftBounds.Grow(bins[i].Bounds);
+      leftCount += bins[i].Count;
+
+      if (leftCount == 0 || rightCounts[i + 1] == 0)
+        continue;
+
+      float cost = GetLeafTestCount(leftCount, settings) * leftBounds.SurfaceArea() +
+                   GetLeafTestCount(rightCounts[i + 1], settings) * rightAreas[i + 1];
+
+      if (cost < best.Cost) {
+        best.Axis = axis;
+        best.Bin = i;
+        best.Cost = cost;
+      }
+    }
+  }
+
+  if (best.Axis != -1) {
+    best.Cost = settings.TraversalCost +
+                settings.IntersectionCost * best.Cost / nodeBounds.SurfaceArea();
+  }
+
+  return best;
+}
+
+Bvh BuildBvh(std::span<const Aabb> primBounds, const BvhBuildSettings& settings) {
+  Bvh bvh{};
+
+  auto numPrims = static_cast<uint32_t>(primBounds.size());
+  if (numPrims == 0)
+    return bvh;
+
+  bvh.PrimIndices.resize(numPrims);
+  std::iota(bvh.PrimIndices.begin(), bvh.PrimIndices.end(), 0);
+
+  std::vector<Float3> centroids(numPrims);
+  for (uint32_t i = 0; i < numPrims; ++i) {
+    centroids[i] = primBounds[i].Centroid();
+  }
+
+  bvh.Nodes.reserve(2 * numPrims - 1);
+
+  BvhNode root{};
+  root.Bounds = Aabb::Empty();
+  root.LeftFirst = 0;
+  root.PrimCount = numPrims;
+
+  for (const Aabb& bounds : primBounds) {
+    root.Bounds.Grow(bounds);
+  }
+
+  bvh.Nodes.push_back(root);
+
+  struct StackEntry {
+    uint32_t NodeIndex;
+    uint32_t Depth;
+  };
+  std::vector<StackEntry> stack = { { 0, 1 } };
+
+  while (!stack.empty()) {
+    auto [nodeIndex, depth] = stack.back();
+    stack.pop_back();
+
+    BvhNode node = bvh.Nodes[nodeIndex];
+
+    // Traversal stacks are sized for k_maxBvhDepth, so anything deeper stays a leaf.
+    if (node.PrimCount <= 1 || depth == k_maxBvhDepth)
+      continue;
+
+    auto first = bvh.PrimIndices.begin() + node.LeftFirst;
+    auto last = first + node.PrimCount;
+
+    Aabb centroidBounds = Aabb::Empty();
+    for (auto it = first; it != last; ++it) {
+      centroidBounds.Grow(centroids[*it]);
+    }
+
+    Split split = FindBestSplit(primBounds, centroids,
+                                std::span(bvh.PrimIndices).subspan(node.LeftFirst, node.PrimCount),
+                                node.Bounds, centroidBounds, settings);
+
+    float leafCost = settings.IntersectionCost * GetLeafTestCount(node.PrimCount, settings);
+
+    decltype(first) middle;
+
+    if (split.Axis != -1) {
+      if (node.PrimCount <= settings.MaxLeafSize && split.Cost >= leafCost)
+        continue;
+
+      float minCentroid = centroidBounds.Min[split.Axis];
+      float scale = static_cast<float>(settings.NumBins) /
+                    (centroidBounds.Max[split.Axis] - minCentroid);
+
+      middle = std::partition(first, last, [&](uint32_t primIndex) {
+        return GetBinIndex(centroids[primIndex][split.Axis], minCentroid, scale,
+                           settings.NumBins) <= split.Bin;
+      });
+    } else {
+      // All centroids coincide, so SAH cannot separate them. Only split if the leaf would be
+      // too large.
+      if (node.PrimCount <= settings.MaxLeafSize)
+        continue;
+
+      middle = first + node.PrimCount / 2;
+    }
+
+    auto leftIndex = static_cast<uint32_t>(bvh.Nodes.size());
+
+    BvhNode left{};
+    left.Bounds = Aabb::Empty();
+    left.LeftFirst = node.LeftFirst;
+    left.PrimCount = static_cast<uint32_t>(middle - first);
+
+    BvhNode right{};
+    right.Bounds = Aabb::Empty();
+    right.LeftFirst = left.LeftFirst + left.PrimCount;
+    right.PrimCount = node.PrimCount - left.PrimCount;
+
+    for (auto it = first; it != middle; ++it) {
+      left.Bounds.Grow(primBounds[*it]);
+    }
+    for (auto it = middle; it != last; ++it) {
+      right.Bounds.Grow(primBounds[*it]);
+    }
+
+    bvh.Nodes.push_back(left);
+    bvh.Nodes.push_back(right);
+
+    bvh.Nodes[nodeIndex].LeftFirst = leftIndex;
+    bvh.Nodes[nodeIndex].PrimCount = 0;
+
+    stack.push_back({ leftIndex, depth + 1 });
+    stack.push_back({ leftIndex + 1, depth + 1 });
+  }
+
+  bvh.Nodes.shrink_to_fit();
+
+  return bvh;
+}
+
+static float GetSplitPlane(const Aabb& nodeBounds, int axis, uint32_t bin, uint32_t numBins) {
+  float extent = nodeBounds.Max[axis] - nodeBounds.Min[axis];
+  return nodeBounds.Min[axis] + extent * static_cast<float>(bin + 1) / static_cast<float>(numBins);
+}
+
+// Bound on the rounding error of a clipped vertex, relative to the larger of its edge's
+// endpoints. It is a few times the error of the float arithmetic below.
+static constexpr float k_clipError = 1.f / (1 << 20);
+
+// Splits a reference to triangle v at position along axis. Each half is bounded by the part of
+// the triangle on its side of the plane and by the reference's own bounds, which may already be
+// clipped. The clipped vertices are widened by their rounding error so no part of the triangle
+// is lost.
+static void SplitReference(const Float3* v, const Aabb& refBounds, int axis, float position,
+                           Aabb* left, Aabb* right) {
+  *left = Aabb::Empty();
+  *right = Aabb::Empty();
+
+  for (int i = 0; i < 3; ++i) {
+    const Float3& a = v[i];
+    const Float3& b = v[(i + 1) % 3];
+
+    float aPos = a[axis];
+    float bPos = b[axis];
+
+    if (aPos <= position)
+      left->Grow(a);
+    if (aPos >= position)
+      right->Grow(a);
+
+    if ((aPos < position && bPos > position) || (aPos > position && bPos < position)) {
+      float t = (position - aPos) / (bPos - aPos);
+
+      Float3 crossing = a + (b - a) * t;
+      Float3 error = Max(Float3{std::abs(a.x), std::abs(a.y), std::abs(a.z)},
+                         Float3{std::abs(b.x), std::abs(b.y), std::abs(b.z)}) * k_clipError;
+
+      Aabb crossingBounds{crossing - error, crossing + error};
+      left->Grow(crossingBounds);
+      right->Grow(crossingBounds);
+    }
+  }
+
+  *left = IntersectAabbs(*left, refBounds);
+  *right = IntersectAabbs(*right, refBounds);
+}
+
+static SpatialSplit FindBestSpatialSplit(std::span<const Float3> triangleVertices,
+                                         const std::vector<Aabb>& refBounds,
+                                         const std::vector<uint32_t>& refPrims,
+                                         std::span<const uint32_t> refs, const Aabb& nodeBounds,
+                                         const BvhBuildSettings& settings) {
+  SpatialSplit best{};
+
+  std::vector<SpatialBin> bins(settings.NumBins);
+  std::vector<Aabb> rightBounds(settings.NumBins);
+  std::vector<uint32_t> rightCounts(settings.NumBins);
+
+  for (int axis = 0; axis < 3; ++axis) {
+    float minBound = nodeBounds.Min[axis];
+    float extent = nodeBounds.Max[axis] - minBound;
+    if (extent <= 0.f)
+      continue;
+
+    float scale = static_cast<float>(settings.NumBins) / extent;
+
+    std::fill(bins.begin(), bins.end(), SpatialBin{});
+
+    // Chops each reference along the bins it spans, so the bins are bounded by the clipped
+    // triangles rather than by the references' bounds.
+    for (uint32_t ref : refs) {
+      const Float3* v = &triangleVertices[refPrims[ref] * 3];
+
+      uint32_t firstBin = GetBinIndex(refBounds[ref].Min[axis], minBound, scale, settings.NumBins);
+      uint32_t lastBin = std::max(
+          firstBin, GetBinIndex(refBounds[ref].Max[axis], minBound, scale, settings.NumBins));
+
+      Aabb remaining = refBounds[ref];
+
+      for (uint32_t i = firstBin; i < lastBin; ++i) {
+        Aabb left, right;
+        SplitReference(v, remaining, axis, GetSplitPlane(nodeBounds, axis, i, settings.NumBins),
+                       &left, &right);
+
+        bins[i].Bounds.Grow(left);
+        remaining = right;
+      }
+
+      bins[lastBin].Bounds.Grow(remaining);
+
+      ++bins[firstBin].Entries;
+      ++bins[lastBin].Exits;
+    }
+
+    Aabb right = Aabb::Empty();
+    uint32_t rightCount = 0;
+
+    for (uint32_t i = settings.NumBins - 1; i > 0; --i) {
+      right.Grow(bins[i].Bounds);
+      rightCount += bins[i].Exits;
+
+      rightBounds[i] = right;
+      rightCounts[i] = rightCount;
+    }
+
+    Aabb left = Aabb::Empty();
+    uint32_t leftCount = 0;
+
+    for (uint32_t i = 0; i < settings.NumBins - 1; ++i) {
+      left.Grow(bins[i].Bounds);
+      leftCount += bins[i].Entries;
+
+      if (leftCount == 0 || rightCounts[i + 1] == 0)
+        continue;
+
+      float cost = GetLeafTestCount(leftCount, settings) * left.SurfaceArea() +
+                   GetLeafTestCount(rightCounts[i + 1], settings) *
+                       rightBounds[i + 1].SurfaceArea();
+
+      if (cost < best.Cost) {
+        best.Axis = axis;
+        best.Position = GetSplitPlane(nodeBounds, axis, i, settings.NumBins);
+        best.Cost = cost;
+        best.LeftBounds = left;
+        best.RightBounds = rightBounds[i + 1];
+        best.LeftCount = leftCount;
+        best.RightCount = rightCounts[i + 1];
+      }
+    }
+  }
+
+  if (best.Axis != -1) {
+    best.Cost = settings.TraversalCost +
+                settings.IntersectionCost * best.Cost / nodeBounds.SurfaceArea();
+  }
+
+  return best;
+}
+
+Bvh BuildSpatialSplitBvh(std::span<const Float3> triangleVertices,
+                         const BvhBuildSettings& settings) {
+  Bvh bvh{};
+
+  auto numPrims = static_cast<uint32_t>(triangleVertices.size() / 3);
+  if (numPrims == 0)
+    return bvh;
+
+  // A reference is a triangle, or the part of one that a spatial split clipped it to. Spatial
+  // splits add references, which share the triangle of the one they were split from.
+  std::vector<Aabb> refBounds(numPrims, Aabb::Empty());
+  std::vector<Float3> refCentroids(numPrims);
+  std::vector<uint32_t> refPrims(numPrims);
+
+  Aabb rootBounds = Aabb::Empty();
+
+  for (uint32_t i = 0; i < numPrims; ++i) {
+    for (uint32_t j = 0; j < 3; ++j) {
+      refBounds[i].Grow(triangleVertices[i * 3 + j]);
+    }
+    refCentroids[i] = refBounds[i].Centroid();
+    refPrims[i] = i;
+
+    rootBounds.Grow(refBounds[i]);
+  }
+
+  // The references spatial splits may add. Each node passes what it did not use on to its
+  // children, in proportion to their reference counts, so no single subtree can use it all up.
+  auto splitBudget = static_cast<uint32_t>(
+      std::max(0.f, settings.MaxReferenceRatio - 1.f) * static_cast<float>(numPrims));
+  float minOverlap = settings.SpatialSplitOverlap * rootBounds.SurfaceArea();
+
+  BvhNode root{};
+  root.Bounds = rootBounds;
+
+  bvh.Nodes.push_back(root);
+
+  struct Task {
+    uint32_t NodeIndex;
+    uint32_t Depth;
+    uint32_t SplitBudget;
+    std::vector<uint32_t> Refs;
+  };
+  std::vector<Task> tasks(1);
+
+  tasks[0].NodeIndex = 0;
+  tasks[0].Depth = 1;
+  tasks[0].SplitBudget = splitBudget;
+  tasks[0].Refs.resize(numPrims);
+  std::iota(tasks[0].Refs.begin(), tasks[0].Refs.end(), 0);
+
+  while (!tasks.empty()) {
+    Task task = std::move(tasks.back());
+    tasks.pop_back();
+
+    Aabb nodeBounds = bvh.Nodes[task.NodeIndex].Bounds;
+    auto count = static_cast<uint32_t>(task.Refs.size());
+
+    auto makeLeaf = [&]() {
+      BvhNode& node = bvh.Nodes[task.NodeIndex];
+      node.LeftFirst = static_cast<uint32_t>(bvh.PrimIndices.size());
+      node.PrimCount = count;
+
+      for (uint32_t ref : task.Refs) {
+        bvh.PrimIndices.push_back(refPrims[ref]);
+      }
+    };
+
+    // Traversal stacks are sized for k_maxBvhDepth, so anything deeper stays a leaf.
+    if (count <= 1 || task.Depth == k_maxBvhDepth) {
+      makeLeaf();
+      continue;
+    }
+
+    Aabb centroidBounds = Aabb::Empty();
+    for (uint32_t ref : task.Refs) {
+      centroidBounds.Grow(refCentroids[ref]);
+    }
+
+    Split split = FindBestSplit(refBounds, refCentroids, task.Refs, nodeBounds, centroidBounds,
+                                settings);
+
+    std::vector<uint32_t> leftRefs;
+    std::vector<uint32_t> rightRefs;
+
+    auto partitionObjectSplit = [&]() {
+      float minCentroid = centroidBounds.Min[split.Axis];
+      float scale = static_cast<float>(settings.NumBins) /
+                    (centroidBounds.Max[split.Axis] - minCentroid);
+
+      for (uint32_t ref : task.Refs) {
+        bool isLeft = GetBinIndex(refCentroids[ref][split.Axis], minCentroid, scale,
+                                  settings.NumBins) <= split.Bin;
+        (isLeft ? leftRefs : rightRefs).push_back(ref);
+      }
+    };
+
+    // Spatial splits are only worth searching for when the object split's children overlap.
+    SpatialSplit spatialSplit{};
+
+    if (task.SplitBudget > 0) {
+      float overlap = std::numeric_limits<float>::infinity();
+
+      if (split.Axis != -1) {
+        partitionObjectSplit();
+
+        Aabb leftBounds = Aabb::Empty();
+        Aabb rightBounds = Aabb::Empty();
+        for (uint32_t ref : leftRefs) {
+          leftBounds.Grow(refBounds[ref]);
+        }
+        for (uint32_t ref : rightRefs) {
+          rightBounds.Grow(refBounds[ref]);
+        }
+
+        overlap = IntersectAabbs(leftBounds, rightBounds).SurfaceArea();
+      }
+
+      if (overlap > minOverlap) {
+        spatialSplit = FindBestSpatialSplit(triangleVertices, refBounds, refPrims, task.Refs,
+                                            nodeBounds, settings);
+
+        if (spatialSplit.LeftCount + spatialSplit.RightCount - count > task.SplitBudget)
+          spatialSplit = SpatialSplit{};
+      }
+    }
+
+    bool useSpatialSplit = spatialSplit.Axis != -1 && spatialSplit.Cost < split.Cost;
+    float bestCost = std::min(split.Cost, spatialSplit.Cost);
+
+    float leafCost = settings.IntersectionCost * GetLeafTestCount(count, settings);
+
+    if (split.Axis == -1 && !useSpatialSplit) {
+      // Neither kind of split can separate the references. Only split if the leaf would be too
+      // large.
+      if (count <= settings.MaxLeafSize) {
+        makeLeaf();
+        continue;
+      }
+    } else if (count <= settings.MaxLeafSize && bestCost >= leafCost) {
+      makeLeaf();
+      continue;
+    }
+
+    leftRefs.clear();
+    rightRefs.clear();
+
+    if (useSpatialSplit) {
+      int axis = spatialSplit.Axis;
+      float position = spatialSplit.Position;
+
+      Aabb leftBounds = spatialSplit.LeftBounds;
+      Aabb rightBounds = spatialSplit.RightBounds;
+      auto leftCount = static_cast<float>(spatialSplit.LeftCount);
+      auto rightCount = static_cast<float>(spatialSplit.RightCount);
+
+      for (uint32_t ref : task.Refs) {
+        Aabb bounds = refBounds[ref];
+
+        if (bounds.Max[axis] <= position) {
+          leftRefs.push_back(ref);
+          continue;
+        }
+        if (bounds.Min[axis] >= position) {
+          rightRefs.push_back(ref);
+          continue;
+        }
+
+        // Reference unsplitting: keep the whole reference on one side if that is cheaper than
+        // duplicating it.
+        Aabb leftGrown = leftBounds;
+        leftGrown.Grow(bounds);
+        Aabb rightGrown = rightBounds;
+        rightGrown.Grow(bounds);
+
+        float splitCost = leftBounds.SurfaceArea() * leftCount +
+                          rightBounds.SurfaceArea() * rightCount;
+        float leftCost = leftGrown.SurfaceArea() * leftCount +
+                         rightBounds.SurfaceArea() * (rightCount - 1.f);
+        float rightCost = leftBounds.SurfaceArea() * (leftCount - 1.f) +
+                          rightGrown.SurfaceArea() * rightCount;
+
+        Aabb left, right;
+        SplitReference(&triangleVertices[refPrims[ref] * 3], bounds, axis, position, &left,
+                       &right);
+
+        if ((leftCost < splitCost && leftCost <= rightCost) || right.IsEmpty()) {
+          leftRefs.push_back(ref);
+          leftBounds = leftGrown;
+          rightCount -= 1.f;
+        } else if (rightCost < splitCost || left.IsEmpty()) {
+          rightRefs.push_back(ref);
+          rightBounds = rightGrown;
+          leftCount -= 1.f;
+        } else {
+          refBounds[ref] = left;
+          refCentroids[ref] = left.Centroid();
+          leftRefs.push_back(ref);
+
+          rightRefs.push_back(static_cast<uint32_t>(refBounds.size()));
+          refBounds.push_back(right);
+          refCentroids.push_back(right.Centroid());
+          refPrims.push_back(refPrims[ref]);
+        }
+      }
+    } else if (split.Axis != -1) {
+      partitionObjectSplit();
+    }
+
+    // Falls back to a median split when no split applies or one side came out empty.
+    if (leftRefs.empty() || rightRefs.empty()) {
+      std::vector<uint32_t> refs = leftRefs.empty() ? std::move(rightRefs) : std::move(leftRefs);
+      if (refs.empty())
+        refs = task.Refs;
+
+      auto middle = refs.begin() + static_cast<ptrdiff_t>(refs.size() / 2);
+      leftRefs.assign(refs.begin(), middle);
+      rightRefs.assign(middle, refs.end());
+    }
+
+    auto leftIndex = static_cast<uint32_t>(bvh.Nodes.size());
+
+    auto leftRefCount = static_cast<uint32_t>(leftRefs.size());
+    auto rightRefCount = static_cast<uint32_t>(rightRefs.size());
+
+    uint32_t remainingBudget = task.SplitBudget - std::min(task.SplitBudget,
+                                                           leftRefCount + rightRefCount - count);
+    auto leftBudget = static_cast<uint32_t>(static_cast<uint64_t>(remainingBudget) * leftRefCount /
+                                            (leftRefCount + rightRefCount));
+
+    for (const std::vector<uint32_t>* childRefs : {&leftRefs, &rightRefs}) {
+      BvhNode child{};
+      child.Bounds = Aabb::Empty();
+
+      for (uint32_t ref : *childRefs) {
+        child.Bounds.Grow(refBounds[ref]);
+      }
+
+      bvh.Nodes.push_back(child);
+    }
+
+    bvh.Nodes[task.NodeIndex].LeftFirst = leftIndex;
+    bvh.Nodes[task.NodeIndex].PrimCount = 0;
+
+    tasks.push_back({ leftIndex, task.Depth + 1, leftBudget, std::move(leftRefs) });
+    tasks.push_back(
+        { leftIndex + 1, task.Depth + 1, remainingBudget - leftBudget, std::move(rightRefs) });
+  }
+
+  bvh.Nodes.shrink_to_fit();
+  bvh.PrimIndices.shrink_to_fit();
+
+  return bvh;
+}
+
+} // namespace cpu_rt
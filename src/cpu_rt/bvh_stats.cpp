@@ -0,0 +1,143 @@
+#include "cpu_rt/bvh_stats.h"
+
+#include <algorithm>
+#include <bit>
+
+namespace cpu_rt {
+
+namespace {
+
+struct StatsTask {
+  uint32_t NodeIndex;
+  uint32_t Depth;
+};
+
+// Sums that are normalized once the whole tree has been visited.
+struct StatsAccumulator {
+  BvhStats Stats;
+  uint64_t LeafDepthSum = 0;
+
+  void AddLeaf(uint32_t primCount, uint32_t depth) {
+    if (Stats.LeafSizeHistogram.size() <= primCount)
+      Stats.LeafSizeHistogram.resize(primCount + 1);
+
+    ++Stats.LeafSizeHistogram[primCount];
+    ++Stats.LeafCount;
+
+    Stats.MaxDepth = std::max(Stats.MaxDepth, depth);
+    LeafDepthSum += depth;
+  }
+
+  BvhStats Finish(float rootArea) {
+    if (Stats.LeafCount > 0) {
+      Stats.AverageLeafDepth = static_cast<float>(LeafDepthSum) /
+                               static_cast<float>(Stats.LeafCount);
+    }
+
+    // A flat root has no area to be relative to.
+    if (rootArea > 0.f) {
+      Stats.SahCost /= rootArea;
+      Stats.SiblingOverlap /= rootArea;
+    }
+
+    return Stats;
+  }
+};
+
+} // namespace
+
+BvhStats ComputeBvhStats(std::span<const BvhNode> nodes, const BvhBuildSettings& settings) {
+  StatsAccumulator acc;
+
+  if (nodes.empty())
+    return acc.Stats;
+
+  std::vector<StatsTask> tasks = { { 0, 0 } };
+
+  while (!tasks.empty()) {
+    auto [nodeIndex, depth] = tasks.back();
+    tasks.pop_back();
+
+    const BvhNode& node = nodes[nodeIndex];
+    float area = node.Bounds.SurfaceArea();
+
+    ++acc.Stats.NodeCount;
+
+    if (node.IsLeaf()) {
+      uint32_t groupCount = (node.PrimCount + settings.LeafGranularity - 1) /
+                            settings.LeafGranularity;
+      acc.Stats.SahCost += settings.IntersectionCost * static_cast<float>(groupCount) * area;
+      acc.AddLeaf(node.PrimCount, depth);
+      continue;
+    }
+
+    acc.Stats.SahCost += settings.TraversalCost * area;
+    acc.Stats.SiblingOverlap += IntersectAabbs(nodes[node.LeftFirst].Bounds,
+                                               nodes[node.LeftFirst + 1].Bounds).SurfaceArea();
+
+    tasks.push_back({ node.LeftFirst, depth + 1 });
+    tasks.push_back({ node.LeftFirst + 1, depth + 1 });
+  }
+
+  return acc.Finish(nodes[0].Bounds.SurfaceArea());
+}
+
+BvhStats ComputeCompressedBvhStats(
+    std::span<const CompressedBvhNode> nodes, const BvhBuildSettings& settings,
+    const std::function<uint32_t(uint32_t, uint32_t)>& getPrimCount) {
+  StatsAccumulator acc;
+
+  if (nodes.empty())
+    return acc.Stats;
+
+  float rootArea = 0.f;
+
+  std::vector<StatsTask> tasks = { { 0, 0 } };
+
+  while (!tasks.empty()) {
+    auto [nodeIndex, depth] = tasks.back();
+    tasks.pop_back();
+
+    const CompressedBvhNode& node = nodes[nodeIndex];
+
+    Aabb childBounds[k_compressedBvhWidth];
+    Aabb bounds = Aabb::Empty();
+
+    for (uint32_t mask = node.ChildMask; mask != 0; mask &= mask - 1) {
+      auto slot = static_cast<uint32_t>(std::countr_zero(mask));
+      childBounds[slot] = GetCompressedChildBounds(node, slot);
+      bounds.Grow(childBounds[slot]);
+    }
+
+    float area = bounds.SurfaceArea();
+    if (nodeIndex == 0)
+      rootArea = area;
+
+    ++acc.Stats.NodeCount;
+    acc.Stats.SahCost += settings.TraversalCost * area;
+
+    for (uint32_t mask = node.ChildMask; mask != 0; mask &= mask - 1) {
+      auto slot = static_cast<uint32_t>(std::countr_zero(mask));
+      uint8_t meta = node.Meta[slot];
+
+      for (uint32_t other = mask & (mask - 1); other != 0; other &= other - 1) {
+        acc.Stats.SiblingOverlap +=
+            IntersectAabbs(childBounds[slot], childBounds[std::countr_zero(other)]).SurfaceArea();
+      }
+
+      if (meta & k_compressedInteriorChild) {
+        tasks.push_back({ node.ChildBase + (meta & 0x7f), depth + 1 });
+        continue;
+      }
+
+      uint32_t itemCount = (meta >> 5) + 1;
+      acc.Stats.SahCost += settings.IntersectionCost * static_cast<float>(itemCount) *
+                           childBounds[slot].SurfaceArea();
+      acc.AddLeaf(getPrimCount(node.ItemBase + (meta & 0x1f), itemCount), depth + 1);
+    }
+  }
+
+  return acc.Finish(rootArea);
+}
+
+} // namespace cpu_rt
@@ -0,0 +1,173 @@
+#include "cpu_rt/compressed_bvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace cpu_rt {
+
+static constexpr int k_minExponent = -126;
+static constexpr int k_maxExponent = 127;
+
+static float GetGridScale(int exponent) {
+  return std::ldexp(1.f, exponent);
+}
+
+// Must round the same way as the dequantization in IntersectCompressedChildren.
+static float Dequantize(float origin, uint32_t q, float scale) {
+  return origin + static_cast<float>(q) * scale;
+}
+
+static void SetGrid(const Aabb& bounds, CompressedBvhNode* node) {
+  node->Origin = bounds.Min;
+
+  for (int axis = 0; axis < 3; ++axis) {
+    float extent = bounds.Max[axis] - bounds.Min[axis];
+
+    int exponent = k_minExponent;
+    if (extent > 0.f)
+      exponent = std::max(exponent, static_cast<int>(std::ceil(std::log2(extent / 255.f))));
+
+    // The top of the grid has to reach the bounds after rounding too.
+    while (exponent < k_maxExponent &&
+           Dequantize(bounds.Min[axis], 255, GetGridScale(exponent)) < bounds.Max[axis]) {
+      ++exponent;
+    }
+
+    node->Exponent[axis] = static_cast<int8_t>(exponent);
+  }
+}
+
+static void QuantizeChild(const Aabb& bounds, uint32_t slot, CompressedBvhNode* node) {
+  for (int axis = 0; axis < 3; ++axis) {
+    float origin = node->Origin[axis];
+    float scale = GetGridScale(node->Exponent[axis]);
+
+    float qMin = std::floor((bounds.Min[axis] - origin) / scale);
+    float qMax = std::ceil((bounds.Max[axis] - origin) / scale);
+
+    auto quantizedMin = static_cast<uint32_t>(std::clamp(qMin, 0.f, 255.f));
+    auto quantizedMax = static_cast<uint32_t>(std::clamp(qMax, 0.f, 255.f));
+
+    // Step outwards until the dequantized box contains the child.
+    while (quantizedMin > 0 && Dequantize(origin, quantizedMin, scale) > bounds.Min[axis]) {
+      --quantizedMin;
+    }
+    while (quantizedMax < 255 && Dequantize(origin, quantizedMax, scale) < bounds.Max[axis]) {
+      ++quantizedMax;
+    }
+
+    node->QuantizedMin[axis][slot] = static_cast<uint8_t>(quantizedMin);
+    node->QuantizedMax[axis][slot] = static_cast<uint8_t>(quantizedMax);
+  }
+}
+
+CompressedBvh CompressBvh(const Bvh& bvh, uint32_t leafGranularity) {
+  CompressedBvh compressed{};
+
+  if (bvh.Nodes.empty())
+    return compressed;
+
+  compressed.Nodes.emplace_back();
+
+  struct Task {
+    uint32_t BinaryIndex;
+    uint32_t NodeIndex;
+  };
+  std::vector<Task> tasks = { { 0, 0 } };
+
+  while (!tasks.empty()) {
+    auto [binaryIndex, nodeIndex] = tasks.back();
+    tasks.pop_back();
+
+    const BvhNode& binaryNode = bvh.Nodes[binaryIndex];
+
+    uint32_t children[k_compressedBvhWidth];
+    uint32_t childCount = 0;
+
+    if (binaryNode.IsLeaf()) {
+      children[childCount++] = binaryIndex;
+    } else {
+      children[childCount++] = binaryNode.LeftFirst;
+      children[childCount++] = binaryNode.LeftFirst + 1;
+
+      // Open the interior child with the largest surface area until the slots run out.
+      while (childCount < k_compressedBvhWidth) {
+        int largest = -1;
+        float largestArea = -1.f;
+
+        for (uint32_t i = 0; i < childCount; ++i) {
+          const BvhNode& child = bvh.Nodes[children[i]];
+          if (!child.IsLeaf() && child.Bounds.SurfaceArea() > largestArea) {
+            largest = static_cast<int>(i);
+            largestArea = child.Bounds.SurfaceArea();
+          }
+        }
+
+        if (largest == -1)
+          break;
+
+        uint32_t opened = bvh.Nodes[children[largest]].LeftFirst;
+        children[largest] = opened;
+        children[childCount++] = opened + 1;
+      }
+    }
+
+    CompressedBvhNode node{};
+    SetGrid(binaryNode.Bounds, &node);
+
+    node.ChildBase = static_cast<uint32_t>(compressed.Nodes.size());
+    node.ItemBase = static_cast<uint32_t>(compressed.ItemIndices.size());
+
+    uint32_t interiorCount = 0;
+    uint32_t itemOffset = 0;
+
+    for (uint32_t slot = 0; slot < childCount; ++slot) {
+      const BvhNode& child = bvh.Nodes[children[slot]];
+
+      QuantizeChild(child.Bounds, slot, &node);
+      node.ChildMask |= static_cast<uint8_t>(1u << slot);
+
+      if (!child.IsLeaf()) {
+        node.Meta[slot] = static_cast<uint8_t>(k_compressedInteriorChild | interiorCount);
+        tasks.push_back({ children[slot], node.ChildBase + interiorCount });
+        ++interiorCount;
+        continue;
+      }
+
+      uint32_t itemCount = (child.PrimCount + leafGranularity - 1) / leafGranularity;
+      if (itemCount > k_maxCompressedLeafItems)
+        throw std::invalid_argument("BVH leaf is too large for the compressed layout.");
+
+      node.Meta[slot] = static_cast<uint8_t>((itemCount - 1) << 5 | itemOffset);
+
+      for (uint32_t i = 0; i < itemCount; ++i) {
+        compressed.ItemIndices.push_back(child.LeftFirst + i);
+      }
+      itemOffset += itemCount;
+    }
+
+    compressed.Nodes.resize(compressed.Nodes.size() + interiorCount);
+    compressed.Nodes[nodeIndex] = node;
+  }
+
+  compressed.Nodes.shrink_to_fit();
+
+  return compressed;
+}
+
+Aabb GetCompressedChildBounds(const CompressedBvhNode& node, uint32_t slot) {
+  float boundsMin[3] = {};
+  float boundsMax[3] = {};
+
+  for (int axis = 0; axis < 3; ++axis) {
+    float scale = GetGridScale(node.Exponent[axis]);
+    boundsMin[axis] = Dequantize(node.Origin[axis], node.QuantizedMin[axis][slot], scale);
+    boundsMax[axis] = Dequantize(node.Origin[axis], node.QuantizedMax[axis][slot], scale);
+  }
+
+  return Aabb{Float3{boundsMin[0], boundsMin[1], boundsMin[2]},
+              Float3{boundsMax[0], boundsMax[1], boundsMax[2]}};
+}
+
+} // namespace cpu_rt
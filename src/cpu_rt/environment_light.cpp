@@ -0,0 +1,173 @@
+#include "cpu_rt/environment_light.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "cpu_rt/parallel_for.h"
+#include "cpu_rt/shading.h"
+
+namespace cpu_rt {
+
+namespace {
+
+// Rows are few and each is a whole pass over the image width, so they are handed out in small
+// chunks.
+constexpr size_t k_rowsPerTask = 4;
+
+// Fills cdf with the normalized running sum of weights, one more entry than there are weights.
+// Returns the sum. All-zero weights get a uniform CDF, which is never sampled but keeps the
+// lookups in range.
+double BuildCdf(std::span<const double> weights, std::span<float> cdf) {
+  double sum = 0.0;
+  for (double weight : weights) {
+    sum += weight;
+  }
+
+  double runningSum = 0.0;
+  cdf[0] = 0.f;
+  for (size_t i = 0; i < weights.size(); ++i) {
+    runningSum += weights[i];
+    cdf[i + 1] = sum > 0.0 ? static_cast<float>(runningSum / sum)
+                           : static_cast<float>(i + 1) / static_cast<float>(weights.size());
+  }
+  cdf[weights.size()] = 1.f;
+
+  return sum;
+}
+
+// Inverts the CDF at u in [0, 1): the bin u falls in, and the continuous position of u within
+// the n bins in [0, n).
+float SampleCdf(std::span<const float> cdf, float u, uint32_t* bin) {
+  auto count = static_cast<uint32_t>(cdf.size() - 1);
+
+  // The first entry above u ends the bin, which therefore has a positive width.
+  auto it = std::upper_bound(cdf.begin() + 1, cdf.end(), u);
+  *bin = std::min(count - 1, static_cast<uint32_t>(it - (cdf.begin() + 1)));
+
+  float width = cdf[*bin + 1] - cdf[*bin];
+  float offset = width > 0.f ? (u - cdf[*bin]) / width : 0.f;
+
+  return static_cast<float>(*bin) + std::clamp(offset, 0.f, 1.f);
+}
+
+// The pixel of a width x height equirectangular image that direction wi falls in. Returns the
+// sine of the polar angle of wi.
+float GetPixel(const Float3& wi, uint32_t width, uint32_t height, uint32_t* x, uint32_t* y) {
+  Float3 dir = Normalize(wi);
+
+  float theta = std::acos(std::clamp(dir.y, -1.f, 1.f));
+  float phi = std::atan2(dir.z, dir.x);
+  if (phi < 0.f)
+    phi += 2.f * k_pi;
+
+  *x = std::min(width - 1, static_cast<uint32_t>(phi / (2.f * k_pi) * static_cast<float>(width)));
+  *y = std::min(height - 1, static_cast<uint32_t>(theta / k_pi * static_cast<float>(height)));
+
+  // More precise than sin(theta) near the poles, where dir.y rounds to 1.
+  return std::sqrt(dir.x * dir.x + dir.z * dir.z);
+}
+
+float GetRowSinTheta(uint32_t y, uint32_t height) {
+  return std::sin(k_pi * (static_cast<float>(y) + 0.5f) / static_cast<float>(height));
+}
+
+} // namespace
+
+EnvironmentLight::EnvironmentLight(uint32_t width, uint32_t height, std::span<const float> rgb)
+  : m_width(width), m_height(height), m_radiance(static_cast<size_t>(width) * height),
+    m_marginalCdf(height + 1), m_conditionalCdfs(static_cast<size_t>(width + 1) * height) {
+  if (width == 0 || height == 0 || rgb.size() != m_radiance.size() * 3)
+    throw std::invalid_argument("Environment image size does not match its pixels.");
+
+  std::vector<double> rowIntegrals(height);
+
+  ParallelFor(height, [&](size_t begin, size_t end) {
+    std::vector<double> weights(width);
+
+    for (size_t y = begin; y < end; ++y) {
+      size_t rowStart = y * width;
+
+      for (uint32_t x = 0; x < width; ++x) {
+        const float* pixel = &rgb[(rowStart + x) * 3];
+        m_radiance[rowStart + x] = Float3{pixel[0], pixel[1], pixel[2]};
+
+        weights[x] = GetImportance(x, static_cast<uint32_t>(y));
+      }
+
+      std::span<float> cdf(&m_conditionalCdfs[y * (width + 1)], width + 1);
+      rowIntegrals[y] = BuildCdf(weights, cdf) / width;
+    }
+  }, k_rowsPerTask);
+
+  m_importanceIntegral = static_cast<float>(BuildCdf(rowIntegrals, m_marginalCdf) / height);
+}
+
+float EnvironmentLight::GetImportance(uint32_t x, uint32_t y) const {
+  // Pixels that are not finite and positive take no part in sampling.
+  float luminance = Luminance(m_radiance[static_cast<size_t>(y) * m_width + x]);
+  return luminance > 0.f && std::isfinite(luminance) ? luminance * GetRowSinTheta(y, m_height)
+                                                     : 0.f;
+}
+
+Float3 EnvironmentLight::GetRadiance(const Float3& wi) const {
+  uint32_t x, y;
+  GetPixel(wi, m_width, m_height, &x, &y);
+
+  return m_radiance[static_cast<size_t>(y) * m_width + x];
+}
+
+Float3 EnvironmentLight::Sample(EnvironmentSamplingType type, float u, float v,
+                                float* pdf) const {
+  if (type == EnvironmentSamplingType::Uniform) {
+    float cosTheta = 1.f - 2.f * v;
+    float sinTheta = std::sqrt(std::max(0.f, 1.f - cosTheta * cosTheta));
+
+    *pdf = 1.f / (4.f * k_pi);
+    return SphericalDirection(sinTheta, cosTheta, 2.f * k_pi * u);
+  }
+
+  *pdf = 0.f;
+  if (!(m_importanceIntegral > 0.f))
+    return Float3{0.f, 1.f, 0.f};
+
+  uint32_t y;
+  float row = SampleCdf(m_marginalCdf, v, &y);
+
+  uint32_t x;
+  float column = SampleCdf(std::span(&m_conditionalCdfs[static_cast<size_t>(y) * (m_width + 1)],
+                                     m_width + 1),
+                           u, &x);
+
+  float theta = k_pi * row / static_cast<float>(m_height);
+  float phi = 2.f * k_pi * column / static_cast<float>(m_width);
+  float sinTheta = std::sin(theta);
+
+  // The map from (u, v) to directions stretches area by 2 pi^2 sin(theta).
+  if (sinTheta > 0.f)
+    *pdf = GetImportance(x, y) / (m_importanceIntegral * 2.f * k_pi * k_pi * sinTheta);
+
+  return SphericalDirection(sinTheta, std::cos(theta), phi);
+}
+
+float EnvironmentLight::GetPdf(EnvironmentSamplingType type, const Float3& wi) const {
+  if (type == EnvironmentSamplingType::Uniform)
+    return 1.f / (4.f * k_pi);
+
+  if (!(m_importanceIntegral > 0.f))
+    return 0.f;
+
+  uint32_t x, y;
+  float sinTheta = GetPixel(wi, m_width, m_height, &x, &y);
+  if (!(sinTheta > 0.f))
+    return 0.f;
+
+  return GetImportance(x, y) / (m_importanceIntegral * 2.f * k_pi * k_pi * sinTheta);
+}
+
+size_t EnvironmentLight::GetMemoryUsage() const {
+  return m_radiance.size() * sizeof(Float3) +
+         (m_marginalCdf.size() + m_conditionalCdfs.size()) * sizeof(float);
+}
+
+} // namespace cpu_rt
@@ -0,0 +1,139 @@
+#include "cpu_rt/film_checkpoint.h"
+
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <stdexcept>
+
+#include "cpu_rt/atomic_file.h"
+#include "cpu_rt/hasher.h"
+#include "cpu_rt/mapped_file.h"
+
+namespace cpu_rt {
+
+namespace {
+
+// Followed by the pixels, then the active pixels.
+struct FilmCheckpointHeader {
+  uint32_t Magic;
+  uint32_t Version;
+  uint64_t Key;
+  uint32_t Width;
+  uint32_t Height;
+  uint32_t SampleCount;
+  uint32_t ActivePixelCount;
+  uint64_t RayCount;
+
+  // Hash of the pixels and active pixels.
+  uint64_t Checksum;
+};
+
+uint64_t GetChecksum(std::span<const FilmPixel> pixels, std::span<const uint32_t> activePixels) {
+  Hasher hasher;
+  hasher.Update(pixels.data(), pixels.size_bytes());
+  hasher.Update(activePixels.data(), activePixels.size_bytes());
+  return hasher.Finish();
+}
+
+} // namespace
+
+static constexpr uint32_t k_filmCheckpointMagic = 0x4d4c4946; // "FILM"
+static constexpr uint32_t k_filmCheckpointVersion = 1;
+
+void SaveFilmCheckpoint(const std::filesystem::path& path, const FilmCheckpoint& checkpoint) {
+  FilmCheckpointHeader header{};
+  header.Magic = k_filmCheckpointMagic;
+  header.Version = k_filmCheckpointVersion;
+  header.Key = checkpoint.Key;
+  header.Width = checkpoint.Width;
+  header.Height = checkpoint.Height;
+  header.SampleCount = checkpoint.SampleCount;
+  header.ActivePixelCount = static_cast<uint32_t>(checkpoint.ActivePixels.size());
+  header.RayCount = checkpoint.RayCount;
+  header.Checksum = GetChecksum(checkpoint.Pixels, checkpoint.ActivePixels);
+
+  size_t pixelsSize = checkpoint.Pixels.size() * sizeof(FilmPixel);
+
+  AtomicFileWriter file(path);
+  file.Write(&header, sizeof(header), 0);
+  file.Write(checkpoint.Pixels.data(), pixelsSize, sizeof(header));
+  file.Write(checkpoint.ActivePixels.data(), checkpoint.ActivePixels.size() * sizeof(uint32_t),
+             sizeof(header) + pixelsSize);
+  file.Commit();
+}
+
+bool LoadFilmCheckpoint(const std::filesystem::path& path, FilmCheckpoint* checkpoint) {
+  std::unique_ptr<MappedFile> file = MappedFile::Open(path);
+  if (!file)
+    return false;
+
+  std::span<const uint8_t> data = file->GetData();
+
+  FilmCheckpointHeader header;
+  if (data.size() < sizeof(header))
+    return false;
+
+  memcpy(&header, data.data(), sizeof(header));
+
+  if (header.Magic != k_filmCheckpointMagic || header.Version != k_filmCheckpointVersion)
+    return false;
+
+  uint64_t pixelCount = static_cast<uint64_t>(header.Width) * header.Height;
+  if (header.ActivePixelCount > pixelCount ||
+      data.size() != sizeof(header) + pixelCount * sizeof(FilmPixel) +
+                         header.ActivePixelCount * sizeof(uint32_t)) {
+    return false;
+  }
+
+  checkpoint->Key = header.Key;
+  checkpoint->Width = header.Width;
+  checkpoint->Height = header.Height;
+  checkpoint->SampleCount = header.SampleCount;
+  checkpoint->RayCount = header.RayCount;
+
+  checkpoint->Pixels.resize(static_cast<size_t>(pixelCount));
+  checkpoint->ActivePixels.resize(header.ActivePixelCount);
+
+  const uint8_t* pixels = data.data() + sizeof(header);
+  memcpy(checkpoint->Pixels.data(), pixels, checkpoint->Pixels.size() * sizeof(FilmPixel));
+  memcpy(checkpoint->ActivePixels.data(), pixels + checkpoint->Pixels.size() * sizeof(FilmPixel),
+         checkpoint->ActivePixels.size() * sizeof(uint32_t));
+
+  if (GetChecksum(checkpoint->Pixels, checkpoint->ActivePixels) != header.Checksum)
+    return false;
+
+  for (uint32_t pixel : checkpoint->ActivePixels) {
+    if (pixel >= pixelCount)
+      return false;
+  }
+
+  return true;
+}
+
+FilmCheckpointWriter::~FilmCheckpointWriter() {
+  if (m_write.valid())
+    m_write.wait();
+}
+
+FilmCheckpoint* FilmCheckpointWriter::GetNextCheckpoint() {
+  if (m_write.valid()) {
+    if (m_write.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+      return nullptr;
+
+    m_write.get();
+  }
+
+  return &m_checkpoint;
+}
+
+void FilmCheckpointWriter::StartWrite() {
+  m_write = std::async(std::launch::async, [this]() { SaveFilmCheckpoint(m_path, m_checkpoint); });
+}
+
+void FilmCheckpointWriter::Wait() {
+  if (m_write.valid())
+    m_write.get();
+}
+
+} // namespace cpu_rt
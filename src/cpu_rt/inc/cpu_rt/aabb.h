@@ -0,0 +1,84 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+
+#include "cpu_rt/math.h"
+
+namespace cpu_rt {
+
+struct Aabb {
+  Float3 Min;
+  Float3 Max;
+
+  static Aabb Empty() {
+    constexpr float inf = std::numeric_limits<float>::infinity();
+    return Aabb{Float3{inf, inf, inf}, Float3{-inf, -inf, -inf}};
+  }
+
+  bool IsEmpty() const { return Min.x > Max.x || Min.y > Max.y || Min.z > Max.z; }
+
+  void Grow(const Float3& p) {
+    Min = cpu_rt::Min(Min, p);
+    Max = cpu_rt::Max(Max, p);
+  }
+
+  void Grow(const Aabb& other) {
+    Min = cpu_rt::Min(Min, other.Min);
+    Max = cpu_rt::Max(Max, other.Max);
+  }
+
+  Float3 Centroid() const { return (Min + Max) * 0.5f; }
+
+  Float3 Extent() const { return Max - Min; }
+
+  float SurfaceArea() const {
+    if (IsEmpty())
+      return 0.f;
+
+    Float3 e = Extent();
+    return 2.f * (e.x * e.y + e.y * e.z + e.z * e.x);
+  }
+};
+
+// Empty if the boxes are disjoint.
+inline Aabb IntersectAabbs(const Aabb& a, const Aabb& b) {
+  return Aabb{Max(a.Min, b.Min), Min(a.Max, b.Max)};
+}
+
+inline Aabb TransformAabb(const Matrix3x4& mat, const Aabb& box) {
+  Aabb result = Aabb::Empty();
+
+  for (int i = 0; i < 8; ++i) {
+    Float3 corner{(i & 1) ? box.Max.x : box.Min.x, (i & 2) ? box.Max.y : box.Min.y,
+                  (i & 4) ? box.Max.z : box.Min.z};
+    result.Grow(TransformPoint(mat, corner));
+  }
+
+  return result;
+}
+
+// Slab test. invDir is the componentwise reciprocal of the ray direction. On a hit, tNear is the
+// entry distance clamped to tMin.
+inline bool IntersectRayAabb(const Aabb& box, const Float3& origin, const Float3& invDir,
+                             float tMin, float tMax, float* tNear) {
+  float tx0 = (box.Min.x - origin.x) * invDir.x;
+  float tx1 = (box.Max.x - origin.x) * invDir.x;
+  float ty0 = (box.Min.y - origin.y) * invDir.y;
+  float ty1 = (box.Max.y - origin.y) * invDir.y;
+  float tz0 = (box.Min.z - origin.z) * invDir.z;
+  float tz1 = (box.Max.z - origin.z) * invDir.z;
+
+  float tEnter = std::max({tMin, std::min(tx0, tx1), std::min(ty0, ty1), std::min(tz0, tz1)});
+  float tExit = std::min({std::max(tx0, tx1), std::max(ty0, ty1), std::max(tz0, tz1)});
+
+  // Widens the exit by the rounding error of the slab distances (Ize, "Robust BVH Ray
+  // Traversal"), so rays that graze a box, like those through the edges of the triangles that
+  // bound it, are never culled.
+  tExit = std::min(tMax, tExit * 1.0000004f);
+
+  *tNear = tEnter;
+  return tEnter <= tExit;
+}
+
+} // namespace cpu_rt
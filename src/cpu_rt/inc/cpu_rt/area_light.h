@@ -0,0 +1,57 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include "cpu_rt/math.h"
+#include "cpu_rt/shading.h"
+
+namespace cpu_rt {
+
+// An emitter that light samples pick a point of uniformly by area: the triangle P0, P0 + Edge1,
+// P0 + Edge2, or the parallelogram the two edges span. Emits Le from the side Cross(Edge1, Edge2)
+// faces, or from both sides like QuadIntersectShader's quad.
+struct AreaLight {
+  Float3 P0;
+  Float3 Edge1;
+  Float3 Edge2;
+  Float3 Le;
+  bool IsParallelogram;
+  bool TwoSided;
+
+  Float3 GetNormal() const { return Normalize(Cross(Edge1, Edge2)); }
+
+  float GetArea() const {
+    float area = Length(Cross(Edge1, Edge2));
+    return IsParallelogram ? area : 0.5f * area;
+  }
+
+  // Flux over the emitting sides, from the largest component of Le.
+  float GetPower() const {
+    float power = std::max({Le.x, Le.y, Le.z}) * GetArea() * k_pi;
+    return TwoSided ? 2.f * power : power;
+  }
+
+  Float3 SamplePoint(float u, float v) const {
+    if (IsParallelogram)
+      return P0 + u * Edge1 + v * Edge2;
+
+    float su = std::sqrt(u);
+    return P0 + (su * (1.f - v)) * Edge1 + (su * v) * Edge2;
+  }
+
+  // Pdf in solid angle of SamplePoint, seen at distance dist in direction wi from a shading
+  // point. 0 if the light faces away from it.
+  float GetPdf(float dist, const Float3& wi) const {
+    float cosLight = -Dot(GetNormal(), wi);
+    if (TwoSided)
+      cosLight = std::abs(cosLight);
+
+    if (!(cosLight > 0.f))
+      return 0.f;
+
+    return (dist * dist) / (cosLight * GetArea());
+  }
+};
+
+} // namespace cpu_rt
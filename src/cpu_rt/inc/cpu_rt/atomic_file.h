@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+namespace cpu_rt {
+
+// Replaces a file as a whole. The contents go to a file next to it, which Commit flushes to disk
+// and renames over it, so that even after a crash of the machine the file holds either its old
+// contents or the new ones, never part of them. Throws std::runtime_error on failure.
+class AtomicFileWriter {
+public:
+  explicit AtomicFileWriter(const std::filesystem::path& path);
+
+  // Deletes the new contents unless they were committed.
+  ~AtomicFileWriter();
+
+  AtomicFileWriter(const AtomicFileWriter&) = delete;
+  AtomicFileWriter& operator=(const AtomicFileWriter&) = delete;
+
+  // Writes size bytes at offset, extending the file as needed.
+  void Write(const void* data, size_t size, uint64_t offset);
+
+  void Commit();
+
+private:
+  std::filesystem::path m_path;
+  std::filesystem::path m_tempPath;
+
+  // The temporary file until Commit closes it: a HANDLE on Windows and a file descriptor
+  // elsewhere.
+#ifdef _WIN32
+  void* m_file;
+#else
+  int m_file;
+#endif
+};
+
+} // namespace cpu_rt
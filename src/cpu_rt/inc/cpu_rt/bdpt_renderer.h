@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "cpu_rt/light_sampler.h"
+#include "cpu_rt/math.h"
+#include "cpu_rt/render_scene.h"
+
+namespace cpu_rt {
+
+struct BdptSettings {
+  // Most bounces of a path, like PathTracerSettings::NumBounces: a path has at most NumBounces
+  // + 2 segments, counting the camera ray and the one that reaches the light.
+  uint32_t NumBounces = 5;
+};
+
+// Bidirectional path tracing (Veach 1997, as in pbrt-v3's BDPTIntegrator). Each sample traces a
+// camera subpath through a pixel and a light subpath from a light picked by power, and connects
+// every vertex of one to every vertex of the other with a shadow ray, as well as camera vertices
+// that hit a light and to a new light sample, and light vertices to the camera. The power
+// heuristic weighs each of these strategies against the others that could have sampled the same
+// path, so that paths to a small or hidden light come from whichever finds them best.
+//
+// Connections to the camera land in a pixel other than the one the sample belongs to, so they
+// are splatted into a film of their own with atomic adds, whose sums depend on the order of the
+// adds in their rounding only. Everything else runs in parallel over the pixels.
+class BdptRenderer {
+public:
+  BdptRenderer(const RenderScene& scene, uint32_t width, uint32_t height,
+               const BdptSettings& settings = {});
+
+  // Traces a sample per pixel and updates the film.
+  void Render();
+
+  uint32_t GetWidth() const { return m_width; }
+  uint32_t GetHeight() const { return m_height; }
+
+  uint32_t GetSampleCount() const { return m_sampleCount; }
+
+  // Row-major radiance of the samples so far.
+  std::span<const Float3> GetFilm() const { return m_film; }
+
+  // Camera, light, bounce and connection rays traced so far.
+  uint64_t GetRayCount() const { return m_rayCount; }
+
+private:
+  enum class VertexType : uint8_t {
+    Camera,
+    Light,
+    Surface
+  };
+
+  // A vertex of a subpath, with the throughput Beta of the subpath up to it and the pdfs in area
+  // measure of sampling it from the vertex before it (PdfFwd) and from the one after it, had the
+  // path been traced the other way (PdfRev). Wo points to the vertex before it.
+  struct Vertex {
+    VertexType Type;
+
+    // The light the vertex is on, if it emits, and the material of a surface, k_invalidIndex for
+    // the quad light, which does not scatter.
+    uint32_t Light;
+    uint32_t MaterialIndex;
+
+    Float3 Position;
+    Float3 Normal;
+    Float3 Wo;
+    Float3 Beta;
+    float PdfFwd;
+    float PdfRev;
+  };
+
+  // Extends the subpath from path[count - 1] along ray, sampled with pdf in solid angle, until it
+  // has maxCount vertices or leaves the scene, and returns its length.
+  uint32_t RandomWalk(Ray ray, Float3 beta, float pdf, bool isCameraPath, Vertex* path,
+                      uint32_t count, uint32_t maxCount, uint32_t* rngState,
+                      uint32_t* rayCount) const;
+
+  // The contribution of the strategy with s light and t camera vertices, MIS weight included.
+  // For t = 1 it belongs to the pixel at filmX, filmY rather than the sample's.
+  Float3 Connect(const Vertex* lightPath, const Vertex* cameraPath, uint32_t s, uint32_t t,
+                 uint32_t* rngState, uint32_t* rayCount, float* filmX, float* filmY) const;
+
+  // sampled stands in for the first vertex of the light subpath if s = 1, and of the camera
+  // subpath if t = 1.
+  float GetMisWeight(const Vertex* lightPath, const Vertex* cameraPath, const Vertex& sampled,
+                     uint32_t s, uint32_t t) const;
+
+  // Pdf in area measure at next of sampling it from vertex, coming from prev. prev is only
+  // needed for surfaces.
+  float GetPdf(const Vertex& vertex, const Vertex* prev, const Vertex& next) const;
+
+  // Pdfs of the light vertex emitting towards next, in area measure at next, and of a light
+  // subpath starting at it.
+  float GetEmissionPdf(const Vertex& vertex, const Vertex& next) const;
+  float GetLightOriginPdf(const Vertex& vertex) const;
+
+  // Radiance the light vertex emits in direction w.
+  Float3 GetEmission(const Vertex& vertex, const Float3& w) const;
+
+  // BRDF of the surface vertex from its Wo towards wi. 0 if either is below the surface.
+  Float3 GetBrdf(const Vertex& vertex, const Float3& wi) const;
+
+  bool IsVisible(const Float3& from, const Float3& to, uint32_t instanceMask) const;
+
+  const RenderScene& m_scene;
+  uint32_t m_width;
+  uint32_t m_height;
+  BdptSettings m_settings;
+
+  // Picks the light of each light subpath and light sample, by power, so that both strategies
+  // share one pdf.
+  AliasTable m_lightPowers;
+
+  uint32_t m_sampleCount = 0;
+  std::vector<Float3> m_film;
+
+  // Sums over the samples so far of the camera subpaths of each pixel and of the connections
+  // from light subpaths to the camera that land in it.
+  std::vector<Float3> m_sums;
+  std::vector<Float3> m_splats;
+
+  uint64_t m_rayCount = 0;
+};
+
+} // namespace cpu_rt
@@ -0,0 +1,602 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <filesystem>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include <utils/gltf_loader.h>
+
+#include "cpu_rt/aabb.h"
+#include "cpu_rt/bvh.h"
+#include "cpu_rt/bvh_stats.h"
+#include "cpu_rt/compressed_bvh.h"
+#include "cpu_rt/mapped_file.h"
+#include "cpu_rt/math.h"
+#include "cpu_rt/procedural.h"
+#include "cpu_rt/ray.h"
+#include "cpu_rt/ray_packet.h"
+#include "cpu_rt/ray_stream.h"
+#include "cpu_rt/traversal_stats.h"
+#include "cpu_rt/triangle_block.h"
+
+namespace cpu_rt {
+
+enum class GeometryType {
+  Triangles,
+  ProceduralPrimitiveAabbs
+};
+
+// Mirrors D3D12_RAYTRACING_GEOMETRY_TRIANGLES_DESC with 32-bit float positions and 16-bit indices.
+struct TrianglesDesc {
+  std::optional<Matrix3x4> Transform3x4;
+  const uint8_t* VertexBuffer = nullptr;
+  uint32_t VertexStride = 0;
+  uint32_t VertexCount = 0;
+  const uint16_t* IndexBuffer = nullptr;
+  uint32_t IndexCount = 0;
+};
+
+// Mirrors D3D12_RAYTRACING_GEOMETRY_AABBS_DESC.
+struct AabbsDesc {
+  const Aabb* Aabbs = nullptr;
+  uint32_t AabbCount = 0;
+};
+
+struct GeometryDesc {
+  GeometryType Type = GeometryType::Triangles;
+  TrianglesDesc Triangles;
+  AabbsDesc Aabbs;
+};
+
+// Describes a glTF primitive the same way App::CreateAccelerationStructures does for the GPU.
+GeometryDesc GetTriangleGeometryDesc(const utils::Scene& scene, const utils::Primitive& prim,
+                                     std::optional<Matrix3x4> transform = std::nullopt);
+
+inline uint32_t GetTriangleBlockCount(const BvhNode& leaf) {
+  return (leaf.PrimCount + k_triangleBlockWidth - 1) / k_triangleBlockWidth;
+}
+
+// Same values as D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS.
+inline constexpr uint32_t k_buildFlagNone = 0x00;
+inline constexpr uint32_t k_buildFlagPreferFastTrace = 0x04;
+inline constexpr uint32_t k_buildFlagMinimizeMemory = 0x10;
+
+// What the Tlas knows about the instance a ray is entering.
+struct BlasTraceContext {
+  uint32_t RayFlags;
+  bool FrontCounterClockwise;
+
+  uint32_t InstanceIndex;
+  uint32_t InstanceID;
+
+  // The hit group of geometry i is HitGroupBase + GeometryMultiplier * i.
+  uint32_t HitGroupBase;
+  uint32_t GeometryMultiplier;
+};
+
+// Buffers that Blas::IntersectStream reuses across the instances of one stream, indexed by ray
+// ID. The caller sizes each to the stream and zeroes Hit, which IntersectStream leaves zeroed.
+struct BlasStreamScratch {
+  std::vector<StreamRay> Rays;
+  std::vector<WatertightRay> WatertightRays;
+  std::vector<uint8_t> Hit;
+};
+
+// Bottom-level acceleration structure. The geometry is copied in at build time, so the source
+// buffers can be released afterwards and any number of Tlas instances can share one Blas. As in
+// DXR, all geometries of a Blas must have the same type. k_buildFlagPreferFastTrace builds
+// triangles with spatial splits, which trades build time and some memory for tighter nodes.
+// k_buildFlagMinimizeMemory stores the BVH as 8-wide compressed nodes, which trades some
+// traversal speed for memory.
+class Blas {
+public:
+  Blas(std::span<const GeometryDesc> geometryDescs, const BvhBuildSettings& settings = {},
+       uint32_t buildFlags = k_buildFlagNone);
+
+  // Maps a Blas written by Save. Returns nullptr if the file is missing, was saved under a
+  // different key or by an incompatible build, or fails validation. The Blas reads its nodes
+  // and primitives from the mapping, so loading does not copy them.
+  static std::unique_ptr<Blas> Load(const std::filesystem::path& path, uint64_t key);
+
+  // Writes the Blas to a flat file that Load can map. Throws std::runtime_error on failure.
+  void Save(const std::filesystem::path& path, uint64_t key) const;
+
+  GeometryType GetType() const { return m_type; }
+
+  const Aabb& GetBounds() const { return m_bounds; }
+
+  uint32_t GetGeometryCount() const { return m_geometryCount; }
+
+  uint32_t GetPrimitiveCount() const { return m_primitiveCount; }
+
+  size_t GetMemoryUsage() const;
+
+  // Stats of whichever layout was built, with the costs of settings. Leaf sizes count triangle
+  // references, which spatial splits can make more than one per triangle.
+  BvhStats GetStats(const BvhBuildSettings& settings = {}) const;
+
+  // Finds the closest hit along an object space ray that is nearer than hit->T. Returns true and
+  // fills the primitive fields of hit if one is found. Procedural primitives are tested with the
+  // intersection function that intersectionTable assigns to their hit group.
+  template<typename IntersectionTable>
+  bool Intersect(const Ray& ray, const BlasTraceContext& ctx,
+                 const IntersectionTable& intersectionTable, HitInfo* hit) const;
+
+  // Packet version of Intersect for the lanes of an object space packet in laneMask, where
+  // hits[lane].T equals packet->TMax[lane]. Returns the lanes that found a nearer hit, whose
+  // hits and TMax are updated. Only binary BVHs over triangles are traversed as packets; other
+  // layouts and procedural primitives trace each lane on its own.
+  template<typename IntersectionTable>
+  uint32_t IntersectPacket(RayPacket* packet, uint32_t laneMask, const BlasTraceContext& ctx,
+                           const IntersectionTable& intersectionTable, HitInfo* hits) const;
+
+  // Stream version of Intersect for the object space rays[i] with i in rayIds, where hits[i].T
+  // limits ray i. Appends each i whose hits[i] it updated to hitRayIds once. Falls back to single
+  // rays like IntersectPacket.
+  template<typename IntersectionTable>
+  void IntersectStream(std::span<const Ray> rays, std::span<const uint32_t> rayIds,
+                       const BlasTraceContext& ctx, const IntersectionTable& intersectionTable,
+                       std::span<HitInfo> hits, BlasStreamScratch* scratch,
+                       std::vector<uint32_t>* hitRayIds) const;
+
+  // Returns true as soon as any primitive is hit in [ray.TMin, tMax). occluder receives an
+  // opaque handle to that primitive which can be passed to OccludedByPrimitive later.
+  template<typename IntersectionTable>
+  bool Occluded(const Ray& ray, float tMax, const BlasTraceContext& ctx,
+                const IntersectionTable& intersectionTable, uint32_t* occluder) const;
+
+  template<typename IntersectionTable>
+  bool OccludedByPrimitive(uint32_t occluder, const Ray& ray, float tMax,
+                           const BlasTraceContext& ctx,
+                           const IntersectionTable& intersectionTable) const;
+
+  // Returns the lanes of laneMask that hit anything in [TMin, TMax).
+  template<typename IntersectionTable>
+  uint32_t OccludedPacket(const RayPacket& packet, uint32_t laneMask, const BlasTraceContext& ctx,
+                          const IntersectionTable& intersectionTable) const;
+
+private:
+  struct ProceduralPrimitive {
+    Aabb Bounds;
+    uint32_t GeometryIndex;
+    uint32_t PrimitiveIndex;
+  };
+
+  // Calls leafFn(firstItem, itemCount) for the leaves along the ray in whichever layout was
+  // built. Items are triangle blocks or procedural primitives.
+  template<typename LeafFn>
+  void TraverseLeaves(const Ray& ray, const Float3& invDir, const float* tMax,
+                      LeafFn&& leafFn) const;
+
+  template<typename LeafFn>
+  void TraverseLeavesAny(const Ray& ray, const Float3& invDir, float tMax, LeafFn&& leafFn) const;
+
+  // Packets and streams are only traced through binary BVHs over triangles.
+  bool CanTraceCoherently() const {
+    return m_type == GeometryType::Triangles && !m_nodes.empty();
+  }
+
+  uint32_t GetLeafItemCount(const BvhNode& leaf) const {
+    return m_type == GeometryType::Triangles ? GetTriangleBlockCount(leaf) : leaf.PrimCount;
+  }
+
+  Blas() = default;
+
+  // Converts the built BVH to the compressed layout and reorders the primitives to match.
+  void Compress(uint32_t leafGranularity);
+
+  // Points the views at the owned arrays.
+  void SetViews();
+
+  // Updates hit if the block has a hit nearer than hit->T.
+  bool IntersectTriangleBlockClosest(const TriangleBlock& block, const WatertightRay& ray,
+                                     const BlasTraceContext& ctx, HitInfo* hit) const;
+
+  template<typename IntersectionTable>
+  bool OccludedByProcedural(const ProceduralPrimitive& prim, const Ray& ray,
+                            const Float3& invDir, float tMax, const BlasTraceContext& ctx,
+                            const IntersectionTable& intersectionTable) const;
+
+  GeometryType m_type = GeometryType::Triangles;
+
+  // What traversal reads: views of the arrays below, or of the mapped file the Blas was loaded
+  // from. Only one of the two node arrays is non-empty.
+  std::span<const BvhNode> m_nodes;
+  std::span<const CompressedBvhNode> m_compressedNodes;
+
+  // In BVH leaf order so a leaf's primitives are contiguous. Only the array matching m_type is
+  // used. Triangle leaves start a new block, so leaves index m_triangleBlocks and a binary leaf
+  // spans ceil(PrimCount / k_triangleBlockWidth) blocks.
+  std::span<const TriangleBlock> m_triangleBlocks;
+  std::span<const ProceduralPrimitive> m_proceduralPrims;
+
+  // Storage of a built Blas.
+  Bvh m_bvh;
+  CompressedBvh m_compressedBvh;
+  std::vector<TriangleBlock> m_triangleBlockStorage;
+  std::vector<ProceduralPrimitive> m_proceduralPrimStorage;
+
+  // Storage of a loaded Blas.
+  std::unique_ptr<MappedFile> m_mappedFile;
+
+  Aabb m_bounds = Aabb::Empty();
+  uint32_t m_geometryCount = 0;
+  uint32_t m_primitiveCount = 0;
+};
+
+// Hash of everything a Blas build depends on: the vertex positions and indices the descs point
+// to, their transforms, the settings and the build flags.
+uint64_t GetBlasCacheKey(std::span<const GeometryDesc> geometryDescs,
+                         const BvhBuildSettings& settings, uint32_t buildFlags);
+
+// Loads the Blas from cacheDir if it holds one built from the same inputs. Otherwise builds it
+// and saves it there for the next run.
+std::unique_ptr<Blas> LoadOrBuildBlas(std::span<const GeometryDesc> geometryDescs,
+                                      const BvhBuildSettings& settings, uint32_t buildFlags,
+                                      const std::filesystem::path& cacheDir);
+
+template<typename LeafFn>
+void Blas::TraverseLeaves(const Ray& ray, const Float3& invDir, const float* tMax,
+                          LeafFn&& leafFn) const {
+  if (!m_compressedNodes.empty()) {
+    TraverseCompressedBvh(m_compressedNodes, ray.Origin, invDir, ray.TMin, tMax, leafFn);
+    return;
+  }
+
+  TraverseBvh(m_nodes, ray.Origin, invDir, ray.TMin, tMax, [&](const BvhNode& leaf) {
+    return leafFn(leaf.LeftFirst, GetLeafItemCount(leaf));
+  });
+}
+
+template<typename LeafFn>
+void Blas::TraverseLeavesAny(const Ray& ray, const Float3& invDir, float tMax,
+                             LeafFn&& leafFn) const {
+  if (!m_compressedNodes.empty()) {
+    TraverseCompressedBvhAny(m_compressedNodes, ray.Origin, invDir, ray.TMin, tMax, leafFn);
+    return;
+  }
+
+  TraverseBvhAny(m_nodes, ray.Origin, invDir, ray.TMin, tMax, [&](const BvhNode& leaf) {
+    return leafFn(leaf.LeftFirst, GetLeafItemCount(leaf));
+  });
+}
+
+inline bool Blas::IntersectTriangleBlockClosest(const TriangleBlock& block,
+                                               const WatertightRay& ray,
+                                               const BlasTraceContext& ctx, HitInfo* hit) const {
+  TriangleBlockHits blockHits;
+  uint32_t laneMask = IntersectTriangleBlock(block, ray, ctx.RayFlags, ctx.FrontCounterClockwise,
+                                             hit->T, &blockHits);
+  if (laneMask == 0)
+    return false;
+
+  int lane = std::countr_zero(laneMask);
+  for (uint32_t mask = laneMask & (laneMask - 1); mask != 0; mask &= mask - 1) {
+    int other = std::countr_zero(mask);
+    if (blockHits.T[other] < blockHits.T[lane])
+      lane = other;
+  }
+
+  hit->T = blockHits.T[lane];
+  hit->Barycentrics[0] = blockHits.U[lane];
+  hit->Barycentrics[1] = blockHits.V[lane];
+  hit->PrimitiveIndex = block.PrimitiveIndex[lane];
+  hit->GeometryIndex = block.GeometryIndex[lane];
+  hit->HitKind = ((blockHits.FrontFaceMask >> lane) & 1) ? k_hitKindTriangleFrontFace
+                                                         : k_hitKindTriangleBackFace;
+  return true;
+}
+
+template<typename IntersectionTable>
+bool Blas::Intersect(const Ray& ray, const BlasTraceContext& ctx,
+                     const IntersectionTable& intersectionTable, HitInfo* hit) const {
+  Float3 invDir{1.f / ray.Direction.x, 1.f / ray.Direction.y, 1.f / ray.Direction.z};
+
+  bool acceptFirstHit = (ctx.RayFlags & k_rayFlagAcceptFirstHitAndEndSearch) != 0;
+  bool found = false;
+
+  if (m_type == GeometryType::Triangles) {
+    WatertightRay watertightRay = MakeWatertightRay(ray);
+
+    TraverseLeaves(ray, invDir, &hit->T, [&](uint32_t first, uint32_t count) {
+      CountTraversal(TraversalCounter::TrianglesTested, count * k_triangleBlockWidth);
+
+      for (uint32_t i = first; i < first + count; ++i) {
+        if (!IntersectTriangleBlockClosest(m_triangleBlocks[i], watertightRay, ctx, hit))
+          continue;
+
+        found = true;
+        if (acceptFirstHit)
+          return true;
+      }
+      return false;
+    });
+  } else {
+    TraverseLeaves(ray, invDir, &hit->T, [&](uint32_t first, uint32_t count) {
+      CountTraversal(TraversalCounter::ProceduralPrimitivesTested, count);
+
+      for (uint32_t i = first; i < first + count; ++i) {
+        const ProceduralPrimitive& prim = m_proceduralPrims[i];
+
+        // Like DXR, only run the intersection function when the ray enters the AABB.
+        float tNear;
+        if (!IntersectRayAabb(prim.Bounds, ray.Origin, invDir, ray.TMin, hit->T, &tNear))
+          continue;
+
+        ProceduralPrimitiveContext primCtx{};
+        primCtx.InstanceIndex = ctx.InstanceIndex;
+        primCtx.InstanceID = ctx.InstanceID;
+        primCtx.GeometryIndex = prim.GeometryIndex;
+        primCtx.PrimitiveIndex = prim.PrimitiveIndex;
+        primCtx.HitGroupIndex = ctx.HitGroupBase + ctx.GeometryMultiplier * prim.GeometryIndex;
+
+        ProceduralHit procHit{};
+        if (!intersectionTable.Intersect(primCtx, ray, ray.TMin, hit->T, &procHit))
+          continue;
+
+        // ReportHit ignores hits outside [RayTMin, RayTCurrent].
+        if (procHit.T < ray.TMin || procHit.T >= hit->T)
+          continue;
+
+        hit->T = procHit.T;
+        hit->Normal = procHit.Normal;
+        hit->PrimitiveIndex = prim.PrimitiveIndex;
+        hit->GeometryIndex = prim.GeometryIndex;
+        hit->HitKind = procHit.HitKind;
+
+        found = true;
+        if (acceptFirstHit)
+          return true;
+      }
+      return false;
+    });
+  }
+
+  return found;
+}
+
+template<typename IntersectionTable>
+uint32_t Blas::IntersectPacket(RayPacket* packet, uint32_t laneMask, const BlasTraceContext& ctx,
+                               const IntersectionTable& intersectionTable, HitInfo* hits) const {
+  uint32_t foundLanes = 0;
+
+  if (!CanTraceCoherently()) {
+    for (uint32_t mask = laneMask; mask != 0; mask &= mask - 1) {
+      int lane = std::countr_zero(mask);
+      if (Intersect(GetPacketRay(*packet, lane), ctx, intersectionTable, &hits[lane])) {
+        packet->TMax[lane] = hits[lane].T;
+        foundLanes |= 1u << lane;
+      }
+    }
+    return foundLanes;
+  }
+
+  WatertightRay watertightRays[k_rayPacketSize];
+  for (uint32_t mask = laneMask; mask != 0; mask &= mask - 1) {
+    int lane = std::countr_zero(mask);
+    watertightRays[lane] = MakeWatertightRay(GetPacketRay(*packet, lane));
+  }
+
+  bool acceptFirstHit = (ctx.RayFlags & k_rayFlagAcceptFirstHitAndEndSearch) != 0;
+
+  TraversePacketBvh(m_nodes, *packet, laneMask, [&](const BvhNode& leaf, uint32_t leafLanes) {
+    uint32_t doneLanes = 0;
+
+    // Each block is loaded once for all the lanes.
+    for (uint32_t i = leaf.LeftFirst; i < leaf.LeftFirst + GetTriangleBlockCount(leaf); ++i) {
+      for (uint32_t mask = leafLanes & ~doneLanes; mask != 0; mask &= mask - 1) {
+        int lane = std::countr_zero(mask);
+
+        CountTraversal(TraversalCounter::TrianglesTested, k_triangleBlockWidth);
+
+        if (!IntersectTriangleBlockClosest(m_triangleBlocks[i], watertightRays[lane], ctx,
+                                           &hits[lane]))
+          continue;
+
+        packet->TMax[lane] = hits[lane].T;
+        foundLanes |= 1u << lane;
+
+        if (acceptFirstHit)
+          doneLanes |= 1u << lane;
+      }
+    }
+    return doneLanes;
+  });
+
+  return foundLanes;
+}
+
+template<typename IntersectionTable>
+void Blas::IntersectStream(std::span<const Ray> rays, std::span<const uint32_t> rayIds,
+                           const BlasTraceContext& ctx,
+                           const IntersectionTable& intersectionTable, std::span<HitInfo> hits,
+                           BlasStreamScratch* scratch, std::vector<uint32_t>* hitRayIds) const {
+  if (!CanTraceCoherently()) {
+    for (uint32_t rayId : rayIds) {
+      if (Intersect(rays[rayId], ctx, intersectionTable, &hits[rayId]))
+        hitRayIds->push_back(rayId);
+    }
+    return;
+  }
+
+  bool acceptFirstHit = (ctx.RayFlags & k_rayFlagAcceptFirstHitAndEndSearch) != 0;
+
+  std::span<StreamRay> streamRays = scratch->Rays;
+  std::span<WatertightRay> watertightRays = scratch->WatertightRays;
+  std::span<uint8_t> hit = scratch->Hit;
+
+  for (uint32_t rayId : rayIds) {
+    const Ray& ray = rays[rayId];
+    streamRays[rayId].Origin = ray.Origin;
+    streamRays[rayId].InvDir = Float3{1.f / ray.Direction.x, 1.f / ray.Direction.y,
+                                      1.f / ray.Direction.z};
+    streamRays[rayId].TMin = ray.TMin;
+    watertightRays[rayId] = MakeWatertightRay(ray);
+  }
+
+  auto isDone = [&](uint32_t rayId) { return acceptFirstHit && hit[rayId]; };
+
+  auto getTMax = [&](uint32_t rayId) {
+    return isDone(rayId) ? -std::numeric_limits<float>::infinity() : hits[rayId].T;
+  };
+
+  TraverseBvhStream(m_nodes, streamRays, rayIds, getTMax,
+                    [&](const BvhNode& leaf, std::span<const uint32_t> leafRayIds) {
+    for (uint32_t i = leaf.LeftFirst; i < leaf.LeftFirst + GetTriangleBlockCount(leaf); ++i) {
+      for (uint32_t rayId : leafRayIds) {
+        if (isDone(rayId))
+          continue;
+
+        CountTraversal(TraversalCounter::TrianglesTested, k_triangleBlockWidth);
+
+        if (IntersectTriangleBlockClosest(m_triangleBlocks[i], watertightRays[rayId], ctx,
+                                          &hits[rayId]))
+          hit[rayId] = 1;
+      }
+    }
+  });
+
+  for (uint32_t rayId : rayIds) {
+    if (hit[rayId]) {
+      hitRayIds->push_back(rayId);
+      hit[rayId] = 0;
+    }
+  }
+}
+
+template<typename IntersectionTable>
+bool Blas::OccludedByProcedural(const ProceduralPrimitive& prim, const Ray& ray,
+                                const Float3& invDir, float tMax, const BlasTraceContext& ctx,
+                                const IntersectionTable& intersectionTable) const {
+  float tNear;
+  if (!IntersectRayAabb(prim.Bounds, ray.Origin, invDir, ray.TMin, tMax, &tNear))
+    return false;
+
+  ProceduralPrimitiveContext primCtx{};
+  primCtx.InstanceIndex = ctx.InstanceIndex;
+  primCtx.InstanceID = ctx.InstanceID;
+  primCtx.GeometryIndex = prim.GeometryIndex;
+  primCtx.PrimitiveIndex = prim.PrimitiveIndex;
+  primCtx.HitGroupIndex = ctx.HitGroupBase + ctx.GeometryMultiplier * prim.GeometryIndex;
+
+  ProceduralHit procHit{};
+  return intersectionTable.Intersect(primCtx, ray, ray.TMin, tMax, &procHit) &&
+         procHit.T >= ray.TMin && procHit.T < tMax;
+}
+
+template<typename IntersectionTable>
+bool Blas::Occluded(const Ray& ray, float tMax, const BlasTraceContext& ctx,
+                    const IntersectionTable& intersectionTable, uint32_t* occluder) const {
+  Float3 invDir{1.f / ray.Direction.x, 1.f / ray.Direction.y, 1.f / ray.Direction.z};
+
+  bool occluded = false;
+
+  if (m_type == GeometryType::Triangles) {
+    WatertightRay watertightRay = MakeWatertightRay(ray);
+
+    TraverseLeavesAny(ray, invDir, tMax, [&](uint32_t first, uint32_t count) {
+      for (uint32_t i = first; i < first + count; ++i) {
+        CountTraversal(TraversalCounter::TrianglesTested, k_triangleBlockWidth);
+
+        uint32_t laneMask = IntersectTriangleBlock(m_triangleBlocks[i], watertightRay,
+                                                   ctx.RayFlags, ctx.FrontCounterClockwise, tMax,
+                                                   nullptr);
+        if (laneMask != 0) {
+          *occluder = i * k_triangleBlockWidth + std::countr_zero(laneMask);
+          occluded = true;
+          return true;
+        }
+      }
+      return false;
+    });
+  } else {
+    TraverseLeavesAny(ray, invDir, tMax, [&](uint32_t first, uint32_t count) {
+      for (uint32_t i = first; i < first + count; ++i) {
+        CountTraversal(TraversalCounter::ProceduralPrimitivesTested);
+
+        if (OccludedByProcedural(m_proceduralPrims[i], ray, invDir, tMax, ctx,
+                                 intersectionTable)) {
+          *occluder = i;
+          occluded = true;
+          return true;
+        }
+      }
+      return false;
+    });
+  }
+
+  return occluded;
+}
+
+template<typename IntersectionTable>
+bool Blas::OccludedByPrimitive(uint32_t occluder, const Ray& ray, float tMax,
+                               const BlasTraceContext& ctx,
+                               const IntersectionTable& intersectionTable) const {
+  if (m_type == GeometryType::Triangles) {
+    CountTraversal(TraversalCounter::TrianglesTested, k_triangleBlockWidth);
+
+    uint32_t laneMask = IntersectTriangleBlock(m_triangleBlocks[occluder / k_triangleBlockWidth],
+                                               MakeWatertightRay(ray), ctx.RayFlags,
+                                               ctx.FrontCounterClockwise, tMax, nullptr);
+    return ((laneMask >> (occluder % k_triangleBlockWidth)) & 1) != 0;
+  }
+
+  CountTraversal(TraversalCounter::ProceduralPrimitivesTested);
+
+  Float3 invDir{1.f / ray.Direction.x, 1.f / ray.Direction.y, 1.f / ray.Direction.z};
+  return OccludedByProcedural(m_proceduralPrims[occluder], ray, invDir, tMax, ctx,
+                              intersectionTable);
+}
+
+template<typename IntersectionTable>
+uint32_t Blas::OccludedPacket(const RayPacket& packet, uint32_t laneMask,
+                              const BlasTraceContext& ctx,
+                              const IntersectionTable& intersectionTable) const {
+  uint32_t occludedLanes = 0;
+
+  if (!CanTraceCoherently()) {
+    for (uint32_t mask = laneMask; mask != 0; mask &= mask - 1) {
+      int lane = std::countr_zero(mask);
+
+      uint32_t occluder;
+      if (Occluded(GetPacketRay(packet, lane), packet.TMax[lane], ctx, intersectionTable,
+                   &occluder))
+        occludedLanes |= 1u << lane;
+    }
+    return occludedLanes;
+  }
+
+  WatertightRay watertightRays[k_rayPacketSize];
+  for (uint32_t mask = laneMask; mask != 0; mask &= mask - 1) {
+    int lane = std::countr_zero(mask);
+    watertightRays[lane] = MakeWatertightRay(GetPacketRay(packet, lane));
+  }
+
+  TraversePacketBvh(m_nodes, packet, laneMask, [&](const BvhNode& leaf, uint32_t leafLanes) {
+    uint32_t leafOccluded = 0;
+
+    for (uint32_t i = leaf.LeftFirst; i < leaf.LeftFirst + GetTriangleBlockCount(leaf); ++i) {
+      for (uint32_t mask = leafLanes & ~leafOccluded; mask != 0; mask &= mask - 1) {
+        int lane = std::countr_zero(mask);
+
+        CountTraversal(TraversalCounter::TrianglesTested, k_triangleBlockWidth);
+
+        if (IntersectTriangleBlock(m_triangleBlocks[i], watertightRays[lane], ctx.RayFlags,
+                                   ctx.FrontCounterClockwise, packet.TMax[lane], nullptr) != 0)
+          leafOccluded |= 1u << lane;
+      }
+    }
+
+    occludedLanes |= leafOccluded;
+    return leafOccluded;
+  });
+
+  return occludedLanes;
+}
+
+} // namespace cpu_rt
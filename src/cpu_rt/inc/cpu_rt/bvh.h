@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "cpu_rt/aabb.h"
+#include "cpu_rt/traversal_stats.h"
+
+namespace cpu_rt {
+
+inline constexpr uint32_t k_maxBvhDepth = 64;
+
+struct BvhNode {
+  Aabb Bounds;
+
+  // Index of the left child for interior nodes (the right child follows it), or of the first
+  // entry in Bvh::PrimIndices for leaves.
+  uint32_t LeftFirst;
+
+  // Zero for interior nodes.
+  uint32_t PrimCount;
+
+  bool IsLeaf() const { return PrimCount > 0; }
+};
+
+static_assert(sizeof(BvhNode) == 32);
+
+struct BvhBuildSettings {
+  uint32_t MaxLeafSize = 4;
+  uint32_t NumBins = 16;
+
+  // SAH costs of visiting a node and of testing a primitive.
+  float TraversalCost = 1.f;
+  float IntersectionCost = 1.f;
+
+  // Primitives that are tested LeafGranularity at a time, like SIMD triangle blocks, cost
+  // IntersectionCost per started group.
+  uint32_t LeafGranularity = 1;
+
+  // BuildSpatialSplitBvh only searches for a spatial split when the children of the best object
+  // split overlap by more than this fraction of the root's surface area, and only while the
+  // number of triangle references stays within MaxReferenceRatio times the triangle count.
+  float SpatialSplitOverlap = 1e-5f;
+  float MaxReferenceRatio = 1.5f;
+};
+
+struct Bvh {
+  std::vector<BvhNode> Nodes;
+  std::vector<uint32_t> PrimIndices;
+};
+
+// Binned SAH build over the primitive bounds. Node 0 is the root.
+Bvh BuildBvh(std::span<const Aabb> primBounds, const BvhBuildSettings& settings = {});
+
+// SBVH build (Stich et al., "Spatial Splits in Bounding Volume Hierarchies") over triangles,
+// where triangle i is triangleVertices[3 * i] to triangleVertices[3 * i + 2]. Nodes can also be
+// split at a plane, with the triangles that straddle it clipped into both children, so a
+// triangle may be referenced by several leaves. Otherwise the result is the same as BuildBvh's.
+Bvh BuildSpatialSplitBvh(std::span<const Float3> triangleVertices,
+                         const BvhBuildSettings& settings = {});
+
+// Visits the leaves whose bounds the ray enters, nearest child first. leafFn(const BvhNode&)
+// returns true to end the traversal and may lower *tMax as hits are found.
+template<typename LeafFn>
+void TraverseBvh(std::span<const BvhNode> nodes, const Float3& origin, const Float3& invDir,
+                 float tMin, const float* tMax, LeafFn&& leafFn) {
+  if (nodes.empty())
+    return;
+
+  float tNear;
+  if (!IntersectRayAabb(nodes[0].Bounds, origin, invDir, tMin, *tMax, &tNear))
+    return;
+
+  uint32_t stack[k_maxBvhDepth];
+  int stackSize = 0;
+
+  uint32_t nodeIndex = 0;
+
+  while (true) {
+    CountTraversal(TraversalCounter::NodesVisited);
+
+    const BvhNode& node = nodes[nodeIndex];
+
+    if (node.IsLeaf()) {
+      if (leafFn(node))
+        return;
+    } else {
+      uint32_t nearChild = node.LeftFirst;
+      uint32_t farChild = node.LeftFirst + 1;
+
+      float tNear0, tNear1;
+      bool hit0 = IntersectRayAabb(nodes[nearChild].Bounds, origin, invDir, tMin, *tMax, &tNear0);
+      bool hit1 = IntersectRayAabb(nodes[farChild].Bounds, origin, invDir, tMin, *tMax, &tNear1);
+
+      if (hit0 && hit1) {
+        if (tNear1 < tNear0)
+          std::swap(nearChild, farChild);
+
+        stack[stackSize++] = farChild;
+        nodeIndex = nearChild;
+        continue;
+      }
+
+      if (hit0 || hit1) {
+        nodeIndex = hit0 ? nearChild : farChild;
+        continue;
+      }
+    }
+
+    if (stackSize == 0)
+      return;
+
+    nodeIndex = stack[--stackSize];
+  }
+}
+
+// Cheaper variant of TraverseBvh for any-hit queries. tMax is fixed, and when the ray enters
+// both children the left one is visited first instead of the nearer one.
+template<typename LeafFn>
+void TraverseBvhAny(std::span<const BvhNode> nodes, const Float3& origin, const Float3& invDir,
+                    float tMin, float tMax, LeafFn&& leafFn) {
+  if (nodes.empty())
+    return;
+
+  float tNear;
+  if (!IntersectRayAabb(nodes[0].Bounds, origin, invDir, tMin, tMax, &tNear))
+    return;
+
+  uint32_t stack[k_maxBvhDepth];
+  int stackSize = 0;
+
+  uint32_t nodeIndex = 0;
+
+  while (true) {
+    CountTraversal(TraversalCounter::NodesVisited);
+
+    const BvhNode& node = nodes[nodeIndex];
+
+    if (node.IsLeaf()) {
+      if (leafFn(node))
+        return;
+    } else {
+      uint32_t leftChild = node.LeftFirst;
+      uint32_t rightChild = node.LeftFirst + 1;
+
+      bool hit0 = IntersectRayAabb(nodes[leftChild].Bounds, origin, invDir, tMin, tMax, &tNear);
+      bool hit1 = IntersectRayAabb(nodes[rightChild].Bounds, origin, invDir, tMin, tMax, &tNear);
+
+      if (hit0 && hit1)
+        stack[stackSize++] = rightChild;
+
+      if (hit0 || hit1) {
+        nodeIndex = hit0 ? leftChild : rightChild;
+        continue;
+      }
+    }
+
+    if (stackSize == 0)
+      return;
+
+    nodeIndex = stack[--stackSize];
+  }
+}
+
+} // namespace cpu_rt
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <vector>
+
+#include "cpu_rt/bvh.h"
+#include "cpu_rt/compressed_bvh.h"
+
+namespace cpu_rt {
+
+// Quality measures of a built BVH.
+struct BvhStats {
+  // Includes the leaves of binary BVHs. Compressed leaves live in their parents, so only the
+  // 8-wide nodes are counted.
+  uint32_t NodeCount = 0;
+  uint32_t LeafCount = 0;
+
+  // The root is at depth 0.
+  uint32_t MaxDepth = 0;
+  float AverageLeafDepth = 0.f;
+
+  // Expected cost of tracing a ray that hits the root, under the SAH model the builders
+  // minimize with the settings' costs.
+  float SahCost = 0.f;
+
+  // Summed surface area of the boxes where sibling nodes overlap, relative to the root's.
+  float SiblingOverlap = 0.f;
+
+  // Entry i is the number of leaves with i primitives.
+  std::vector<uint32_t> LeafSizeHistogram;
+};
+
+BvhStats ComputeBvhStats(std::span<const BvhNode> nodes, const BvhBuildSettings& settings = {});
+
+// Leaf children of compressed nodes only know their item ranges, so getPrimCount(firstItem,
+// itemCount) returns the number of primitives in one.
+BvhStats ComputeCompressedBvhStats(
+    std::span<const CompressedBvhNode> nodes, const BvhBuildSettings& settings,
+    const std::function<uint32_t(uint32_t, uint32_t)>& getPrimCount);
+
+} // namespace cpu_rt
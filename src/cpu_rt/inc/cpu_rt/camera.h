@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+
+#include "cpu_rt/math.h"
+#include "cpu_rt/ray.h"
+
+namespace cpu_rt {
+
+// Where the pinhole camera of RayGenShader sits. It looks down +z.
+inline constexpr Float3 k_cameraPosition{0.f, 1.f, -4.f};
+
+// The camera ray through (x + jitterX, y + jitterY) of a width x height film, with y down.
+inline Ray GetCameraRay(uint32_t width, uint32_t height, uint32_t x, uint32_t y, float jitterX,
+                        float jitterY) {
+  float lerpX = (static_cast<float>(x) + jitterX) / static_cast<float>(width);
+  float lerpY = (static_cast<float>(y) + jitterY) / static_cast<float>(height);
+
+  float viewportX = -1.33f + lerpX * 2.66f;
+  float viewportY = 1.f - lerpY * 2.f;
+
+  Ray ray{};
+  ray.Origin = k_cameraPosition;
+  ray.Direction = Float3{viewportX * 0.414f, viewportY * 0.414f, 1.f};
+  ray.TMin = 0.f;
+  ray.TMax = k_rayTMax;
+  return ray;
+}
+
+// The inverse of GetCameraRay: the film position x + jitterX, y + jitterY that a ray from the
+// camera along direction passes through. False if it misses the film.
+inline bool GetCameraFilmPosition(uint32_t width, uint32_t height, const Float3& direction,
+                                  float* filmX, float* filmY) {
+  if (!(direction.z > 0.f))
+    return false;
+
+  float viewportX = direction.x / (direction.z * 0.414f);
+  float viewportY = direction.y / (direction.z * 0.414f);
+
+  *filmX = (viewportX + 1.33f) / 2.66f * static_cast<float>(width);
+  *filmY = (1.f - viewportY) / 2.f * static_cast<float>(height);
+
+  return *filmX >= 0.f && *filmX < static_cast<float>(width) && *filmY >= 0.f &&
+         *filmY < static_cast<float>(height);
+}
+
+// Pdf in solid angle of the normalized direction of a GetCameraRay through a uniformly random
+// film position, 0 if it misses the film. The film spans 2.66 x 2 times 0.414 at distance 1,
+// which a solid angle covers 1 / cos^3 times as much of as it does straight ahead.
+inline float GetCameraDirectionPdf(const Float3& direction) {
+  float filmX, filmY;
+  if (!GetCameraFilmPosition(1, 1, direction, &filmX, &filmY))
+    return 0.f;
+
+  float filmArea = (2.66f * 0.414f) * (2.f * 0.414f);
+  float cosTheta = direction.z;
+  return 1.f / (filmArea * cosTheta * cosTheta * cosTheta);
+}
+
+} // namespace cpu_rt
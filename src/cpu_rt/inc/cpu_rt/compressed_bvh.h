@@ -0,0 +1,199 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <span>
+#include <vector>
+
+#include "cpu_rt/aabb.h"
+#include "cpu_rt/bvh.h"
+#include "cpu_rt/math.h"
+#include "cpu_rt/simd.h"
+#include "cpu_rt/traversal_stats.h"
+
+namespace cpu_rt {
+
+inline constexpr uint32_t k_compressedBvhWidth = 8;
+
+// A leaf child can reference up to this many items, and the leaf children of a node up to
+// k_compressedBvhWidth times as many.
+inline constexpr uint32_t k_maxCompressedLeafItems = 4;
+
+// 8-wide node with child bounds quantized to 8 bits on a grid anchored at Origin, with a power
+// of two cell size per axis. The grid is rounded outwards, so a dequantized box always contains
+// the child. Interior children are stored contiguously from ChildBase and the items of leaf
+// children from ItemBase, so each child only needs a one byte offset.
+struct alignas(16) CompressedBvhNode {
+  Float3 Origin;
+  int8_t Exponent[3];
+
+  // Bit i is set if child slot i is used.
+  uint8_t ChildMask;
+
+  uint32_t ChildBase;
+  uint32_t ItemBase;
+
+  // Interior children: k_compressedInteriorChild | node offset from ChildBase. Leaves:
+  // (item count - 1) << 5 | item offset from ItemBase.
+  uint8_t Meta[k_compressedBvhWidth];
+
+  uint8_t QuantizedMin[3][k_compressedBvhWidth];
+  uint8_t QuantizedMax[3][k_compressedBvhWidth];
+};
+
+static_assert(sizeof(CompressedBvhNode) == 80);
+
+inline constexpr uint8_t k_compressedInteriorChild = 0x80;
+
+struct CompressedBvh {
+  std::vector<CompressedBvhNode> Nodes;
+
+  // For each item slot, the index of the item in the source BVH's order. Callers reorder their
+  // items with it.
+  std::vector<uint32_t> ItemIndices;
+};
+
+// Collapses a binary BVH into 8-wide compressed nodes. A binary leaf covers
+// ceil(PrimCount / leafGranularity) items starting at LeftFirst, which must not exceed
+// k_maxCompressedLeafItems.
+CompressedBvh CompressBvh(const Bvh& bvh, uint32_t leafGranularity);
+
+// The dequantized bounds of the child in the given slot.
+Aabb GetCompressedChildBounds(const CompressedBvhNode& node, uint32_t slot);
+
+// Slab tests the ray against all children of a node. Returns a mask of the children hit and
+// their entry distances.
+inline uint32_t IntersectCompressedChildren(const CompressedBvhNode& node, const Float3& origin,
+                                            const Float3& invDir, float tMin, float tMax,
+                                            float* tNear) {
+  uint32_t hitMask = 0;
+
+  for (uint32_t g = 0; g < k_compressedBvhWidth; g += k_simdWidth) {
+    SimdFloat tEnter = SimdSet(tMin);
+    SimdFloat tExit = SimdSet(std::numeric_limits<float>::infinity());
+
+    for (int axis = 0; axis < 3; ++axis) {
+      uint32_t scaleBits = static_cast<uint32_t>(node.Exponent[axis] + 127) << 23;
+
+      float scale;
+      memcpy(&scale, &scaleBits, sizeof(scale));
+
+      // q * scale is exact, so this gives the same bounds the builder checked.
+      SimdFloat gridOrigin = SimdSet(node.Origin[axis]);
+      SimdFloat gridScale = SimdSet(scale);
+      SimdFloat boxMin = SimdAdd(gridOrigin,
+                                 SimdMul(SimdLoadU8(node.QuantizedMin[axis] + g), gridScale));
+      SimdFloat boxMax = SimdAdd(gridOrigin,
+                                 SimdMul(SimdLoadU8(node.QuantizedMax[axis] + g), gridScale));
+
+      SimdFloat rayOrigin = SimdSet(origin[axis]);
+      SimdFloat rayInvDir = SimdSet(invDir[axis]);
+
+      SimdFloat t0 = SimdMul(SimdSub(boxMin, rayOrigin), rayInvDir);
+      SimdFloat t1 = SimdMul(SimdSub(boxMax, rayOrigin), rayInvDir);
+
+      tEnter = SimdMax(tEnter, SimdMin(t0, t1));
+      tExit = SimdMin(tExit, SimdMax(t0, t1));
+    }
+
+    // Same error bound as IntersectRayAabb.
+    tExit = SimdMin(SimdSet(tMax), SimdMul(tExit, SimdSet(1.0000004f)));
+
+    SimdStore(tNear + g, tEnter);
+    hitMask |= SimdMoveMask(SimdLe(tEnter, tExit)) << g;
+  }
+
+  return hitMask & node.ChildMask;
+}
+
+template<bool Ordered, typename LeafFn>
+void TraverseCompressedBvhImpl(std::span<const CompressedBvhNode> nodes, const Float3& origin,
+                               const Float3& invDir, float tMin, const float* tMax,
+                               LeafFn&& leafFn) {
+  if (nodes.empty())
+    return;
+
+  // ItemCount is zero for interior nodes.
+  struct StackEntry {
+    uint32_t Index;
+    uint32_t ItemCount;
+    float TNear;
+  };
+
+  // Every node visited replaces its stack entry with at most k_compressedBvhWidth new ones.
+  StackEntry stack[(k_compressedBvhWidth - 1) * k_maxBvhDepth + 1];
+  int stackSize = 0;
+
+  stack[stackSize++] = {0, 0, tMin};
+
+  while (stackSize > 0) {
+    StackEntry entry = stack[--stackSize];
+
+    // Skips children that were pushed before a closer hit was found.
+    if (entry.TNear > *tMax)
+      continue;
+
+    if (entry.ItemCount > 0) {
+      if (leafFn(entry.Index, entry.ItemCount))
+        return;
+      continue;
+    }
+
+    CountTraversal(TraversalCounter::NodesVisited);
+
+    const CompressedBvhNode& node = nodes[entry.Index];
+
+    alignas(32) float tNear[k_compressedBvhWidth];
+    uint32_t hitMask = IntersectCompressedChildren(node, origin, invDir, tMin, *tMax, tNear);
+
+    StackEntry children[k_compressedBvhWidth];
+    int childCount = 0;
+
+    for (; hitMask != 0; hitMask &= hitMask - 1) {
+      int slot = std::countr_zero(hitMask);
+      uint8_t meta = node.Meta[slot];
+
+      StackEntry child{};
+      child.TNear = tNear[slot];
+
+      if (meta & k_compressedInteriorChild) {
+        child.Index = node.ChildBase + (meta & 0x7f);
+      } else {
+        child.Index = node.ItemBase + (meta & 0x1f);
+        child.ItemCount = (meta >> 5) + 1;
+      }
+
+      // Keeps the nearest child last so it is popped first.
+      int i = childCount++;
+      if constexpr (Ordered) {
+        for (; i > 0 && children[i - 1].TNear < child.TNear; --i) {
+          children[i] = children[i - 1];
+        }
+      }
+      children[i] = child;
+    }
+
+    for (int i = 0; i < childCount; ++i) {
+      stack[stackSize++] = children[i];
+    }
+  }
+}
+
+// Same contract as TraverseBvh, except that leafFn(uint32_t firstItem, uint32_t itemCount) is
+// called with item ranges instead of binary leaves.
+template<typename LeafFn>
+void TraverseCompressedBvh(std::span<const CompressedBvhNode> nodes, const Float3& origin,
+                           const Float3& invDir, float tMin, const float* tMax, LeafFn&& leafFn) {
+  TraverseCompressedBvhImpl<true>(nodes, origin, invDir, tMin, tMax, leafFn);
+}
+
+// Any-hit version: children are visited in slot order and tMax is fixed.
+template<typename LeafFn>
+void TraverseCompressedBvhAny(std::span<const CompressedBvhNode> nodes, const Float3& origin,
+                              const Float3& invDir, float tMin, float tMax, LeafFn&& leafFn) {
+  TraverseCompressedBvhImpl<false>(nodes, origin, invDir, tMin, &tMax, leafFn);
+}
+
+} // namespace cpu_rt
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "cpu_rt/math.h"
+
+namespace cpu_rt {
+
+enum class EnvironmentSamplingType {
+  // Directions uniformly over the sphere, whatever the image holds.
+  Uniform,
+
+  // Directions in proportion to the radiance of the image, weighed by the solid angle of its
+  // pixels.
+  Importance
+};
+
+// Light from infinitely far away in every direction, looked up in an equirectangular image. The
+// top row is +y, and u runs around y from +x towards +z, like SphericalDirection's phi. Each
+// pixel is constant over its rectangle in (u, v), which the sampling distribution matches
+// exactly.
+class EnvironmentLight {
+public:
+  // rgb holds three floats per pixel, row-major from the top row. Builds the sampling
+  // distribution, one row per task.
+  EnvironmentLight(uint32_t width, uint32_t height, std::span<const float> rgb);
+
+  uint32_t GetWidth() const { return m_width; }
+  uint32_t GetHeight() const { return m_height; }
+
+  // The radiance of the pixels, row-major from the top row.
+  std::span<const Float3> GetPixels() const { return m_radiance; }
+
+  Float3 GetRadiance(const Float3& wi) const;
+
+  // Samples a direction from u and v in [0, 1). pdf is in solid angle, and 0 if the image is
+  // black.
+  Float3 Sample(EnvironmentSamplingType type, float u, float v, float* pdf) const;
+
+  // The pdf in solid angle with which Sample returns wi.
+  float GetPdf(EnvironmentSamplingType type, const Float3& wi) const;
+
+  size_t GetMemoryUsage() const;
+
+private:
+  // The importance of pixel (x, y): its luminance times the sine of its row's polar angle, to
+  // which the solid angle of its rectangle is proportional.
+  float GetImportance(uint32_t x, uint32_t y) const;
+
+  uint32_t m_width;
+  uint32_t m_height;
+
+  std::vector<Float3> m_radiance;
+
+  // The piecewise-constant 2D distribution over (u, v): the CDF over rows of their summed
+  // importance, then for each row the CDF over its pixels, width + 1 entries per row.
+  std::vector<float> m_marginalCdf;
+  std::vector<float> m_conditionalCdfs;
+
+  // The integral of the importance over [0, 1)^2.
+  float m_importanceIntegral = 0.f;
+};
+
+} // namespace cpu_rt
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <future>
+#include <utility>
+#include <vector>
+
+namespace cpu_rt {
+
+// The samples a pixel has accumulated over its Render calls. Sum adds up their radiance in
+// double, so that the film stays exact to float precision however many samples it takes, where
+// re-averaging a float film each call drifts. Count, Mean and M2 are a Welford accumulator over
+// the luminance of the calls, each the mean of the samples that call added. Batch means rather
+// than single paths credit the low-discrepancy samplers for the stratification within each batch.
+struct FilmPixel {
+  double Sum[3];
+  uint32_t Count;
+  float Mean;
+  float M2;
+};
+
+// Everything a PathTracer needs to carry on with a render where it left off. Key identifies the
+// scene and settings it was taken with.
+struct FilmCheckpoint {
+  uint64_t Key;
+  uint32_t Width;
+  uint32_t Height;
+  uint32_t SampleCount;
+  uint64_t RayCount;
+  std::vector<FilmPixel> Pixels;
+  std::vector<uint32_t> ActivePixels;
+};
+
+// Writes the checkpoint with an AtomicFileWriter, so that path holds either the last checkpoint
+// or the one before, never part of one, even after a crash of the machine. Throws
+// std::runtime_error on failure.
+void SaveFilmCheckpoint(const std::filesystem::path& path, const FilmCheckpoint& checkpoint);
+
+// Reads a checkpoint written by SaveFilmCheckpoint. Returns false if the file is missing,
+// truncated or corrupt.
+bool LoadFilmCheckpoint(const std::filesystem::path& path, FilmCheckpoint* checkpoint);
+
+// Saves checkpoints on a thread of its own, so that a render only stops to copy its film. A new
+// checkpoint waits until the last one is written, so that one is in flight at most and the
+// copies cost no more than a copy per write.
+class FilmCheckpointWriter {
+public:
+  explicit FilmCheckpointWriter(std::filesystem::path path) : m_path(std::move(path)) {}
+
+  FilmCheckpointWriter(const FilmCheckpointWriter&) = delete;
+  FilmCheckpointWriter& operator=(const FilmCheckpointWriter&) = delete;
+
+  // Waits for the checkpoint in flight, if any.
+  ~FilmCheckpointWriter();
+
+  // The checkpoint to fill in for the next write, or nullptr while the last one is still being
+  // written. Rethrows the error of the last write if it failed.
+  FilmCheckpoint* GetNextCheckpoint();
+
+  // Starts writing the checkpoint that GetNextCheckpoint returned.
+  void StartWrite();
+
+  // Waits for the checkpoint in flight, if any, and rethrows its error.
+  void Wait();
+
+private:
+  std::filesystem::path m_path;
+  FilmCheckpoint m_checkpoint{};
+  std::future<void> m_write;
+};
+
+} // namespace cpu_rt
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace cpu_rt {
+
+// Streaming 64-bit hash for cache keys and checksums. Not meant to resist deliberate
+// collisions.
+class Hasher {
+public:
+  void Update(const void* data, size_t size) {
+    auto bytes = static_cast<const uint8_t*>(data);
+
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+      uint64_t word;
+      memcpy(&word, bytes + i, sizeof(word));
+      MixWord(word);
+    }
+
+    if (i < size) {
+      uint64_t word = 0;
+      memcpy(&word, bytes + i, size - i);
+      MixWord(word);
+    }
+
+    m_length += size;
+  }
+
+  template<typename T>
+  void UpdateValue(const T& value) {
+    Update(&value, sizeof(value));
+  }
+
+  // MurmurHash3's finalizer.
+  uint64_t Finish() const {
+    uint64_t h = m_state ^ m_length;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccd;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53;
+    h ^= h >> 33;
+    return h;
+  }
+
+private:
+  void MixWord(uint64_t word) {
+    word *= 0x87c37b91114253d5;
+    word = std::rotl(word, 31);
+    word *= 0x4cf5ad432745937f;
+
+    m_state ^= word;
+    m_state = std::rotl(m_state, 27) * 5 + 0x52dce729;
+  }
+
+  uint64_t m_state = 0x9e3779b97f4a7c15;
+  uint64_t m_length = 0;
+};
+
+} // namespace cpu_rt
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "cpu_rt/aabb.h"
+#include "cpu_rt/area_light.h"
+#include "cpu_rt/math.h"
+
+namespace cpu_rt {
+
+enum class LightSamplerType {
+  // Every light is equally likely.
+  Uniform,
+
+  // Lights in proportion to their power, wherever the shading point is.
+  Power,
+
+  // Down a BVH over the lights, towards the ones that can give the shading point the most light
+  // (Conty Estevez and Kulla 2018, as in pbrt-v4's BVHLightSampler).
+  Bvh
+};
+
+// Walker's alias method: draws index i with probability Weights[i] / sum(Weights) in constant
+// time.
+class AliasTable {
+public:
+  AliasTable() = default;
+  explicit AliasTable(std::span<const float> weights);
+
+  // u is uniform in [0, 1).
+  uint32_t Sample(float u, float* pmf) const;
+
+  float GetPmf(uint32_t index) const { return m_bins[index].Pmf; }
+
+  uint32_t GetSize() const { return static_cast<uint32_t>(m_bins.size()); }
+
+private:
+  struct Bin {
+    // Chance of keeping the bin's own index rather than its alias.
+    float Probability;
+    uint32_t Alias;
+    float Pmf;
+  };
+
+  std::vector<Bin> m_bins;
+};
+
+// What a set of lights can emit towards a point: where they are, the cone of their normals, how
+// far past it they emit and their summed power.
+struct LightBounds {
+  Aabb Bounds;
+
+  // The normals lie within acos(CosThetaO) of Axis, and light leaves at most acos(CosThetaE)
+  // beyond the normals.
+  Float3 Axis;
+  float CosThetaO;
+  float CosThetaE;
+
+  float Power;
+  bool TwoSided;
+
+  // A conservative estimate of the light reaching point p of a surface with normal n. 0 only if
+  // none of the lights can light it.
+  float GetImportance(const Float3& p, const Float3& n) const;
+};
+
+LightBounds GetLightBounds(const AreaLight& light);
+
+LightBounds UnionLightBounds(const LightBounds& a, const LightBounds& b);
+
+// Picks the light a shading point samples. The Bvh type takes O(log N) importance evaluations
+// per pick, the others O(1). An environment light comes after the area lights, with an index of
+// lights.size(). Uniform picks it like any other light, while Power and Bvh, which cannot weigh
+// it against the area lights, pick it half of the time like pbrt-v4's BVHLightSampler does.
+class LightSampler {
+public:
+  LightSampler(std::span<const AreaLight> lights, LightSamplerType type,
+               bool hasEnvironmentLight = false);
+
+  // The area lights and the environment light, if any.
+  uint32_t GetLightCount() const { return m_lightCount + (m_environmentPmf > 0.f ? 1 : 0); }
+
+  // Picks a light for point p with normal n from u in [0, 1). False if no light can reach p.
+  bool Sample(const Float3& p, const Float3& n, float u, uint32_t* light, float* pmf) const;
+
+  // The probability that Sample picks the light for p and n.
+  float GetPmf(const Float3& p, const Float3& n, uint32_t light) const;
+
+private:
+  bool SampleAreaLight(const Float3& p, const Float3& n, float u, uint32_t* light,
+                       float* pmf) const;
+
+  float GetAreaLightPmf(const Float3& p, const Float3& n, uint32_t light) const;
+
+  // Interior nodes are followed by their first child and point to their second.
+  struct Node {
+    LightBounds Bounds;
+    uint32_t ChildOrLightIndex;
+    bool IsLeaf;
+  };
+
+  uint32_t BuildBvh(std::span<const LightBounds> lightBounds, std::span<uint32_t> lightIndices,
+                    uint64_t bitTrail, uint32_t depth);
+
+  LightSamplerType m_type;
+
+  // Area lights only.
+  uint32_t m_lightCount;
+
+  // The chance of picking the environment light, 0 without one.
+  float m_environmentPmf = 0.f;
+
+  AliasTable m_powerTable;
+
+  std::vector<Node> m_nodes;
+
+  // The path from the root to each light's leaf, one bit per level with 1 for the second child.
+  // Lights without power are left out of the BVH.
+  std::vector<uint64_t> m_bitTrails;
+};
+
+} // namespace cpu_rt
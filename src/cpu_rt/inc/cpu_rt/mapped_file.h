@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <span>
+
+namespace cpu_rt {
+
+// Read-only memory mapping of a whole file.
+class MappedFile {
+public:
+  // Returns nullptr if the file does not exist, is empty or cannot be mapped.
+  static std::unique_ptr<MappedFile> Open(const std::filesystem::path& path);
+
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  std::span<const uint8_t> GetData() const { return {m_data, m_size}; }
+
+private:
+  MappedFile(const uint8_t* data, size_t size) : m_data(data), m_size(size) {}
+
+  const uint8_t* m_data;
+  size_t m_size;
+};
+
+} // namespace cpu_rt
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+namespace cpu_rt {
+
+struct Float3 {
+  float x;
+  float y;
+  float z;
+
+  float operator[](int axis) const { return axis == 0 ? x : (axis == 1 ? y : z); }
+};
+
+inline Float3 operator+(const Float3& a, const Float3& b) {
+  return Float3{a.x + b.x, a.y + b.y, a.z + b.z};
+}
+
+inline Float3 operator-(const Float3& a, const Float3& b) {
+  return Float3{a.x - b.x, a.y - b.y, a.z - b.z};
+}
+
+inline Float3 operator-(const Float3& a) {
+  return Float3{-a.x, -a.y, -a.z};
+}
+
+inline Float3 operator*(const Float3& a, const Float3& b) {
+  return Float3{a.x * b.x, a.y * b.y, a.z * b.z};
+}
+
+inline Float3 operator*(const Float3& a, float s) {
+  return Float3{a.x * s, a.y * s, a.z * s};
+}
+
+inline Float3 operator*(float s, const Float3& a) {
+  return a * s;
+}
+
+inline Float3 operator/(const Float3& a, float s) {
+  return a * (1.f / s);
+}
+
+inline Float3& operator+=(Float3& a, const Float3& b) {
+  a = a + b;
+  return a;
+}
+
+inline Float3& operator*=(Float3& a, const Float3& b) {
+  a = a * b;
+  return a;
+}
+
+inline float Dot(const Float3& a, const Float3& b) {
+  return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline Float3 Cross(const Float3& a, const Float3& b) {
+  return Float3{a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
+}
+
+inline float Length(const Float3& a) {
+  return std::sqrt(Dot(a, a));
+}
+
+inline Float3 Normalize(const Float3& a) {
+  return a / Length(a);
+}
+
+inline Float3 Min(const Float3& a, const Float3& b) {
+  return Float3{std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z)};
+}
+
+inline Float3 Max(const Float3& a, const Float3& b) {
+  return Float3{std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z)};
+}
+
+// Row-major affine transform with the translation in the last column. Same layout as
+// D3D12_RAYTRACING_INSTANCE_DESC::Transform and the geometry Transform3x4.
+struct Matrix3x4 {
+  float m[3][4];
+};
+
+inline Matrix3x4 Identity3x4() {
+  return Matrix3x4{{{1.f, 0.f, 0.f, 0.f}, {0.f, 1.f, 0.f, 0.f}, {0.f, 0.f, 1.f, 0.f}}};
+}
+
+inline Float3 TransformPoint(const Matrix3x4& mat, const Float3& p) {
+  return Float3{mat.m[0][0] * p.x + mat.m[0][1] * p.y + mat.m[0][2] * p.z + mat.m[0][3],
+                mat.m[1][0] * p.x + mat.m[1][1] * p.y + mat.m[1][2] * p.z + mat.m[1][3],
+                mat.m[2][0] * p.x + mat.m[2][1] * p.y + mat.m[2][2] * p.z + mat.m[2][3]};
+}
+
+inline Float3 TransformVector(const Matrix3x4& mat, const Float3& v) {
+  return Float3{mat.m[0][0] * v.x + mat.m[0][1] * v.y + mat.m[0][2] * v.z,
+                mat.m[1][0] * v.x + mat.m[1][1] * v.y + mat.m[1][2] * v.z,
+                mat.m[2][0] * v.x + mat.m[2][1] * v.y + mat.m[2][2] * v.z};
+}
+
+// Inverse of an affine transform. The 3x3 part must be invertible.
+inline Matrix3x4 Inverse(const Matrix3x4& mat) {
+  const float (&m)[3][4] = mat.m;
+
+  float c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+  float c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+  float c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+
+  float invDet = 1.f / (m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02);
+
+  Matrix3x4 inv{};
+  inv.m[0][0] = c00 * invDet;
+  inv.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * invDet;
+  inv.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * invDet;
+  inv.m[1][0] = c01 * invDet;
+  inv.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * invDet;
+  inv.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * invDet;
+  inv.m[2][0] = c02 * invDet;
+  inv.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * invDet;
+  inv.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * invDet;
+
+  Float3 t = TransformVector(inv, Float3{m[0][3], m[1][3], m[2][3]});
+  inv.m[0][3] = -t.x;
+  inv.m[1][3] = -t.y;
+  inv.m[2][3] = -t.z;
+
+  return inv;
+}
+
+} // namespace cpu_rt
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+namespace cpu_rt {
+
+// Calls fn(begin, end) on contiguous chunks of [0, count) from all hardware threads: the calling
+// thread and a pool of workers that wait between calls, since the renderers make several calls
+// per bounce. Items that take long each, such as image rows, want a smaller chunkSize to spread
+// over the threads. Calls from other threads wait their turn, and calls from within fn run on
+// the thread that makes them. Rethrows the first exception that fn throws, once every chunk
+// has run or been skipped.
+void ParallelFor(size_t count, const std::function<void(size_t, size_t)>& fn,
+                 size_t chunkSize = 4096);
+
+} // namespace cpu_rt
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "cpu_rt/aabb.h"
+#include "cpu_rt/math.h"
+
+namespace cpu_rt {
+
+struct PathGuideSettings {
+  // Share of the bounce rays of a guided hit that sample its BSDF rather than the guide.
+  float BsdfSamplingFraction = 0.5f;
+
+  // A spatial leaf splits once an iteration records more than this times the square root of
+  // the iteration's samples per pixel in it (c in the paper).
+  float SpatialThreshold = 12000.f;
+
+  // A directional node splits while it holds more than this share of the leaf's radiance (rho
+  // in the paper).
+  float DirectionalThreshold = 0.01f;
+  uint32_t MaxDirectionalDepth = 20;
+};
+
+struct PathGuideStats {
+  // Iterations the guide has learned from. Iteration k spans 2^k frames.
+  uint32_t Iteration;
+
+  uint32_t LeafCount;
+
+  // Mean over the leaves of the nodes of their directional trees.
+  float DirectionalNodeCount;
+};
+
+// A bounce ray that the guide learns from: the leaf of its origin, its direction and pdf, and
+// what the rest of its path finds. Radiance is the luminance of the radiance arriving along the
+// ray in fixed point, so that its sum does not depend on the order the contributions come in.
+struct PathGuideVertex {
+  uint32_t Leaf;
+  Float3 Direction;
+  float Pdf;
+
+  // Turns light that the path gathers past the bounce into radiance arriving along it.
+  Float3 InverseThroughput;
+
+  uint64_t Radiance;
+};
+
+// Practical path guiding (Muller et al., "Practical Path Guiding for Efficient Light-Transport
+// Simulation", 2017). A binary tree splits the scene bounds in half along x, y and z in turn,
+// and each of its leaves holds a quadtree over the sphere of directions, mapped to a square by
+// cosine of the polar angle and azimuth, whose nodes sum the radiance that arrived through them.
+// Bounce rays sample the quadtree of the last iteration in proportion to its radiance.
+//
+// The trees keep their shape for a whole iteration. Threads record into the quadtrees being
+// built with atomic adds of fixed-point sums, which need no locks, and give the same trees for
+// any order of the records. EndFrame refines both trees between iterations, each twice as long
+// as the last, so that the guide improves on fewer but better samples.
+class PathGuide {
+public:
+  explicit PathGuide(const Aabb& sceneBounds, const PathGuideSettings& settings = {});
+
+  uint32_t GetLeaf(const Float3& p) const;
+
+  // Whether the leaf has a distribution to sample, i.e. learned any radiance last iteration.
+  bool CanSample(uint32_t leaf) const;
+
+  Float3 Sample(uint32_t leaf, float u, float v) const;
+
+  // Pdf in solid angle of Sample returning the direction.
+  float GetPdf(uint32_t leaf, const Float3& direction) const;
+
+  // Adds a contribution that the path of the vertex gathered past it. Not thread-safe for one
+  // vertex, which belongs to a single path.
+  static void AddRadiance(PathGuideVertex* vertex, const Float3& contribution);
+
+  // Adds the vertex to the quadtree being built in its leaf. Thread-safe.
+  void Record(const PathGuideVertex& vertex);
+
+  // Ends a frame that traced samplesPerPixel paths per pixel, and the iteration if it has
+  // taken its share of frames. Not thread-safe with the other methods.
+  void EndFrame(uint32_t samplesPerPixel);
+
+  // As of the last iteration.
+  const PathGuideStats& GetStats() const { return m_stats; }
+
+  size_t GetMemoryUsage() const;
+
+private:
+  // Each Sum is the fixed-point radiance of a quadrant, and each child the node that splits it,
+  // 0 if none. Sampling trees also keep each quadrant's share of the node's radiance, a fourth
+  // each if it has none, so that sampling and pdfs need no divisions.
+  struct QuadNode {
+    uint64_t Sum[4];
+    uint32_t Children[4];
+    float Share[4];
+  };
+
+  using QuadTree = std::vector<QuadNode>;
+
+  // Children[0] is 0 for a leaf, whose data is m_leaves[Leaf].
+  struct SpatialNode {
+    uint32_t Children[2];
+    uint32_t Leaf;
+  };
+
+  struct Leaf {
+    QuadTree Sampling;
+    QuadTree Building;
+
+    // Vertices recorded this iteration.
+    uint32_t SampleCount;
+  };
+
+  void SplitSpatialNode(uint32_t node, uint32_t depth, float threshold);
+  QuadTree RefineQuadTree(const QuadTree& tree) const;
+
+  Float3 m_origin;
+  float m_size;
+  PathGuideSettings m_settings;
+
+  std::vector<SpatialNode> m_nodes;
+  std::vector<Leaf> m_leaves;
+
+  uint32_t m_iteration = 0;
+  uint32_t m_iterationFrames = 0;
+  uint32_t m_iterationSamples = 0;
+
+  PathGuideStats m_stats{};
+};
+
+} // namespace cpu_rt
@@ -0,0 +1,286 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "cpu_rt/environment_light.h"
+#include "cpu_rt/film_checkpoint.h"
+#include "cpu_rt/light_sampler.h"
+#include "cpu_rt/math.h"
+#include "cpu_rt/path_guide.h"
+#include "cpu_rt/radiance_cache.h"
+#include "cpu_rt/ray.h"
+#include "cpu_rt/render_scene.h"
+#include "cpu_rt/sampler.h"
+#include "cpu_rt/shading.h"
+
+namespace cpu_rt {
+
+// RayGenShader averages this many jittered camera rays per pixel.
+inline constexpr uint32_t k_cameraRaysPerPixel = 4;
+
+// Same defaults as App, except that App only has the Random sampler and no Russian roulette.
+struct PathTracerSettings {
+  // The most bounces a path takes, whatever Russian roulette decides.
+  uint32_t NumBounces = 8;
+
+  // Bounce rays from hits at this depth on go through Russian roulette. NumBounces or more turns
+  // it off.
+  uint32_t MinRouletteBounces = 3;
+
+  // Paths traced per camera ray in each Render call, like SampleConstants::SampleIncrement.
+  uint32_t SampleIncrement = 10;
+
+  SamplerType Sampler = SamplerType::Sobol;
+
+  // How light samples pick one of the scene's lights. App only has the quad light, which every
+  // type picks alike.
+  LightSamplerType LightSampler = LightSamplerType::Bvh;
+
+  // How light samples pick a direction of the scene's environment light, if it has one.
+  EnvironmentSamplingType EnvironmentSampling = EnvironmentSamplingType::Importance;
+
+  // Pixels stop receiving samples once the standard error of their luminance falls below this
+  // fraction of the luminance. 0 samples every pixel in every Render call, like App does.
+  float AdaptiveThreshold = 0.f;
+
+  // Render calls a pixel takes part in before adaptive sampling may stop it, so that its error
+  // estimate has enough batches behind it.
+  uint32_t MinAdaptiveBatches = 4;
+
+  // Whether paths end in a RadianceCache at diffuse hits after RadianceCache.TerminationBounce
+  // bounces, which trades the bias of the cache for much shorter paths. Each Render call is a
+  // frame of the cache.
+  bool UseRadianceCache = false;
+  RadianceCacheSettings RadianceCache;
+
+  // Whether bounce rays from hits on materials with a diffuse lobe sample a PathGuide that learns
+  // from the paths of earlier Render calls as well as the BSDF. Each Render call is a frame of
+  // the guide.
+  bool UsePathGuide = false;
+  PathGuideSettings PathGuide;
+
+  // Whether the wavefront mode traces the rays of each bounce in the order of their Morton keys
+  // rather than in the order the paths were shaded.
+  bool SortRays = true;
+};
+
+enum class PathTracerMode {
+  // One task per pixel follows each path to its end, recursing at every bounce like
+  // ClosestHitShader does.
+  Megakernel,
+
+  // The paths of a wave advance one bounce at a time through separate extend, shade and connect
+  // stages, each of which runs over every path of the wave before the next starts. Shading is
+  // sorted by material so each stage works through similar hits together.
+  Wavefront
+};
+
+// CPU port of the raytracing sample's shaders. Both modes trace the same paths with the same
+// samples, so their films only differ by the order in which path radiance is summed.
+class PathTracer {
+public:
+  PathTracer(const RenderScene& scene, uint32_t width, uint32_t height,
+             const PathTracerSettings& settings = {});
+
+  // Traces SampleIncrement more samples for each active pixel and adds them to the film, like one
+  // dispatch of RayGenShader. Then stops the pixels that have converged.
+  void Render(PathTracerMode mode);
+
+  uint32_t GetWidth() const { return m_width; }
+  uint32_t GetHeight() const { return m_height; }
+
+  // Samples accumulated so far by the active pixels, i.e. SampleConstants::CurrentSample of the
+  // next dispatch.
+  uint32_t GetSampleCount() const { return m_sampleCount; }
+
+  // Row-major indices of the pixels that the next Render call samples.
+  std::span<const uint32_t> GetActivePixels() const { return m_activePixels; }
+
+  // Samples accumulated so far by a pixel, which falls behind GetSampleCount once the pixel stops.
+  uint32_t GetPixelSampleCount(uint32_t pixel) const {
+    return m_pixels[pixel].Count * m_settings.SampleIncrement;
+  }
+
+  // The estimated standard error of the pixel's luminance, relative to the luminance.
+  float GetPixelError(uint32_t pixel) const;
+
+  // Row-major radiance, averaged over the samples so far.
+  std::span<const Float3> GetFilm() const { return m_film; }
+
+  // Camera and bounce rays traced so far, i.e. the summed length of the paths. Shadow rays are
+  // not counted.
+  uint64_t GetRayCount() const { return m_rayCount; }
+
+  // Copies the state of the render into checkpoint, reusing its storage.
+  void GetCheckpoint(FilmCheckpoint* checkpoint) const;
+
+  // Carries on from a checkpoint of a PathTracer with the same scene, size and settings, so that
+  // the next Render calls trace the same samples they would have without the break. The radiance
+  // cache and path guide are not part of the checkpoint and start over. Returns false if the
+  // checkpoint came from another scene, size or settings.
+  bool Resume(const FilmCheckpoint& checkpoint);
+
+  // nullptr unless UseRadianceCache is set.
+  const RadianceCache* GetRadianceCache() const { return m_radianceCache.get(); }
+
+  // nullptr unless UsePathGuide is set.
+  const PathGuide* GetPathGuide() const { return m_pathGuide.get(); }
+
+private:
+  // Where a path draws its samples from: the XorShift state of the Random sampler, or the pixel
+  // and sample index of the low-discrepancy ones. The pixel stands in for DispatchRaysIndex().
+  struct PathSample {
+    uint32_t RngState;
+    uint32_t PixelX;
+    uint32_t PixelY;
+    uint32_t SampleIndex;
+  };
+
+  struct RayPayload {
+    Float3 L;
+    Float3 Throughput;
+
+    // The pdf the bounce ray was sampled with and the shading normal at its origin, which
+    // weigh the light it hits.
+    float BsdfPdf;
+    Float3 BsdfNormal;
+
+    uint32_t Bounces;
+    PathSample Sample;
+
+    // The cache cell of the hit the ray was bounced from, k_invalidIndex if none, and the
+    // factor that turns the radiance the ray finds into radiance reflected at that hit.
+    uint32_t CacheCell;
+    Float3 CacheWeight;
+
+    // With a path guide, the path's guide vertices by the bounce they leave from.
+    PathGuideVertex* GuideVertices;
+  };
+
+  // What ClosestHitShader computes at a mesh hit before it traces its rays.
+  struct HitShading {
+    // Whether a bounce ray is traced, and the payload it gets.
+    bool Continue;
+    Ray BounceRay;
+    Float3 BounceThroughput;
+    float BouncePdf;
+    Float3 BounceNormal;
+
+    // Whether a light was sampled, the ray towards the sample and the instances that can block
+    // it, and the radiance it adds if nothing does.
+    bool HasLightSample;
+    Ray ShadowRay;
+    uint32_t ShadowRayMask;
+    Float3 LightContribution;
+
+    // With a radiance cache, the cell of the hit's sample, k_invalidIndex if it takes none, and
+    // what the bounce ray and the light sample add to it per unit of the radiance they carry.
+    // CachedRadiance is the resolved radiance of the hit's cell, 0 if it is not valid, and
+    // EndsInCache whether the path ends in it rather than tracing any more rays.
+    uint32_t CacheCell;
+    Float3 BounceCacheWeight;
+    Float3 LightCacheRadiance;
+    Float3 CachedRadiance;
+    bool EndsInCache;
+
+    // With a path guide, the leaf that the bounce ray is recorded in, k_invalidIndex if it is
+    // not.
+    uint32_t GuideLeaf;
+  };
+
+  struct Wavefront;
+
+  // Identifies the scene, size and settings, which a checkpoint must match to resume from.
+  uint64_t GetCheckpointKey() const;
+
+  // Sets the pixel's film value to the mean of its samples.
+  void UpdateFilm(uint32_t pixel);
+
+  // The sample of path j of camera ray cameraRay of a pixel in this Render call.
+  PathSample GetPathSample(uint32_t x, uint32_t y, uint32_t cameraRay, uint32_t j) const;
+
+  void GetSample2D(PathSample* sample, uint32_t dimension, float* u, float* v) const;
+
+  // The camera ray of a path. Random shares one jitter between the paths of a camera ray, the
+  // low-discrepancy samplers draw one per path.
+  Ray GetCameraRay(uint32_t x, uint32_t y, float jitterX, float jitterY) const;
+
+  // Classifies the hit's material and runs the ShadeHit specialized for its class.
+  HitShading ShadeHit(const Ray& ray, const HitInfo& hit, const Float3& throughput,
+                      uint32_t bounces, PathSample sample) const;
+
+  template<MaterialClass materialClass>
+  HitShading ShadeHit(const Ray& ray, const HitInfo& hit, const ShadingMaterial& material,
+                      const Float3& throughput, uint32_t bounces, PathSample sample) const;
+
+  // The MIS-weighted radiance a ray finds when it hits light at distance t, which its path adds
+  // times its throughput. LightClosestHitShader has no MIS and only lets camera rays see the
+  // quad. bsdfPdf and bsdfNormal are those of the payload.
+  Float3 GetLightHitRadiance(uint32_t light, const Ray& ray, float t, uint32_t bounces,
+                             float bsdfPdf, const Float3& bsdfNormal) const;
+
+  // The same for a ray that leaves the scene, like LightRayMissShader, which has no environment
+  // light and returns black.
+  Float3 GetMissRadiance(const Ray& ray, uint32_t bounces, float bsdfPdf,
+                         const Float3& bsdfNormal) const;
+
+  // Whether the path is one of those that trace on past valid cache cells to keep them updated.
+  bool IsTrainingPath(const PathSample& sample) const;
+
+  // Adds radiance that reached a hit to the sample of its cache cell, if it has one.
+  void AddCacheRadiance(uint32_t cell, const Float3& radiance) const;
+
+  // Adds radiance that a path gathered at the given bounce to its guide vertices before it.
+  void AddGuideRadiance(PathGuideVertex* vertices, uint32_t bounces,
+                        const Float3& contribution) const;
+
+  // The guide vertex of a bounce ray.
+  PathGuideVertex GetGuideVertex(const HitShading& shading) const;
+
+  bool IsOccluded(const Ray& shadowRay, uint32_t instanceMask) const;
+
+  // Returns the number of rays traced along the path.
+  uint32_t TracePath(const Ray& ray, RayPayload* payload) const;
+
+  void RenderMegakernel();
+  void RenderWavefront();
+
+  void GeneratePaths(uint32_t activeBegin, uint32_t activeEnd, Wavefront* wavefront) const;
+  void SortPathsByRay(Wavefront* wavefront) const;
+  void ExtendPaths(Wavefront* wavefront) const;
+  void SortPathsByMaterial(Wavefront* wavefront) const;
+  void ShadePaths(Wavefront* wavefront) const;
+  void ConnectPaths(Wavefront* wavefront) const;
+  void RecordGuideVertices(const Wavefront& wavefront, uint32_t pathCount) const;
+
+  const RenderScene& m_scene;
+  uint32_t m_width;
+  uint32_t m_height;
+  PathTracerSettings m_settings;
+
+  LightSampler m_lightSampler;
+
+  std::unique_ptr<RadianceCache> m_radianceCache;
+  std::unique_ptr<PathGuide> m_pathGuide;
+
+  uint32_t m_sampleCount = 0;
+
+  // The mean of each pixel's Sum, as of the last Render call.
+  std::vector<Float3> m_film;
+
+  uint64_t m_rayCount = 0;
+
+  // Radiance of the current Render call, averaged over the screen samples of each pixel.
+  std::vector<Float3> m_sampleL;
+
+  std::vector<FilmPixel> m_pixels;
+
+  // The pixels that have not converged, in row-major order so that each wave and ParallelFor
+  // chunk covers nearby pixels.
+  std::vector<uint32_t> m_activePixels;
+};
+
+} // namespace cpu_rt
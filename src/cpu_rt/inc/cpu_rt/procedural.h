@@ -0,0 +1,251 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "cpu_rt/aabb.h"
+#include "cpu_rt/math.h"
+#include "cpu_rt/ray.h"
+
+namespace cpu_rt {
+
+// What an intersection shader passes to ReportHit.
+struct ProceduralHit {
+  float T = 0.f;
+  Float3 Normal{};
+  uint8_t HitKind = 0;
+};
+
+// The system values an intersection shader can read, besides the object space ray.
+struct ProceduralPrimitiveContext {
+  uint32_t InstanceIndex;
+  uint32_t InstanceID;
+  uint32_t GeometryIndex;
+  uint32_t PrimitiveIndex;
+  uint32_t HitGroupIndex;
+};
+
+// Built-in analytic shapes. All of them are two-sided, like QuadIntersectShader.
+
+// Rectangle spanning Center +/- AxisU +/- AxisV. The axes must be perpendicular and the normal
+// is Cross(AxisU, AxisV).
+struct QuadShape {
+  Float3 Center;
+  Float3 AxisU;
+  Float3 AxisV;
+
+  Aabb GetBounds() const;
+  bool Intersect(const Ray& ray, float tMin, float tMax, ProceduralHit* hit) const;
+};
+
+struct SphereShape {
+  Float3 Center;
+  float Radius;
+
+  Aabb GetBounds() const;
+  bool Intersect(const Ray& ray, float tMin, float tMax, ProceduralHit* hit) const;
+};
+
+struct DiskShape {
+  Float3 Center;
+  Float3 Normal;
+  float Radius;
+
+  Aabb GetBounds() const;
+  bool Intersect(const Ray& ray, float tMin, float tMax, ProceduralHit* hit) const;
+};
+
+// Intersection function for a procedural geometry made of one Shape per AABB, indexed by
+// PrimitiveIndex.
+template<typename Shape>
+class ShapeIntersector {
+public:
+  ShapeIntersector() = default;
+  explicit ShapeIntersector(std::vector<Shape> shapes) : m_shapes(std::move(shapes)) {}
+
+  // AABBs to build the geometry's Blas from, in primitive order.
+  std::vector<Aabb> GetAabbs() const {
+    std::vector<Aabb> aabbs;
+    aabbs.reserve(m_shapes.size());
+
+    for (const Shape& shape : m_shapes) {
+      aabbs.push_back(shape.GetBounds());
+    }
+    return aabbs;
+  }
+
+  bool operator()(const ProceduralPrimitiveContext& ctx, const Ray& ray, float tMin, float tMax,
+                  ProceduralHit* hit) const {
+    return m_shapes[ctx.PrimitiveIndex].Intersect(ray, tMin, tMax, hit);
+  }
+
+private:
+  std::vector<Shape> m_shapes;
+};
+
+using QuadIntersector = ShapeIntersector<QuadShape>;
+using SphereIntersector = ShapeIntersector<SphereShape>;
+using DiskIntersector = ShapeIntersector<DiskShape>;
+
+// Maps hit group indices to intersection functions, the CPU equivalent of putting an
+// intersection shader in a procedural hit group. The function types are template parameters so
+// the call in the traversal loop is resolved at compile time instead of through a vtable. Any
+// callable with the ShapeIntersector::operator() signature can be registered.
+template<typename... Intersectors>
+class IntersectionTable {
+public:
+  IntersectionTable() = default;
+  explicit IntersectionTable(Intersectors... intersectors)
+    requires (sizeof...(Intersectors) > 0)
+    : m_intersectors(std::move(intersectors)...) {}
+
+  template<size_t I>
+  void SetHitGroupIntersector(uint32_t hitGroupIndex) {
+    static_assert(I < sizeof...(Intersectors));
+
+    if (hitGroupIndex >= m_hitGroupIntersectors.size())
+      m_hitGroupIntersectors.resize(hitGroupIndex + 1, k_invalidIndex);
+
+    m_hitGroupIntersectors[hitGroupIndex] = static_cast<uint32_t>(I);
+  }
+
+  template<size_t I>
+  const auto& GetIntersector() const { return std::get<I>(m_intersectors); }
+
+  bool Intersect(const ProceduralPrimitiveContext& ctx, const Ray& ray, float tMin, float tMax,
+                 ProceduralHit* hit) const {
+    if (ctx.HitGroupIndex >= m_hitGroupIntersectors.size())
+      return false;
+
+    return Dispatch(std::index_sequence_for<Intersectors...>{},
+                    m_hitGroupIntersectors[ctx.HitGroupIndex], ctx, ray, tMin, tMax, hit);
+  }
+
+private:
+  template<size_t... Is>
+  bool Dispatch(std::index_sequence<Is...>, uint32_t index, const ProceduralPrimitiveContext& ctx,
+                const Ray& ray, float tMin, float tMax, ProceduralHit* hit) const {
+    bool result = false;
+    ((index == Is && (result = std::get<Is>(m_intersectors)(ctx, ray, tMin, tMax, hit), true)) ||
+     ...);
+    return result;
+  }
+
+  bool Dispatch(std::index_sequence<>, uint32_t, const ProceduralPrimitiveContext&, const Ray&,
+                float, float, ProceduralHit*) const {
+    return false;
+  }
+
+  std::tuple<Intersectors...> m_intersectors;
+  std::vector<uint32_t> m_hitGroupIntersectors;
+};
+
+// For scenes without procedural geometry.
+using EmptyIntersectionTable = IntersectionTable<>;
+
+// Flat shapes get a little thickness so their bounds never have a zero-width slab.
+inline Aabb PadFlatBounds(Aabb bounds) {
+  Float3 extent = bounds.Extent();
+  float pad = 1e-4f * std::max({extent.x, extent.y, extent.z, 1e-3f});
+
+  bounds.Min = bounds.Min - Float3{pad, pad, pad};
+  bounds.Max = bounds.Max + Float3{pad, pad, pad};
+  return bounds;
+}
+
+inline Aabb QuadShape::GetBounds() const {
+  Aabb bounds = Aabb::Empty();
+  bounds.Grow(Center - AxisU - AxisV);
+  bounds.Grow(Center - AxisU + AxisV);
+  bounds.Grow(Center + AxisU - AxisV);
+  bounds.Grow(Center + AxisU + AxisV);
+  return PadFlatBounds(bounds);
+}
+
+inline bool QuadShape::Intersect(const Ray& ray, float tMin, float tMax,
+                                 ProceduralHit* hit) const {
+  Float3 normal = Cross(AxisU, AxisV);
+
+  float dDotN = Dot(ray.Direction, normal);
+  if (dDotN == 0.f)
+    return false;
+
+  float t = Dot(Center - ray.Origin, normal) / dDotN;
+  if (t < tMin || t > tMax)
+    return false;
+
+  Float3 p = ray.Origin + t * ray.Direction - Center;
+
+  if (std::abs(Dot(p, AxisU)) > Dot(AxisU, AxisU) || std::abs(Dot(p, AxisV)) > Dot(AxisV, AxisV))
+    return false;
+
+  hit->T = t;
+  hit->Normal = Normalize(normal);
+  hit->HitKind = 0;
+  return true;
+}
+
+inline Aabb SphereShape::GetBounds() const {
+  Float3 r{Radius, Radius, Radius};
+  return Aabb{Center - r, Center + r};
+}
+
+inline bool SphereShape::Intersect(const Ray& ray, float tMin, float tMax,
+                                   ProceduralHit* hit) const {
+  Float3 oc = ray.Origin - Center;
+
+  float a = Dot(ray.Direction, ray.Direction);
+  float b = Dot(oc, ray.Direction);
+  float c = Dot(oc, oc) - Radius * Radius;
+
+  float discriminant = b * b - a * c;
+  if (discriminant < 0.f)
+    return false;
+
+  float sqrtDiscriminant = std::sqrt(discriminant);
+
+  float t = (-b - sqrtDiscriminant) / a;
+  if (t < tMin)
+    t = (-b + sqrtDiscriminant) / a;
+
+  if (t < tMin || t > tMax)
+    return false;
+
+  hit->T = t;
+  hit->Normal = (oc + t * ray.Direction) / Radius;
+  hit->HitKind = 0;
+  return true;
+}
+
+inline Aabb DiskShape::GetBounds() const {
+  Float3 n = Normalize(Normal);
+  Float3 extent{Radius * std::sqrt(std::max(0.f, 1.f - n.x * n.x)),
+                Radius * std::sqrt(std::max(0.f, 1.f - n.y * n.y)),
+                Radius * std::sqrt(std::max(0.f, 1.f - n.z * n.z))};
+  return PadFlatBounds(Aabb{Center - extent, Center + extent});
+}
+
+inline bool DiskShape::Intersect(const Ray& ray, float tMin, float tMax,
+                                 ProceduralHit* hit) const {
+  float dDotN = Dot(ray.Direction, Normal);
+  if (dDotN == 0.f)
+    return false;
+
+  float t = Dot(Center - ray.Origin, Normal) / dDotN;
+  if (t < tMin || t > tMax)
+    return false;
+
+  Float3 p = ray.Origin + t * ray.Direction - Center;
+  if (Dot(p, p) > Radius * Radius)
+    return false;
+
+  hit->T = t;
+  hit->Normal = Normalize(Normal);
+  hit->HitKind = 0;
+  return true;
+}
+
+} // namespace cpu_rt
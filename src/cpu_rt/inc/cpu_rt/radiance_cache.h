@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "cpu_rt/math.h"
+#include "cpu_rt/ray.h"
+
+namespace cpu_rt {
+
+struct RadianceCacheSettings {
+  // Paths end in the cache at diffuse hits of this depth on, where hits of camera rays have
+  // depth 0, if the cell of the hit has enough samples.
+  uint32_t TerminationBounce = 1;
+
+  // One path in this many traces on past valid cells, so that cells which other paths end in
+  // keep getting samples.
+  uint32_t TrainingPathInterval = 8;
+
+  // Edge length of the cells up to LevelDistance from the camera. Each doubling of the distance
+  // past it doubles the edge length, so that cells cover a similar part of the screen.
+  float CellSize = 0.05f;
+  float LevelDistance = 4.f;
+
+  // Samples a cell needs before paths may end in it.
+  uint32_t MinSamples = 16;
+
+  // Old samples of a cell count as at most this many, so that it keeps up with the cells it
+  // gathers light from while they converge.
+  uint32_t MaxSamples = 32;
+
+  // Cells that no path has used for this many frames are evicted.
+  uint32_t MaxAge = 8;
+
+  // Bytes the table of cells may take.
+  size_t MemoryBudget = size_t{64} << 20;
+};
+
+struct RadianceCacheStats {
+  uint32_t Capacity;
+  uint32_t CellCount;
+
+  // The share of the last frame's lookups that found enough samples for paths to end in.
+  float HitRate;
+
+  // Insertions so far that found every slot of their probe sequence taken.
+  uint64_t InsertFailures;
+};
+
+// A world-space spatial hash of the radiance that diffuse surfaces reflect, after Binder et al.,
+// "Massively Parallel Path Space Filtering" (2019) and the hash grid of NVIDIA's SHaRC. Cells are
+// keyed by their quantized position, level of detail and dominant normal axis, and live in a
+// lock-free open-addressing table that threads insert into and accumulate samples in with
+// atomics. Paths read the radiance resolved at the end of the previous frame, so a frame never
+// sees its own samples.
+class RadianceCache {
+public:
+  // cameraPosition sets the level of detail of each cell by its distance.
+  RadianceCache(const Float3& cameraPosition, const RadianceCacheSettings& settings = {});
+
+  // The cell of a point with normal n, inserted if it is not in the table yet. k_invalidIndex
+  // if its probes are all taken by other cells.
+  uint32_t FindOrInsert(const Float3& p, const Float3& n);
+
+  // The resolved radiance of the cell. False if it has too few samples for paths to end in.
+  bool Lookup(uint32_t cell, Float3* radiance);
+
+  // Starts a sample of the cell, whose radiance is added by AddRadiance, possibly in parts.
+  void AddSample(uint32_t cell);
+  void AddRadiance(uint32_t cell, const Float3& radiance);
+
+  // Blends the samples of the frame into the resolved radiance and evicts the cells that have
+  // not been used for MaxAge frames. Not thread-safe with the other methods.
+  void EndFrame();
+
+  // As of the last EndFrame.
+  const RadianceCacheStats& GetStats() const { return m_stats; }
+
+  size_t GetMemoryUsage() const { return m_cells.size() * sizeof(Cell); }
+
+private:
+  struct Cell {
+    // 0 for an empty cell.
+    std::atomic<uint64_t> Key;
+
+    // The samples of the current frame.
+    std::atomic<float> Sum[3];
+    std::atomic<uint32_t> SampleCount;
+
+    std::atomic<uint32_t> LastUsedFrame;
+
+    // What Lookup reads, written only by EndFrame.
+    Float3 Radiance;
+    uint32_t ResolvedSampleCount;
+  };
+
+  uint64_t GetKey(const Float3& p, const Float3& n) const;
+
+  Float3 m_cameraPosition;
+  RadianceCacheSettings m_settings;
+
+  std::vector<Cell> m_cells;
+  uint32_t m_frame = 0;
+
+  std::atomic<uint64_t> m_lookupCount = 0;
+  std::atomic<uint64_t> m_lookupHitCount = 0;
+  std::atomic<uint64_t> m_insertFailureCount = 0;
+
+  RadianceCacheStats m_stats{};
+};
+
+} // namespace cpu_rt
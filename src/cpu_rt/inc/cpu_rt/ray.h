@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+
+#include "cpu_rt/math.h"
+
+namespace cpu_rt {
+
+// Same layout and meaning as the HLSL RayDesc.
+struct Ray {
+  Float3 Origin;
+  float TMin;
+  Float3 Direction;
+  float TMax;
+};
+
+// Subset of the DXR RAY_FLAG values that the CPU traversal honours.
+inline constexpr uint32_t k_rayFlagNone = 0x00;
+inline constexpr uint32_t k_rayFlagForceOpaque = 0x01;
+inline constexpr uint32_t k_rayFlagAcceptFirstHitAndEndSearch = 0x04;
+inline constexpr uint32_t k_rayFlagSkipClosestHitShader = 0x08;
+inline constexpr uint32_t k_rayFlagCullBackFacingTriangles = 0x10;
+inline constexpr uint32_t k_rayFlagCullFrontFacingTriangles = 0x20;
+
+// HitKind() values for triangles. Procedural hits report their own kind in [0, 127].
+inline constexpr uint8_t k_hitKindTriangleFrontFace = 0xfe;
+inline constexpr uint8_t k_hitKindTriangleBackFace = 0xff;
+
+inline constexpr uint32_t k_invalidIndex = ~0u;
+
+// TMax of the camera and bounce rays of shader.hlsl.
+inline constexpr float k_rayTMax = 10000.f;
+
+// Shadow rays stop this fraction short of the light sample, so they do not hit an emissive
+// triangle that the light sample is on.
+inline constexpr float k_shadowRayShortening = 1e-4f;
+
+struct HitInfo {
+  float T = 0.f;
+
+  // Attributes of triangle hits.
+  float Barycentrics[2] = {};
+
+  // Attributes of procedural hits, in object space.
+  Float3 Normal{};
+
+  uint32_t PrimitiveIndex = k_invalidIndex;
+  uint32_t GeometryIndex = k_invalidIndex;
+  uint32_t InstanceIndex = k_invalidIndex;
+  uint32_t InstanceID = 0;
+
+  // Index into the hit group table computed with the DXR addressing formula.
+  uint32_t HitGroupIndex = 0;
+
+  uint8_t HitKind = k_hitKindTriangleFrontFace;
+
+  bool IsProcedural() const { return HitKind < k_hitKindTriangleFrontFace; }
+};
+
+} // namespace cpu_rt
@@ -0,0 +1,275 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <span>
+
+#include "cpu_rt/aabb.h"
+#include "cpu_rt/bvh.h"
+#include "cpu_rt/math.h"
+#include "cpu_rt/ray.h"
+#include "cpu_rt/simd.h"
+#include "cpu_rt/traversal_stats.h"
+
+namespace cpu_rt {
+
+inline constexpr uint32_t k_rayPacketSize = 16;
+
+static_assert(k_rayPacketSize % k_simdWidth == 0);
+
+// Up to k_rayPacketSize rays in SoA form, one per lane. Traversal lowers TMax as hits are found.
+struct alignas(32) RayPacket {
+  float Origin[3][k_rayPacketSize];
+  float Direction[3][k_rayPacketSize];
+  float InvDir[3][k_rayPacketSize];
+  float TMin[k_rayPacketSize];
+  float TMax[k_rayPacketSize];
+};
+
+inline void SetPacketRay(RayPacket* packet, uint32_t lane, const Ray& ray) {
+  for (int axis = 0; axis < 3; ++axis) {
+    packet->Origin[axis][lane] = ray.Origin[axis];
+    packet->Direction[axis][lane] = ray.Direction[axis];
+    packet->InvDir[axis][lane] = 1.f / ray.Direction[axis];
+  }
+  packet->TMin[lane] = ray.TMin;
+  packet->TMax[lane] = ray.TMax;
+}
+
+inline Ray GetPacketRay(const RayPacket& packet, uint32_t lane) {
+  Ray ray{};
+  ray.Origin = Float3{packet.Origin[0][lane], packet.Origin[1][lane], packet.Origin[2][lane]};
+  ray.Direction = Float3{packet.Direction[0][lane], packet.Direction[1][lane],
+                         packet.Direction[2][lane]};
+  ray.TMin = packet.TMin[lane];
+  ray.TMax = packet.TMax[lane];
+  return ray;
+}
+
+// Packets only pay off for rays that cross the scene in roughly the same direction. Rays whose
+// directions differ in sign on some axis are better traced one at a time.
+inline bool HaveSameDirectionSigns(std::span<const Ray> rays) {
+  for (const Ray& ray : rays) {
+    for (int axis = 0; axis < 3; ++axis) {
+      if (std::signbit(ray.Direction[axis]) != std::signbit(rays[0].Direction[axis]))
+        return false;
+    }
+  }
+  return true;
+}
+
+// Bounds of the origins and inverse directions of a packet's rays. Float rounding is monotonic,
+// so slab distances computed from the interval ends bound those of every ray, and a box that
+// the whole frustum misses is missed by every lane.
+struct PacketFrustum {
+  // False unless every lane has the same direction signs and finite inverse directions, which
+  // the bounds below rely on.
+  bool Valid;
+
+  bool Negative[3];
+  float OriginMin[3];
+  float OriginMax[3];
+  float InvDirMin[3];
+  float InvDirMax[3];
+  float TMin;
+  float TMax;
+};
+
+inline PacketFrustum GetPacketFrustum(const RayPacket& packet, uint32_t laneMask) {
+  constexpr float inf = std::numeric_limits<float>::infinity();
+
+  PacketFrustum frustum{};
+  frustum.Valid = true;
+  frustum.TMin = inf;
+  frustum.TMax = -inf;
+
+  int firstLane = std::countr_zero(laneMask);
+
+  for (int axis = 0; axis < 3; ++axis) {
+    frustum.Negative[axis] = packet.InvDir[axis][firstLane] < 0.f;
+    frustum.OriginMin[axis] = inf;
+    frustum.OriginMax[axis] = -inf;
+    frustum.InvDirMin[axis] = inf;
+    frustum.InvDirMax[axis] = -inf;
+  }
+
+  for (uint32_t mask = laneMask; mask != 0; mask &= mask - 1) {
+    int lane = std::countr_zero(mask);
+
+    for (int axis = 0; axis < 3; ++axis) {
+      float invDir = packet.InvDir[axis][lane];
+      if (std::isinf(invDir) || (invDir < 0.f) != frustum.Negative[axis])
+        frustum.Valid = false;
+
+      frustum.OriginMin[axis] = std::min(frustum.OriginMin[axis], packet.Origin[axis][lane]);
+      frustum.OriginMax[axis] = std::max(frustum.OriginMax[axis], packet.Origin[axis][lane]);
+      frustum.InvDirMin[axis] = std::min(frustum.InvDirMin[axis], invDir);
+      frustum.InvDirMax[axis] = std::max(frustum.InvDirMax[axis], invDir);
+    }
+
+    frustum.TMin = std::min(frustum.TMin, packet.TMin[lane]);
+    frustum.TMax = std::max(frustum.TMax, packet.TMax[lane]);
+  }
+
+  return frustum;
+}
+
+// Interval arithmetic version of IntersectRayAabb. Returns true only if no ray of the frustum
+// can enter the box.
+inline bool FrustumMissesAabb(const PacketFrustum& frustum, const Aabb& box) {
+  float tEnterMin = frustum.TMin;
+  float tExitMax = std::numeric_limits<float>::infinity();
+
+  for (int axis = 0; axis < 3; ++axis) {
+    float invDirMin = frustum.InvDirMin[axis];
+    float invDirMax = frustum.InvDirMax[axis];
+
+    // With the signs known, the lowest entry and highest exit distance each come from one end
+    // of the origin interval and one end of the inverse direction interval.
+    float tEnter, tExit;
+    if (!frustum.Negative[axis]) {
+      float dEnter = box.Min[axis] - frustum.OriginMax[axis];
+      float dExit = box.Max[axis] - frustum.OriginMin[axis];
+      tEnter = dEnter * (dEnter >= 0.f ? invDirMin : invDirMax);
+      tExit = dExit * (dExit >= 0.f ? invDirMax : invDirMin);
+    } else {
+      float dEnter = box.Max[axis] - frustum.OriginMin[axis];
+      float dExit = box.Min[axis] - frustum.OriginMax[axis];
+      tEnter = dEnter * (dEnter >= 0.f ? invDirMin : invDirMax);
+      tExit = dExit * (dExit >= 0.f ? invDirMax : invDirMin);
+    }
+
+    tEnterMin = std::max(tEnterMin, tEnter);
+    tExitMax = std::min(tExitMax, tExit);
+  }
+
+  tExitMax = std::min(frustum.TMax, tExitMax * 1.0000004f);
+
+  return tEnterMin > tExitMax;
+}
+
+// IntersectRayAabb for every lane in laneMask. Returns the lanes that enter the box and writes
+// their entry distances to tNear.
+inline uint32_t IntersectRayPacketAabb(const Aabb& box, const RayPacket& packet,
+                                       uint32_t laneMask, float* tNear) {
+  uint32_t hitMask = 0;
+
+  for (uint32_t g = 0; g < k_rayPacketSize; g += k_simdWidth) {
+    SimdFloat tEnter = SimdLoad(packet.TMin + g);
+    SimdFloat tExit = SimdSet(std::numeric_limits<float>::infinity());
+
+    for (int axis = 0; axis < 3; ++axis) {
+      SimdFloat origin = SimdLoad(packet.Origin[axis] + g);
+      SimdFloat invDir = SimdLoad(packet.InvDir[axis] + g);
+
+      SimdFloat t0 = SimdMul(SimdSub(SimdSet(box.Min[axis]), origin), invDir);
+      SimdFloat t1 = SimdMul(SimdSub(SimdSet(box.Max[axis]), origin), invDir);
+
+      tEnter = SimdMax(tEnter, SimdMin(t0, t1));
+      tExit = SimdMin(tExit, SimdMax(t0, t1));
+    }
+
+    tExit = SimdMin(SimdLoad(packet.TMax + g), SimdMul(tExit, SimdSet(1.0000004f)));
+
+    SimdStore(tNear + g, tEnter);
+    hitMask |= SimdMoveMask(SimdLe(tEnter, tExit)) << g;
+  }
+
+  return hitMask & laneMask;
+}
+
+// Packet version of TraverseBvh. A node is visited once for all the lanes of laneMask that enter
+// it, and nodes that the packet's frustum misses are rejected without testing the lanes.
+// leafFn(const BvhNode& leaf, uint32_t leafLanes) is called with the lanes that enter the leaf
+// and returns the lanes that are done, which take no further part. It may lower packet.TMax.
+template<typename LeafFn>
+void TraversePacketBvh(std::span<const BvhNode> nodes, const RayPacket& packet,
+                       uint32_t laneMask, LeafFn&& leafFn) {
+  if (nodes.empty() || laneMask == 0)
+    return;
+
+  PacketFrustum frustum = GetPacketFrustum(packet, laneMask);
+
+  // Returns the lanes that enter the node and the nearest of their entry distances.
+  auto testNode = [&](uint32_t nodeIndex, uint32_t lanes, float* nearest) -> uint32_t {
+    const Aabb& bounds = nodes[nodeIndex].Bounds;
+    if (frustum.Valid && FrustumMissesAabb(frustum, bounds))
+      return 0;
+
+    alignas(32) float tNear[k_rayPacketSize];
+    uint32_t hitLanes = IntersectRayPacketAabb(bounds, packet, lanes, tNear);
+
+    *nearest = std::numeric_limits<float>::infinity();
+    for (uint32_t mask = hitLanes; mask != 0; mask &= mask - 1) {
+      *nearest = std::min(*nearest, tNear[std::countr_zero(mask)]);
+    }
+    return hitLanes;
+  };
+
+  struct StackEntry {
+    uint32_t NodeIndex;
+    uint32_t Lanes;
+  };
+
+  StackEntry stack[k_maxBvhDepth];
+  int stackSize = 0;
+
+  float tNear;
+  uint32_t lanes = testNode(0, laneMask, &tNear);
+  if (lanes == 0)
+    return;
+
+  uint32_t nodeIndex = 0;
+
+  while (true) {
+    CountTraversal(TraversalCounter::NodesVisited);
+
+    const BvhNode& node = nodes[nodeIndex];
+
+    if (node.IsLeaf()) {
+      laneMask &= ~leafFn(node, lanes);
+      if (laneMask == 0)
+        return;
+    } else {
+      uint32_t nearChild = node.LeftFirst;
+      uint32_t farChild = node.LeftFirst + 1;
+
+      float tNear0, tNear1;
+      uint32_t lanes0 = testNode(nearChild, lanes, &tNear0);
+      uint32_t lanes1 = testNode(farChild, lanes, &tNear1);
+
+      if (lanes0 != 0 && lanes1 != 0) {
+        if (tNear1 < tNear0) {
+          std::swap(nearChild, farChild);
+          std::swap(lanes0, lanes1);
+        }
+
+        stack[stackSize++] = {farChild, lanes1};
+        nodeIndex = nearChild;
+        lanes = lanes0;
+        continue;
+      }
+
+      if (lanes0 != 0 || lanes1 != 0) {
+        nodeIndex = lanes0 != 0 ? nearChild : farChild;
+        lanes = lanes0 | lanes1;
+        continue;
+      }
+    }
+
+    // Skips entries whose lanes have all finished since they were pushed.
+    do {
+      if (stackSize == 0)
+        return;
+
+      StackEntry entry = stack[--stackSize];
+      nodeIndex = entry.NodeIndex;
+      lanes = entry.Lanes & laneMask;
+    } while (lanes == 0);
+  }
+}
+
+} // namespace cpu_rt
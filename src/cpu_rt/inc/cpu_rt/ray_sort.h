@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+
+#include "cpu_rt/aabb.h"
+#include "cpu_rt/math.h"
+
+namespace cpu_rt {
+
+// GetRayMortonKey quantizes each of its five dimensions to this many bits.
+inline constexpr uint32_t k_rayKeyBitsPerDimension = 12;
+inline constexpr uint32_t k_rayKeyBits = 5 * k_rayKeyBitsPerDimension;
+
+// Morton code of a ray's origin, quantized within sceneBounds, and its direction, quantized
+// through the octahedral map. Rays with nearby keys start close together and head the same way,
+// so they tend to visit the same BVH nodes and triangles.
+uint64_t GetRayMortonKey(const Float3& origin, const Float3& direction, const Aabb& sceneBounds);
+
+// Sorts values by the low keyBits bits of keys with an LSD radix sort. Both spans are permuted.
+// Stable, so values with equal keys keep their order.
+void RadixSortByKey(std::span<uint64_t> keys, std::span<uint32_t> values,
+                    uint32_t keyBits = k_rayKeyBits);
+
+} // namespace cpu_rt
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "cpu_rt/aabb.h"
+#include "cpu_rt/bvh.h"
+#include "cpu_rt/math.h"
+#include "cpu_rt/traversal_stats.h"
+
+namespace cpu_rt {
+
+// What stream traversal needs of a ray.
+struct StreamRay {
+  Float3 Origin;
+  Float3 InvDir;
+  float TMin;
+};
+
+// Filters a batch of rays through the BVH instead of tracing them one by one: each node is
+// visited once with the list of rays that enter it, so a node's bounds and a leaf's primitives
+// are loaded once per batch rather than once per ray. rayIds are the indices of the rays to
+// trace. getTMax(rayId) returns a ray's current tMax, which leafFn may lower as hits are found,
+// or -infinity once it needs no further hits. leafFn(const BvhNode& leaf, std::span<const
+// uint32_t> leafRayIds) is called with the rays that enter each leaf. Children are visited in
+// the order that is front to back for most of the batch.
+template<typename TMaxFn, typename LeafFn>
+void TraverseBvhStream(std::span<const BvhNode> nodes, std::span<const StreamRay> rays,
+                       std::span<const uint32_t> rayIds, TMaxFn&& getTMax, LeafFn&& leafFn) {
+  if (nodes.empty() || rayIds.empty())
+    return;
+
+  // The majority direction along each axis, from the signs of the inverse directions.
+  int directionSum[3] = {};
+  for (uint32_t rayId : rayIds) {
+    for (int axis = 0; axis < 3; ++axis) {
+      directionSum[axis] += rays[rayId].InvDir[axis] < 0.f ? -1 : 1;
+    }
+  }
+
+  // A task is a node and the rays that entered its parent, at [Begin, End) of ids. Tasks are
+  // popped in the reverse order they were pushed, so everything after a task's range belongs
+  // to tasks that have finished when it is popped.
+  struct Task {
+    uint32_t NodeIndex;
+    uint32_t Begin;
+    uint32_t End;
+  };
+
+  std::vector<uint32_t> ids(rayIds.begin(), rayIds.end());
+  std::vector<Task> tasks = { { 0, 0, static_cast<uint32_t>(ids.size()) } };
+
+  while (!tasks.empty()) {
+    Task task = tasks.back();
+    tasks.pop_back();
+
+    ids.resize(task.End);
+
+    const BvhNode& node = nodes[task.NodeIndex];
+
+    // Filters with the current tMax, so rays that found hits in earlier subtrees drop out.
+    auto begin = static_cast<uint32_t>(ids.size());
+    for (uint32_t i = task.Begin; i < task.End; ++i) {
+      uint32_t rayId = ids[i];
+      const StreamRay& ray = rays[rayId];
+
+      float tNear;
+      if (IntersectRayAabb(node.Bounds, ray.Origin, ray.InvDir, ray.TMin, getTMax(rayId), &tNear))
+        ids.push_back(rayId);
+    }
+    auto end = static_cast<uint32_t>(ids.size());
+
+    if (begin == end)
+      continue;
+
+    CountTraversal(TraversalCounter::NodesVisited, end - begin);
+
+    if (node.IsLeaf()) {
+      leafFn(node, std::span<const uint32_t>(ids).subspan(begin, end - begin));
+      continue;
+    }
+
+    uint32_t nearChild = node.LeftFirst;
+    uint32_t farChild = node.LeftFirst + 1;
+
+    // Orders the children along the axis that separates them most.
+    Float3 separation = nodes[farChild].Bounds.Centroid() - nodes[nearChild].Bounds.Centroid();
+    int axis = 0;
+    for (int i = 1; i < 3; ++i) {
+      if (std::abs(separation[i]) > std::abs(separation[axis]))
+        axis = i;
+    }
+    if ((separation[axis] < 0.f) != (directionSum[axis] < 0))
+      std::swap(nearChild, farChild);
+
+    tasks.push_back({ farChild, begin, end });
+    tasks.push_back({ nearChild, begin, end });
+  }
+}
+
+} // namespace cpu_rt
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include <utils/gltf_loader.h>
+
+#include "cpu_rt/area_light.h"
+#include "cpu_rt/blas.h"
+#include "cpu_rt/bvh.h"
+#include "cpu_rt/environment_light.h"
+#include "cpu_rt/math.h"
+#include "cpu_rt/procedural.h"
+#include "cpu_rt/shading.h"
+#include "cpu_rt/tlas.h"
+
+namespace cpu_rt {
+
+// Instance masks used by App. Shadow rays trace against ~k_lightInstanceMask.
+inline constexpr uint32_t k_sceneInstanceMask = 1;
+inline constexpr uint32_t k_lightInstanceMask = 2;
+
+// The CPU counterpart of the acceleration structures App builds: the glTF meshes with z
+// flipped and counter-clockwise winding in one instance, and the quad light as a procedural
+// instance whose hit group follows the mesh geometries. The triangles of emissive materials are
+// lights as well.
+class RenderScene {
+public:
+  using LightIntersectionTable = IntersectionTable<QuadIntersector>;
+
+  // buildFlags apply to the mesh Blas. If bvhCacheDir is set, the mesh Blas is loaded from it
+  // when it was built from the same geometry and settings before, and saved to it otherwise.
+  explicit RenderScene(const utils::Scene& scene, const BvhBuildSettings& settings = {},
+                       uint32_t buildFlags = k_buildFlagNone,
+                       const std::filesystem::path& bvhCacheDir = {});
+
+  const Tlas& GetTlas() const { return *m_tlas; }
+
+  const Blas& GetMeshBlas() const { return *m_blas; }
+
+  const LightIntersectionTable& GetIntersectionTable() const { return m_intersectionTable; }
+
+  // The transform applied to the glTF positions, which normals need as well.
+  const Matrix3x4& GetGeometryTransform() const { return m_geometryTransform; }
+
+  const QuadShape& GetLight() const { return m_light; }
+
+  // The quad light, then the emissive triangles in geometry and primitive order.
+  std::span<const AreaLight> GetLights() const { return m_lights; }
+
+  // Index in GetLights of the triangle of a mesh hit, or k_invalidIndex if it does not emit.
+  uint32_t GetTriangleLight(const HitInfo& hit) const {
+    uint32_t firstLight = m_meshGeometries[hit.GeometryIndex].FirstLight;
+    return firstLight == k_invalidIndex ? k_invalidIndex : firstLight + hit.PrimitiveIndex;
+  }
+
+  // Lights the rays that leave the scene. Set before creating the renderers that use the scene.
+  void SetEnvironmentLight(std::unique_ptr<EnvironmentLight> light);
+
+  // nullptr without one, in which case rays that leave the scene see black, like
+  // LightRayMissShader returns.
+  const EnvironmentLight* GetEnvironmentLight() const { return m_environmentLight.get(); }
+
+  // Hit group of the light, i.e. the number of mesh geometries.
+  uint32_t GetLightHitGroupIndex() const { return m_lightHitGroupIndex; }
+
+  std::span<const Material> GetMaterials() const { return m_materials; }
+
+  // The materials classified for the specialized shading kernels, indexed like GetMaterials.
+  std::span<const ShadingMaterial> GetShadingMaterials() const { return m_shadingMaterials; }
+
+  // The material index in the shader record of a mesh hit group.
+  uint32_t GetMaterialIndex(uint32_t hitGroupIndex) const {
+    return m_meshGeometries[hitGroupIndex].MaterialIndex;
+  }
+
+  // Hash of everything a render of the scene depends on: the positions, indices and normals of
+  // the meshes, their transforms and materials, the lights and the environment image. Renders of
+  // scenes with different keys cannot share samples.
+  uint64_t GetContentKey() const;
+
+  // The interpolated vertex normal of a mesh hit in world space, as ClosestHitShader computes it.
+  Float3 GetShadingNormal(const HitInfo& hit) const;
+
+private:
+  // What ClosestHitShader reads through the shader record of a mesh geometry's hit group.
+  struct MeshGeometry {
+    uint32_t MaterialIndex;
+    std::vector<uint16_t> Indices;
+    std::vector<Float3> Normals;
+
+    // The light of the first triangle if the material emits. The others follow in order.
+    uint32_t FirstLight = k_invalidIndex;
+  };
+
+  static MeshGeometry GetMeshGeometry(const utils::Scene& scene, const utils::Primitive& prim);
+
+  // Adds a light for each triangle of the geometry, which emits from its front face.
+  void AddTriangleLights(const GeometryDesc& desc, const Float3& le, MeshGeometry* geometry);
+
+  Matrix3x4 m_geometryTransform;
+  QuadShape m_light;
+  uint32_t m_lightHitGroupIndex;
+
+  std::vector<AreaLight> m_lights;
+  std::unique_ptr<EnvironmentLight> m_environmentLight;
+
+  std::vector<Material> m_materials;
+  std::vector<ShadingMaterial> m_shadingMaterials;
+
+  // Indexed by hit group, which for mesh geometries is the geometry index.
+  std::vector<MeshGeometry> m_meshGeometries;
+
+  LightIntersectionTable m_intersectionTable;
+
+  // The parts of GetContentKey that the constructor and SetEnvironmentLight set up, 0 without an
+  // environment light.
+  uint64_t m_geometryKey = 0;
+  uint64_t m_environmentKey = 0;
+
+  // Heap allocated so the Tlas' pointers survive moves.
+  std::unique_ptr<Blas> m_blas;
+  std::unique_ptr<Blas> m_lightBlas;
+  std::unique_ptr<Tlas> m_tlas;
+};
+
+} // namespace cpu_rt
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "cpu_rt/light_sampler.h"
+#include "cpu_rt/math.h"
+#include "cpu_rt/render_scene.h"
+
+namespace cpu_rt {
+
+// Whose reservoirs a pixel resamples its light sample from besides its own.
+enum class RestirReuse {
+  None,
+
+  // Those of random pixels nearby that see a similar surface.
+  Spatial,
+
+  // Its own reservoir of the previous frame.
+  Temporal,
+
+  // The previous frame first, then the neighbours, whose reservoirs then hold both.
+  Spatiotemporal
+};
+
+struct RestirSettings {
+  // Light samples each pixel draws from LightSampler as the candidates of its reservoir.
+  uint32_t InitialCandidates = 32;
+
+  LightSamplerType LightSampler = LightSamplerType::Bvh;
+
+  RestirReuse Reuse = RestirReuse::Spatiotemporal;
+
+  // Neighbours a pixel tries, at random within SpatialRadius pixels.
+  uint32_t SpatialNeighbors = 5;
+  float SpatialRadius = 30.f;
+
+  // The reservoir of the previous frame counts as at most this many frames of candidates, so
+  // that it cannot outweigh new ones forever.
+  uint32_t TemporalHistoryLimit = 20;
+};
+
+// Means over the pixels that see a surface.
+struct RestirFrameStats {
+  // Candidates behind each reservoir, i.e. its M.
+  float CandidateCount;
+
+  // Kish's effective sample size of the resampling weights behind each reservoir, which counts
+  // how many candidates effectively shared in picking its sample.
+  float EffectiveSampleCount;
+};
+
+// Direct lighting by reservoir-based spatiotemporal importance resampling (ReSTIR DI, Bitterli
+// et al. 2020): the light transport PathTracer computes with NumBounces 0, so that a converged
+// render of it is the ground truth. Each frame traces one jittered camera ray per pixel and
+// resamples the pixel's light sample from its own candidates and the reservoirs it reuses. The
+// generalized balance heuristic weighs the reservoirs, which keeps reuse unbiased.
+class RestirRenderer {
+public:
+  RestirRenderer(const RenderScene& scene, uint32_t width, uint32_t height,
+                 const RestirSettings& settings = {});
+
+  // Renders a frame and blends it into the film.
+  void Render();
+
+  uint32_t GetWidth() const { return m_width; }
+  uint32_t GetHeight() const { return m_height; }
+
+  uint32_t GetFrameCount() const { return m_frameCount; }
+
+  // Row-major radiance of the last frame alone.
+  std::span<const Float3> GetFrame() const { return m_frame; }
+
+  // Row-major radiance, averaged over the frames so far.
+  std::span<const Float3> GetFilm() const { return m_film; }
+
+  const RestirFrameStats& GetFrameStats() const { return m_frameStats; }
+
+  // Camera and shadow rays traced so far.
+  uint64_t GetRayCount() const { return m_rayCount; }
+
+private:
+  // The camera ray hit a pixel shades. Pixels that see a light or nothing have none.
+  struct Surface {
+    Float3 Position;
+    Float3 Normal;
+    Float3 Wo;
+    float Distance;
+    uint32_t MaterialIndex;
+    bool IsValid;
+  };
+
+  // A point on a light. Reservoirs pick points by area, so another surface can reuse them
+  // without a change of measure.
+  struct LightSample {
+    Float3 Position;
+    uint32_t Light;
+  };
+
+  struct Reservoir {
+    LightSample Sample;
+
+    // The sum of the resampling weights of the candidates streamed through so far, and the sum
+    // of their squares over their effective sample counts.
+    float WeightSum;
+    float WeightSquareSum;
+
+    // The unbiased contribution weight of Sample, which estimates the inverse of its pdf. 0 if
+    // there is no sample.
+    float W;
+
+    float M;
+    float EffectiveSampleCount;
+
+    // Keeps the candidate with probability weight / WeightSum.
+    void Update(const LightSample& sample, float weight, float effectiveSampleCount, float u);
+  };
+
+  // Unshadowed radiance that a light sample reflects off the surface towards the camera, per
+  // unit area of the light.
+  Float3 GetUnshadowedContribution(const Surface& surface, const LightSample& sample) const;
+
+  // The target function reservoirs resample by: the luminance of GetUnshadowedContribution.
+  float GetTargetFunction(const Surface& surface, const LightSample& sample) const;
+
+  // Resamples InitialCandidates light samples, each drawn from m_lightSampler.
+  Reservoir SampleLights(const Surface& surface, uint32_t* rngState) const;
+
+  // Resamples one sample out of the reservoirs, the first of which belongs to the canonical
+  // surface that the result is for and each of which was resampled for its surface.
+  Reservoir CombineReservoirs(std::span<const Surface* const> surfaces,
+                              std::span<const Reservoir* const> reservoirs,
+                              uint32_t* rngState) const;
+
+  void TraceCameraRays();
+  void ReuseTemporally();
+  void ReuseSpatially();
+  void Shade();
+
+  const RenderScene& m_scene;
+  uint32_t m_width;
+  uint32_t m_height;
+  RestirSettings m_settings;
+
+  LightSampler m_lightSampler;
+
+  uint32_t m_frameCount = 0;
+  std::vector<Float3> m_film;
+  std::vector<Float3> m_frame;
+
+  // Indexed like the film. The previous ones are those the last frame shaded with, until
+  // ReuseSpatially, which needs them no longer and writes its reservoirs there.
+  std::vector<Reservoir> m_reservoirs;
+  std::vector<Reservoir> m_prevReservoirs;
+  std::vector<Surface> m_surfaces;
+  std::vector<Surface> m_prevSurfaces;
+
+  // Radiance of the lights the camera rays hit.
+  std::vector<Float3> m_emission;
+
+  RestirFrameStats m_frameStats{};
+  uint64_t m_rayCount = 0;
+};
+
+} // namespace cpu_rt
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+namespace cpu_rt {
+
+// Same RNG as shader.hlsl (Ch14 of Ray Tracing Gems II), so CPU and GPU paths draw identical
+// sequences for the same pixel and sample.
+
+inline uint32_t JenkinsHash(uint32_t x) {
+  x += x << 10;
+  x ^= x >> 6;
+  x += x << 3;
+  x ^= x >> 11;
+  x += x << 15;
+
+  return x;
+}
+
+inline uint32_t InitRngSeed(uint32_t pixelX, uint32_t pixelY, uint32_t sampleVal) {
+  uint32_t rngState = (pixelX + pixelY * 10000) ^ JenkinsHash(sampleVal);
+  return JenkinsHash(rngState);
+}
+
+inline uint32_t XorShift(uint32_t* rngState) {
+  *rngState ^= (*rngState << 13);
+  *rngState ^= (*rngState >> 17);
+  *rngState ^= (*rngState << 5);
+
+  return *rngState;
+}
+
+inline float RngStateToFloat(uint32_t rngState) {
+  uint32_t bits = 0x3f800000 | (rngState >> 9);
+
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f - 1.f;
+}
+
+inline float Rand(uint32_t* rngState) {
+  return RngStateToFloat(XorShift(rngState));
+}
+
+} // namespace cpu_rt
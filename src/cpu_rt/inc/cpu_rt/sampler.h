@@ -0,0 +1,200 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+namespace cpu_rt {
+
+// Low-discrepancy samplers for the path tracer. They only use integer arithmetic, so a port to
+// the shader could draw the same samples.
+
+enum class SamplerType : uint32_t {
+  // The shader's XorShift RNG.
+  Random,
+
+  // Owen-scrambled Sobol points, shuffled and scrambled per pixel and dimension (Burley 2020).
+  Sobol,
+
+  // Owen-scrambled Sobol points handed out along a Morton curve over the pixels, so that
+  // neighboring pixels get complementary samples and the error is blue noise (Ahmed and Wonka
+  // 2020, as in pbrt-v4's ZSobolSampler).
+  BlueNoise
+};
+
+// The 2D dimensions a path draws from: the camera jitter, then a BSDF, a light and a Russian
+// roulette sample at each bounce. The roulette sample's second value picks the light.
+inline constexpr uint32_t k_cameraDimension = 0;
+
+inline uint32_t GetBsdfDimension(uint32_t bounces) {
+  return 1 + 3 * bounces;
+}
+
+inline uint32_t GetLightDimension(uint32_t bounces) {
+  return 2 + 3 * bounces;
+}
+
+inline uint32_t GetRouletteDimension(uint32_t bounces) {
+  return 3 + 3 * bounces;
+}
+
+// The blue-noise sampler lays out this many samples per pixel along its Morton curve, over tiles
+// of this many pixels per side, so the whole curve fits in a 32-bit Sobol index. Later samples
+// start new passes and other tiles repeat the curve, each with seeds of its own.
+inline constexpr uint32_t k_log2BlueNoiseSampleCount = 12;
+inline constexpr uint32_t k_log2BlueNoiseTileSize = 10;
+
+static_assert(k_log2BlueNoiseSampleCount + 2 * k_log2BlueNoiseTileSize == 32);
+
+// Sobol's recurrence for the primitive polynomial x + 1 with the direction number m_1 = 1.
+constexpr std::array<uint32_t, 32> GenerateSobolMatrix1() {
+  std::array<uint32_t, 32> matrix{};
+  matrix[0] = 1u << 31;
+  for (size_t i = 1; i < matrix.size(); ++i) {
+    matrix[i] = matrix[i - 1] ^ (matrix[i - 1] >> 1);
+  }
+  return matrix;
+}
+
+constexpr std::array<uint32_t, 24> GenerateBase4Permutations() {
+  std::array<uint32_t, 24> permutations{};
+  std::array<uint32_t, 4> digits = {0, 1, 2, 3};
+  for (uint32_t& permutation : permutations) {
+    for (uint32_t d = 0; d < 4; ++d) {
+      permutation |= digits[d] << (2 * d);
+    }
+    std::next_permutation(digits.begin(), digits.end());
+  }
+  return permutations;
+}
+
+// Generator matrix of the second Sobol dimension, column i for bit i of the index. The first
+// dimension is the index with its bits reversed.
+inline constexpr std::array<uint32_t, 32> k_sobolMatrix1 = GenerateSobolMatrix1();
+
+// The 24 permutations of a base-4 digit in lexicographic order. Bits 2d and 2d + 1 of each hold
+// the digit that d maps to.
+inline constexpr std::array<uint32_t, 24> k_base4Permutations = GenerateBase4Permutations();
+
+inline uint32_t ReverseBits(uint32_t x) {
+  x = (x << 16) | (x >> 16);
+  x = ((x & 0x00ff00ff) << 8) | ((x >> 8) & 0x00ff00ff);
+  x = ((x & 0x0f0f0f0f) << 4) | ((x >> 4) & 0x0f0f0f0f);
+  x = ((x & 0x33333333) << 2) | ((x >> 2) & 0x33333333);
+  x = ((x & 0x55555555) << 1) | ((x >> 1) & 0x55555555);
+  return x;
+}
+
+// Wellons' lowbias32. Unlike JenkinsHash, every input bit reaches every output bit, which the
+// scrambling seeds need.
+inline uint32_t SamplerHash(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
+  return x;
+}
+
+inline uint32_t HashCombine(uint32_t seed, uint32_t value) {
+  return SamplerHash(seed ^ (SamplerHash(value) + 0x9e3779b9));
+}
+
+// Each bit of x is flipped by a hash of the seed and the bits below it (Laine and Karras 2011,
+// with Burley's constants).
+inline uint32_t LaineKarrasPermutation(uint32_t x, uint32_t seed) {
+  x += seed;
+  x ^= x * 0x6c50b47c;
+  x ^= x * 0xb82f1e52;
+  x ^= x * 0xc7afe638;
+  x ^= x * 0x8d22f6e6;
+  return x;
+}
+
+// Owen scrambling of a sample, whose leading bits are its coarsest digits, or a shuffle of a
+// sample index that keeps each aligned power of two block of indices together.
+inline uint32_t NestedUniformScramble(uint32_t x, uint32_t seed) {
+  return ReverseBits(LaineKarrasPermutation(ReverseBits(x), seed));
+}
+
+// k_sobolMatrix1 applied to each value of each byte of the index, so the product with the whole
+// index takes four lookups instead of a pass over its bits.
+inline constexpr auto k_sobolMatrix1Bytes = [] {
+  std::array<std::array<uint32_t, 256>, 4> tables{};
+  for (uint32_t byte = 0; byte < 4; ++byte) {
+    for (uint32_t value = 0; value < 256; ++value) {
+      for (uint32_t bit = 0; bit < 8; ++bit) {
+        if ((value >> bit) & 1)
+          tables[byte][value] ^= k_sobolMatrix1[8 * byte + bit];
+      }
+    }
+  }
+  return tables;
+}();
+
+// The first two Sobol dimensions, which together are a (0, 2)-sequence.
+inline void GetSobolPoint(uint32_t index, uint32_t* x, uint32_t* y) {
+  *x = ReverseBits(index);
+  *y = k_sobolMatrix1Bytes[0][index & 0xff] ^ k_sobolMatrix1Bytes[1][(index >> 8) & 0xff] ^
+       k_sobolMatrix1Bytes[2][(index >> 16) & 0xff] ^ k_sobolMatrix1Bytes[3][index >> 24];
+}
+
+// The top 24 bits as a float in [0, 1), which converts exactly.
+inline float SampleToFloat(uint32_t x) {
+  return static_cast<float>(x >> 8) * (1.f / 16777216.f);
+}
+
+inline void GetScrambledSobol2D(uint32_t index, uint32_t seed, float* u, float* v) {
+  uint32_t x, y;
+  GetSobolPoint(index, &x, &y);
+  *u = SampleToFloat(NestedUniformScramble(x, HashCombine(seed, 0)));
+  *v = SampleToFloat(NestedUniformScramble(y, HashCombine(seed, 1)));
+}
+
+inline void GetSobolSample2D(uint32_t pixelX, uint32_t pixelY, uint32_t sampleIndex,
+                             uint32_t dimension, float* u, float* v) {
+  uint32_t seed = HashCombine(HashCombine(SamplerHash(pixelX), pixelY), dimension);
+  GetScrambledSobol2D(NestedUniformScramble(sampleIndex, seed), seed, u, v);
+}
+
+// Interleaves the bits of x and y, which are below 2^16.
+inline uint32_t EncodeMorton2(uint32_t x, uint32_t y) {
+  auto spread = [](uint32_t v) {
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+  };
+  return spread(x) | (spread(y) << 1);
+}
+
+// Permutes each base-4 digit of the Morton index by a permutation that the digits above it pick,
+// so pixels get their samples in a random but stratified order.
+inline uint32_t GetBlueNoiseSobolIndex(uint32_t mortonIndex, uint32_t seed) {
+  uint32_t index = 0;
+  for (uint32_t shift = 0; shift < 32; shift += 2) {
+    uint32_t digit = (mortonIndex >> shift) & 3;
+    uint32_t higherDigits = (mortonIndex >> shift) >> 2;
+    uint32_t permutation = k_base4Permutations[(SamplerHash(higherDigits ^ seed) >> 24) % 24];
+    index |= ((permutation >> (2 * digit)) & 3) << shift;
+  }
+  return index;
+}
+
+inline void GetBlueNoiseSample2D(uint32_t pixelX, uint32_t pixelY, uint32_t sampleIndex,
+                                 uint32_t dimension, float* u, float* v) {
+  constexpr uint32_t tileMask = (1u << k_log2BlueNoiseTileSize) - 1;
+  constexpr uint32_t sampleMask = (1u << k_log2BlueNoiseSampleCount) - 1;
+
+  uint32_t seed = HashCombine(SamplerHash(dimension), sampleIndex >> k_log2BlueNoiseSampleCount);
+  seed = HashCombine(HashCombine(seed, pixelX >> k_log2BlueNoiseTileSize),
+                     pixelY >> k_log2BlueNoiseTileSize);
+
+  uint32_t mortonIndex = EncodeMorton2(pixelX & tileMask, pixelY & tileMask);
+  mortonIndex = (mortonIndex << k_log2BlueNoiseSampleCount) | (sampleIndex & sampleMask);
+
+  GetScrambledSobol2D(GetBlueNoiseSobolIndex(mortonIndex, seed), seed, u, v);
+}
+
+} // namespace cpu_rt
@@ -0,0 +1,344 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "cpu_rt/math.h"
+
+namespace cpu_rt {
+
+// Ports of the shading functions of shader.hlsl, so the CPU renderers shade hits the same way as
+// ClosestHitShader.
+
+inline constexpr float k_pi = 3.14159265f;
+
+// Same fields as the Material constant buffer of ClosestHitShader, from the glTF
+// pbrMetallicRoughness of the geometry.
+struct Material {
+  Float3 BaseColor;
+  float Metallic;
+  float Roughness;
+};
+
+// Which of the specialized shading kernels a material takes. Each class has its own
+// instantiation, without the terms and branches that the class never needs.
+enum class MaterialClass : uint8_t {
+  // Metallic 0: the base color under the 0.04 specular of a dielectric, sampled by cosine.
+  Diffuse,
+
+  // Metallic 1: only the GGX lobe, tinted by the base color and sampled by GGX.
+  Metal,
+
+  // Anything in between, which mixes both lobes like Brdf and samples GGX above 0.5.
+  Mixed
+};
+
+// A Material classified at load time, with the terms of Brdf that only depend on the material
+// already computed.
+struct ShadingMaterial {
+  MaterialClass Class;
+
+  // cDiff and f0 of Brdf, and the GGX alpha.
+  Float3 DiffuseColor;
+  Float3 F0;
+  float Alpha;
+
+  float Metallic;
+  float Roughness;
+};
+
+inline Float3 Lerp(const Float3& a, const Float3& b, float t) {
+  return a + t * (b - a);
+}
+
+inline Float3 Reflect(const Float3& i, const Float3& n) {
+  return i - 2.f * Dot(n, i) * n;
+}
+
+inline float TrowbridgeReitzGGX_Microfacet(const Float3& n, const Float3& h, float alpha) {
+  float alphaSq = alpha * alpha;
+  float nDotH = Dot(n, h);
+
+  float f = (nDotH * nDotH) * (alphaSq - 1.f) + 1.f;
+
+  return alphaSq / (k_pi * f * f);
+}
+
+// Smith masking of the microfacets seen from a direction at cosTheta to the normal.
+inline float TrowbridgeReitzGGX_G1(float cosTheta, float alpha) {
+  float alphaSq = alpha * alpha;
+  return 2.f * cosTheta /
+         (cosTheta + std::sqrt(alphaSq + (1.f - alphaSq) * cosTheta * cosTheta));
+}
+
+inline float TrowbridgeReitzGGX_Visibility(const Float3& wo, const Float3& wi, const Float3& n,
+                                           float alpha) {
+  float alphaSq = alpha * alpha;
+  float nDotwo = Dot(n, wo);
+  float nDotwi = Dot(n, wi);
+
+  float denom1 = nDotwo * std::sqrt(nDotwi * nDotwi * (1.f - alphaSq) + alphaSq);
+  float denom2 = nDotwi * std::sqrt(nDotwo * nDotwo * (1.f - alphaSq) + alphaSq);
+
+  float denom = denom1 + denom2;
+  if (denom > 0.f)
+    return 0.5f / denom;
+
+  return 0.f;
+}
+
+inline Float3 Brdf(const Float3& wo, const Float3& wi, const Float3& n, const Material& material) {
+  float alpha = material.Roughness * material.Roughness;
+  Float3 h = Normalize(wo + wi);
+
+  float D = TrowbridgeReitzGGX_Microfacet(n, h, alpha);
+  float V = TrowbridgeReitzGGX_Visibility(wo, wi, n, alpha);
+
+  Float3 black{0.f, 0.f, 0.f};
+  Float3 cDiff = Lerp(material.BaseColor, black, material.Metallic);
+
+  Float3 f0 = Lerp(Float3{0.04f, 0.04f, 0.04f}, material.BaseColor, material.Metallic);
+  Float3 one{1.f, 1.f, 1.f};
+  Float3 fresnel = f0 + (one - f0) * std::pow(1.f - std::abs(Dot(wo, h)), 5.f);
+
+  Float3 diffuse = (one - fresnel) * (1.f / k_pi) * cDiff;
+  Float3 specular = fresnel * D * V;
+
+  return diffuse + specular;
+}
+
+inline ShadingMaterial ClassifyMaterial(const Material& material) {
+  ShadingMaterial result{};
+
+  if (material.Metallic == 0.f) {
+    result.Class = MaterialClass::Diffuse;
+  } else if (material.Metallic == 1.f) {
+    result.Class = MaterialClass::Metal;
+  } else {
+    result.Class = MaterialClass::Mixed;
+  }
+
+  // The same expressions as Brdf, so the specialized kernels compute the same floats.
+  result.DiffuseColor = Lerp(material.BaseColor, Float3{0.f, 0.f, 0.f}, material.Metallic);
+  result.F0 = Lerp(Float3{0.04f, 0.04f, 0.04f}, material.BaseColor, material.Metallic);
+  result.Alpha = material.Roughness * material.Roughness;
+
+  result.Metallic = material.Metallic;
+  result.Roughness = material.Roughness;
+  return result;
+}
+
+// Brdf for a material of class materialClass, without the lerps and, for metals, without the
+// diffuse term, which is exactly 0 there. Otherwise the same operations in the same order, so the
+// result is bit for bit that of Brdf.
+template<MaterialClass materialClass>
+Float3 Brdf(const Float3& wo, const Float3& wi, const Float3& n, const ShadingMaterial& material) {
+  Float3 h = Normalize(wo + wi);
+
+  float D = TrowbridgeReitzGGX_Microfacet(n, h, material.Alpha);
+  float V = TrowbridgeReitzGGX_Visibility(wo, wi, n, material.Alpha);
+
+  Float3 f0 = material.F0;
+  if constexpr (materialClass == MaterialClass::Diffuse)
+    f0 = Float3{0.04f, 0.04f, 0.04f};
+
+  Float3 one{1.f, 1.f, 1.f};
+  Float3 fresnel = f0 + (one - f0) * std::pow(1.f - std::abs(Dot(wo, h)), 5.f);
+
+  Float3 specular = fresnel * D * V;
+
+  if constexpr (materialClass == MaterialClass::Metal) {
+    return specular;
+  } else {
+    Float3 diffuse = (one - fresnel) * (1.f / k_pi) * material.DiffuseColor;
+    return diffuse + specular;
+  }
+}
+
+// Sampling from Ch13 of pbrt book. randU and randV are uniform in [0, 1).
+
+inline void ConcentricSampleDisk(float randU, float randV, float* x, float* y) {
+  float offsetX = 2.f * randU - 1.f;
+  float offsetY = 2.f * randV - 1.f;
+
+  if (offsetX == 0.f && offsetY == 0.f) {
+    *x = 0.f;
+    *y = 0.f;
+    return;
+  }
+
+  float theta = 0.f;
+  float r = 0.f;
+
+  if (std::abs(offsetX) > std::abs(offsetY)) {
+    r = offsetX;
+    theta = k_pi / 4.f * (offsetY / offsetX);
+  } else {
+    r = offsetY;
+    theta = k_pi / 2.f - k_pi / 4.f * (offsetX / offsetY);
+  }
+
+  *x = r * std::cos(theta);
+  *y = r * std::sin(theta);
+}
+
+// Around +y, like the rest of shader.hlsl's local frames.
+inline Float3 CosineSampleHemisphere(float randU, float randV) {
+  float x, z;
+  ConcentricSampleDisk(randU, randV, &x, &z);
+
+  float y = std::sqrt(std::max(0.f, 1.f - x * x - z * z));
+
+  return Float3{x, y, z};
+}
+
+inline Float3 SphericalDirection(float sinTheta, float cosTheta, float phi) {
+  return Float3{sinTheta * std::cos(phi), cosTheta, sinTheta * std::sin(phi)};
+}
+
+// From pbrt book. Samples the whole distribution of normals, including the ones facing away from
+// the viewer, as ClosestHitShader and the batch version in shading_simd.h do. The CPU path
+// tracer samples TrowbridgeReitzGGX_Sample_vndf instead.
+inline Float3 TrowbridgeReitzGGX_Sample_wh(float randU, float randV, float roughness) {
+  float alpha = roughness * roughness;
+  float phi = 2.f * k_pi * randV;
+
+  float tanThetaSq = alpha * alpha * randU / (1.f - randU);
+  float cosTheta = 1.f / std::sqrt(1.f + tanThetaSq);
+  float sinTheta = std::sqrt(std::max(0.f, 1.f - cosTheta * cosTheta));
+
+  return SphericalDirection(sinTheta, cosTheta, phi);
+}
+
+// Samples a normal from the microfacets visible from wo, which is in the local frame and above
+// the surface (Heitz 2018, "Sampling the GGX Distribution of Visible Normals"). Unlike
+// TrowbridgeReitzGGX_Sample_wh, no sample is spent on a microfacet that wo cannot see.
+inline Float3 TrowbridgeReitzGGX_Sample_vndf(const Float3& wo, float randU, float randV,
+                                             float alpha) {
+  // Stretch wo so the microfacets become a hemisphere, and sample the projection of the part of
+  // it that wo sees, a disk whose lower half is squashed by the tilt of wo.
+  Float3 vh = Normalize(Float3{alpha * wo.x, wo.y, alpha * wo.z});
+
+  float lengthSq = vh.x * vh.x + vh.z * vh.z;
+  Float3 t1 = lengthSq > 0.f ? Float3{-vh.z, 0.f, vh.x} / std::sqrt(lengthSq)
+                             : Float3{1.f, 0.f, 0.f};
+  Float3 t2 = Cross(t1, vh);
+
+  float r = std::sqrt(randU);
+  float phi = 2.f * k_pi * randV;
+  float p1 = r * std::cos(phi);
+  float p2 = r * std::sin(phi);
+  float s = 0.5f * (1.f + vh.y);
+  p2 = (1.f - s) * std::sqrt(std::max(0.f, 1.f - p1 * p1)) + s * p2;
+
+  Float3 nh = p1 * t1 + p2 * t2 + std::sqrt(std::max(0.f, 1.f - p1 * p1 - p2 * p2)) * vh;
+
+  return Normalize(Float3{alpha * nh.x, std::max(0.f, nh.y), alpha * nh.z});
+}
+
+// Pdf in solid angle of reflecting wo about a TrowbridgeReitzGGX_Sample_vndf normal into wi.
+inline float TrowbridgeReitzGGX_Pdf_vndf(const Float3& wo, const Float3& wi, const Float3& n,
+                                         float alpha) {
+  float nDotwo = Dot(n, wo);
+  if (nDotwo <= 0.f)
+    return 0.f;
+
+  Float3 h = Normalize(wo + wi);
+  return TrowbridgeReitzGGX_G1(nDotwo, alpha) * TrowbridgeReitzGGX_Microfacet(n, h, alpha) /
+         (4.f * nDotwo);
+}
+
+// Whether bounce rays of the material sample GGX rather than the cosine. Mixed materials decide
+// at run time, as ClosestHitShader does for all of them.
+template<MaterialClass materialClass>
+bool SamplesGgx(const ShadingMaterial& material) {
+  return materialClass == MaterialClass::Metal ||
+         (materialClass == MaterialClass::Mixed && material.Metallic > 0.5f);
+}
+
+// Pdf in solid angle of a bounce ray towards wi.
+template<MaterialClass materialClass>
+float BsdfPdf(const Float3& wo, const Float3& wi, const Float3& n,
+              const ShadingMaterial& material) {
+  if (SamplesGgx<materialClass>(material))
+    return TrowbridgeReitzGGX_Pdf_vndf(wo, wi, n, material.Alpha);
+
+  return std::max(0.f, Dot(wi, n)) / k_pi;
+}
+
+// Power heuristic weight, with an exponent of 2, of the strategy that sampled a direction with
+// pdf, against one that would have with otherPdf. Written as a ratio so that an infinite pdf
+// still gives a weight.
+inline float PowerHeuristic(float pdf, float otherPdf) {
+  float ratio = otherPdf / pdf;
+  return 1.f / (1.f + ratio * ratio);
+}
+
+// Rec. 709 luminance of linear RGB.
+inline float Luminance(const Float3& c) {
+  return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+inline void GetCoordinateSystem(const Float3& v1, Float3* v2, Float3* v3) {
+  if (std::abs(v1.x) > std::abs(v1.y)) {
+    *v2 = Float3{-v1.z, 0.f, v1.x} / std::sqrt(v1.x * v1.x + v1.z * v1.z);
+  } else {
+    *v2 = Float3{0.f, v1.z, -v1.y} / std::sqrt(v1.y * v1.y + v1.z * v1.z);
+  }
+  *v3 = Cross(v1, *v2);
+}
+
+// Whether bounce rays sample GGX, like SamplesGgx for a material of any class.
+inline bool SamplesGgx(const ShadingMaterial& material) {
+  switch (material.Class) {
+  case MaterialClass::Diffuse:
+    return SamplesGgx<MaterialClass::Diffuse>(material);
+  case MaterialClass::Metal:
+    return SamplesGgx<MaterialClass::Metal>(material);
+  default:
+    return SamplesGgx<MaterialClass::Mixed>(material);
+  }
+}
+
+// BsdfPdf for a material of any class.
+inline float GetBsdfPdf(const Float3& wo, const Float3& wi, const Float3& n,
+                        const ShadingMaterial& material) {
+  switch (material.Class) {
+  case MaterialClass::Diffuse:
+    return BsdfPdf<MaterialClass::Diffuse>(wo, wi, n, material);
+  case MaterialClass::Metal:
+    return BsdfPdf<MaterialClass::Metal>(wo, wi, n, material);
+  default:
+    return BsdfPdf<MaterialClass::Mixed>(wo, wi, n, material);
+  }
+}
+
+// Samples a bounce direction like ClosestHitShader, except that GGX lobes sample the visible
+// normals. False if there is none above the surface.
+inline bool SampleBsdf(const Float3& wo, const Float3& n, const ShadingMaterial& material,
+                       float u, float v, Float3* wi, float* pdf) {
+  Float3 b1, b2;
+  GetCoordinateSystem(n, &b1, &b2);
+
+  if (SamplesGgx(material)) {
+    Float3 woLocal{Dot(wo, b1), Dot(wo, n), Dot(wo, b2)};
+    if (!(woLocal.y > 0.f))
+      return false;
+
+    Float3 wh = TrowbridgeReitzGGX_Sample_vndf(woLocal, u, v, material.Alpha);
+    wh = Normalize(wh.x * b1 + wh.y * n + wh.z * b2);
+    *wi = Reflect(-wo, wh);
+  } else {
+    Float3 local = CosineSampleHemisphere(u, v);
+    *wi = Normalize(local.x * b1 + local.y * n + local.z * b2);
+  }
+
+  if (!(Dot(*wi, n) > 0.f))
+    return false;
+
+  *pdf = GetBsdfPdf(wo, *wi, n, material);
+  return *pdf > 0.f;
+}
+
+} // namespace cpu_rt
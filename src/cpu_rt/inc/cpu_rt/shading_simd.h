@@ -0,0 +1,281 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "cpu_rt/math.h"
+#include "cpu_rt/shading.h"
+#include "cpu_rt/simd.h"
+#include "cpu_rt/simd_math.h"
+
+namespace cpu_rt {
+
+// k_simdWidth-lane versions of the functions of shading.h and rng.h, for shading many hits at
+// once. Each lane computes what the scalar function would for its inputs, up to the error of the
+// approximations in simd_math.h. The RNG is integer only, so every lane draws exactly the
+// sequence the shader does.
+
+struct SimdFloat3 {
+  SimdFloat x;
+  SimdFloat y;
+  SimdFloat z;
+};
+
+struct SimdMaterial {
+  SimdFloat3 BaseColor;
+  SimdFloat Metallic;
+  SimdFloat Roughness;
+};
+
+inline SimdFloat3 SimdSet(const Float3& v) {
+  return SimdFloat3{SimdSet(v.x), SimdSet(v.y), SimdSet(v.z)};
+}
+
+inline SimdFloat3 SimdAdd(const SimdFloat3& a, const SimdFloat3& b) {
+  return SimdFloat3{SimdAdd(a.x, b.x), SimdAdd(a.y, b.y), SimdAdd(a.z, b.z)};
+}
+
+inline SimdFloat3 SimdSub(const SimdFloat3& a, const SimdFloat3& b) {
+  return SimdFloat3{SimdSub(a.x, b.x), SimdSub(a.y, b.y), SimdSub(a.z, b.z)};
+}
+
+inline SimdFloat3 SimdMul(const SimdFloat3& a, const SimdFloat3& b) {
+  return SimdFloat3{SimdMul(a.x, b.x), SimdMul(a.y, b.y), SimdMul(a.z, b.z)};
+}
+
+inline SimdFloat3 SimdMul(const SimdFloat3& a, SimdFloat s) {
+  return SimdFloat3{SimdMul(a.x, s), SimdMul(a.y, s), SimdMul(a.z, s)};
+}
+
+inline SimdFloat SimdDot(const SimdFloat3& a, const SimdFloat3& b) {
+  return SimdAdd(SimdAdd(SimdMul(a.x, b.x), SimdMul(a.y, b.y)), SimdMul(a.z, b.z));
+}
+
+// Exact rather than through SimdFastRsqrt, like Normalize: near the specular peak of a smooth
+// material, D is sensitive enough to the half vector to amplify its error a thousandfold.
+inline SimdFloat3 SimdNormalize(const SimdFloat3& a) {
+  return SimdMul(a, SimdDiv(SimdSet(1.f), SimdSqrt(SimdDot(a, a))));
+}
+
+inline SimdFloat3 SimdLerp(const SimdFloat3& a, const SimdFloat3& b, SimdFloat t) {
+  return SimdAdd(a, SimdMul(SimdSub(b, a), t));
+}
+
+inline SimdInt SimdJenkinsHash(SimdInt x) {
+  x = SimdAddInt(x, SimdShiftLeft<10>(x));
+  x = SimdXorInt(x, SimdShiftRight<6>(x));
+  x = SimdAddInt(x, SimdShiftLeft<3>(x));
+  x = SimdXorInt(x, SimdShiftRight<11>(x));
+  x = SimdAddInt(x, SimdShiftLeft<15>(x));
+
+  return x;
+}
+
+inline SimdInt SimdInitRngSeed(SimdInt pixelX, SimdInt pixelY, SimdInt sampleVal) {
+  // pixelY * 10000 as shifts and adds, since SSE2 has no 32-bit multiply: 10000 is
+  // 2^13 + 2^10 + 2^9 + 2^8 + 2^4.
+  SimdInt pixelYTimes10000 = SimdAddInt(
+      SimdAddInt(SimdShiftLeft<13>(pixelY), SimdShiftLeft<10>(pixelY)),
+      SimdAddInt(SimdAddInt(SimdShiftLeft<9>(pixelY), SimdShiftLeft<8>(pixelY)),
+                 SimdShiftLeft<4>(pixelY)));
+
+  SimdInt rngState = SimdXorInt(SimdAddInt(pixelX, pixelYTimes10000), SimdJenkinsHash(sampleVal));
+  return SimdJenkinsHash(rngState);
+}
+
+inline SimdInt SimdXorShift(SimdInt* rngState) {
+  *rngState = SimdXorInt(*rngState, SimdShiftLeft<13>(*rngState));
+  *rngState = SimdXorInt(*rngState, SimdShiftRight<17>(*rngState));
+  *rngState = SimdXorInt(*rngState, SimdShiftLeft<5>(*rngState));
+
+  return *rngState;
+}
+
+inline SimdFloat SimdRngStateToFloat(SimdInt rngState) {
+  SimdInt bits = SimdOrInt(SimdSetInt(0x3f800000), SimdShiftRight<9>(rngState));
+  return SimdSub(SimdAsFloat(bits), SimdSet(1.f));
+}
+
+inline SimdFloat SimdRand(SimdInt* rngState) {
+  return SimdRngStateToFloat(SimdXorShift(rngState));
+}
+
+inline SimdFloat SimdTrowbridgeReitzGGX_Microfacet(const SimdFloat3& n, const SimdFloat3& h,
+                                                   SimdFloat alpha) {
+  SimdFloat alphaSq = SimdMul(alpha, alpha);
+  SimdFloat nDotH = SimdDot(n, h);
+
+  SimdFloat f = SimdAdd(SimdMul(SimdMul(nDotH, nDotH), SimdSub(alphaSq, SimdSet(1.f))),
+                        SimdSet(1.f));
+
+  return SimdDiv(alphaSq, SimdMul(SimdSet(k_pi), SimdMul(f, f)));
+}
+
+inline SimdFloat SimdTrowbridgeReitzGGX_Visibility(const SimdFloat3& wo, const SimdFloat3& wi,
+                                                   const SimdFloat3& n, SimdFloat alpha) {
+  SimdFloat alphaSq = SimdMul(alpha, alpha);
+  SimdFloat oneMinusAlphaSq = SimdSub(SimdSet(1.f), alphaSq);
+  SimdFloat nDotwo = SimdDot(n, wo);
+  SimdFloat nDotwi = SimdDot(n, wi);
+
+  SimdFloat denom1 = SimdMul(nDotwo, SimdFastSqrt(SimdAdd(
+      SimdMul(SimdMul(nDotwi, nDotwi), oneMinusAlphaSq), alphaSq)));
+  SimdFloat denom2 = SimdMul(nDotwi, SimdFastSqrt(SimdAdd(
+      SimdMul(SimdMul(nDotwo, nDotwo), oneMinusAlphaSq), alphaSq)));
+
+  SimdFloat denom = SimdAdd(denom1, denom2);
+
+  return SimdAnd(SimdDiv(SimdSet(0.5f), denom), SimdGt(denom, SimdSet(0.f)));
+}
+
+inline SimdFloat3 SimdBrdf(const SimdFloat3& wo, const SimdFloat3& wi, const SimdFloat3& n,
+                           const SimdMaterial& material) {
+  SimdFloat alpha = SimdMul(material.Roughness, material.Roughness);
+  SimdFloat3 h = SimdNormalize(SimdAdd(wo, wi));
+
+  SimdFloat D = SimdTrowbridgeReitzGGX_Microfacet(n, h, alpha);
+  SimdFloat V = SimdTrowbridgeReitzGGX_Visibility(wo, wi, n, alpha);
+
+  SimdFloat3 black = SimdSet(Float3{0.f, 0.f, 0.f});
+  SimdFloat3 cDiff = SimdLerp(material.BaseColor, black, material.Metallic);
+
+  SimdFloat3 f0 = SimdLerp(SimdSet(Float3{0.04f, 0.04f, 0.04f}), material.BaseColor,
+                           material.Metallic);
+  SimdFloat3 one = SimdSet(Float3{1.f, 1.f, 1.f});
+  SimdFloat fresnelWeight = SimdPow5(SimdSub(SimdSet(1.f), SimdAbs(SimdDot(wo, h))));
+  SimdFloat3 fresnel = SimdAdd(f0, SimdMul(SimdSub(one, f0), fresnelWeight));
+
+  SimdFloat3 diffuse = SimdMul(SimdMul(SimdSub(one, fresnel), SimdSet(1.f / k_pi)), cDiff);
+  SimdFloat3 specular = SimdMul(fresnel, SimdMul(D, V));
+
+  return SimdAdd(diffuse, specular);
+}
+
+// SimdBrdf for hits that all have the same material, of class materialClass. As with the scalar
+// Brdf<materialClass>, the terms that only depend on the material come precomputed.
+template<MaterialClass materialClass>
+SimdFloat3 SimdBrdf(const SimdFloat3& wo, const SimdFloat3& wi, const SimdFloat3& n,
+                    const ShadingMaterial& material) {
+  SimdFloat alpha = SimdSet(material.Alpha);
+  SimdFloat3 h = SimdNormalize(SimdAdd(wo, wi));
+
+  SimdFloat D = SimdTrowbridgeReitzGGX_Microfacet(n, h, alpha);
+  SimdFloat V = SimdTrowbridgeReitzGGX_Visibility(wo, wi, n, alpha);
+
+  Float3 f0 = materialClass == MaterialClass::Diffuse ? Float3{0.04f, 0.04f, 0.04f} : material.F0;
+  Float3 oneMinusF0 = Float3{1.f, 1.f, 1.f} - f0;
+
+  SimdFloat fresnelWeight = SimdPow5(SimdSub(SimdSet(1.f), SimdAbs(SimdDot(wo, h))));
+  SimdFloat3 fresnel = SimdAdd(SimdSet(f0), SimdMul(SimdSet(oneMinusF0), fresnelWeight));
+
+  SimdFloat3 specular = SimdMul(fresnel, SimdMul(D, V));
+
+  if constexpr (materialClass == MaterialClass::Metal) {
+    return specular;
+  } else {
+    SimdFloat3 one = SimdSet(Float3{1.f, 1.f, 1.f});
+    SimdFloat3 diffuseColor = SimdSet(material.DiffuseColor * (1.f / k_pi));
+    SimdFloat3 diffuse = SimdMul(SimdSub(one, fresnel), diffuseColor);
+    return SimdAdd(diffuse, specular);
+  }
+}
+
+inline void SimdConcentricSampleDisk(SimdFloat randU, SimdFloat randV, SimdFloat* x,
+                                     SimdFloat* y) {
+  SimdFloat offsetX = SimdSub(SimdMul(SimdSet(2.f), randU), SimdSet(1.f));
+  SimdFloat offsetY = SimdSub(SimdMul(SimdSet(2.f), randV), SimdSet(1.f));
+
+  SimdFloat xMajor = SimdGt(SimdAbs(offsetX), SimdAbs(offsetY));
+
+  SimdFloat r = SimdSelect(offsetY, offsetX, xMajor);
+
+  SimdFloat quarterPi = SimdSet(k_pi / 4.f);
+  SimdFloat thetaX = SimdMul(quarterPi, SimdDiv(offsetY, offsetX));
+  SimdFloat thetaY = SimdSub(SimdSet(k_pi / 2.f), SimdMul(quarterPi, SimdDiv(offsetX, offsetY)));
+  SimdFloat theta = SimdSelect(thetaY, thetaX, xMajor);
+
+  SimdFloat sinTheta, cosTheta;
+  SimdSinCos(theta, &sinTheta, &cosTheta);
+
+  // The center, where theta is 0 / 0.
+  SimdFloat zero = SimdSet(0.f);
+  SimdFloat center = SimdAnd(SimdEq(offsetX, zero), SimdEq(offsetY, zero));
+
+  *x = SimdAndNot(center, SimdMul(r, cosTheta));
+  *y = SimdAndNot(center, SimdMul(r, sinTheta));
+}
+
+inline SimdFloat3 SimdCosineSampleHemisphere(SimdFloat randU, SimdFloat randV) {
+  SimdFloat x, z;
+  SimdConcentricSampleDisk(randU, randV, &x, &z);
+
+  SimdFloat ySq = SimdSub(SimdSub(SimdSet(1.f), SimdMul(x, x)), SimdMul(z, z));
+  SimdFloat y = SimdFastSqrt(SimdMax(SimdSet(0.f), ySq));
+
+  return SimdFloat3{x, y, z};
+}
+
+inline SimdFloat3 SimdTrowbridgeReitzGGX_Sample_wh(SimdFloat randU, SimdFloat randV,
+                                                   SimdFloat roughness) {
+  SimdFloat alpha = SimdMul(roughness, roughness);
+  SimdFloat phi = SimdMul(SimdSet(2.f * k_pi), randV);
+
+  SimdFloat tanThetaSq = SimdDiv(SimdMul(SimdMul(alpha, alpha), randU),
+                                 SimdSub(SimdSet(1.f), randU));
+  // Exact for the same reason as SimdNormalize: near the pole sinTheta has lost most of its bits
+  // to the cancellation in 1 - cosTheta^2.
+  SimdFloat cosTheta = SimdDiv(SimdSet(1.f), SimdSqrt(SimdAdd(SimdSet(1.f), tanThetaSq)));
+  SimdFloat sinTheta = SimdFastSqrt(SimdMax(SimdSet(0.f),
+                                            SimdSub(SimdSet(1.f), SimdMul(cosTheta, cosTheta))));
+
+  SimdFloat sinPhi, cosPhi;
+  SimdSinCos(phi, &sinPhi, &cosPhi);
+
+  return SimdFloat3{SimdMul(sinTheta, cosPhi), cosTheta, SimdMul(sinTheta, sinPhi)};
+}
+
+// SoA arrays of count vectors or materials for the batch functions below, which run the kernels
+// above over them k_simdWidth entries at a time. The arrays need not be aligned or padded.
+
+struct Float3Soa {
+  float* X;
+  float* Y;
+  float* Z;
+};
+
+struct ConstFloat3Soa {
+  const float* X;
+  const float* Y;
+  const float* Z;
+};
+
+struct MaterialSoa {
+  ConstFloat3Soa BaseColor;
+  const float* Metallic;
+  const float* Roughness;
+};
+
+void BatchInitRngSeed(size_t count, const uint32_t* pixelX, const uint32_t* pixelY,
+                      const uint32_t* sampleVal, uint32_t* rngStates);
+
+// Draws the next number of each RNG.
+void BatchRand(size_t count, uint32_t* rngStates, float* values);
+
+void BatchBrdf(size_t count, const ConstFloat3Soa& wo, const ConstFloat3Soa& wi,
+               const ConstFloat3Soa& n, const MaterialSoa& materials, const Float3Soa& brdf);
+
+// BatchBrdf for count hits of one material of class materialClass.
+template<MaterialClass materialClass>
+void BatchBrdf(size_t count, const ConstFloat3Soa& wo, const ConstFloat3Soa& wi,
+               const ConstFloat3Soa& n, const ShadingMaterial& material, const Float3Soa& brdf);
+
+void BatchConcentricSampleDisk(size_t count, const float* randU, const float* randV, float* x,
+                               float* y);
+
+void BatchCosineSampleHemisphere(size_t count, const float* randU, const float* randV,
+                                 const Float3Soa& directions);
+
+void BatchTrowbridgeReitzGGX_Sample_wh(size_t count, const float* randU, const float* randV,
+                                       const float* roughness, const Float3Soa& wh);
+
+} // namespace cpu_rt
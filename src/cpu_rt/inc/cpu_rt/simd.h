@@ -0,0 +1,189 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include <immintrin.h>
+
+namespace cpu_rt {
+
+// Thin wrappers over the widest float vector the build targets, so kernels are written once for
+// AVX2 (8 lanes) and SSE (4 lanes). Compares return all-ones lanes for true.
+
+#if defined(__AVX2__)
+
+inline constexpr uint32_t k_simdWidth = 8;
+
+using SimdFloat = __m256;
+
+inline SimdFloat SimdSet(float f) { return _mm256_set1_ps(f); }
+inline SimdFloat SimdLoad(const float* p) { return _mm256_load_ps(p); }
+
+// Loads k_simdWidth bytes and converts them to floats.
+inline SimdFloat SimdLoadU8(const uint8_t* p) {
+  __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+  return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+}
+
+inline void SimdStore(float* p, SimdFloat v) { _mm256_store_ps(p, v); }
+
+inline SimdFloat SimdAdd(SimdFloat a, SimdFloat b) { return _mm256_add_ps(a, b); }
+inline SimdFloat SimdSub(SimdFloat a, SimdFloat b) { return _mm256_sub_ps(a, b); }
+inline SimdFloat SimdMul(SimdFloat a, SimdFloat b) { return _mm256_mul_ps(a, b); }
+inline SimdFloat SimdDiv(SimdFloat a, SimdFloat b) { return _mm256_div_ps(a, b); }
+inline SimdFloat SimdMin(SimdFloat a, SimdFloat b) { return _mm256_min_ps(a, b); }
+inline SimdFloat SimdMax(SimdFloat a, SimdFloat b) { return _mm256_max_ps(a, b); }
+
+inline SimdFloat SimdAnd(SimdFloat a, SimdFloat b) { return _mm256_and_ps(a, b); }
+inline SimdFloat SimdOr(SimdFloat a, SimdFloat b) { return _mm256_or_ps(a, b); }
+inline SimdFloat SimdXor(SimdFloat a, SimdFloat b) { return _mm256_xor_ps(a, b); }
+inline SimdFloat SimdAndNot(SimdFloat a, SimdFloat b) { return _mm256_andnot_ps(a, b); }
+
+inline SimdFloat SimdLt(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+inline SimdFloat SimdLe(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+inline SimdFloat SimdGt(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+inline SimdFloat SimdGe(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+inline SimdFloat SimdEq(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+inline SimdFloat SimdNeq(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a, b, _CMP_NEQ_OQ); }
+
+// Takes b where mask is set and a elsewhere.
+inline SimdFloat SimdSelect(SimdFloat a, SimdFloat b, SimdFloat mask) {
+  return _mm256_blendv_ps(a, b, mask);
+}
+
+inline uint32_t SimdMoveMask(SimdFloat mask) {
+  return static_cast<uint32_t>(_mm256_movemask_ps(mask));
+}
+
+
+using SimdInt = __m256i;
+
+inline SimdFloat SimdLoadU(const float* p) { return _mm256_loadu_ps(p); }
+inline void SimdStoreU(float* p, SimdFloat v) { _mm256_storeu_ps(p, v); }
+
+inline SimdFloat SimdSqrt(SimdFloat a) { return _mm256_sqrt_ps(a); }
+
+// Hardware estimate of 1 / sqrt(a), with a relative error of up to 1.5 * 2^-12.
+inline SimdFloat SimdRsqrt(SimdFloat a) { return _mm256_rsqrt_ps(a); }
+
+inline SimdInt SimdSetInt(uint32_t i) { return _mm256_set1_epi32(static_cast<int>(i)); }
+
+inline SimdInt SimdLoadIntU(const uint32_t* p) {
+  return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+}
+
+inline void SimdStoreIntU(uint32_t* p, SimdInt v) {
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v);
+}
+
+inline SimdInt SimdAddInt(SimdInt a, SimdInt b) { return _mm256_add_epi32(a, b); }
+inline SimdInt SimdAndInt(SimdInt a, SimdInt b) { return _mm256_and_si256(a, b); }
+inline SimdInt SimdOrInt(SimdInt a, SimdInt b) { return _mm256_or_si256(a, b); }
+inline SimdInt SimdXorInt(SimdInt a, SimdInt b) { return _mm256_xor_si256(a, b); }
+inline SimdInt SimdEqInt(SimdInt a, SimdInt b) { return _mm256_cmpeq_epi32(a, b); }
+
+// Logical shifts.
+template<int count>
+inline SimdInt SimdShiftLeft(SimdInt a) { return _mm256_slli_epi32(a, count); }
+template<int count>
+inline SimdInt SimdShiftRight(SimdInt a) { return _mm256_srli_epi32(a, count); }
+
+// Reinterpret the bits.
+inline SimdFloat SimdAsFloat(SimdInt a) { return _mm256_castsi256_ps(a); }
+inline SimdInt SimdAsInt(SimdFloat a) { return _mm256_castps_si256(a); }
+
+inline SimdFloat SimdIntToFloat(SimdInt a) { return _mm256_cvtepi32_ps(a); }
+
+// Rounds to the nearest integer, ties to even.
+inline SimdInt SimdRoundToInt(SimdFloat a) { return _mm256_cvtps_epi32(a); }
+
+#else
+
+inline constexpr uint32_t k_simdWidth = 4;
+
+using SimdFloat = __m128;
+
+inline SimdFloat SimdSet(float f) { return _mm_set1_ps(f); }
+inline SimdFloat SimdLoad(const float* p) { return _mm_load_ps(p); }
+
+inline SimdFloat SimdLoadU8(const uint8_t* p) {
+  int32_t packed;
+  memcpy(&packed, p, sizeof(packed));
+
+  __m128i zero = _mm_setzero_si128();
+  __m128i words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero);
+  return _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+}
+
+inline void SimdStore(float* p, SimdFloat v) { _mm_store_ps(p, v); }
+
+inline SimdFloat SimdAdd(SimdFloat a, SimdFloat b) { return _mm_add_ps(a, b); }
+inline SimdFloat SimdSub(SimdFloat a, SimdFloat b) { return _mm_sub_ps(a, b); }
+inline SimdFloat SimdMul(SimdFloat a, SimdFloat b) { return _mm_mul_ps(a, b); }
+inline SimdFloat SimdDiv(SimdFloat a, SimdFloat b) { return _mm_div_ps(a, b); }
+inline SimdFloat SimdMin(SimdFloat a, SimdFloat b) { return _mm_min_ps(a, b); }
+inline SimdFloat SimdMax(SimdFloat a, SimdFloat b) { return _mm_max_ps(a, b); }
+
+inline SimdFloat SimdAnd(SimdFloat a, SimdFloat b) { return _mm_and_ps(a, b); }
+inline SimdFloat SimdOr(SimdFloat a, SimdFloat b) { return _mm_or_ps(a, b); }
+inline SimdFloat SimdXor(SimdFloat a, SimdFloat b) { return _mm_xor_ps(a, b); }
+inline SimdFloat SimdAndNot(SimdFloat a, SimdFloat b) { return _mm_andnot_ps(a, b); }
+
+inline SimdFloat SimdLt(SimdFloat a, SimdFloat b) { return _mm_cmplt_ps(a, b); }
+inline SimdFloat SimdLe(SimdFloat a, SimdFloat b) { return _mm_cmple_ps(a, b); }
+inline SimdFloat SimdGt(SimdFloat a, SimdFloat b) { return _mm_cmpgt_ps(a, b); }
+inline SimdFloat SimdGe(SimdFloat a, SimdFloat b) { return _mm_cmpge_ps(a, b); }
+inline SimdFloat SimdEq(SimdFloat a, SimdFloat b) { return _mm_cmpeq_ps(a, b); }
+inline SimdFloat SimdNeq(SimdFloat a, SimdFloat b) { return _mm_cmpneq_ps(a, b); }
+
+inline SimdFloat SimdSelect(SimdFloat a, SimdFloat b, SimdFloat mask) {
+  return _mm_or_ps(_mm_andnot_ps(mask, a), _mm_and_ps(mask, b));
+}
+
+inline uint32_t SimdMoveMask(SimdFloat mask) {
+  return static_cast<uint32_t>(_mm_movemask_ps(mask));
+}
+
+
+using SimdInt = __m128i;
+
+inline SimdFloat SimdLoadU(const float* p) { return _mm_loadu_ps(p); }
+inline void SimdStoreU(float* p, SimdFloat v) { _mm_storeu_ps(p, v); }
+
+inline SimdFloat SimdSqrt(SimdFloat a) { return _mm_sqrt_ps(a); }
+inline SimdFloat SimdRsqrt(SimdFloat a) { return _mm_rsqrt_ps(a); }
+
+inline SimdInt SimdSetInt(uint32_t i) { return _mm_set1_epi32(static_cast<int>(i)); }
+
+inline SimdInt SimdLoadIntU(const uint32_t* p) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+inline void SimdStoreIntU(uint32_t* p, SimdInt v) {
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v);
+}
+
+inline SimdInt SimdAddInt(SimdInt a, SimdInt b) { return _mm_add_epi32(a, b); }
+inline SimdInt SimdAndInt(SimdInt a, SimdInt b) { return _mm_and_si128(a, b); }
+inline SimdInt SimdOrInt(SimdInt a, SimdInt b) { return _mm_or_si128(a, b); }
+inline SimdInt SimdXorInt(SimdInt a, SimdInt b) { return _mm_xor_si128(a, b); }
+inline SimdInt SimdEqInt(SimdInt a, SimdInt b) { return _mm_cmpeq_epi32(a, b); }
+
+template<int count>
+inline SimdInt SimdShiftLeft(SimdInt a) { return _mm_slli_epi32(a, count); }
+template<int count>
+inline SimdInt SimdShiftRight(SimdInt a) { return _mm_srli_epi32(a, count); }
+
+inline SimdFloat SimdAsFloat(SimdInt a) { return _mm_castsi128_ps(a); }
+inline SimdInt SimdAsInt(SimdFloat a) { return _mm_castps_si128(a); }
+
+inline SimdFloat SimdIntToFloat(SimdInt a) { return _mm_cvtepi32_ps(a); }
+inline SimdInt SimdRoundToInt(SimdFloat a) { return _mm_cvtps_epi32(a); }
+
+#endif
+
+inline SimdFloat SimdSignMask() { return SimdSet(-0.f); }
+
+inline SimdFloat SimdAbs(SimdFloat a) { return SimdAndNot(SimdSignMask(), a); }
+
+} // namespace cpu_rt
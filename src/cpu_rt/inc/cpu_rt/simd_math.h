@@ -0,0 +1,68 @@
+#pragma once
+
+#include <limits>
+
+#include "cpu_rt/simd.h"
+
+namespace cpu_rt {
+
+// Approximations that the SIMD shading kernels use in place of the libm calls of the scalar
+// ports. The error bounds are checked by shading_bench.
+
+// 1 / sqrt(a) from the hardware estimate and one Newton-Raphson step, which leaves a relative
+// error under 4e-7.
+inline SimdFloat SimdFastRsqrt(SimdFloat a) {
+  SimdFloat r = SimdRsqrt(a);
+  SimdFloat halfAR = SimdMul(SimdMul(SimdSet(0.5f), a), r);
+  return SimdMul(r, SimdSub(SimdSet(1.5f), SimdMul(halfAR, r)));
+}
+
+// sqrt(a) for a >= 0 as a / sqrt(a), also with a relative error under 4e-7.
+inline SimdFloat SimdFastSqrt(SimdFloat a) {
+  // Keeps 0 * inf from turning zeros into NaNs.
+  SimdFloat nonZero = SimdMax(a, SimdSet(std::numeric_limits<float>::min()));
+  return SimdMul(a, SimdFastRsqrt(nonZero));
+}
+
+// The shaders only raise to the fifth power, which three multiplies do within float rounding.
+inline SimdFloat SimdPow5(SimdFloat a) {
+  SimdFloat aSq = SimdMul(a, a);
+  return SimdMul(SimdMul(aSq, aSq), a);
+}
+
+// sin and cos of a, with an absolute error under 1e-7 for |a| < 8192. a is reduced to
+// [-pi/4, pi/4] by the nearest multiple of pi/2, split into three parts so that the products are
+// exact, and the polynomials are the minimax ones of Cephes' sinf and cosf.
+inline void SimdSinCos(SimdFloat a, SimdFloat* sin, SimdFloat* cos) {
+  SimdInt quadrant = SimdRoundToInt(SimdMul(a, SimdSet(0.636619772f)));
+  SimdFloat q = SimdIntToFloat(quadrant);
+
+  SimdFloat x = SimdSub(a, SimdMul(q, SimdSet(1.5703125f)));
+  x = SimdSub(x, SimdMul(q, SimdSet(4.837512969970703125e-4f)));
+  x = SimdSub(x, SimdMul(q, SimdSet(7.54978995489188216e-8f)));
+
+  SimdFloat xSq = SimdMul(x, x);
+
+  SimdFloat s = SimdAdd(SimdMul(SimdSet(-1.9515295891e-4f), xSq), SimdSet(8.3321608736e-3f));
+  s = SimdAdd(SimdMul(s, xSq), SimdSet(-1.6666654611e-1f));
+  s = SimdAdd(SimdMul(SimdMul(s, xSq), x), x);
+
+  SimdFloat c = SimdAdd(SimdMul(SimdSet(2.443315711809948e-5f), xSq),
+                        SimdSet(-1.388731625493765e-3f));
+  c = SimdAdd(SimdMul(c, xSq), SimdSet(4.166664568298827e-2f));
+  c = SimdMul(SimdMul(c, xSq), xSq);
+  c = SimdAdd(SimdSub(c, SimdMul(SimdSet(0.5f), xSq)), SimdSet(1.f));
+
+  // sin(a) is s, c, -s or -c for quadrants 0 to 3 and cos(a) is c, -s, -c or s, so odd quadrants
+  // swap the two and bit 1 of the quadrant, after adding 1 for cos, gives the sign.
+  SimdInt one = SimdSetInt(1);
+  SimdFloat swap = SimdAsFloat(SimdEqInt(SimdAndInt(quadrant, one), one));
+
+  SimdInt sinSign = SimdShiftLeft<30>(SimdAndInt(quadrant, SimdSetInt(2)));
+  SimdInt cosSign = SimdShiftLeft<30>(SimdAndInt(SimdAddInt(quadrant, one), SimdSetInt(2)));
+
+  *sin = SimdXor(SimdSelect(s, c, swap), SimdAsFloat(sinSign));
+  *cos = SimdXor(SimdSelect(c, s, swap), SimdAsFloat(cosSign));
+}
+
+} // namespace cpu_rt
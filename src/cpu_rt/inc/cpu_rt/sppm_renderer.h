@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "cpu_rt/light_sampler.h"
+#include "cpu_rt/math.h"
+#include "cpu_rt/render_scene.h"
+
+namespace cpu_rt {
+
+struct SppmSettings {
+  // Photon paths traced from the lights each iteration.
+  uint32_t PhotonsPerIteration = 1 << 18;
+
+  // Most bounces of camera and photon paths, like PathTracerSettings::NumBounces.
+  uint32_t NumBounces = 5;
+
+  // Gather radius of every pixel in the first iteration, in scene units.
+  float InitialRadius = 0.03f;
+
+  // Share of the photons of an iteration that a pixel keeps, in (0, 1]. The radius shrinks so
+  // that its density estimate converges, the slower the closer this is to 1.
+  float Alpha = 2.f / 3.f;
+
+  LightSamplerType LightSampler = LightSamplerType::Bvh;
+};
+
+struct SppmIterationStats {
+  // Pixels whose camera path found a surface to gather photons at.
+  uint32_t VisiblePointCount;
+
+  uint32_t StoredPhotonCount;
+
+  // Means over the visible points.
+  float GatheredPhotonCount;
+  float Radius;
+};
+
+// Stochastic progressive photon mapping (Hachisuka and Jensen 2009, as in pbrt-v3's SPPM). Each
+// iteration traces a camera path per pixel through metals to a visible point on the first
+// surface with a diffuse lobe, which takes a light sample for its direct light. Photons traced
+// from the lights then give it the rest, by density estimation over a radius that shrinks from
+// one iteration to the next. Paths from the camera find caustics that a metal focuses from the
+// light only by chance, and photons deliver them at every visible point nearby.
+//
+// Photons are stored in a hash grid sorted by cell, with their positions in arrays of their own
+// so that the gather tests k_simdWidth of them at a time. Photon tracing and gathering run in
+// parallel over photons and pixels, and neither needs atomics, so a render is the same for any
+// number of threads.
+class SppmRenderer {
+public:
+  SppmRenderer(const RenderScene& scene, uint32_t width, uint32_t height,
+               const SppmSettings& settings = {});
+
+  // Runs an iteration and updates the film.
+  void Render();
+
+  uint32_t GetWidth() const { return m_width; }
+  uint32_t GetHeight() const { return m_height; }
+
+  uint32_t GetIterationCount() const { return m_iterationCount; }
+
+  // Row-major radiance of the iterations so far.
+  std::span<const Float3> GetFilm() const { return m_film; }
+
+  const SppmIterationStats& GetIterationStats() const { return m_iterationStats; }
+
+  // Camera, bounce, shadow and photon rays traced so far.
+  uint64_t GetRayCount() const { return m_rayCount; }
+
+private:
+  // Where a camera path ends on a surface with a diffuse lobe, and its throughput there.
+  struct VisiblePoint {
+    Float3 Position;
+    Float3 Normal;
+    Float3 Wo;
+    Float3 Throughput;
+    uint32_t MaterialIndex;
+    bool IsValid;
+  };
+
+  // The progressive estimate of a pixel: its direct light summed over the iterations, and the
+  // flux of the photons it gathered, scaled to its current radius, with their count N.
+  struct PixelState {
+    Float3 DirectSum;
+    Float3 Tau;
+    float PhotonCount;
+    float Radius;
+  };
+
+  // Light arriving at a surface, from the direction Wi.
+  struct Photon {
+    Float3 Position;
+    Float3 Wi;
+    Float3 Flux;
+  };
+
+  // The photons of an iteration by cell of a uniform grid, whose cells hash to the buckets of a
+  // table. The photons of bucket b are [BucketStart[b], BucketStart[b + 1]). Each array has
+  // k_simdWidth more entries than photons, so that the last ones load as a whole vector.
+  struct PhotonGrid {
+    float CellSize;
+    std::vector<uint32_t> BucketStart;
+    std::vector<float> PositionX;
+    std::vector<float> PositionY;
+    std::vector<float> PositionZ;
+    std::vector<Float3> Wi;
+    std::vector<Float3> Flux;
+  };
+
+  void TraceCameraPaths();
+  void TracePhotons();
+  void BuildPhotonGrid();
+  void GatherPhotons();
+
+  uint32_t GetBucket(int32_t x, int32_t y, int32_t z) const;
+
+  // Direct light at a camera path vertex from a light sample, weighed against the bounce ray
+  // if one follows.
+  Float3 SampleDirectLight(const Float3& p, const Float3& n, const Float3& wo,
+                           uint32_t materialIndex, bool weighBounce, uint32_t* rngState,
+                           uint32_t* rayCount) const;
+
+  const RenderScene& m_scene;
+  uint32_t m_width;
+  uint32_t m_height;
+  SppmSettings m_settings;
+
+  LightSampler m_lightSampler;
+
+  // Picks the light each photon leaves, by power.
+  AliasTable m_photonLights;
+
+  uint32_t m_iterationCount = 0;
+  std::vector<Float3> m_film;
+  std::vector<PixelState> m_pixels;
+  std::vector<VisiblePoint> m_visiblePoints;
+
+  std::vector<Photon> m_photons;
+  PhotonGrid m_grid;
+
+  SppmIterationStats m_iterationStats{};
+  uint64_t m_rayCount = 0;
+};
+
+} // namespace cpu_rt
@@ -0,0 +1,497 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+#include "cpu_rt/aabb.h"
+#include "cpu_rt/blas.h"
+#include "cpu_rt/bvh.h"
+#include "cpu_rt/bvh_stats.h"
+#include "cpu_rt/math.h"
+#include "cpu_rt/procedural.h"
+#include "cpu_rt/ray.h"
+#include "cpu_rt/ray_packet.h"
+#include "cpu_rt/ray_stream.h"
+#include "cpu_rt/traversal_stats.h"
+
+namespace cpu_rt {
+
+// Same values as D3D12_RAYTRACING_INSTANCE_FLAGS.
+inline constexpr uint32_t k_instanceFlagNone = 0x0;
+inline constexpr uint32_t k_instanceFlagTriangleCullDisable = 0x1;
+inline constexpr uint32_t k_instanceFlagTriangleFrontCounterClockwise = 0x2;
+
+// Mirrors D3D12_RAYTRACING_INSTANCE_DESC. The Blas must outlive the Tlas.
+struct InstanceDesc {
+  Matrix3x4 Transform = Identity3x4();
+  uint32_t InstanceID = 0;
+  uint8_t InstanceMask = 0xff;
+  uint32_t InstanceContributionToHitGroupIndex = 0;
+  uint32_t Flags = k_instanceFlagNone;
+  const Blas* AccelerationStructure = nullptr;
+};
+
+// Top-level acceleration structure: a BVH over instance bounds. Each instance only stores its
+// transforms and a pointer to the shared Blas, so the cost per instance is independent of the
+// mesh size.
+class Tlas {
+public:
+  Tlas(std::span<const InstanceDesc> instanceDescs, const BvhBuildSettings& settings = {});
+
+  uint32_t GetInstanceCount() const { return static_cast<uint32_t>(m_instances.size()); }
+
+  const Matrix3x4& GetObjectToWorld(uint32_t instanceIndex) const {
+    return m_instances[instanceIndex].ObjectToWorld;
+  }
+
+  // World space bounds of the instances.
+  Aabb GetBounds() const { return m_bvh.Nodes.empty() ? Aabb::Empty() : m_bvh.Nodes[0].Bounds; }
+
+  // Does not include the memory of the referenced Blases.
+  size_t GetMemoryUsage() const;
+
+  // Stats of the BVH over the instances.
+  BvhStats GetStats(const BvhBuildSettings& settings = {}) const {
+    return ComputeBvhStats(m_bvh.Nodes, settings);
+  }
+
+  // Same arguments as the HLSL TraceRay, minus the miss shader index. Returns true if anything
+  // was hit, in which case hit describes the closest hit. Instances are skipped unless
+  // InstanceMask & instanceInclusionMask is non-zero. Procedural geometry needs an
+  // intersectionTable that covers its hit groups.
+  template<typename IntersectionTable = EmptyIntersectionTable>
+  bool TraceRay(const Ray& ray, uint32_t rayFlags, uint32_t instanceInclusionMask,
+                uint32_t rayContributionToHitGroupIndex,
+                uint32_t multiplierForGeometryContributionToHitGroupIndex, HitInfo* hit,
+                const IntersectionTable& intersectionTable = {}) const;
+
+  // Packet version of TraceRay for up to k_rayPacketSize coherent rays, such as the camera rays
+  // of neighboring pixels. Fills hits[i] for rays[i] and returns a mask of the rays that hit.
+  // The closest hits are the same as TraceRay's, though ties between primitives at the same
+  // distance may resolve differently. Rays whose direction signs differ are traced one at a
+  // time.
+  template<typename IntersectionTable = EmptyIntersectionTable>
+  uint32_t TraceRayPacket(std::span<const Ray> rays, uint32_t rayFlags,
+                          uint32_t instanceInclusionMask, uint32_t rayContributionToHitGroupIndex,
+                          uint32_t multiplierForGeometryContributionToHitGroupIndex,
+                          HitInfo* hits, const IntersectionTable& intersectionTable = {}) const;
+
+  // Traces a large batch of rays with TraverseBvhStream, which pays off when the rays are too
+  // incoherent for packets but many of them still cross the same nodes. Same results as
+  // TraceRayPacket, with found[i] set to whether rays[i] hit.
+  template<typename IntersectionTable = EmptyIntersectionTable>
+  void TraceRayStream(std::span<const Ray> rays, uint32_t rayFlags, uint32_t instanceInclusionMask,
+                      uint32_t rayContributionToHitGroupIndex,
+                      uint32_t multiplierForGeometryContributionToHitGroupIndex,
+                      std::span<HitInfo> hits, std::span<uint8_t> found,
+                      const IntersectionTable& intersectionTable = {}) const;
+
+  // Shadow ray query: returns true if anything in [ray.TMin, tMax) blocks the ray. Equivalent to
+  // TraceRay with AcceptFirstHitAndEndSearch | SkipClosestHitShader and a contribution of 0 and
+  // multiplier of 1, but skips the hit bookkeeping. Each thread remembers the primitive that
+  // occluded its previous ray against this Tlas and tests it first, which pays off for coherent
+  // shadow rays towards the same light.
+  template<typename IntersectionTable = EmptyIntersectionTable>
+  bool Occluded(const Ray& ray, float tMax, uint32_t instanceInclusionMask,
+                uint32_t rayFlags = k_rayFlagNone,
+                const IntersectionTable& intersectionTable = {}) const;
+
+  // Packet version of Occluded, where ray.TMax is the tMax of each ray. Returns a mask of the
+  // occluded rays. Packets do not use the occluder cache.
+  template<typename IntersectionTable = EmptyIntersectionTable>
+  uint32_t OccludedPacket(std::span<const Ray> rays, uint32_t instanceInclusionMask,
+                          uint32_t rayFlags = k_rayFlagNone,
+                          const IntersectionTable& intersectionTable = {}) const;
+
+private:
+  struct Instance {
+    Matrix3x4 WorldToObject;
+    Matrix3x4 ObjectToWorld;
+    const Blas* AccelerationStructure;
+    uint32_t InstanceID;
+    uint32_t InstanceContributionToHitGroupIndex;
+    uint8_t InstanceMask;
+    uint8_t Flags;
+  };
+
+  struct OccluderCache {
+    uint64_t TlasId = 0;
+    uint32_t InstanceIndex = k_invalidIndex;
+    uint32_t Occluder = 0;
+  };
+
+  // The calling thread's cache.
+  static OccluderCache& GetOccluderCache();
+
+  Ray GetObjectRay(const Instance& instance, const Ray& ray) const;
+
+  // Transforms the lanes in laneMask like GetObjectRay.
+  RayPacket GetObjectPacket(const Instance& instance, const RayPacket& packet,
+                            uint32_t laneMask) const;
+
+  BlasTraceContext GetBlasTraceContext(uint32_t instanceIndex, uint32_t rayFlags,
+                                       uint32_t rayContributionToHitGroupIndex,
+                                       uint32_t multiplierForGeometryContributionToHitGroupIndex)
+      const;
+
+  // Identifies this Tlas in the occluder caches. Unlike the address, it is never reused.
+  uint64_t m_id;
+
+  Bvh m_bvh;
+  std::vector<Instance> m_instances;
+};
+
+inline Ray Tlas::GetObjectRay(const Instance& instance, const Ray& ray) const {
+  // Rays enter the Blas in object space. The direction is not renormalized so that t is the same
+  // in both spaces.
+  Ray objectRay{};
+  objectRay.Origin = TransformPoint(instance.WorldToObject, ray.Origin);
+  objectRay.Direction = TransformVector(instance.WorldToObject, ray.Direction);
+  objectRay.TMin = ray.TMin;
+  objectRay.TMax = ray.TMax;
+  return objectRay;
+}
+
+inline RayPacket Tlas::GetObjectPacket(const Instance& instance, const RayPacket& packet,
+                                       uint32_t laneMask) const {
+  RayPacket objectPacket = packet;
+  for (uint32_t mask = laneMask; mask != 0; mask &= mask - 1) {
+    auto lane = static_cast<uint32_t>(std::countr_zero(mask));
+    SetPacketRay(&objectPacket, lane, GetObjectRay(instance, GetPacketRay(packet, lane)));
+  }
+  return objectPacket;
+}
+
+inline BlasTraceContext Tlas::GetBlasTraceContext(
+    uint32_t instanceIndex, uint32_t rayFlags, uint32_t rayContributionToHitGroupIndex,
+    uint32_t multiplierForGeometryContributionToHitGroupIndex) const {
+  const Instance& instance = m_instances[instanceIndex];
+
+  BlasTraceContext ctx{};
+  ctx.RayFlags = rayFlags;
+  ctx.FrontCounterClockwise = (instance.Flags & k_instanceFlagTriangleFrontCounterClockwise) != 0;
+  ctx.InstanceIndex = instanceIndex;
+  ctx.InstanceID = instance.InstanceID;
+  ctx.HitGroupBase = rayContributionToHitGroupIndex + instance.InstanceContributionToHitGroupIndex;
+  ctx.GeometryMultiplier = multiplierForGeometryContributionToHitGroupIndex;
+
+  if (instance.Flags & k_instanceFlagTriangleCullDisable)
+    ctx.RayFlags &= ~(k_rayFlagCullBackFacingTriangles | k_rayFlagCullFrontFacingTriangles);
+
+  return ctx;
+}
+
+template<typename IntersectionTable>
+bool Tlas::TraceRay(const Ray& ray, uint32_t rayFlags, uint32_t instanceInclusionMask,
+                    uint32_t rayContributionToHitGroupIndex,
+                    uint32_t multiplierForGeometryContributionToHitGroupIndex, HitInfo* hit,
+                    const IntersectionTable& intersectionTable) const {
+  CountTraversal(TraversalCounter::Rays);
+
+  *hit = HitInfo{};
+  hit->T = ray.TMax;
+
+  Float3 invDir{1.f / ray.Direction.x, 1.f / ray.Direction.y, 1.f / ray.Direction.z};
+
+  bool found = false;
+
+  TraverseBvh(m_bvh.Nodes, ray.Origin, invDir, ray.TMin, &hit->T, [&](const BvhNode& leaf) {
+    for (uint32_t i = leaf.LeftFirst; i < leaf.LeftFirst + leaf.PrimCount; ++i) {
+      uint32_t instanceIndex = m_bvh.PrimIndices[i];
+      const Instance& instance = m_instances[instanceIndex];
+
+      if ((instance.InstanceMask & instanceInclusionMask) == 0)
+        continue;
+
+      Ray objectRay = GetObjectRay(instance, ray);
+      BlasTraceContext ctx = GetBlasTraceContext(instanceIndex, rayFlags,
+                                                 rayContributionToHitGroupIndex,
+                                                 multiplierForGeometryContributionToHitGroupIndex);
+
+      if (!instance.AccelerationStructure->Intersect(objectRay, ctx, intersectionTable, hit))
+        continue;
+
+      hit->InstanceIndex = instanceIndex;
+      hit->InstanceID = instance.InstanceID;
+      hit->HitGroupIndex = ctx.HitGroupBase + ctx.GeometryMultiplier * hit->GeometryIndex;
+
+      found = true;
+      if (rayFlags & k_rayFlagAcceptFirstHitAndEndSearch)
+        return true;
+    }
+    return false;
+  });
+
+  return found;
+}
+
+template<typename IntersectionTable>
+uint32_t Tlas::TraceRayPacket(std::span<const Ray> rays, uint32_t rayFlags,
+                              uint32_t instanceInclusionMask,
+                              uint32_t rayContributionToHitGroupIndex,
+                              uint32_t multiplierForGeometryContributionToHitGroupIndex,
+                              HitInfo* hits, const IntersectionTable& intersectionTable) const {
+  if (rays.size() > k_rayPacketSize)
+    throw std::invalid_argument("Too many rays for a packet.");
+
+  uint32_t foundLanes = 0;
+
+  if (!HaveSameDirectionSigns(rays)) {
+    for (uint32_t i = 0; i < rays.size(); ++i) {
+      if (TraceRay(rays[i], rayFlags, instanceInclusionMask, rayContributionToHitGroupIndex,
+                   multiplierForGeometryContributionToHitGroupIndex, &hits[i], intersectionTable))
+        foundLanes |= 1u << i;
+    }
+    return foundLanes;
+  }
+
+  CountTraversal(TraversalCounter::Rays, rays.size());
+
+  RayPacket packet{};
+  for (uint32_t i = 0; i < rays.size(); ++i) {
+    SetPacketRay(&packet, i, rays[i]);
+    hits[i] = HitInfo{};
+    hits[i].T = rays[i].TMax;
+  }
+
+  // Lanes past the end of rays are never traced.
+  uint32_t laneMask = (1u << rays.size()) - 1;
+
+  TraversePacketBvh(m_bvh.Nodes, packet, laneMask, [&](const BvhNode& leaf, uint32_t leafLanes) {
+    uint32_t doneLanes = 0;
+
+    for (uint32_t i = leaf.LeftFirst; i < leaf.LeftFirst + leaf.PrimCount; ++i) {
+      uint32_t instanceIndex = m_bvh.PrimIndices[i];
+      const Instance& instance = m_instances[instanceIndex];
+
+      uint32_t lanes = leafLanes & ~doneLanes;
+      if ((instance.InstanceMask & instanceInclusionMask) == 0 || lanes == 0)
+        continue;
+
+      RayPacket objectPacket = GetObjectPacket(instance, packet, lanes);
+      BlasTraceContext ctx = GetBlasTraceContext(instanceIndex, rayFlags,
+                                                 rayContributionToHitGroupIndex,
+                                                 multiplierForGeometryContributionToHitGroupIndex);
+
+      uint32_t hitLanes = instance.AccelerationStructure->IntersectPacket(
+          &objectPacket, lanes, ctx, intersectionTable, hits);
+
+      for (uint32_t mask = hitLanes; mask != 0; mask &= mask - 1) {
+        int lane = std::countr_zero(mask);
+
+        packet.TMax[lane] = objectPacket.TMax[lane];
+
+        HitInfo& hit = hits[lane];
+        hit.InstanceIndex = instanceIndex;
+        hit.InstanceID = instance.InstanceID;
+        hit.HitGroupIndex = ctx.HitGroupBase + ctx.GeometryMultiplier * hit.GeometryIndex;
+      }
+
+      foundLanes |= hitLanes;
+      if (rayFlags & k_rayFlagAcceptFirstHitAndEndSearch)
+        doneLanes |= hitLanes;
+    }
+    return doneLanes;
+  });
+
+  return foundLanes;
+}
+
+template<typename IntersectionTable>
+void Tlas::TraceRayStream(std::span<const Ray> rays, uint32_t rayFlags,
+                          uint32_t instanceInclusionMask, uint32_t rayContributionToHitGroupIndex,
+                          uint32_t multiplierForGeometryContributionToHitGroupIndex,
+                          std::span<HitInfo> hits, std::span<uint8_t> found,
+                          const IntersectionTable& intersectionTable) const {
+  CountTraversal(TraversalCounter::Rays, rays.size());
+
+  bool acceptFirstHit = (rayFlags & k_rayFlagAcceptFirstHitAndEndSearch) != 0;
+
+  std::vector<StreamRay> streamRays(rays.size());
+  std::vector<uint32_t> rayIds(rays.size());
+
+  for (uint32_t i = 0; i < rays.size(); ++i) {
+    const Ray& ray = rays[i];
+    streamRays[i].Origin = ray.Origin;
+    streamRays[i].InvDir = Float3{1.f / ray.Direction.x, 1.f / ray.Direction.y,
+                                  1.f / ray.Direction.z};
+    streamRays[i].TMin = ray.TMin;
+
+    rayIds[i] = i;
+
+    hits[i] = HitInfo{};
+    hits[i].T = ray.TMax;
+    found[i] = 0;
+  }
+
+  auto getTMax = [&](uint32_t rayId) {
+    return acceptFirstHit && found[rayId] ? -std::numeric_limits<float>::infinity()
+                                          : hits[rayId].T;
+  };
+
+  // Reused across instances. Only the entries of the rays entering an instance are set.
+  std::vector<Ray> objectRays(rays.size());
+  std::vector<uint32_t> instanceRayIds;
+  std::vector<uint32_t> hitRayIds;
+
+  BlasStreamScratch blasScratch;
+  blasScratch.Rays.resize(rays.size());
+  blasScratch.WatertightRays.resize(rays.size());
+  blasScratch.Hit.resize(rays.size());
+
+  TraverseBvhStream(m_bvh.Nodes, streamRays, rayIds, getTMax,
+                    [&](const BvhNode& leaf, std::span<const uint32_t> leafRayIds) {
+    for (uint32_t i = leaf.LeftFirst; i < leaf.LeftFirst + leaf.PrimCount; ++i) {
+      uint32_t instanceIndex = m_bvh.PrimIndices[i];
+      const Instance& instance = m_instances[instanceIndex];
+
+      if ((instance.InstanceMask & instanceInclusionMask) == 0)
+        continue;
+
+      instanceRayIds.clear();
+      for (uint32_t rayId : leafRayIds) {
+        if (acceptFirstHit && found[rayId])
+          continue;
+
+        objectRays[rayId] = GetObjectRay(instance, rays[rayId]);
+        instanceRayIds.push_back(rayId);
+      }
+
+      BlasTraceContext ctx = GetBlasTraceContext(instanceIndex, rayFlags,
+                                                 rayContributionToHitGroupIndex,
+                                                 multiplierForGeometryContributionToHitGroupIndex);
+
+      hitRayIds.clear();
+      instance.AccelerationStructure->IntersectStream(objectRays, instanceRayIds, ctx,
+                                                      intersectionTable, hits, &blasScratch,
+                                                      &hitRayIds);
+
+      for (uint32_t rayId : hitRayIds) {
+        HitInfo& hit = hits[rayId];
+        hit.InstanceIndex = instanceIndex;
+        hit.InstanceID = instance.InstanceID;
+        hit.HitGroupIndex = ctx.HitGroupBase + ctx.GeometryMultiplier * hit.GeometryIndex;
+
+        found[rayId] = 1;
+      }
+    }
+  });
+}
+
+template<typename IntersectionTable>
+bool Tlas::Occluded(const Ray& ray, float tMax, uint32_t instanceInclusionMask, uint32_t rayFlags,
+                    const IntersectionTable& intersectionTable) const {
+  CountTraversal(TraversalCounter::ShadowRays);
+
+  rayFlags |= k_rayFlagAcceptFirstHitAndEndSearch | k_rayFlagSkipClosestHitShader;
+
+  OccluderCache& cache = GetOccluderCache();
+
+  if (cache.TlasId == m_id && cache.InstanceIndex < m_instances.size()) {
+    const Instance& instance = m_instances[cache.InstanceIndex];
+
+    if (instance.InstanceMask & instanceInclusionMask) {
+      BlasTraceContext ctx = GetBlasTraceContext(cache.InstanceIndex, rayFlags, 0, 1);
+      if (instance.AccelerationStructure->OccludedByPrimitive(
+              cache.Occluder, GetObjectRay(instance, ray), tMax, ctx, intersectionTable)) {
+        CountTraversal(TraversalCounter::OccluderCacheHits);
+        CountTraversal(TraversalCounter::ShadowRaysOccluded);
+        return true;
+      }
+    }
+  }
+
+  Float3 invDir{1.f / ray.Direction.x, 1.f / ray.Direction.y, 1.f / ray.Direction.z};
+
+  bool occluded = false;
+
+  TraverseBvhAny(m_bvh.Nodes, ray.Origin, invDir, ray.TMin, tMax, [&](const BvhNode& leaf) {
+    for (uint32_t i = leaf.LeftFirst; i < leaf.LeftFirst + leaf.PrimCount; ++i) {
+      uint32_t instanceIndex = m_bvh.PrimIndices[i];
+      const Instance& instance = m_instances[instanceIndex];
+
+      if ((instance.InstanceMask & instanceInclusionMask) == 0)
+        continue;
+
+      BlasTraceContext ctx = GetBlasTraceContext(instanceIndex, rayFlags, 0, 1);
+
+      uint32_t occluder;
+      if (!instance.AccelerationStructure->Occluded(GetObjectRay(instance, ray), tMax, ctx,
+                                                    intersectionTable, &occluder))
+        continue;
+
+      cache.TlasId = m_id;
+      cache.InstanceIndex = instanceIndex;
+      cache.Occluder = occluder;
+
+      occluded = true;
+      return true;
+    }
+    return false;
+  });
+
+  if (occluded)
+    CountTraversal(TraversalCounter::ShadowRaysOccluded);
+
+  // Unoccluded rays tend to come in runs too, so stop paying for the cached test until the next
+  // occluder is found.
+  if (!occluded)
+    cache.InstanceIndex = k_invalidIndex;
+
+  return occluded;
+}
+
+template<typename IntersectionTable>
+uint32_t Tlas::OccludedPacket(std::span<const Ray> rays, uint32_t instanceInclusionMask,
+                              uint32_t rayFlags, const IntersectionTable& intersectionTable) const {
+  if (rays.size() > k_rayPacketSize)
+    throw std::invalid_argument("Too many rays for a packet.");
+
+  uint32_t occludedLanes = 0;
+
+  if (!HaveSameDirectionSigns(rays)) {
+    for (uint32_t i = 0; i < rays.size(); ++i) {
+      if (Occluded(rays[i], rays[i].TMax, instanceInclusionMask, rayFlags, intersectionTable))
+        occludedLanes |= 1u << i;
+    }
+    return occludedLanes;
+  }
+
+  CountTraversal(TraversalCounter::ShadowRays, rays.size());
+
+  rayFlags |= k_rayFlagAcceptFirstHitAndEndSearch | k_rayFlagSkipClosestHitShader;
+
+  RayPacket packet{};
+  for (uint32_t i = 0; i < rays.size(); ++i) {
+    SetPacketRay(&packet, i, rays[i]);
+  }
+
+  uint32_t laneMask = (1u << rays.size()) - 1;
+
+  TraversePacketBvh(m_bvh.Nodes, packet, laneMask, [&](const BvhNode& leaf, uint32_t leafLanes) {
+    for (uint32_t i = leaf.LeftFirst; i < leaf.LeftFirst + leaf.PrimCount; ++i) {
+      uint32_t instanceIndex = m_bvh.PrimIndices[i];
+      const Instance& instance = m_instances[instanceIndex];
+
+      uint32_t lanes = leafLanes & ~occludedLanes;
+      if ((instance.InstanceMask & instanceInclusionMask) == 0 || lanes == 0)
+        continue;
+
+      BlasTraceContext ctx = GetBlasTraceContext(instanceIndex, rayFlags, 0, 1);
+      occludedLanes |= instance.AccelerationStructure->OccludedPacket(
+          GetObjectPacket(instance, packet, lanes), lanes, ctx, intersectionTable);
+    }
+    return leafLanes & occludedLanes;
+  });
+
+  CountTraversal(TraversalCounter::ShadowRaysOccluded,
+                 static_cast<uint32_t>(std::popcount(occludedLanes)));
+
+  return occludedLanes;
+}
+
+} // namespace cpu_rt
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace cpu_rt {
+
+// Traversal is only instrumented when CPU_RT_TRAVERSAL_STATS is defined, as it is for the
+// cpu_rt_stats library. Otherwise CountTraversal compiles to nothing.
+#if defined(CPU_RT_TRAVERSAL_STATS)
+inline constexpr bool k_traversalStatsEnabled = true;
+#else
+inline constexpr bool k_traversalStatsEnabled = false;
+#endif
+
+enum class TraversalCounter {
+  // Tlas::TraceRay calls.
+  Rays,
+  // Tlas::Occluded calls, how many of them found an occluder, and how many found it with the
+  // cached primitive before traversing.
+  ShadowRays,
+  ShadowRaysOccluded,
+  OccluderCacheHits,
+  // Binary or 8-wide nodes visited in the Tlas and the Blases.
+  NodesVisited,
+  // Triangle block lanes tested, including the padding of partially filled blocks.
+  TrianglesTested,
+  ProceduralPrimitivesTested,
+  Count
+};
+
+struct TraversalStats {
+  uint64_t Rays = 0;
+  uint64_t ShadowRays = 0;
+  uint64_t ShadowRaysOccluded = 0;
+  uint64_t OccluderCacheHits = 0;
+  uint64_t NodesVisited = 0;
+  uint64_t TrianglesTested = 0;
+  uint64_t ProceduralPrimitivesTested = 0;
+};
+
+// The calling thread's counters, indexed by TraversalCounter. Only the owning thread writes
+// them, so they are updated without read-modify-writes and can be read from any thread.
+std::atomic<uint64_t>* GetThreadTraversalCounters();
+
+inline void CountTraversal(TraversalCounter counter, uint64_t count = 1) {
+  if constexpr (k_traversalStatsEnabled) {
+    std::atomic<uint64_t>& value = GetThreadTraversalCounters()[static_cast<size_t>(counter)];
+    value.store(value.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+  }
+}
+
+// Sums the counters of every thread that has traced so far, including threads that have exited.
+// Counts from threads that are still tracing may be slightly behind.
+TraversalStats GetTraversalStats();
+
+} // namespace cpu_rt
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+
+#include "cpu_rt/math.h"
+#include "cpu_rt/ray.h"
+#include "cpu_rt/simd.h"
+
+namespace cpu_rt {
+
+inline constexpr uint32_t k_triangleBlockWidth = k_simdWidth;
+
+// Up to k_triangleBlockWidth triangles of one BVH leaf in SoA form, transformed into Blas space
+// at build time. Unused lanes hold NaN vertices, which never hit.
+struct alignas(k_triangleBlockWidth * sizeof(float)) TriangleBlock {
+  float V0[3][k_triangleBlockWidth];
+  float V1[3][k_triangleBlockWidth];
+  float V2[3][k_triangleBlockWidth];
+
+  uint32_t GeometryIndex[k_triangleBlockWidth];
+  uint32_t PrimitiveIndex[k_triangleBlockWidth];
+};
+
+// Per-ray constants of the watertight test from "Watertight Ray/Triangle Intersection" (Woop,
+// Benthin and Wald 2013). The ray is sheared so that it points down +z from the origin, which
+// makes the edge tests exact for shared edges: no ray slips between adjacent triangles.
+struct WatertightRay {
+  Float3 Origin;
+  float TMin;
+
+  int Kx, Ky, Kz;
+  float Sx, Sy, Sz;
+};
+
+inline WatertightRay MakeWatertightRay(const Ray& ray) {
+  const Float3& d = ray.Direction;
+
+  WatertightRay wr{};
+  wr.Origin = ray.Origin;
+  wr.TMin = ray.TMin;
+
+  wr.Kz = std::abs(d.x) > std::abs(d.y) ? (std::abs(d.x) > std::abs(d.z) ? 0 : 2)
+                                        : (std::abs(d.y) > std::abs(d.z) ? 1 : 2);
+  wr.Kx = (wr.Kz + 1) % 3;
+  wr.Ky = (wr.Kx + 1) % 3;
+
+  // Keeps the winding, and so the sign of det, independent of the direction.
+  if (d[wr.Kz] < 0.f)
+    std::swap(wr.Kx, wr.Ky);
+
+  wr.Sx = d[wr.Kx] / d[wr.Kz];
+  wr.Sy = d[wr.Ky] / d[wr.Kz];
+  wr.Sz = 1.f / d[wr.Kz];
+
+  return wr;
+}
+
+struct TriangleBlockHits {
+  alignas(k_triangleBlockWidth * sizeof(float)) float T[k_triangleBlockWidth];
+  alignas(k_triangleBlockWidth * sizeof(float)) float U[k_triangleBlockWidth];
+  alignas(k_triangleBlockWidth * sizeof(float)) float V[k_triangleBlockWidth];
+
+  // Bit i is set if lane i hit its front face.
+  uint32_t FrontFaceMask;
+};
+
+// Tests the ray against every lane of the block and returns a bit mask of the lanes hit in
+// [TMin, tMax). As in DXR, with the default winding a triangle is front facing when its
+// vertices appear clockwise from the ray origin. If hits is not null, it receives t and the
+// barycentrics of the hit lanes.
+inline uint32_t IntersectTriangleBlock(const TriangleBlock& block, const WatertightRay& ray,
+                                       uint32_t rayFlags, bool frontCounterClockwise, float tMax,
+                                       TriangleBlockHits* hits) {
+  const int kx = ray.Kx;
+  const int ky = ray.Ky;
+  const int kz = ray.Kz;
+
+  SimdFloat ox = SimdSet(ray.Origin[kx]);
+  SimdFloat oy = SimdSet(ray.Origin[ky]);
+  SimdFloat oz = SimdSet(ray.Origin[kz]);
+  SimdFloat sx = SimdSet(ray.Sx);
+  SimdFloat sy = SimdSet(ray.Sy);
+  SimdFloat sz = SimdSet(ray.Sz);
+
+  // Vertices relative to the origin and sheared into ray space.
+  SimdFloat az = SimdSub(SimdLoad(block.V0[kz]), oz);
+  SimdFloat bz = SimdSub(SimdLoad(block.V1[kz]), oz);
+  SimdFloat cz = SimdSub(SimdLoad(block.V2[kz]), oz);
+
+  SimdFloat ax = SimdSub(SimdSub(SimdLoad(block.V0[kx]), ox), SimdMul(sx, az));
+  SimdFloat ay = SimdSub(SimdSub(SimdLoad(block.V0[ky]), oy), SimdMul(sy, az));
+  SimdFloat bx = SimdSub(SimdSub(SimdLoad(block.V1[kx]), ox), SimdMul(sx, bz));
+  SimdFloat by = SimdSub(SimdSub(SimdLoad(block.V1[ky]), oy), SimdMul(sy, bz));
+  SimdFloat cx = SimdSub(SimdSub(SimdLoad(block.V2[kx]), ox), SimdMul(sx, cz));
+  SimdFloat cy = SimdSub(SimdSub(SimdLoad(block.V2[ky]), oy), SimdMul(sy, cz));
+
+  // Scaled barycentrics of v0, v1 and v2.
+  SimdFloat u = SimdSub(SimdMul(cx, by), SimdMul(cy, bx));
+  SimdFloat v = SimdSub(SimdMul(ax, cy), SimdMul(ay, cx));
+  SimdFloat w = SimdSub(SimdMul(bx, ay), SimdMul(by, ax));
+
+  SimdFloat zero = SimdSet(0.f);
+
+  // A zero means the ray is exactly on an edge, where float rounding could decide differently
+  // for the two triangles sharing it. Those lanes are redone in double precision.
+  uint32_t edgeLanes = SimdMoveMask(SimdOr(SimdOr(SimdEq(u, zero), SimdEq(v, zero)),
+                                           SimdEq(w, zero)));
+  if (edgeLanes != 0) [[unlikely]] {
+    alignas(k_triangleBlockWidth * sizeof(float)) float lanes[9][k_triangleBlockWidth];
+    SimdStore(lanes[0], ax);
+    SimdStore(lanes[1], ay);
+    SimdStore(lanes[2], bx);
+    SimdStore(lanes[3], by);
+    SimdStore(lanes[4], cx);
+    SimdStore(lanes[5], cy);
+    SimdStore(lanes[6], u);
+    SimdStore(lanes[7], v);
+    SimdStore(lanes[8], w);
+
+    for (uint32_t mask = edgeLanes; mask != 0; mask &= mask - 1) {
+      int i = std::countr_zero(mask);
+
+      double dax = lanes[0][i], day = lanes[1][i];
+      double dbx = lanes[2][i], dby = lanes[3][i];
+      double dcx = lanes[4][i], dcy = lanes[5][i];
+
+      lanes[6][i] = static_cast<float>(dcx * dby - dcy * dbx);
+      lanes[7][i] = static_cast<float>(dax * dcy - day * dcx);
+      lanes[8][i] = static_cast<float>(dbx * day - dby * dax);
+    }
+
+    u = SimdLoad(lanes[6]);
+    v = SimdLoad(lanes[7]);
+    w = SimdLoad(lanes[8]);
+  }
+
+  // The ray is inside when all three have the same sign. NaN lanes fail both tests.
+  SimdFloat allNonNegative = SimdAnd(SimdAnd(SimdGe(u, zero), SimdGe(v, zero)), SimdGe(w, zero));
+  SimdFloat allNonPositive = SimdAnd(SimdAnd(SimdLe(u, zero), SimdLe(v, zero)), SimdLe(w, zero));
+  SimdFloat inside = SimdOr(allNonNegative, allNonPositive);
+
+  SimdFloat det = SimdAdd(SimdAdd(u, v), w);
+  SimdFloat hitMask = SimdAnd(inside, SimdNeq(det, zero));
+
+  // det is positive when the vertices appear clockwise.
+  uint32_t positiveDet = SimdMoveMask(SimdGt(det, zero));
+  uint32_t frontFaceMask = frontCounterClockwise ? ~positiveDet : positiveDet;
+
+  uint32_t laneMask = SimdMoveMask(hitMask);
+  if (rayFlags & k_rayFlagCullBackFacingTriangles)
+    laneMask &= frontFaceMask;
+  if (rayFlags & k_rayFlagCullFrontFacingTriangles)
+    laneMask &= ~frontFaceMask;
+
+  if (laneMask == 0)
+    return 0;
+
+  // Compares t * |det| against the range to avoid the divide on misses.
+  SimdFloat scaledT = SimdAdd(SimdAdd(SimdMul(u, SimdMul(sz, az)), SimdMul(v, SimdMul(sz, bz))),
+                              SimdMul(w, SimdMul(sz, cz)));
+
+  SimdFloat detSign = SimdAnd(det, SimdSignMask());
+  SimdFloat absDet = SimdAbs(det);
+  SimdFloat signedT = SimdXor(scaledT, detSign);
+
+  SimdFloat inRange = SimdAnd(SimdGe(signedT, SimdMul(SimdSet(ray.TMin), absDet)),
+                              SimdLt(signedT, SimdMul(SimdSet(tMax), absDet)));
+
+  laneMask &= SimdMoveMask(inRange);
+
+  if (laneMask != 0 && hits) {
+    SimdFloat invDet = SimdDiv(SimdSet(1.f), det);
+
+    SimdStore(hits->T, SimdMul(scaledT, invDet));
+    SimdStore(hits->U, SimdMul(v, invDet));
+    SimdStore(hits->V, SimdMul(w, invDet));
+    hits->FrontFaceMask = frontFaceMask;
+  }
+
+  return laneMask;
+}
+
+} // namespace cpu_rt
@@ -0,0 +1,494 @@
+#include "cpu_rt/light_sampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+namespace cpu_rt {
+
+namespace {
+
+// Splits are evaluated between this many buckets along each axis.
+constexpr uint32_t k_numBuckets = 12;
+
+// Below this depth the BVH splits by cost, deeper it splits at the median, so that the bit
+// trails of the lights fit in 64 bits.
+constexpr uint32_t k_maxCostSplitDepth = 32;
+
+// Marks the bit trail of a light that is not in the BVH.
+constexpr uint64_t k_noBitTrail = ~0ull;
+
+constexpr float k_oneMinusEpsilon = 0x1.fffffep-1f;
+
+float SafeSqrt(float x) {
+  return std::sqrt(std::max(0.f, x));
+}
+
+float SafeAcos(float x) {
+  return std::acos(std::clamp(x, -1.f, 1.f));
+}
+
+// cos(max(0, a - b)) and sin(max(0, a - b)) of angles given by their sines and cosines.
+float CosSubClamped(float sinA, float cosA, float sinB, float cosB) {
+  if (cosA > cosB)
+    return 1.f;
+
+  return cosA * cosB + sinA * sinB;
+}
+
+float SinSubClamped(float sinA, float cosA, float sinB, float cosB) {
+  if (cosA > cosB)
+    return 0.f;
+
+  return sinA * cosB - cosA * sinB;
+}
+
+// Rotates v by angle about the unit axis (Rodrigues' formula).
+Float3 Rotate(const Float3& v, const Float3& axis, float angle) {
+  float cosAngle = std::cos(angle);
+  float sinAngle = std::sin(angle);
+
+  return cosAngle * v + sinAngle * Cross(axis, v) + ((1.f - cosAngle) * Dot(axis, v)) * axis;
+}
+
+// The cost of a BVH node over bounds b, as part of a node over parentBounds split along axis:
+// its power times the solid angle its cone emits into times its surface area, with boxes that
+// are thin along the axis made more expensive.
+float GetSplitCost(const LightBounds& b, const Aabb& parentBounds, int axis) {
+  float thetaO = SafeAcos(b.CosThetaO);
+  float thetaE = SafeAcos(b.CosThetaE);
+  float thetaW = std::min(thetaO + thetaE, k_pi);
+  float sinThetaO = SafeSqrt(1.f - b.CosThetaO * b.CosThetaO);
+
+  float solidAngle = 2.f * k_pi * (1.f - b.CosThetaO) +
+                     k_pi / 2.f * (2.f * thetaW * sinThetaO - std::cos(thetaO - 2.f * thetaW) -
+                                   2.f * thetaO * sinThetaO + b.CosThetaO);
+
+  Float3 extent = parentBounds.Extent();
+  float aspect = std::max({extent.x, extent.y, extent.z}) / extent[axis];
+
+  return b.Power * solidAngle * aspect * b.Bounds.SurfaceArea();
+}
+
+} // namespace
+
+AliasTable::AliasTable(std::span<const float> weights) : m_bins(weights.size()) {
+  double sum = std::accumulate(weights.begin(), weights.end(), 0.0);
+  if (!(sum > 0.0))
+    return;
+
+  auto n = static_cast<double>(weights.size());
+
+  // Each bin holds n * pmf of its index until it is paired with an alias.
+  std::vector<double> scaled(weights.size());
+  std::vector<uint32_t> under;
+  std::vector<uint32_t> over;
+
+  for (uint32_t i = 0; i < weights.size(); ++i) {
+    m_bins[i].Pmf = static_cast<float>(weights[i] / sum);
+    m_bins[i].Alias = i;
+
+    scaled[i] = weights[i] / sum * n;
+    (scaled[i] < 1.0 ? under : over).push_back(i);
+  }
+
+  while (!under.empty() && !over.empty()) {
+    uint32_t small = under.back();
+    under.pop_back();
+    uint32_t large = over.back();
+    over.pop_back();
+
+    m_bins[small].Probability = static_cast<float>(scaled[small]);
+    m_bins[small].Alias = large;
+
+    scaled[large] -= 1.0 - scaled[small];
+    (scaled[large] < 1.0 ? under : over).push_back(large);
+  }
+
+  // What is left is 1 up to rounding.
+  for (uint32_t i : under) {
+    m_bins[i].Probability = 1.f;
+  }
+  for (uint32_t i : over) {
+    m_bins[i].Probability = 1.f;
+  }
+}
+
+uint32_t AliasTable::Sample(float u, float* pmf) const {
+  float scaled = u * static_cast<float>(m_bins.size());
+  uint32_t bin = std::min(static_cast<uint32_t>(scaled), GetSize() - 1);
+  float up = std::min(scaled - static_cast<float>(bin), k_oneMinusEpsilon);
+
+  uint32_t index = up < m_bins[bin].Probability ? bin : m_bins[bin].Alias;
+  *pmf = m_bins[index].Pmf;
+  return index;
+}
+
+float LightBounds::GetImportance(const Float3& p, const Float3& n) const {
+  Float3 center = Bounds.Centroid();
+  Float3 toPoint = p - center;
+
+  // Points inside or next to the bounds are treated as if they were half a diagonal away.
+  float distSq = Dot(toPoint, toPoint);
+  distSq = std::max(distSq, 0.5f * Length(Bounds.Extent()));
+
+  Float3 wi = Normalize(toPoint);
+
+  float cosThetaW = Dot(Axis, wi);
+  if (TwoSided)
+    cosThetaW = std::abs(cosThetaW);
+  float sinThetaW = SafeSqrt(1.f - cosThetaW * cosThetaW);
+
+  // The half angle of the cone of directions from p that reach the bounding sphere, the whole
+  // sphere if p is inside it.
+  float radiusSq = 0.25f * Dot(Bounds.Extent(), Bounds.Extent());
+  float cosThetaB = -1.f;
+  if (Dot(toPoint, toPoint) > radiusSq)
+    cosThetaB = SafeSqrt(1.f - radiusSq / Dot(toPoint, toPoint));
+  float sinThetaB = SafeSqrt(1.f - cosThetaB * cosThetaB);
+
+  // The smallest angle between a normal in the cone and a direction towards p, which the lights
+  // must emit into.
+  float sinThetaO = SafeSqrt(1.f - CosThetaO * CosThetaO);
+  float cosThetaX = CosSubClamped(sinThetaW, cosThetaW, sinThetaO, CosThetaO);
+  float sinThetaX = SinSubClamped(sinThetaW, cosThetaW, sinThetaO, CosThetaO);
+  float cosThetaP = CosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+  if (cosThetaP <= CosThetaE)
+    return 0.f;
+
+  float importance = Power * cosThetaP / distSq;
+
+  // The largest cosine between n and a direction from p towards the bounds.
+  float cosThetaI = -Dot(wi, n);
+  float sinThetaI = SafeSqrt(1.f - cosThetaI * cosThetaI);
+  importance *= CosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+
+  return std::max(0.f, importance);
+}
+
+LightBounds GetLightBounds(const AreaLight& light) {
+  LightBounds bounds{};
+
+  bounds.Bounds = Aabb::Empty();
+  bounds.Bounds.Grow(light.P0);
+  bounds.Bounds.Grow(light.P0 + light.Edge1);
+  bounds.Bounds.Grow(light.P0 + light.Edge2);
+  if (light.IsParallelogram)
+    bounds.Bounds.Grow(light.P0 + light.Edge1 + light.Edge2);
+
+  // Flat diffuse emitters: one normal, emitting up to 90 degrees off it.
+  bounds.Axis = light.GetNormal();
+  bounds.CosThetaO = 1.f;
+  bounds.CosThetaE = 0.f;
+
+  bounds.Power = light.GetPower();
+  bounds.TwoSided = light.TwoSided;
+  return bounds;
+}
+
+LightBounds UnionLightBounds(const LightBounds& a, const LightBounds& b) {
+  if (a.Power == 0.f)
+    return b;
+  if (b.Power == 0.f)
+    return a;
+
+  LightBounds result{};
+
+  result.Bounds = a.Bounds;
+  result.Bounds.Grow(b.Bounds);
+
+  result.Power = a.Power + b.Power;
+  result.CosThetaE = std::min(a.CosThetaE, b.CosThetaE);
+  result.TwoSided = a.TwoSided || b.TwoSided;
+
+  // The smallest cone around both cones.
+  float thetaA = SafeAcos(a.CosThetaO);
+  float thetaB = SafeAcos(b.CosThetaO);
+  float thetaD = SafeAcos(Dot(a.Axis, b.Axis));
+
+  if (std::min(thetaD + thetaB, k_pi) <= thetaA) {
+    result.Axis = a.Axis;
+    result.CosThetaO = a.CosThetaO;
+    return result;
+  }
+
+  if (std::min(thetaD + thetaA, k_pi) <= thetaB) {
+    result.Axis = b.Axis;
+    result.CosThetaO = b.CosThetaO;
+    return result;
+  }
+
+  float thetaO = 0.5f * (thetaA + thetaD + thetaB);
+  Float3 rotationAxis = Cross(a.Axis, b.Axis);
+
+  if (thetaO >= k_pi || Dot(rotationAxis, rotationAxis) == 0.f) {
+    result.Axis = a.Axis;
+    result.CosThetaO = -1.f;
+    return result;
+  }
+
+  result.Axis = Rotate(a.Axis, Normalize(rotationAxis), thetaO - thetaA);
+  result.CosThetaO = std::cos(thetaO);
+  return result;
+}
+
+LightSampler::LightSampler(std::span<const AreaLight> lights, LightSamplerType type,
+                           bool hasEnvironmentLight)
+  : m_type(type), m_lightCount(static_cast<uint32_t>(lights.size())) {
+  if (hasEnvironmentLight) {
+    if (m_lightCount == 0) {
+      m_environmentPmf = 1.f;
+    } else if (type == LightSamplerType::Uniform) {
+      m_environmentPmf = 1.f / static_cast<float>(m_lightCount + 1);
+    } else {
+      m_environmentPmf = 0.5f;
+    }
+  }
+
+  if (type == LightSamplerType::Power) {
+    std::vector<float> powers;
+    powers.reserve(lights.size());
+
+    for (const AreaLight& light : lights) {
+      powers.push_back(light.GetPower());
+    }
+
+    m_powerTable = AliasTable(powers);
+  }
+
+  if (type == LightSamplerType::Bvh) {
+    std::vector<LightBounds> lightBounds;
+    std::vector<uint32_t> lightIndices;
+
+    for (uint32_t i = 0; i < m_lightCount; ++i) {
+      lightBounds.push_back(GetLightBounds(lights[i]));
+      if (lightBounds.back().Power > 0.f)
+        lightIndices.push_back(i);
+    }
+
+    m_bitTrails.resize(m_lightCount, k_noBitTrail);
+
+    if (!lightIndices.empty())
+      BuildBvh(lightBounds, lightIndices, 0, 0);
+  }
+}
+
+uint32_t LightSampler::BuildBvh(std::span<const LightBounds> lightBounds,
+                                std::span<uint32_t> lightIndices, uint64_t bitTrail,
+                                uint32_t depth) {
+  auto nodeIndex = static_cast<uint32_t>(m_nodes.size());
+  m_nodes.emplace_back();
+
+  if (lightIndices.size() == 1) {
+    m_nodes[nodeIndex] = Node{lightBounds[lightIndices[0]], lightIndices[0], true};
+    m_bitTrails[lightIndices[0]] = bitTrail;
+    return nodeIndex;
+  }
+
+  Aabb bounds = Aabb::Empty();
+  Aabb centroidBounds = Aabb::Empty();
+
+  for (uint32_t i : lightIndices) {
+    bounds.Grow(lightBounds[i].Bounds);
+    centroidBounds.Grow(lightBounds[i].Bounds.Centroid());
+  }
+
+  int bestAxis = -1;
+  uint32_t bestBucket = 0;
+  float bestCost = std::numeric_limits<float>::infinity();
+
+  auto getBucket = [&](uint32_t light, int axis) {
+    float minCentroid = centroidBounds.Min[axis];
+    float scale = static_cast<float>(k_numBuckets) / (centroidBounds.Max[axis] - minCentroid);
+    auto bucket = static_cast<uint32_t>(
+        std::max(0.f, (lightBounds[light].Bounds.Centroid()[axis] - minCentroid) * scale));
+    return std::min(bucket, k_numBuckets - 1);
+  };
+
+  for (int axis = 0; axis < 3 && depth < k_maxCostSplitDepth; ++axis) {
+    if (centroidBounds.Max[axis] <= centroidBounds.Min[axis])
+      continue;
+
+    LightBounds buckets[k_numBuckets]{};
+    for (uint32_t i : lightIndices) {
+      LightBounds& bucket = buckets[getBucket(i, axis)];
+      bucket = UnionLightBounds(bucket, lightBounds[i]);
+    }
+
+    for (uint32_t split = 0; split < k_numBuckets - 1; ++split) {
+      LightBounds left{};
+      LightBounds right{};
+
+      for (uint32_t b = 0; b <= split; ++b) {
+        left = UnionLightBounds(left, buckets[b]);
+      }
+      for (uint32_t b = split + 1; b < k_numBuckets; ++b) {
+        right = UnionLightBounds(right, buckets[b]);
+      }
+
+      if (left.Power == 0.f || right.Power == 0.f)
+        continue;
+
+      float cost = GetSplitCost(left, bounds, axis) + GetSplitCost(right, bounds, axis);
+      if (cost < bestCost) {
+        bestAxis = axis;
+        bestBucket = split;
+        bestCost = cost;
+      }
+    }
+  }
+
+  size_t leftCount = lightIndices.size() / 2;
+
+  if (bestAxis != -1) {
+    auto middle = std::partition(lightIndices.begin(), lightIndices.end(), [&](uint32_t i) {
+      return getBucket(i, bestAxis) <= bestBucket;
+    });
+    leftCount = static_cast<size_t>(middle - lightIndices.begin());
+  } else {
+    // Deep nodes, coincident centroids or costs that overflowed.
+    Float3 extent = centroidBounds.Extent();
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+    std::nth_element(lightIndices.begin(), lightIndices.begin() + leftCount, lightIndices.end(),
+                     [&](uint32_t a, uint32_t b) {
+                       return lightBounds[a].Bounds.Centroid()[axis] <
+                              lightBounds[b].Bounds.Centroid()[axis];
+                     });
+  }
+
+  BuildBvh(lightBounds, lightIndices.first(leftCount), bitTrail, depth + 1);
+  uint32_t secondChild = BuildBvh(lightBounds, lightIndices.subspan(leftCount),
+                                  bitTrail | (1ull << depth), depth + 1);
+
+  m_nodes[nodeIndex] = Node{UnionLightBounds(m_nodes[nodeIndex + 1].Bounds,
+                                             m_nodes[secondChild].Bounds),
+                            secondChild, false};
+  return nodeIndex;
+}
+
+bool LightSampler::Sample(const Float3& p, const Float3& n, float u, uint32_t* light,
+                          float* pmf) const {
+  if (m_environmentPmf == 0.f)
+    return SampleAreaLight(p, n, u, light, pmf);
+
+  if (u < m_environmentPmf) {
+    *light = m_lightCount;
+    *pmf = m_environmentPmf;
+    return true;
+  }
+
+  // Stretches the rest of u back over [0, 1) for the area lights.
+  u = std::min((u - m_environmentPmf) / (1.f - m_environmentPmf), k_oneMinusEpsilon);
+
+  if (!SampleAreaLight(p, n, u, light, pmf))
+    return false;
+
+  *pmf *= 1.f - m_environmentPmf;
+  return true;
+}
+
+float LightSampler::GetPmf(const Float3& p, const Float3& n, uint32_t light) const {
+  if (light == m_lightCount)
+    return m_environmentPmf;
+
+  return (1.f - m_environmentPmf) * GetAreaLightPmf(p, n, light);
+}
+
+bool LightSampler::SampleAreaLight(const Float3& p, const Float3& n, float u, uint32_t* light,
+                                   float* pmf) const {
+  if (m_lightCount == 0)
+    return false;
+
+  if (m_type == LightSamplerType::Uniform) {
+    *light = std::min(static_cast<uint32_t>(u * static_cast<float>(m_lightCount)),
+                      m_lightCount - 1);
+    *pmf = 1.f / static_cast<float>(m_lightCount);
+    return true;
+  }
+
+  if (m_type == LightSamplerType::Power) {
+    if (m_powerTable.GetSize() == 0)
+      return false;
+
+    *light = m_powerTable.Sample(u, pmf);
+    return *pmf > 0.f;
+  }
+
+  if (m_nodes.empty())
+    return false;
+
+  uint32_t nodeIndex = 0;
+  float nodePmf = 1.f;
+
+  while (!m_nodes[nodeIndex].IsLeaf) {
+    const Node& node = m_nodes[nodeIndex];
+
+    float importance0 = m_nodes[nodeIndex + 1].Bounds.GetImportance(p, n);
+    float importance1 = m_nodes[node.ChildOrLightIndex].Bounds.GetImportance(p, n);
+    if (importance0 == 0.f && importance1 == 0.f)
+      return false;
+
+    // Picks a child and stretches the part of u that picked it back over [0, 1).
+    float p0 = importance0 / (importance0 + importance1);
+
+    if (u < p0) {
+      nodeIndex = nodeIndex + 1;
+      nodePmf *= p0;
+      u = std::min(u / p0, k_oneMinusEpsilon);
+    } else {
+      nodeIndex = node.ChildOrLightIndex;
+      nodePmf *= 1.f - p0;
+      u = std::min((u - p0) / (1.f - p0), k_oneMinusEpsilon);
+    }
+  }
+
+  const Node& leaf = m_nodes[nodeIndex];
+
+  // Interior nodes already checked the importance of a leaf below the root.
+  if (nodeIndex == 0 && leaf.Bounds.GetImportance(p, n) == 0.f)
+    return false;
+
+  *light = leaf.ChildOrLightIndex;
+  *pmf = nodePmf;
+  return true;
+}
+
+float LightSampler::GetAreaLightPmf(const Float3& p, const Float3& n, uint32_t light) const {
+  if (m_type == LightSamplerType::Uniform)
+    return 1.f / static_cast<float>(m_lightCount);
+
+  if (m_type == LightSamplerType::Power)
+    return m_powerTable.GetSize() > 0 ? m_powerTable.GetPmf(light) : 0.f;
+
+  uint64_t bitTrail = m_bitTrails[light];
+  if (bitTrail == k_noBitTrail)
+    return 0.f;
+
+  uint32_t nodeIndex = 0;
+  float pmf = 1.f;
+
+  while (!m_nodes[nodeIndex].IsLeaf) {
+    const Node& node = m_nodes[nodeIndex];
+
+    float importance0 = m_nodes[nodeIndex + 1].Bounds.GetImportance(p, n);
+    float importance1 = m_nodes[node.ChildOrLightIndex].Bounds.GetImportance(p, n);
+    if (importance0 == 0.f && importance1 == 0.f)
+      return 0.f;
+
+    if (bitTrail & 1) {
+      pmf *= importance1 / (importance0 + importance1);
+      nodeIndex = node.ChildOrLightIndex;
+    } else {
+      pmf *= importance0 / (importance0 + importance1);
+      nodeIndex = nodeIndex + 1;
+    }
+
+    bitTrail >>= 1;
+  }
+
+  return pmf;
+}
+
+} // namespace cpu_rt
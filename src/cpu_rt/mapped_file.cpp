@@ -0,0 +1,74 @@
+#include "cpu_rt/mapped_file.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <wil/resource.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace cpu_rt {
+
+#ifdef _WIN32
+
+std::unique_ptr<MappedFile> MappedFile::Open(const std::filesystem::path& path) {
+  wil::unique_hfile file(CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                     OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr));
+  if (!file)
+    return nullptr;
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file.get(), &size) || size.QuadPart == 0)
+    return nullptr;
+
+  wil::unique_handle mapping(
+      CreateFileMappingW(file.get(), nullptr, PAGE_READONLY, 0, 0, nullptr));
+  if (!mapping)
+    return nullptr;
+
+  // The view keeps the file mapped after both handles are closed.
+  void* data = MapViewOfFile(mapping.get(), FILE_MAP_READ, 0, 0, 0);
+  if (!data)
+    return nullptr;
+
+  return std::unique_ptr<MappedFile>(
+      new MappedFile(static_cast<const uint8_t*>(data), static_cast<size_t>(size.QuadPart)));
+}
+
+MappedFile::~MappedFile() {
+  UnmapViewOfFile(m_data);
+}
+
+#else
+
+std::unique_ptr<MappedFile> MappedFile::Open(const std::filesystem::path& path) {
+  int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (file < 0)
+    return nullptr;
+
+  struct stat info;
+  bool valid = fstat(file, &info) == 0 && info.st_size > 0;
+
+  // The mapping keeps the file mapped after the descriptor is closed.
+  void* data = valid ? mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE,
+                            file, 0)
+                     : MAP_FAILED;
+  close(file);
+
+  if (data == MAP_FAILED)
+    return nullptr;
+
+  return std::unique_ptr<MappedFile>(
+      new MappedFile(static_cast<const uint8_t*>(data), static_cast<size_t>(info.st_size)));
+}
+
+MappedFile::~MappedFile() {
+  munmap(const_cast<uint8_t*>(m_data), m_size);
+}
+
+#endif
+
+} // namespace cpu_rt
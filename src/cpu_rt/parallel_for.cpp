@@ -0,0 +1,146 @@
+#include "cpu_rt/parallel_for.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace cpu_rt {
+
+namespace {
+
+// Set on the pool's workers, and on the calling thread while it works on a call.
+thread_local bool t_inParallelFor = false;
+
+class ThreadPool {
+public:
+  ThreadPool() {
+    unsigned int threadCount = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned int i = 1; i < threadCount; ++i) {
+      m_workers.emplace_back([this]() { WorkerLoop(); });
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard lock(m_mutex);
+      m_stop = true;
+    }
+    m_wake.notify_all();
+
+    for (std::thread& worker : m_workers) {
+      worker.join();
+    }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  void Run(size_t count, const std::function<void(size_t, size_t)>& fn, size_t chunkSize) {
+    std::lock_guard callLock(m_callMutex);
+
+    {
+      std::lock_guard lock(m_mutex);
+      m_count = count;
+      m_fn = &fn;
+      m_chunkSize = chunkSize;
+      m_next = 0;
+      m_error = nullptr;
+      m_busyWorkers = m_workers.size();
+      ++m_generation;
+    }
+    m_wake.notify_all();
+
+    t_inParallelFor = true;
+    Work();
+    t_inParallelFor = false;
+
+    std::unique_lock lock(m_mutex);
+    m_done.wait(lock, [&]() { return m_busyWorkers == 0; });
+
+    if (m_error)
+      std::rethrow_exception(m_error);
+  }
+
+private:
+  void WorkerLoop() {
+    t_inParallelFor = true;
+
+    uint64_t generation = 0;
+    while (true) {
+      {
+        std::unique_lock lock(m_mutex);
+        m_wake.wait(lock, [&]() { return m_stop || m_generation != generation; });
+        if (m_stop)
+          return;
+
+        generation = m_generation;
+      }
+
+      Work();
+
+      std::lock_guard lock(m_mutex);
+      if (--m_busyWorkers == 0)
+        m_done.notify_one();
+    }
+  }
+
+  void Work() {
+    while (true) {
+      size_t begin = m_next.fetch_add(m_chunkSize, std::memory_order_relaxed);
+      if (begin >= m_count)
+        return;
+
+      try {
+        (*m_fn)(begin, std::min(begin + m_chunkSize, m_count));
+      } catch (...) {
+        // The remaining chunks are skipped.
+        m_next = m_count;
+
+        std::lock_guard lock(m_mutex);
+        if (!m_error)
+          m_error = std::current_exception();
+      }
+    }
+  }
+
+  std::vector<std::thread> m_workers;
+
+  // Held for the whole of a call, so that calls from different threads take turns.
+  std::mutex m_callMutex;
+
+  // Guards the call and the counts below, which m_wake and m_done signal changes of.
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::condition_variable m_done;
+  uint64_t m_generation = 0;
+  size_t m_busyWorkers = 0;
+  bool m_stop = false;
+
+  // The current call, which the workers read once m_wake has woken them.
+  size_t m_count = 0;
+  const std::function<void(size_t, size_t)>* m_fn = nullptr;
+  size_t m_chunkSize = 0;
+  std::atomic<size_t> m_next = 0;
+  std::exception_ptr m_error;
+};
+
+} // namespace
+
+void ParallelFor(size_t count, const std::function<void(size_t, size_t)>& fn,
+                 size_t chunkSize) {
+  if (t_inParallelFor) {
+    for (size_t begin = 0; begin < count; begin += chunkSize) {
+      fn(begin, std::min(begin + chunkSize, count));
+    }
+    return;
+  }
+
+  static ThreadPool pool;
+  pool.Run(count, fn, chunkSize);
+}
+
+} // namespace cpu_rt
@@ -0,0 +1,348 @@
+#include "cpu_rt/path_guide.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+#include "cpu_rt/parallel_for.h"
+#include "cpu_rt/shading.h"
+
+namespace cpu_rt {
+
+namespace {
+
+// Radiance is summed in units of 2^-20, and a single record is clamped to 2^32 so that a
+// quadrant takes 4096 of them before it can overflow.
+constexpr float k_radianceScale = 1048576.f;
+constexpr float k_maxRadiance = 4294967296.f;
+
+// Leaves stop splitting at this depth, where they are some 2^-20 of the scene across.
+constexpr uint32_t k_maxSpatialDepth = 60;
+
+constexpr float k_oneMinusEpsilon = 0x1.fffffep-1f;
+
+uint64_t Quantize(float radiance) {
+  if (!(radiance > 0.f))
+    return 0;
+
+  return static_cast<uint64_t>(std::min(radiance, k_maxRadiance) * k_radianceScale);
+}
+
+// The point of the unit square that a direction maps to: the cosine of its angle to +y scaled
+// to [0, 1], and its azimuth around y as a fraction of a turn. The map preserves area, so the
+// square's density is 4 pi times the pdf in solid angle.
+void GetSquarePoint(const Float3& direction, float* x, float* y) {
+  *x = std::clamp(0.5f * (direction.y + 1.f), 0.f, k_oneMinusEpsilon);
+
+  float phi = std::atan2(direction.z, direction.x);
+  if (phi < 0.f)
+    phi += 2.f * k_pi;
+
+  *y = std::clamp(phi / (2.f * k_pi), 0.f, k_oneMinusEpsilon);
+}
+
+Float3 GetSquareDirection(float x, float y) {
+  float cosTheta = 2.f * x - 1.f;
+  float sinTheta = std::sqrt(std::max(0.f, 1.f - cosTheta * cosTheta));
+  return SphericalDirection(sinTheta, cosTheta, 2.f * k_pi * y);
+}
+
+// The quadrant of a node that a point of its square falls in, with the point moved into the
+// quadrant's square. Quadrants are numbered x first.
+uint32_t GetQuadrant(float* x, float* y) {
+  uint32_t quadrant = 0;
+
+  *x *= 2.f;
+  if (*x >= 1.f) {
+    *x -= 1.f;
+    quadrant |= 1;
+  }
+
+  *y *= 2.f;
+  if (*y >= 1.f) {
+    *y -= 1.f;
+    quadrant |= 2;
+  }
+
+  return quadrant;
+}
+
+} // namespace
+
+PathGuide::PathGuide(const Aabb& sceneBounds, const PathGuideSettings& settings)
+  : m_origin{0.f, 0.f, 0.f}, m_size(1.f), m_settings(settings) {
+  // The tree splits a cube, so that its leaves stay close to cubes themselves.
+  if (!sceneBounds.IsEmpty()) {
+    Float3 extent = sceneBounds.Extent();
+    m_origin = sceneBounds.Min;
+    m_size = std::max({extent.x, extent.y, extent.z, 1e-6f}) * 1.0001f;
+  }
+
+  m_nodes.push_back(SpatialNode{{0, 0}, 0});
+
+  Leaf& leaf = m_leaves.emplace_back();
+  leaf.Sampling.resize(1);
+  leaf.Building = RefineQuadTree(leaf.Sampling);
+
+  m_stats.LeafCount = 1;
+  m_stats.DirectionalNodeCount = static_cast<float>(leaf.Building.size());
+}
+
+uint32_t PathGuide::GetLeaf(const Float3& p) const {
+  Float3 local = (p - m_origin) / m_size;
+  float coordinates[3] = {std::clamp(local.x, 0.f, k_oneMinusEpsilon),
+                          std::clamp(local.y, 0.f, k_oneMinusEpsilon),
+                          std::clamp(local.z, 0.f, k_oneMinusEpsilon)};
+
+  uint32_t node = 0;
+  for (uint32_t depth = 0; m_nodes[node].Children[0] != 0; ++depth) {
+    float& x = coordinates[depth % 3];
+    x *= 2.f;
+
+    uint32_t child = 0;
+    if (x >= 1.f) {
+      x -= 1.f;
+      child = 1;
+    }
+
+    node = m_nodes[node].Children[child];
+  }
+
+  return m_nodes[node].Leaf;
+}
+
+bool PathGuide::CanSample(uint32_t leaf) const {
+  const uint64_t* sum = m_leaves[leaf].Sampling[0].Sum;
+  return sum[0] + sum[1] + sum[2] + sum[3] > 0;
+}
+
+Float3 PathGuide::Sample(uint32_t leaf, float u, float v) const {
+  const QuadTree& tree = m_leaves[leaf].Sampling;
+
+  float originX = 0.f;
+  float originY = 0.f;
+  float size = 1.f;
+
+  // Picks the column of quadrants by its share of the radiance and then the quadrant within it,
+  // reusing what is left of u and v at each level.
+  uint32_t node = 0;
+  do {
+    const float* share = tree[node].Share;
+
+    uint32_t quadrant = 0;
+
+    // The shares are rounded separately, so left may fall short of 1 with none of the radiance
+    // on the right. Such a column, or quadrant, must never be picked.
+    float left = share[0] + share[2];
+    if (u < left || share[1] + share[3] == 0.f) {
+      u /= left;
+    } else {
+      u = (u - left) / (1.f - left);
+      quadrant |= 1;
+    }
+
+    float column = share[quadrant] + share[quadrant + 2];
+    float bottom = column > 0.f ? share[quadrant] / column : 0.5f;
+    if (v < bottom) {
+      v /= bottom;
+    } else {
+      v = (v - bottom) / (1.f - bottom);
+      quadrant |= 2;
+    }
+
+    u = std::min(u, k_oneMinusEpsilon);
+    v = std::min(v, k_oneMinusEpsilon);
+
+    size *= 0.5f;
+    originX += (quadrant & 1) ? size : 0.f;
+    originY += (quadrant & 2) ? size : 0.f;
+
+    node = tree[node].Children[quadrant];
+  } while (node != 0);
+
+  return GetSquareDirection(originX + u * size, originY + v * size);
+}
+
+float PathGuide::GetPdf(uint32_t leaf, const Float3& direction) const {
+  const QuadTree& tree = m_leaves[leaf].Sampling;
+
+  float x, y;
+  GetSquarePoint(direction, &x, &y);
+
+  // Each level scales the density by how much more than a fourth of the radiance the quadrant
+  // holds.
+  float density = 1.f;
+
+  uint32_t node = 0;
+  do {
+    uint32_t quadrant = GetQuadrant(&x, &y);
+    density *= 4.f * tree[node].Share[quadrant];
+    node = tree[node].Children[quadrant];
+  } while (node != 0);
+
+  return density / (4.f * k_pi);
+}
+
+void PathGuide::AddRadiance(PathGuideVertex* vertex, const Float3& contribution) {
+  vertex->Radiance += Quantize(Luminance(contribution * vertex->InverseThroughput));
+}
+
+void PathGuide::Record(const PathGuideVertex& vertex) {
+  Leaf& leaf = m_leaves[vertex.Leaf];
+
+  std::atomic_ref(leaf.SampleCount).fetch_add(1, std::memory_order_relaxed);
+
+  // The Monte Carlo estimate of the radiance arriving through each node.
+  uint64_t radiance = Quantize(static_cast<float>(vertex.Radiance) /
+                               (k_radianceScale * vertex.Pdf));
+  if (radiance == 0)
+    return;
+
+  float x, y;
+  GetSquarePoint(vertex.Direction, &x, &y);
+
+  uint32_t node = 0;
+  do {
+    uint32_t quadrant = GetQuadrant(&x, &y);
+
+    // EndFrame joins the threads before it reads the sums, so the adds need no ordering.
+    std::atomic_ref(leaf.Building[node].Sum[quadrant])
+        .fetch_add(radiance, std::memory_order_relaxed);
+
+    node = leaf.Building[node].Children[quadrant];
+  } while (node != 0);
+}
+
+void PathGuide::EndFrame(uint32_t samplesPerPixel) {
+  m_iterationSamples += samplesPerPixel;
+  if (++m_iterationFrames < (1u << std::min(m_iteration, 31u)))
+    return;
+
+  float threshold = m_settings.SpatialThreshold *
+                    std::sqrt(static_cast<float>(m_iterationSamples));
+  SplitSpatialNode(0, 0, threshold);
+
+  // What each leaf built this iteration is what it samples next, and the shape of what it
+  // builds next.
+  ParallelFor(m_leaves.size(), [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      Leaf& leaf = m_leaves[i];
+      leaf.Sampling = std::move(leaf.Building);
+      leaf.Building = RefineQuadTree(leaf.Sampling);
+      leaf.SampleCount = 0;
+
+      for (QuadNode& node : leaf.Sampling) {
+        uint64_t total = node.Sum[0] + node.Sum[1] + node.Sum[2] + node.Sum[3];
+        for (uint32_t quadrant = 0; quadrant < 4; ++quadrant) {
+          node.Share[quadrant] = total > 0 ? static_cast<float>(
+                                                 static_cast<double>(node.Sum[quadrant]) /
+                                                 static_cast<double>(total))
+                                           : 0.25f;
+        }
+      }
+    }
+  }, 16);
+
+  ++m_iteration;
+  m_iterationFrames = 0;
+  m_iterationSamples = 0;
+
+  size_t nodeCount = 0;
+  for (const Leaf& leaf : m_leaves) {
+    nodeCount += leaf.Building.size();
+  }
+
+  m_stats.Iteration = m_iteration;
+  m_stats.LeafCount = static_cast<uint32_t>(m_leaves.size());
+  m_stats.DirectionalNodeCount = static_cast<float>(nodeCount) /
+                                 static_cast<float>(m_leaves.size());
+}
+
+size_t PathGuide::GetMemoryUsage() const {
+  size_t size = m_nodes.size() * sizeof(SpatialNode) + m_leaves.size() * sizeof(Leaf);
+  for (const Leaf& leaf : m_leaves) {
+    size += (leaf.Sampling.size() + leaf.Building.size()) * sizeof(QuadNode);
+  }
+  return size;
+}
+
+// Splits the leaf in half if it recorded more than threshold vertices, and its halves until
+// they do not. Each half starts with a copy of the quadtrees and half the vertices.
+void PathGuide::SplitSpatialNode(uint32_t node, uint32_t depth, float threshold) {
+  if (m_nodes[node].Children[0] != 0) {
+    SplitSpatialNode(m_nodes[node].Children[0], depth + 1, threshold);
+    SplitSpatialNode(m_nodes[node].Children[1], depth + 1, threshold);
+    return;
+  }
+
+  uint32_t leaf = m_nodes[node].Leaf;
+  if (static_cast<float>(m_leaves[leaf].SampleCount) <= threshold ||
+      depth >= k_maxSpatialDepth)
+    return;
+
+  m_leaves[leaf].SampleCount /= 2;
+
+  auto otherLeaf = static_cast<uint32_t>(m_leaves.size());
+  m_leaves.push_back(m_leaves[leaf]);
+
+  auto child = static_cast<uint32_t>(m_nodes.size());
+  m_nodes.push_back(SpatialNode{{0, 0}, leaf});
+  m_nodes.push_back(SpatialNode{{0, 0}, otherLeaf});
+  m_nodes[node].Children[0] = child;
+  m_nodes[node].Children[1] = child + 1;
+
+  SplitSpatialNode(child, depth + 1, threshold);
+  SplitSpatialNode(child + 1, depth + 1, threshold);
+}
+
+// An empty quadtree that splits each quadrant of tree with more than DirectionalThreshold of
+// its radiance, so that the next iteration resolves the directions light came from. Quadrants
+// that were not split share their radiance evenly among the quadrants they split into.
+PathGuide::QuadTree PathGuide::RefineQuadTree(const QuadTree& tree) const {
+  struct Entry {
+    uint32_t Node;
+
+    // The node of tree it refines, or 0 for a quadrant that tree did not split.
+    uint32_t SourceNode;
+    double SourceRadiance;
+
+    uint32_t Depth;
+  };
+
+  const uint64_t* rootSum = tree[0].Sum;
+  auto total = static_cast<double>(rootSum[0] + rootSum[1] + rootSum[2] + rootSum[3]);
+
+  QuadTree refined(1);
+
+  std::vector<Entry> stack{{0, 0, total, 1}};
+  while (!stack.empty()) {
+    Entry entry = stack.back();
+    stack.pop_back();
+
+    for (uint32_t quadrant = 0; quadrant < 4; ++quadrant) {
+      // The root is never a child, so SourceNode 0 only means the root at the top.
+      bool hasSource = entry.Depth == 1 || entry.SourceNode != 0;
+
+      double radiance = hasSource ? static_cast<double>(tree[entry.SourceNode].Sum[quadrant])
+                                  : 0.25 * entry.SourceRadiance;
+
+      // With no radiance at all, the tree splits evenly to the depth the threshold allows.
+      double share = total > 0.0 ? radiance / total : std::pow(0.25, entry.Depth);
+
+      if (entry.Depth >= m_settings.MaxDirectionalDepth ||
+          share <= m_settings.DirectionalThreshold)
+        continue;
+
+      auto child = static_cast<uint32_t>(refined.size());
+      refined.emplace_back();
+      refined[entry.Node].Children[quadrant] = child;
+
+      uint32_t sourceChild = hasSource ? tree[entry.SourceNode].Children[quadrant] : 0;
+      stack.push_back({child, sourceChild, radiance, entry.Depth + 1});
+    }
+  }
+
+  return refined;
+}
+
+} // namespace cpu_rt
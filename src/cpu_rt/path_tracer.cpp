@@ -0,0 +1,1133 @@
+#include "cpu_rt/path_tracer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <utility>
+
+#include "cpu_rt/camera.h"
+#include "cpu_rt/hasher.h"
+#include "cpu_rt/parallel_for.h"
+#include "cpu_rt/ray_sort.h"
+#include "cpu_rt/rng.h"
+#include "cpu_rt/shading.h"
+
+namespace cpu_rt {
+
+namespace {
+
+constexpr uint32_t k_rayFlags = k_rayFlagCullBackFacingTriangles;
+constexpr uint32_t k_shadowRayFlags = k_rayFlagCullBackFacingTriangles |
+                                      k_rayFlagAcceptFirstHitAndEndSearch |
+                                      k_rayFlagForceOpaque | k_rayFlagSkipClosestHitShader;
+
+// Adaptive sampling measures error relative to at least this luminance, so that dark pixels are
+// not sampled forever for noise nobody can see.
+constexpr float k_minAdaptiveLuminance = 0.01f;
+
+// Paths in flight per wave. Bounds the memory of the wavefront queues, which take about 250
+// bytes per path.
+constexpr uint32_t k_wavefrontPathCount = 1 << 18;
+
+// Smaller bounces are traced unsorted, since they spend too little time in traversal to pay
+// for the sort.
+constexpr uint32_t k_minSortedRayCount = 1 << 14;
+
+// Writers stage this many entries before claiming room for them in the shared queue, so threads
+// only contend on the queue's size once per chunk.
+constexpr uint32_t k_queueChunkSize = 64;
+
+// Paths waiting for their next TraceRay, one array per field.
+struct PathQueue {
+  struct Entry {
+    Float3 Origin;
+    Float3 Direction;
+    Float3 Throughput;
+    float BsdfPdf;
+    Float3 BsdfNormal;
+    uint32_t RngState;
+    uint32_t PathIndex;
+    uint32_t Bounces;
+    uint32_t CacheCell;
+    Float3 CacheWeight;
+  };
+
+  explicit PathQueue(uint32_t capacity)
+    : Origin(capacity), Direction(capacity), Throughput(capacity), BsdfPdf(capacity),
+      BsdfNormal(capacity), RngState(capacity), PathIndex(capacity), Bounces(capacity),
+      CacheCell(capacity), CacheWeight(capacity) {}
+
+  Entry Load(uint32_t index) const {
+    return Entry{Origin[index], Direction[index], Throughput[index], BsdfPdf[index],
+                 BsdfNormal[index], RngState[index], PathIndex[index], Bounces[index],
+                 CacheCell[index], CacheWeight[index]};
+  }
+
+  void Store(uint32_t index, const Entry& entry) {
+    Origin[index] = entry.Origin;
+    Direction[index] = entry.Direction;
+    Throughput[index] = entry.Throughput;
+    BsdfPdf[index] = entry.BsdfPdf;
+    BsdfNormal[index] = entry.BsdfNormal;
+    RngState[index] = entry.RngState;
+    PathIndex[index] = entry.PathIndex;
+    Bounces[index] = entry.Bounces;
+    CacheCell[index] = entry.CacheCell;
+    CacheWeight[index] = entry.CacheWeight;
+  }
+
+  Ray GetRay(uint32_t index) const {
+    return Ray{Origin[index], 0.f, Direction[index], k_rayTMax};
+  }
+
+  std::vector<Float3> Origin;
+  std::vector<Float3> Direction;
+  std::vector<Float3> Throughput;
+  std::vector<float> BsdfPdf;
+  std::vector<Float3> BsdfNormal;
+  std::vector<uint32_t> RngState;
+  std::vector<uint32_t> PathIndex;
+  std::vector<uint32_t> Bounces;
+  std::vector<uint32_t> CacheCell;
+  std::vector<Float3> CacheWeight;
+
+  std::atomic<uint32_t> Size = 0;
+};
+
+// Shadow rays of the shaded paths, with the radiance each adds to its path if unoccluded.
+struct ShadowQueue {
+  struct Entry {
+    Ray ShadowRay;
+    uint32_t InstanceMask;
+    Float3 Contribution;
+    uint32_t PathIndex;
+    uint32_t Bounces;
+    uint32_t CacheCell;
+    Float3 CacheRadiance;
+  };
+
+  explicit ShadowQueue(uint32_t capacity)
+    : Rays(capacity), InstanceMask(capacity), Contribution(capacity), PathIndex(capacity),
+      Bounces(capacity), CacheCell(capacity), CacheRadiance(capacity) {}
+
+  void Store(uint32_t index, const Entry& entry) {
+    Rays[index] = entry.ShadowRay;
+    InstanceMask[index] = entry.InstanceMask;
+    Contribution[index] = entry.Contribution;
+    PathIndex[index] = entry.PathIndex;
+    Bounces[index] = entry.Bounces;
+    CacheCell[index] = entry.CacheCell;
+    CacheRadiance[index] = entry.CacheRadiance;
+  }
+
+  std::vector<Ray> Rays;
+  std::vector<uint32_t> InstanceMask;
+  std::vector<Float3> Contribution;
+  std::vector<uint32_t> PathIndex;
+  std::vector<uint32_t> Bounces;
+  std::vector<uint32_t> CacheCell;
+  std::vector<Float3> CacheRadiance;
+
+  std::atomic<uint32_t> Size = 0;
+};
+
+// Lock-free appends to a queue shared by all threads. Each ParallelFor chunk has its own
+// writer, and the order of the entries in the queue does not matter.
+template<typename Queue>
+class QueueWriter {
+public:
+  explicit QueueWriter(Queue* queue) : m_queue(queue) {}
+
+  ~QueueWriter() { Flush(); }
+
+  QueueWriter(const QueueWriter&) = delete;
+  QueueWriter& operator=(const QueueWriter&) = delete;
+
+  void Push(const typename Queue::Entry& entry) {
+    m_chunk[m_count++] = entry;
+    if (m_count == k_queueChunkSize)
+      Flush();
+  }
+
+  void Flush() {
+    if (m_count == 0)
+      return;
+
+    // ParallelFor joins its threads before the next stage reads the queue, so the stores need
+    // no ordering of their own.
+    uint32_t begin = m_queue->Size.fetch_add(m_count, std::memory_order_relaxed);
+    for (uint32_t i = 0; i < m_count; ++i) {
+      m_queue->Store(begin + i, m_chunk[i]);
+    }
+    m_count = 0;
+  }
+
+private:
+  Queue* m_queue;
+  typename Queue::Entry m_chunk[k_queueChunkSize];
+  uint32_t m_count = 0;
+};
+
+// Componentwise, with 0 for the components that are 0, which carry no light.
+Float3 GetInverse(const Float3& a) {
+  return Float3{a.x > 0.f ? 1.f / a.x : 0.f, a.y > 0.f ? 1.f / a.y : 0.f,
+                a.z > 0.f ? 1.f / a.z : 0.f};
+}
+
+} // namespace
+
+// The state of the paths of one wave. Paths are numbered pixel by pixel within the wave, so
+// each pixel owns a contiguous range of PathL.
+struct PathTracer::Wavefront {
+  Wavefront(uint32_t capacity, uint32_t guideVerticesPerPath)
+    : Queues{PathQueue(capacity), PathQueue(capacity)}, ShadowRays(capacity), Hits(capacity),
+      ShadingKeys(capacity), ShadingOrder(capacity), RayKeys(capacity), RayOrder(capacity),
+      PathL(capacity), GuideVertices(static_cast<size_t>(capacity) * guideVerticesPerPath),
+      GuideVertexCounts(guideVerticesPerPath > 0 ? capacity : 0),
+      GuideVerticesPerPath(guideVerticesPerPath) {}
+
+  // Path p's guide vertices, nullptr without a path guide.
+  PathGuideVertex* GetGuideVertices(uint32_t p) {
+    return GuideVerticesPerPath > 0 ? &GuideVertices[size_t{p} * GuideVerticesPerPath] : nullptr;
+  }
+
+  PathQueue Queues[2];
+  PathQueue* Paths = &Queues[0];
+  PathQueue* NextPaths = &Queues[1];
+
+  ShadowQueue ShadowRays;
+
+  // Indexed like Paths.
+  std::vector<HitInfo> Hits;
+  std::vector<uint32_t> ShadingKeys;
+
+  // The slots of Paths in the order they are shaded.
+  std::vector<uint32_t> ShadingOrder;
+
+  std::vector<uint64_t> RayKeys;
+  std::vector<uint32_t> RayOrder;
+
+  std::vector<Float3> PathL;
+
+  // With a path guide, the vertices of the bounces each path has taken so far, which it records
+  // once the wave ends. About 40 bytes per path and bounce.
+  std::vector<PathGuideVertex> GuideVertices;
+  std::vector<uint32_t> GuideVertexCounts;
+  uint32_t GuideVerticesPerPath;
+
+  // The wave's first entry of m_activePixels.
+  uint32_t ActiveBegin = 0;
+};
+
+PathTracer::PathTracer(const RenderScene& scene, uint32_t width, uint32_t height,
+                       const PathTracerSettings& settings)
+  : m_scene(scene), m_width(width), m_height(height), m_settings(settings),
+    m_lightSampler(scene.GetLights(), settings.LightSampler,
+                   scene.GetEnvironmentLight() != nullptr),
+    m_film(static_cast<size_t>(width) * height), m_sampleL(m_film.size()),
+    m_pixels(m_film.size()), m_activePixels(m_film.size()) {
+  std::iota(m_activePixels.begin(), m_activePixels.end(), 0);
+
+  if (settings.UseRadianceCache)
+    m_radianceCache = std::make_unique<RadianceCache>(k_cameraPosition, settings.RadianceCache);
+
+  if (settings.UsePathGuide)
+    m_pathGuide = std::make_unique<PathGuide>(scene.GetTlas().GetBounds(), settings.PathGuide);
+}
+
+void PathTracer::Render(PathTracerMode mode) {
+  if (m_activePixels.empty())
+    return;
+
+  if (mode == PathTracerMode::Megakernel) {
+    RenderMegakernel();
+  } else {
+    RenderWavefront();
+  }
+
+  if (m_radianceCache)
+    m_radianceCache->EndFrame();
+
+  if (m_pathGuide)
+    m_pathGuide->EndFrame(k_cameraRaysPerPixel * m_settings.SampleIncrement);
+
+  auto k = static_cast<float>(m_settings.SampleIncrement);
+
+  for (uint32_t pixel : m_activePixels) {
+    FilmPixel& filmPixel = m_pixels[pixel];
+    for (int c = 0; c < 3; ++c) {
+      filmPixel.Sum[c] += m_sampleL[pixel][c];
+    }
+
+    float luminance = Luminance(m_sampleL[pixel]) / k;
+    ++filmPixel.Count;
+    float delta = luminance - filmPixel.Mean;
+    filmPixel.Mean += delta / static_cast<float>(filmPixel.Count);
+    filmPixel.M2 += delta * (luminance - filmPixel.Mean);
+
+    UpdateFilm(pixel);
+  }
+
+  m_sampleCount += m_settings.SampleIncrement;
+
+  if (m_settings.AdaptiveThreshold > 0.f) {
+    // NaN errors compare false, so pixels with a NaN sample keep going rather than stop early.
+    std::erase_if(m_activePixels, [&](uint32_t pixel) {
+      return m_pixels[pixel].Count >= m_settings.MinAdaptiveBatches &&
+             GetPixelError(pixel) < m_settings.AdaptiveThreshold;
+    });
+  }
+}
+
+float PathTracer::GetPixelError(uint32_t pixel) const {
+  const FilmPixel& stats = m_pixels[pixel];
+  if (stats.Count < 2)
+    return std::numeric_limits<float>::infinity();
+
+  // The film is the mean of Count batches, so its variance is that of a batch over Count.
+  auto count = static_cast<float>(stats.Count);
+  float standardError = std::sqrt(stats.M2 / ((count - 1.f) * count));
+
+  return standardError / std::max(stats.Mean, k_minAdaptiveLuminance);
+}
+
+void PathTracer::GetCheckpoint(FilmCheckpoint* checkpoint) const {
+  checkpoint->Key = GetCheckpointKey();
+  checkpoint->Width = m_width;
+  checkpoint->Height = m_height;
+  checkpoint->SampleCount = m_sampleCount;
+  checkpoint->RayCount = m_rayCount;
+  checkpoint->Pixels.assign(m_pixels.begin(), m_pixels.end());
+  checkpoint->ActivePixels.assign(m_activePixels.begin(), m_activePixels.end());
+}
+
+bool PathTracer::Resume(const FilmCheckpoint& checkpoint) {
+  if (checkpoint.Key != GetCheckpointKey() || checkpoint.Width != m_width ||
+      checkpoint.Height != m_height || checkpoint.Pixels.size() != m_pixels.size()) {
+    return false;
+  }
+
+  m_sampleCount = checkpoint.SampleCount;
+  m_rayCount = checkpoint.RayCount;
+  m_pixels = checkpoint.Pixels;
+  m_activePixels = checkpoint.ActivePixels;
+
+  for (uint32_t pixel = 0; pixel < m_pixels.size(); ++pixel) {
+    UpdateFilm(pixel);
+  }
+
+  return true;
+}
+
+uint64_t PathTracer::GetCheckpointKey() const {
+  Hasher hasher;
+  hasher.UpdateValue(m_width);
+  hasher.UpdateValue(m_height);
+
+  // The settings that change which samples are traced or what they add up to.
+  hasher.UpdateValue(m_settings.NumBounces);
+  hasher.UpdateValue(m_settings.MinRouletteBounces);
+  hasher.UpdateValue(m_settings.SampleIncrement);
+  hasher.UpdateValue(m_settings.Sampler);
+  hasher.UpdateValue(m_settings.LightSampler);
+  hasher.UpdateValue(m_settings.EnvironmentSampling);
+  hasher.UpdateValue(m_settings.AdaptiveThreshold);
+  hasher.UpdateValue(m_settings.MinAdaptiveBatches);
+
+  // Field by field, as RadianceCacheSettings has padding before MemoryBudget.
+  const RadianceCacheSettings& cache = m_settings.RadianceCache;
+  hasher.UpdateValue(m_settings.UseRadianceCache);
+  hasher.UpdateValue(cache.TerminationBounce);
+  hasher.UpdateValue(cache.TrainingPathInterval);
+  hasher.UpdateValue(cache.CellSize);
+  hasher.UpdateValue(cache.LevelDistance);
+  hasher.UpdateValue(cache.MinSamples);
+  hasher.UpdateValue(cache.MaxSamples);
+  hasher.UpdateValue(cache.MaxAge);
+  hasher.UpdateValue(cache.MemoryBudget);
+
+  const PathGuideSettings& guide = m_settings.PathGuide;
+  hasher.UpdateValue(m_settings.UsePathGuide);
+  hasher.UpdateValue(guide.BsdfSamplingFraction);
+  hasher.UpdateValue(guide.SpatialThreshold);
+  hasher.UpdateValue(guide.DirectionalThreshold);
+  hasher.UpdateValue(guide.MaxDirectionalDepth);
+
+  hasher.UpdateValue(m_scene.GetContentKey());
+
+  return hasher.Finish();
+}
+
+void PathTracer::UpdateFilm(uint32_t pixel) {
+  const FilmPixel& filmPixel = m_pixels[pixel];
+  if (filmPixel.Count == 0)
+    return;
+
+  double sampleCount = static_cast<double>(filmPixel.Count) * m_settings.SampleIncrement;
+  m_film[pixel] = Float3{static_cast<float>(filmPixel.Sum[0] / sampleCount),
+                         static_cast<float>(filmPixel.Sum[1] / sampleCount),
+                         static_cast<float>(filmPixel.Sum[2] / sampleCount)};
+}
+
+PathTracer::PathSample PathTracer::GetPathSample(uint32_t x, uint32_t y, uint32_t cameraRay,
+                                                 uint32_t j) const {
+  PathSample sample{};
+  sample.RngState = InitRngSeed(x, y, m_sampleCount + j);
+  sample.PixelX = x;
+  sample.PixelY = y;
+  sample.SampleIndex = (m_sampleCount + j) * k_cameraRaysPerPixel + cameraRay;
+  return sample;
+}
+
+void PathTracer::GetSample2D(PathSample* sample, uint32_t dimension, float* u, float* v) const {
+  switch (m_settings.Sampler) {
+  case SamplerType::Sobol:
+    GetSobolSample2D(sample->PixelX, sample->PixelY, sample->SampleIndex, dimension, u, v);
+    break;
+  case SamplerType::BlueNoise:
+    GetBlueNoiseSample2D(sample->PixelX, sample->PixelY, sample->SampleIndex, dimension, u, v);
+    break;
+  default:
+    *u = Rand(&sample->RngState);
+    *v = Rand(&sample->RngState);
+    break;
+  }
+}
+
+Ray PathTracer::GetCameraRay(uint32_t x, uint32_t y, float jitterX, float jitterY) const {
+  return cpu_rt::GetCameraRay(m_width, m_height, x, y, jitterX, jitterY);
+}
+
+PathTracer::HitShading PathTracer::ShadeHit(const Ray& ray, const HitInfo& hit,
+                                            const Float3& throughput, uint32_t bounces,
+                                            PathSample sample) const {
+  const ShadingMaterial& material =
+      m_scene.GetShadingMaterials()[m_scene.GetMaterialIndex(hit.HitGroupIndex)];
+
+  switch (material.Class) {
+  case MaterialClass::Diffuse:
+    return ShadeHit<MaterialClass::Diffuse>(ray, hit, material, throughput, bounces, sample);
+  case MaterialClass::Metal:
+    return ShadeHit<MaterialClass::Metal>(ray, hit, material, throughput, bounces, sample);
+  default:
+    return ShadeHit<MaterialClass::Mixed>(ray, hit, material, throughput, bounces, sample);
+  }
+}
+
+template<MaterialClass materialClass>
+PathTracer::HitShading PathTracer::ShadeHit(const Ray& ray, const HitInfo& hit,
+                                            const ShadingMaterial& material,
+                                            const Float3& throughput, uint32_t bounces,
+                                            PathSample sample) const {
+  Float3 normal = m_scene.GetShadingNormal(hit);
+  Float3 hitPos = ray.Origin + hit.T * ray.Direction;
+  Float3 wo = -Normalize(ray.Direction);
+
+  HitShading shading{};
+  shading.CacheCell = k_invalidIndex;
+  shading.GuideLeaf = k_invalidIndex;
+
+  if constexpr (materialClass == MaterialClass::Diffuse) {
+    if (m_radianceCache) {
+      uint32_t cell = m_radianceCache->FindOrInsert(hitPos, normal);
+
+      if (cell != k_invalidIndex) {
+        bool isValid = m_radianceCache->Lookup(cell, &shading.CachedRadiance);
+
+        if (isValid && bounces >= m_settings.RadianceCache.TerminationBounce &&
+            !IsTrainingPath(sample)) {
+          shading.EndsInCache = true;
+          return shading;
+        }
+
+        // Past the last bounce there is no bounce ray to complete the sample.
+        if (bounces < m_settings.NumBounces) {
+          shading.CacheCell = cell;
+          m_radianceCache->AddSample(cell);
+        }
+      }
+    }
+  }
+
+  // Metals keep to the BSDF, whose lobes are narrower than the guide resolves.
+  uint32_t guideLeaf = k_invalidIndex;
+  if constexpr (materialClass != MaterialClass::Metal) {
+    if (m_pathGuide)
+      guideLeaf = m_pathGuide->GetLeaf(hitPos);
+  }
+
+  // A guided hit samples its bounce ray from a mixture of the BSDF and the guide, once the guide
+  // has learned a distribution for it.
+  bool isGuided = guideLeaf != k_invalidIndex && m_pathGuide->CanSample(guideLeaf);
+  float bsdfFraction = isGuided ? m_settings.PathGuide.BsdfSamplingFraction : 1.f;
+
+  auto getBouncePdf = [&](const Float3& w) {
+    float bsdfPdf = BsdfPdf<materialClass>(wo, w, normal, material);
+    if (!isGuided)
+      return bsdfPdf;
+
+    return bsdfFraction * bsdfPdf + (1.f - bsdfFraction) * m_pathGuide->GetPdf(guideLeaf, w);
+  };
+
+  // Light that a bounce ray finds is weighed against the light sample below, except past the
+  // last bounce, where the light sample is all there is.
+  bool sampleBsdf = bounces < m_settings.NumBounces;
+
+  if (sampleBsdf) {
+    float randU, randV;
+    GetSample2D(&sample, GetBsdfDimension(bounces), &randU, &randV);
+
+    Float3 b1, b2;
+    GetCoordinateSystem(normal, &b1, &b2);
+
+    Float3 wi{};
+    bool shouldContinue = true;
+
+    // randU picks the BSDF or the guide, and is stretched back over [0, 1) for the one it picks.
+    bool sampleGuide = false;
+    if (isGuided) {
+      if (randU < bsdfFraction) {
+        randU /= bsdfFraction;
+      } else {
+        randU = (randU - bsdfFraction) / (1.f - bsdfFraction);
+        sampleGuide = true;
+      }
+    }
+
+    if (sampleGuide) {
+      wi = m_pathGuide->Sample(guideLeaf, randU, randV);
+    } else if (SamplesGgx<materialClass>(material)) {
+      // Interpolated normals can face away from the viewer, which then sees no microfacet.
+      Float3 woLocal{Dot(wo, b1), Dot(wo, normal), Dot(wo, b2)};
+
+      if (woLocal.y > 0.f) {
+        Float3 wh = TrowbridgeReitzGGX_Sample_vndf(woLocal, randU, randV, material.Alpha);
+        wh = Normalize(wh.x * b1 + wh.y * normal + wh.z * b2);
+        wi = Reflect(-wo, wh);
+      } else {
+        shouldContinue = false;
+      }
+    } else {
+      wi = CosineSampleHemisphere(randU, randV);
+      wi = Normalize(wi.x * b1 + wi.y * normal + wi.z * b2);
+    }
+
+    float pdf = 0.f;
+    if (shouldContinue && Dot(wi, normal) > 0.f)
+      pdf = getBouncePdf(wi);
+
+    if (!(pdf > 0.f))
+      shouldContinue = false;
+
+    Float3 bounceThroughput{};
+    Float3 bounceCacheWeight{};
+    if (shouldContinue) {
+      Float3 brdf = Brdf<materialClass>(wo, wi, normal, material);
+      bounceThroughput = throughput * brdf * Dot(wi, normal) / pdf;
+
+      if (shading.CacheCell != k_invalidIndex)
+        bounceCacheWeight = brdf * Dot(wi, normal) / pdf;
+    }
+
+    // Russian roulette, which keeps the path with a probability of its throughput and divides
+    // the throughput by it.
+    if (shouldContinue && bounces >= m_settings.MinRouletteBounces) {
+      float survival = std::min(1.f, std::max(std::max(bounceThroughput.x, bounceThroughput.y),
+                                              bounceThroughput.z));
+
+      float rouletteU, rouletteV;
+      GetSample2D(&sample, GetRouletteDimension(bounces), &rouletteU, &rouletteV);
+
+      if (rouletteU < survival) {
+        bounceThroughput = bounceThroughput / survival;
+        bounceCacheWeight = bounceCacheWeight / survival;
+      } else {
+        shouldContinue = false;
+      }
+    }
+
+    if (shouldContinue) {
+      shading.Continue = true;
+      shading.BounceRay = Ray{hitPos, 0.f, wi, k_rayTMax};
+      shading.BounceThroughput = bounceThroughput;
+      shading.BouncePdf = pdf;
+      shading.BounceNormal = normal;
+      shading.BounceCacheWeight = bounceCacheWeight;
+      shading.GuideLeaf = guideLeaf;
+    }
+  }
+
+  // The second value of the roulette dimension picks the light. Scenes with only the quad light
+  // skip the draw, which keeps the Random sampler's sequence that of ClosestHitShader.
+  uint32_t lightIndex = 0;
+  float lightPmf = 1.f;
+
+  if (m_lightSampler.GetLightCount() > 1) {
+    float unusedU, selectU;
+    GetSample2D(&sample, GetRouletteDimension(bounces), &unusedU, &selectU);
+
+    if (!m_lightSampler.Sample(hitPos, normal, selectU, &lightIndex, &lightPmf))
+      return shading;
+  }
+
+  float lightU, lightV;
+  GetSample2D(&sample, GetLightDimension(bounces), &lightU, &lightV);
+
+  Float3 wi;
+  Float3 le;
+  float pdf;
+
+  // The environment light follows the area lights.
+  if (lightIndex == m_scene.GetLights().size()) {
+    const EnvironmentLight& environment = *m_scene.GetEnvironmentLight();
+
+    wi = environment.Sample(m_settings.EnvironmentSampling, lightU, lightV, &pdf);
+    pdf *= lightPmf;
+    le = environment.GetRadiance(wi);
+
+    // Bounce rays only reach the environment past the quad light, so shadow rays towards it
+    // test the quad as well.
+    shading.ShadowRay = Ray{hitPos, 0.0001f, wi, k_rayTMax};
+    shading.ShadowRayMask = ~0u;
+  } else {
+    const AreaLight& light = m_scene.GetLights()[lightIndex];
+
+    Float3 lightSamplePos = light.SamplePoint(lightU, lightV);
+    float lightDist = Length(lightSamplePos - hitPos);
+
+    wi = Normalize(lightSamplePos - hitPos);
+    pdf = lightPmf * light.GetPdf(lightDist, wi);
+    le = light.Le;
+
+    shading.ShadowRay = Ray{hitPos, 0.0001f, wi, lightDist * (1.f - k_shadowRayShortening)};
+    shading.ShadowRayMask = ~k_lightInstanceMask;
+  }
+
+  if (!(pdf > 0.f))
+    return shading;
+
+  float misWeight = 1.f;
+  if (sampleBsdf)
+    misWeight = PowerHeuristic(pdf, getBouncePdf(wi));
+
+  shading.HasLightSample = true;
+
+  Float3 brdf = Brdf<materialClass>(wo, wi, normal, material);
+  shading.LightContribution = throughput * brdf * std::max(0.f, Dot(wi, normal)) *
+                              (le * (misWeight / pdf));
+
+  if (shading.CacheCell != k_invalidIndex)
+    shading.LightCacheRadiance = brdf * std::max(0.f, Dot(wi, normal)) * (le * (misWeight / pdf));
+
+  return shading;
+}
+
+Float3 PathTracer::GetLightHitRadiance(uint32_t light, const Ray& ray, float t, uint32_t bounces,
+                                       float bsdfPdf, const Float3& bsdfNormal) const {
+  const AreaLight& areaLight = m_scene.GetLights()[light];
+
+  // Camera rays have no light sample to share the light with.
+  float misWeight = 1.f;
+  if (bounces > 0) {
+    float lightPdf = m_lightSampler.GetPmf(ray.Origin, bsdfNormal, light) *
+                     areaLight.GetPdf(t, ray.Direction);
+    misWeight = PowerHeuristic(bsdfPdf, lightPdf);
+  }
+
+  return areaLight.Le * misWeight;
+}
+
+Float3 PathTracer::GetMissRadiance(const Ray& ray, uint32_t bounces, float bsdfPdf,
+                                   const Float3& bsdfNormal) const {
+  const EnvironmentLight* environment = m_scene.GetEnvironmentLight();
+  if (!environment)
+    return Float3{0.f, 0.f, 0.f};
+
+  float misWeight = 1.f;
+  if (bounces > 0) {
+    auto light = static_cast<uint32_t>(m_scene.GetLights().size());
+    float lightPdf = m_lightSampler.GetPmf(ray.Origin, bsdfNormal, light) *
+                     environment->GetPdf(m_settings.EnvironmentSampling, ray.Direction);
+    misWeight = PowerHeuristic(bsdfPdf, lightPdf);
+  }
+
+  return environment->GetRadiance(ray.Direction) * misWeight;
+}
+
+bool PathTracer::IsTrainingPath(const PathSample& sample) const {
+  uint32_t hash = JenkinsHash(sample.PixelX ^ JenkinsHash(sample.PixelY ^
+                                                          JenkinsHash(sample.SampleIndex)));
+  return hash % m_settings.RadianceCache.TrainingPathInterval == 0;
+}
+
+void PathTracer::AddCacheRadiance(uint32_t cell, const Float3& radiance) const {
+  if (cell != k_invalidIndex)
+    m_radianceCache->AddRadiance(cell, radiance);
+}
+
+void PathTracer::AddGuideRadiance(PathGuideVertex* vertices, uint32_t bounces,
+                                  const Float3& contribution) const {
+  if (!vertices)
+    return;
+
+  for (uint32_t i = 0; i < bounces; ++i) {
+    if (vertices[i].Leaf != k_invalidIndex)
+      PathGuide::AddRadiance(&vertices[i], contribution);
+  }
+}
+
+PathGuideVertex PathTracer::GetGuideVertex(const HitShading& shading) const {
+  return PathGuideVertex{shading.GuideLeaf, shading.BounceRay.Direction, shading.BouncePdf,
+                         GetInverse(shading.BounceThroughput), 0};
+}
+
+bool PathTracer::IsOccluded(const Ray& shadowRay, uint32_t instanceMask) const {
+  return m_scene.GetTlas().Occluded(shadowRay, shadowRay.TMax, instanceMask, k_shadowRayFlags,
+                                    m_scene.GetIntersectionTable());
+}
+
+// TraceRay followed by the shader it invokes.
+uint32_t PathTracer::TracePath(const Ray& ray, RayPayload* payload) const {
+  uint32_t rayCount = 1;
+
+  HitInfo hit;
+  if (!m_scene.GetTlas().TraceRay(ray, k_rayFlags, ~0u, 0, 1, &hit,
+                                  m_scene.GetIntersectionTable())) {
+    Float3 radiance =
+        GetMissRadiance(ray, payload->Bounces, payload->BsdfPdf, payload->BsdfNormal);
+    payload->L = payload->Throughput * radiance;
+    AddCacheRadiance(payload->CacheCell, payload->CacheWeight * radiance);
+    AddGuideRadiance(payload->GuideVertices, payload->Bounces, payload->L);
+    return rayCount;
+  }
+
+  // The quad is the first light.
+  if (hit.HitGroupIndex == m_scene.GetLightHitGroupIndex()) {
+    Float3 radiance = GetLightHitRadiance(0, ray, hit.T, payload->Bounces, payload->BsdfPdf,
+                                          payload->BsdfNormal);
+    payload->L = payload->Throughput * radiance;
+    AddCacheRadiance(payload->CacheCell, payload->CacheWeight * radiance);
+    AddGuideRadiance(payload->GuideVertices, payload->Bounces, payload->L);
+    return rayCount;
+  }
+
+  Float3 emission{0.f, 0.f, 0.f};
+
+  uint32_t light = m_scene.GetTriangleLight(hit);
+  if (light != k_invalidIndex) {
+    emission = GetLightHitRadiance(light, ray, hit.T, payload->Bounces, payload->BsdfPdf,
+                                   payload->BsdfNormal);
+    payload->L = payload->Throughput * emission;
+    AddGuideRadiance(payload->GuideVertices, payload->Bounces, payload->L);
+  }
+
+  HitShading shading = ShadeHit(ray, hit, payload->Throughput, payload->Bounces,
+                                payload->Sample);
+
+  // The hit passes on the radiance it has cached rather than what the rest of the path finds,
+  // which only reaches its own cell.
+  AddCacheRadiance(payload->CacheCell, payload->CacheWeight * (emission + shading.CachedRadiance));
+
+  if (shading.EndsInCache) {
+    payload->L += payload->Throughput * shading.CachedRadiance;
+    AddGuideRadiance(payload->GuideVertices, payload->Bounces,
+                     payload->Throughput * shading.CachedRadiance);
+    return rayCount;
+  }
+
+  if (shading.Continue) {
+    // The vertex has all its radiance once the bounce ray's path ends, since the light sample
+    // below leaves in another direction.
+    PathGuideVertex* guideVertex = nullptr;
+    if (payload->GuideVertices) {
+      guideVertex = &payload->GuideVertices[payload->Bounces];
+      *guideVertex = GetGuideVertex(shading);
+    }
+
+    RayPayload reflectPayload{};
+    reflectPayload.Throughput = shading.BounceThroughput;
+    reflectPayload.BsdfPdf = shading.BouncePdf;
+    reflectPayload.BsdfNormal = shading.BounceNormal;
+    reflectPayload.Bounces = payload->Bounces + 1;
+    reflectPayload.Sample = payload->Sample;
+    reflectPayload.Sample.RngState ^= JenkinsHash(reflectPayload.Bounces);
+    reflectPayload.CacheCell = shading.CacheCell;
+    reflectPayload.CacheWeight = shading.BounceCacheWeight;
+    reflectPayload.GuideVertices = payload->GuideVertices;
+
+    rayCount += TracePath(shading.BounceRay, &reflectPayload);
+
+    payload->L += reflectPayload.L;
+
+    if (guideVertex && guideVertex->Leaf != k_invalidIndex)
+      m_pathGuide->Record(*guideVertex);
+  }
+
+  if (shading.HasLightSample && !IsOccluded(shading.ShadowRay, shading.ShadowRayMask)) {
+    payload->L += shading.LightContribution;
+    AddCacheRadiance(shading.CacheCell, shading.LightCacheRadiance);
+    AddGuideRadiance(payload->GuideVertices, payload->Bounces, shading.LightContribution);
+  }
+
+  return rayCount;
+}
+
+void PathTracer::RenderMegakernel() {
+  std::atomic<uint64_t> rayCount = 0;
+
+  ParallelFor(m_activePixels.size(), [&](size_t begin, size_t end) {
+    uint64_t chunkRayCount = 0;
+
+    // The guide vertices of the path being traced, by bounce.
+    std::vector<PathGuideVertex> guideVertices(m_pathGuide ? m_settings.NumBounces : 0);
+
+    for (size_t i = begin; i < end; ++i) {
+      uint32_t pixel = m_activePixels[i];
+      uint32_t x = pixel % m_width;
+      uint32_t y = pixel / m_width;
+
+      uint32_t rngState = InitRngSeed(x, y, m_sampleCount);
+
+      Float3 accumL{0.f, 0.f, 0.f};
+
+      for (uint32_t s = 0; s < k_cameraRaysPerPixel; ++s) {
+        float jitterX = Rand(&rngState);
+        float jitterY = Rand(&rngState);
+
+        for (uint32_t j = 0; j < m_settings.SampleIncrement; ++j) {
+          RayPayload payload{};
+          payload.Throughput = Float3{1.f, 1.f, 1.f};
+          payload.Sample = GetPathSample(x, y, s, j);
+          payload.CacheCell = k_invalidIndex;
+          payload.GuideVertices = m_pathGuide ? guideVertices.data() : nullptr;
+
+          if (m_settings.Sampler != SamplerType::Random)
+            GetSample2D(&payload.Sample, k_cameraDimension, &jitterX, &jitterY);
+
+          chunkRayCount += TracePath(GetCameraRay(x, y, jitterX, jitterY), &payload);
+
+          accumL += payload.L;
+        }
+      }
+
+      m_sampleL[pixel] = accumL / static_cast<float>(k_cameraRaysPerPixel);
+    }
+
+    rayCount.fetch_add(chunkRayCount, std::memory_order_relaxed);
+  });
+
+  m_rayCount += rayCount;
+}
+
+void PathTracer::RenderWavefront() {
+  auto pixelCount = static_cast<uint32_t>(m_activePixels.size());
+
+  uint32_t pathsPerPixel = k_cameraRaysPerPixel * m_settings.SampleIncrement;
+  uint32_t wavePixelCount = std::min(pixelCount,
+                                     std::max(1u, k_wavefrontPathCount / pathsPerPixel));
+
+  Wavefront wavefront(wavePixelCount * pathsPerPixel, m_pathGuide ? m_settings.NumBounces : 0);
+
+  for (uint32_t activeBegin = 0; activeBegin < pixelCount; activeBegin += wavePixelCount) {
+    uint32_t activeEnd = std::min(pixelCount, activeBegin + wavePixelCount);
+
+    GeneratePaths(activeBegin, activeEnd, &wavefront);
+
+    for (uint32_t bounce = 0; wavefront.Paths->Size > 0; ++bounce) {
+      // Camera rays are already coherent in pixel order.
+      if (m_settings.SortRays && bounce > 0 && wavefront.Paths->Size >= k_minSortedRayCount)
+        SortPathsByRay(&wavefront);
+
+      m_rayCount += wavefront.Paths->Size;
+
+      ExtendPaths(&wavefront);
+      SortPathsByMaterial(&wavefront);
+      ShadePaths(&wavefront);
+      ConnectPaths(&wavefront);
+
+      wavefront.Paths->Size = 0;
+      wavefront.ShadowRays.Size = 0;
+      std::swap(wavefront.Paths, wavefront.NextPaths);
+    }
+
+    if (m_pathGuide)
+      RecordGuideVertices(wavefront, (activeEnd - activeBegin) * pathsPerPixel);
+
+    // Sums each pixel's paths in the order RayGenShader traces them.
+    ParallelFor(activeEnd - activeBegin, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        Float3 accumL{0.f, 0.f, 0.f};
+        for (uint32_t p = 0; p < pathsPerPixel; ++p) {
+          accumL += wavefront.PathL[i * pathsPerPixel + p];
+        }
+
+        m_sampleL[m_activePixels[activeBegin + i]] =
+            accumL / static_cast<float>(k_cameraRaysPerPixel);
+      }
+    });
+  }
+}
+
+// Camera rays for the pixels in [activeBegin, activeEnd) of m_activePixels, with one path per
+// payload RayGenShader would trace.
+void PathTracer::GeneratePaths(uint32_t activeBegin, uint32_t activeEnd,
+                               Wavefront* wavefront) const {
+  PathQueue& paths = *wavefront->Paths;
+
+  wavefront->ActiveBegin = activeBegin;
+
+  uint32_t pathsPerPixel = k_cameraRaysPerPixel * m_settings.SampleIncrement;
+
+  ParallelFor(activeEnd - activeBegin, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      uint32_t pixel = m_activePixels[activeBegin + i];
+      uint32_t x = pixel % m_width;
+      uint32_t y = pixel / m_width;
+
+      uint32_t rngState = InitRngSeed(x, y, m_sampleCount);
+
+      auto pathIndex = static_cast<uint32_t>(i * pathsPerPixel);
+
+      for (uint32_t s = 0; s < k_cameraRaysPerPixel; ++s) {
+        float jitterX = Rand(&rngState);
+        float jitterY = Rand(&rngState);
+
+        for (uint32_t j = 0; j < m_settings.SampleIncrement; ++j) {
+          PathSample sample = GetPathSample(x, y, s, j);
+
+          if (m_settings.Sampler != SamplerType::Random)
+            GetSample2D(&sample, k_cameraDimension, &jitterX, &jitterY);
+
+          Ray ray = GetCameraRay(x, y, jitterX, jitterY);
+
+          PathQueue::Entry entry{};
+          entry.Origin = ray.Origin;
+          entry.Direction = ray.Direction;
+          entry.Throughput = Float3{1.f, 1.f, 1.f};
+          entry.RngState = sample.RngState;
+          entry.PathIndex = pathIndex;
+          entry.CacheCell = k_invalidIndex;
+
+          paths.Store(pathIndex, entry);
+          wavefront->PathL[pathIndex] = Float3{0.f, 0.f, 0.f};
+          if (m_pathGuide)
+            wavefront->GuideVertexCounts[pathIndex] = 0;
+          ++pathIndex;
+        }
+      }
+    }
+  });
+
+  paths.Size = (activeEnd - activeBegin) * pathsPerPixel;
+}
+
+// Reorders Paths by the Morton keys of their rays, so that rays which are traced one after the
+// other visit similar nodes and find them in cache. Diffuse bounces otherwise leave neighboring
+// slots with unrelated rays.
+void PathTracer::SortPathsByRay(Wavefront* wavefront) const {
+  uint32_t pathCount = wavefront->Paths->Size;
+
+  std::span<uint64_t> keys = std::span(wavefront->RayKeys).subspan(0, pathCount);
+  std::span<uint32_t> order = std::span(wavefront->RayOrder).subspan(0, pathCount);
+
+  Aabb sceneBounds = m_scene.GetTlas().GetBounds();
+
+  ParallelFor(pathCount, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      keys[i] = GetRayMortonKey(wavefront->Paths->Origin[i], wavefront->Paths->Direction[i],
+                                sceneBounds);
+      order[i] = static_cast<uint32_t>(i);
+    }
+  });
+
+  RadixSortByKey(keys, order);
+
+  // NextPaths is empty until the paths are shaded, so the sorted paths are gathered into it.
+  ParallelFor(pathCount, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      wavefront->NextPaths->Store(static_cast<uint32_t>(i), wavefront->Paths->Load(order[i]));
+    }
+  });
+
+  wavefront->NextPaths->Size = pathCount;
+  wavefront->Paths->Size = 0;
+  std::swap(wavefront->Paths, wavefront->NextPaths);
+}
+
+// Finds the closest hit of every path and the key it is shaded by: the material index from the
+// hit group record for mesh hits, followed by one key for light hits and one for misses.
+void PathTracer::ExtendPaths(Wavefront* wavefront) const {
+  const PathQueue& paths = *wavefront->Paths;
+
+  auto materialCount = static_cast<uint32_t>(m_scene.GetMaterials().size());
+
+  ParallelFor(paths.Size, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      HitInfo& hit = wavefront->Hits[i];
+
+      uint32_t& key = wavefront->ShadingKeys[i];
+
+      if (!m_scene.GetTlas().TraceRay(paths.GetRay(static_cast<uint32_t>(i)), k_rayFlags, ~0u, 0,
+                                      1, &hit, m_scene.GetIntersectionTable())) {
+        key = materialCount + 1;
+      } else if (hit.HitGroupIndex == m_scene.GetLightHitGroupIndex()) {
+        key = materialCount;
+      } else {
+        key = m_scene.GetMaterialIndex(hit.HitGroupIndex);
+      }
+    }
+  });
+}
+
+// Counting sort of the path slots by shading key. Stable, so the paths of a material keep the
+// pixel order they were extended in.
+void PathTracer::SortPathsByMaterial(Wavefront* wavefront) const {
+  uint32_t pathCount = wavefront->Paths->Size;
+
+  std::vector<uint32_t> offsets(m_scene.GetMaterials().size() + 3);
+
+  for (uint32_t i = 0; i < pathCount; ++i) {
+    ++offsets[wavefront->ShadingKeys[i] + 1];
+  }
+
+  for (size_t key = 1; key < offsets.size(); ++key) {
+    offsets[key] += offsets[key - 1];
+  }
+
+  for (uint32_t i = 0; i < pathCount; ++i) {
+    wavefront->ShadingOrder[offsets[wavefront->ShadingKeys[i]]++] = i;
+  }
+}
+
+// Runs the closest hit and miss shaders of every path in material order. Bounce rays go to
+// NextPaths and light samples to ShadowRays.
+void PathTracer::ShadePaths(Wavefront* wavefront) const {
+  const PathQueue& paths = *wavefront->Paths;
+
+  auto materialCount = static_cast<uint32_t>(m_scene.GetMaterials().size());
+
+  uint32_t pathsPerPixel = k_cameraRaysPerPixel * m_settings.SampleIncrement;
+
+  ParallelFor(paths.Size, [&](size_t begin, size_t end) {
+    QueueWriter<PathQueue> nextPaths(wavefront->NextPaths);
+    QueueWriter<ShadowQueue> shadowRays(&wavefront->ShadowRays);
+
+    for (size_t i = begin; i < end; ++i) {
+      uint32_t slot = wavefront->ShadingOrder[i];
+      uint32_t key = wavefront->ShadingKeys[slot];
+
+      uint32_t pathIndex = paths.PathIndex[slot];
+      uint32_t bounces = paths.Bounces[slot];
+
+      uint32_t cacheCell = paths.CacheCell[slot];
+      PathGuideVertex* guideVertices = wavefront->GetGuideVertices(pathIndex);
+
+      if (key > materialCount) {
+        Float3 radiance = GetMissRadiance(paths.GetRay(slot), bounces, paths.BsdfPdf[slot],
+                                          paths.BsdfNormal[slot]);
+        wavefront->PathL[pathIndex] += paths.Throughput[slot] * radiance;
+        AddCacheRadiance(cacheCell, paths.CacheWeight[slot] * radiance);
+        AddGuideRadiance(guideVertices, bounces, paths.Throughput[slot] * radiance);
+        continue;
+      }
+
+      const HitInfo& hit = wavefront->Hits[slot];
+
+      Float3 emission{0.f, 0.f, 0.f};
+
+      uint32_t light = key == materialCount ? 0 : m_scene.GetTriangleLight(hit);
+      if (light != k_invalidIndex) {
+        emission = GetLightHitRadiance(light, paths.GetRay(slot), hit.T, bounces,
+                                       paths.BsdfPdf[slot], paths.BsdfNormal[slot]);
+        wavefront->PathL[pathIndex] += paths.Throughput[slot] * emission;
+        AddGuideRadiance(guideVertices, bounces, paths.Throughput[slot] * emission);
+      }
+
+      if (key == materialCount) {
+        AddCacheRadiance(cacheCell, paths.CacheWeight[slot] * emission);
+        continue;
+      }
+
+      // Paths are numbered like GeneratePaths creates them.
+      uint32_t pixel = m_activePixels[wavefront->ActiveBegin + pathIndex / pathsPerPixel];
+      uint32_t pixelPath = pathIndex % pathsPerPixel;
+
+      PathSample sample = GetPathSample(pixel % m_width, pixel / m_width,
+                                        pixelPath / m_settings.SampleIncrement,
+                                        pixelPath % m_settings.SampleIncrement);
+      sample.RngState = paths.RngState[slot];
+
+      HitShading shading = ShadeHit(paths.GetRay(slot), hit, paths.Throughput[slot], bounces,
+                                    sample);
+
+      AddCacheRadiance(cacheCell, paths.CacheWeight[slot] * (emission + shading.CachedRadiance));
+
+      if (shading.EndsInCache) {
+        wavefront->PathL[pathIndex] += paths.Throughput[slot] * shading.CachedRadiance;
+        AddGuideRadiance(guideVertices, bounces, paths.Throughput[slot] * shading.CachedRadiance);
+        continue;
+      }
+
+      if (shading.Continue) {
+        if (guideVertices) {
+          guideVertices[bounces] = GetGuideVertex(shading);
+          wavefront->GuideVertexCounts[pathIndex] = bounces + 1;
+        }
+
+        PathQueue::Entry entry{};
+        entry.Origin = shading.BounceRay.Origin;
+        entry.Direction = shading.BounceRay.Direction;
+        entry.Throughput = shading.BounceThroughput;
+        entry.BsdfPdf = shading.BouncePdf;
+        entry.BsdfNormal = shading.BounceNormal;
+        entry.RngState = paths.RngState[slot] ^ JenkinsHash(bounces + 1);
+        entry.PathIndex = pathIndex;
+        entry.Bounces = bounces + 1;
+        entry.CacheCell = shading.CacheCell;
+        entry.CacheWeight = shading.BounceCacheWeight;
+
+        nextPaths.Push(entry);
+      }
+
+      if (shading.HasLightSample)
+        shadowRays.Push({shading.ShadowRay, shading.ShadowRayMask, shading.LightContribution,
+                         pathIndex, bounces, shading.CacheCell, shading.LightCacheRadiance});
+    }
+  });
+}
+
+// Traces the shadow rays and adds the light of the unoccluded ones to their paths.
+void PathTracer::ConnectPaths(Wavefront* wavefront) const {
+  const ShadowQueue& shadowRays = wavefront->ShadowRays;
+
+  ParallelFor(shadowRays.Size, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      if (!IsOccluded(shadowRays.Rays[i], shadowRays.InstanceMask[i])) {
+        uint32_t pathIndex = shadowRays.PathIndex[i];
+        wavefront->PathL[pathIndex] += shadowRays.Contribution[i];
+        AddCacheRadiance(shadowRays.CacheCell[i], shadowRays.CacheRadiance[i]);
+        AddGuideRadiance(wavefront->GetGuideVertices(pathIndex), shadowRays.Bounces[i],
+                         shadowRays.Contribution[i]);
+      }
+    }
+  });
+}
+
+// Records the guide vertices of the first pathCount paths of the wave, which have all ended.
+void PathTracer::RecordGuideVertices(const Wavefront& wavefront, uint32_t pathCount) const {
+  ParallelFor(pathCount, [&](size_t begin, size_t end) {
+    for (size_t p = begin; p < end; ++p) {
+      const PathGuideVertex* vertices =
+          &wavefront.GuideVertices[p * wavefront.GuideVerticesPerPath];
+
+      for (uint32_t i = 0; i < wavefront.GuideVertexCounts[p]; ++i) {
+        if (vertices[i].Leaf != k_invalidIndex)
+          m_pathGuide->Record(vertices[i]);
+      }
+    }
+  });
+}
+
+} // namespace cpu_rt
@@ -0,0 +1,185 @@
+#include "cpu_rt/radiance_cache.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+#include "cpu_rt/parallel_for.h"
+
+namespace cpu_rt {
+
+namespace {
+
+// Slots a cell may take after the one its key hashes to.
+constexpr uint32_t k_maxProbes = 8;
+
+// Bits of each quantized coordinate in a key, which wrap around beyond them.
+constexpr uint32_t k_coordinateBits = 19;
+constexpr uint32_t k_maxLevel = 15;
+
+// The finalizer of MurmurHash3.
+uint64_t HashKey(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdull;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ull;
+  key ^= key >> 33;
+  return key;
+}
+
+uint64_t QuantizeCoordinate(float x, float cellSize) {
+  auto cell = static_cast<int64_t>(std::floor(x / cellSize));
+  return static_cast<uint64_t>(cell) & ((uint64_t{1} << k_coordinateBits) - 1);
+}
+
+} // namespace
+
+RadianceCache::RadianceCache(const Float3& cameraPosition, const RadianceCacheSettings& settings)
+  : m_cameraPosition(cameraPosition), m_settings(settings),
+    m_cells(std::bit_floor(std::max(settings.MemoryBudget / sizeof(Cell),
+                                     size_t{k_maxProbes}))) {}
+
+// Level, dominant normal axis and the three coordinates, packed into 4 + 3 + 3 * 19 bits. The
+// axis is numbered from 1 so that no key is 0.
+uint64_t RadianceCache::GetKey(const Float3& p, const Float3& n) const {
+  float distance = Length(p - m_cameraPosition);
+
+  uint32_t level = 0;
+  if (distance > m_settings.LevelDistance) {
+    level = std::min(k_maxLevel,
+                     static_cast<uint32_t>(std::log2(distance / m_settings.LevelDistance)) + 1);
+  }
+
+  float cellSize = std::ldexp(m_settings.CellSize, static_cast<int>(level));
+
+  uint32_t axis = 0;
+  if (std::abs(n.y) > std::abs(n[axis]))
+    axis = 1;
+  if (std::abs(n.z) > std::abs(n[axis]))
+    axis = 2;
+
+  uint64_t normalCode = 1 + axis * 2 + (n[axis] < 0.f ? 1 : 0);
+
+  return uint64_t{level} << 60 | normalCode << 57 |
+         QuantizeCoordinate(p.x, cellSize) << (2 * k_coordinateBits) |
+         QuantizeCoordinate(p.y, cellSize) << k_coordinateBits | QuantizeCoordinate(p.z, cellSize);
+}
+
+uint32_t RadianceCache::FindOrInsert(const Float3& p, const Float3& n) {
+  uint64_t key = GetKey(p, n);
+  size_t mask = m_cells.size() - 1;
+  size_t start = HashKey(key) & mask;
+
+  // Evictions leave holes, so the key may sit past an empty slot.
+  for (uint32_t probe = 0; probe < k_maxProbes; ++probe) {
+    size_t index = (start + probe) & mask;
+    if (m_cells[index].Key.load(std::memory_order_relaxed) == key)
+      return static_cast<uint32_t>(index);
+  }
+
+  // Threads inserting the same key try the empty slots in the same order, so they agree on the
+  // first one any of them claims.
+  for (uint32_t probe = 0; probe < k_maxProbes; ++probe) {
+    size_t index = (start + probe) & mask;
+
+    uint64_t expected = 0;
+    if (m_cells[index].Key.compare_exchange_strong(expected, key, std::memory_order_relaxed)) {
+      m_cells[index].LastUsedFrame.store(m_frame, std::memory_order_relaxed);
+      return static_cast<uint32_t>(index);
+    }
+
+    if (expected == key)
+      return static_cast<uint32_t>(index);
+  }
+
+  m_insertFailureCount.fetch_add(1, std::memory_order_relaxed);
+  return k_invalidIndex;
+}
+
+bool RadianceCache::Lookup(uint32_t cell, Float3* radiance) {
+  Cell& entry = m_cells[cell];
+  entry.LastUsedFrame.store(m_frame, std::memory_order_relaxed);
+
+  bool isValid = entry.ResolvedSampleCount >= m_settings.MinSamples;
+
+  m_lookupCount.fetch_add(1, std::memory_order_relaxed);
+  if (isValid)
+    m_lookupHitCount.fetch_add(1, std::memory_order_relaxed);
+
+  *radiance = isValid ? entry.Radiance : Float3{0.f, 0.f, 0.f};
+  return isValid;
+}
+
+void RadianceCache::AddSample(uint32_t cell) {
+  m_cells[cell].SampleCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void RadianceCache::AddRadiance(uint32_t cell, const Float3& radiance) {
+  if (radiance.x == 0.f && radiance.y == 0.f && radiance.z == 0.f)
+    return;
+
+  for (int c = 0; c < 3; ++c) {
+    m_cells[cell].Sum[c].fetch_add(radiance[c], std::memory_order_relaxed);
+  }
+}
+
+void RadianceCache::EndFrame() {
+  std::atomic<uint32_t> cellCount = 0;
+
+  ParallelFor(m_cells.size(), [&](size_t begin, size_t end) {
+    uint32_t chunkCellCount = 0;
+
+    for (size_t i = begin; i < end; ++i) {
+      Cell& cell = m_cells[i];
+      if (cell.Key.load(std::memory_order_relaxed) == 0)
+        continue;
+
+      if (m_frame - cell.LastUsedFrame.load(std::memory_order_relaxed) >= m_settings.MaxAge) {
+        cell.Key.store(0, std::memory_order_relaxed);
+        for (std::atomic<float>& sum : cell.Sum) {
+          sum.store(0.f, std::memory_order_relaxed);
+        }
+        cell.SampleCount.store(0, std::memory_order_relaxed);
+        cell.Radiance = Float3{0.f, 0.f, 0.f};
+        cell.ResolvedSampleCount = 0;
+        continue;
+      }
+
+      ++chunkCellCount;
+
+      uint32_t sampleCount = cell.SampleCount.load(std::memory_order_relaxed);
+      if (sampleCount == 0)
+        continue;
+
+      Float3 sum{cell.Sum[0].load(std::memory_order_relaxed),
+                 cell.Sum[1].load(std::memory_order_relaxed),
+                 cell.Sum[2].load(std::memory_order_relaxed)};
+
+      uint32_t history = std::min(cell.ResolvedSampleCount, m_settings.MaxSamples);
+      cell.Radiance = (static_cast<float>(history) * cell.Radiance + sum) /
+                      static_cast<float>(history + sampleCount);
+      cell.ResolvedSampleCount = history + sampleCount;
+
+      for (std::atomic<float>& cellSum : cell.Sum) {
+        cellSum.store(0.f, std::memory_order_relaxed);
+      }
+      cell.SampleCount.store(0, std::memory_order_relaxed);
+    }
+
+    cellCount.fetch_add(chunkCellCount, std::memory_order_relaxed);
+  });
+
+  uint64_t lookupCount = m_lookupCount.exchange(0, std::memory_order_relaxed);
+  uint64_t lookupHitCount = m_lookupHitCount.exchange(0, std::memory_order_relaxed);
+
+  m_stats.Capacity = static_cast<uint32_t>(m_cells.size());
+  m_stats.CellCount = cellCount;
+  m_stats.HitRate = lookupCount > 0 ? static_cast<float>(lookupHitCount) /
+                                          static_cast<float>(lookupCount)
+                                    : 0.f;
+  m_stats.InsertFailures = m_insertFailureCount.load(std::memory_order_relaxed);
+
+  ++m_frame;
+}
+
+} // namespace cpu_rt
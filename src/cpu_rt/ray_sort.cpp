@@ -0,0 +1,114 @@
+#include "cpu_rt/ray_sort.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+namespace cpu_rt {
+
+namespace {
+
+// Bits sorted per radix sort pass. The 60-bit ray keys take five passes.
+constexpr uint32_t k_radixBits = 12;
+constexpr uint32_t k_radixSize = 1u << k_radixBits;
+
+// Spreads the bits of a byte five apart, so five spread values can be interleaved with shifts.
+constexpr std::array<uint64_t, 256> k_spreadByte = [] {
+  std::array<uint64_t, 256> table{};
+  for (uint32_t value = 0; value < 256; ++value) {
+    for (uint32_t bit = 0; bit < 8; ++bit) {
+      table[value] |= static_cast<uint64_t>((value >> bit) & 1) << (5 * bit);
+    }
+  }
+  return table;
+}();
+
+uint64_t SpreadBits(uint32_t value) {
+  return k_spreadByte[value & 0xff] | (k_spreadByte[value >> 8] << 40);
+}
+
+uint32_t Quantize(float value, float min, float extent) {
+  constexpr auto maxValue = static_cast<float>((1u << k_rayKeyBitsPerDimension) - 1);
+
+  float t = extent > 0.f ? (value - min) / extent * maxValue : 0.f;
+
+  // Also maps NaNs to 0.
+  if (!(t > 0.f))
+    return 0;
+
+  return static_cast<uint32_t>(std::min(t, maxValue) + 0.5f);
+}
+
+} // namespace
+
+uint64_t GetRayMortonKey(const Float3& origin, const Float3& direction, const Aabb& sceneBounds) {
+  Float3 extent = sceneBounds.Extent();
+
+  uint32_t x = Quantize(origin.x, sceneBounds.Min.x, extent.x);
+  uint32_t y = Quantize(origin.y, sceneBounds.Min.y, extent.y);
+  uint32_t z = Quantize(origin.z, sceneBounds.Min.z, extent.z);
+
+  // Octahedral map of the direction to [-1, 1]^2.
+  float norm = std::abs(direction.x) + std::abs(direction.y) + std::abs(direction.z);
+  float u = direction.x / norm;
+  float v = direction.y / norm;
+
+  if (direction.z < 0.f) {
+    float foldedU = (1.f - std::abs(v)) * (u < 0.f ? -1.f : 1.f);
+    float foldedV = (1.f - std::abs(u)) * (v < 0.f ? -1.f : 1.f);
+    u = foldedU;
+    v = foldedV;
+  }
+
+  uint32_t dirU = Quantize(u, -1.f, 2.f);
+  uint32_t dirV = Quantize(v, -1.f, 2.f);
+
+  return SpreadBits(x) << 4 | SpreadBits(y) << 3 | SpreadBits(z) << 2 | SpreadBits(dirU) << 1 |
+         SpreadBits(dirV);
+}
+
+void RadixSortByKey(std::span<uint64_t> keys, std::span<uint32_t> values, uint32_t keyBits) {
+  std::vector<uint64_t> keyScratch(keys.size());
+  std::vector<uint32_t> valueScratch(values.size());
+
+  std::span<uint64_t> srcKeys = keys;
+  std::span<uint32_t> srcValues = values;
+  std::span<uint64_t> dstKeys = keyScratch;
+  std::span<uint32_t> dstValues = valueScratch;
+
+  std::vector<uint32_t> offsets(k_radixSize);
+
+  for (uint32_t shift = 0; shift < keyBits; shift += k_radixBits) {
+    std::fill(offsets.begin(), offsets.end(), 0);
+
+    for (uint64_t key : srcKeys) {
+      ++offsets[(key >> shift) & (k_radixSize - 1)];
+    }
+
+    uint32_t sum = 0;
+    for (uint32_t& offset : offsets) {
+      uint32_t count = offset;
+      offset = sum;
+      sum += count;
+    }
+
+    for (size_t i = 0; i < srcKeys.size(); ++i) {
+      uint32_t dst = offsets[(srcKeys[i] >> shift) & (k_radixSize - 1)]++;
+      dstKeys[dst] = srcKeys[i];
+      dstValues[dst] = srcValues[i];
+    }
+
+    std::swap(srcKeys, dstKeys);
+    std::swap(srcValues, dstValues);
+  }
+
+  // An odd number of passes leaves the result in the scratch buffers.
+  if (srcKeys.data() != keys.data()) {
+    std::copy(srcKeys.begin(), srcKeys.end(), keys.begin());
+    std::copy(srcValues.begin(), srcValues.end(), values.begin());
+  }
+}
+
+} // namespace cpu_rt
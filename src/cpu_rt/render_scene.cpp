@@ -0,0 +1,244 @@
+#include "cpu_rt/render_scene.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "cpu_rt/hasher.h"
+
+namespace cpu_rt {
+
+static Material GetMaterial(const utils::Material& material) {
+  const utils::PbrMetallicRoughness& pbr = material.PbrMetallicRoughness;
+
+  Material result{};
+  result.BaseColor = Float3{pbr.BaseColorFactor[0], pbr.BaseColorFactor[1],
+                            pbr.BaseColorFactor[2]};
+  result.Metallic = pbr.MetallicFactor;
+  result.Roughness = pbr.RoughnessFactor;
+  return result;
+}
+
+static Float3 GetEmission(const utils::Material& material) {
+  return material.EmissiveStrength * Float3{material.EmissiveFactor[0],
+                                            material.EmissiveFactor[1],
+                                            material.EmissiveFactor[2]};
+}
+
+static Float3 LoadVertex(const TrianglesDesc& desc, uint32_t index) {
+  Float3 v;
+  memcpy(&v, desc.VertexBuffer + static_cast<size_t>(index) * desc.VertexStride, sizeof(v));
+
+  if (desc.Transform3x4)
+    v = TransformPoint(*desc.Transform3x4, v);
+
+  return v;
+}
+
+static float GetDeterminant(const Matrix3x4& mat) {
+  return mat.m[0][0] * (mat.m[1][1] * mat.m[2][2] - mat.m[1][2] * mat.m[2][1]) -
+         mat.m[0][1] * (mat.m[1][0] * mat.m[2][2] - mat.m[1][2] * mat.m[2][0]) +
+         mat.m[0][2] * (mat.m[1][0] * mat.m[2][1] - mat.m[1][1] * mat.m[2][0]);
+}
+
+RenderScene::RenderScene(const utils::Scene& scene, const BvhBuildSettings& settings,
+                         uint32_t buildFlags, const std::filesystem::path& bvhCacheDir) {
+  m_geometryTransform = Identity3x4();
+  m_geometryTransform.m[2][2] = -1.f;
+
+  for (const utils::Material& material : scene.Materials) {
+    m_materials.push_back(GetMaterial(material));
+    m_shadingMaterials.push_back(ClassifyMaterial(m_materials.back()));
+  }
+
+  // Same light as App::CreateAssets.
+  Float3 lightCenter{0.f, 1.98999f, 0.f};
+
+  m_light.Center = lightCenter;
+  m_light.AxisU = Float3{0.25f, 0.f, 0.f};
+  m_light.AxisV = Float3{0.f, 0.f, 0.25f};
+
+  // With the Le of ClosestHitShader.
+  AreaLight quadLight{};
+  quadLight.P0 = m_light.Center - m_light.AxisU - m_light.AxisV;
+  quadLight.Edge1 = 2.f * m_light.AxisU;
+  quadLight.Edge2 = 2.f * m_light.AxisV;
+  quadLight.Le = Float3{40.f, 40.f, 40.f};
+  quadLight.IsParallelogram = true;
+  quadLight.TwoSided = true;
+  m_lights.push_back(quadLight);
+
+  std::vector<GeometryDesc> geometryDescs;
+
+  for (const utils::Mesh& mesh : scene.Meshes) {
+    for (const utils::Primitive& prim : mesh.Primitives) {
+      geometryDescs.push_back(GetTriangleGeometryDesc(scene, prim, m_geometryTransform));
+      m_meshGeometries.push_back(GetMeshGeometry(scene, prim));
+
+      Float3 le = GetEmission(scene.Materials[prim.MaterialIndex]);
+      if (le.x > 0.f || le.y > 0.f || le.z > 0.f)
+        AddTriangleLights(geometryDescs.back(), le, &m_meshGeometries.back());
+    }
+  }
+
+  if (bvhCacheDir.empty()) {
+    m_blas = std::make_unique<Blas>(geometryDescs, settings, buildFlags);
+  } else {
+    m_blas = LoadOrBuildBlas(geometryDescs, settings, buildFlags, bvhCacheDir);
+  }
+
+  Float3 lightHalfExtent{0.25f, 0.1f, 0.25f};
+  Aabb lightAabb{lightCenter - lightHalfExtent, lightCenter + lightHalfExtent};
+
+  GeometryDesc lightDesc{};
+  lightDesc.Type = GeometryType::ProceduralPrimitiveAabbs;
+  lightDesc.Aabbs.Aabbs = &lightAabb;
+  lightDesc.Aabbs.AabbCount = 1;
+
+  m_lightBlas = std::make_unique<Blas>(std::span(&lightDesc, 1), settings);
+
+  m_lightHitGroupIndex = static_cast<uint32_t>(geometryDescs.size());
+
+  m_intersectionTable = LightIntersectionTable(QuadIntersector({m_light}));
+  m_intersectionTable.SetHitGroupIntersector<0>(m_lightHitGroupIndex);
+
+  InstanceDesc instanceDescs[2]{};
+
+  instanceDescs[0].InstanceMask = k_sceneInstanceMask;
+  // Gltf uses counter-clockwise winding order.
+  instanceDescs[0].Flags = k_instanceFlagTriangleFrontCounterClockwise;
+  instanceDescs[0].AccelerationStructure = m_blas.get();
+
+  instanceDescs[1].InstanceMask = k_lightInstanceMask;
+  instanceDescs[1].InstanceContributionToHitGroupIndex = m_lightHitGroupIndex;
+  instanceDescs[1].AccelerationStructure = m_lightBlas.get();
+
+  m_tlas = std::make_unique<Tlas>(instanceDescs, settings);
+
+  // The positions and indices are hashed as for the Blas cache, which the light Blas, built from
+  // constants, does not need.
+  Hasher hasher;
+  hasher.UpdateValue(GetBlasCacheKey(geometryDescs, settings, buildFlags));
+
+  for (const MeshGeometry& geometry : m_meshGeometries) {
+    hasher.UpdateValue(geometry.MaterialIndex);
+    hasher.Update(geometry.Normals.data(), geometry.Normals.size() * sizeof(Float3));
+  }
+
+  hasher.UpdateValue(m_geometryTransform);
+
+  for (const InstanceDesc& desc : instanceDescs) {
+    hasher.UpdateValue(desc.Transform);
+    hasher.UpdateValue(desc.InstanceMask);
+    hasher.UpdateValue(desc.InstanceContributionToHitGroupIndex);
+    hasher.UpdateValue(desc.Flags);
+  }
+
+  hasher.Update(m_materials.data(), m_materials.size() * sizeof(Material));
+
+  // Field by field, as the padding after the flags is undefined.
+  for (const AreaLight& light : m_lights) {
+    hasher.UpdateValue(light.P0);
+    hasher.UpdateValue(light.Edge1);
+    hasher.UpdateValue(light.Edge2);
+    hasher.UpdateValue(light.Le);
+    hasher.UpdateValue(light.IsParallelogram);
+    hasher.UpdateValue(light.TwoSided);
+  }
+
+  m_geometryKey = hasher.Finish();
+}
+
+void RenderScene::SetEnvironmentLight(std::unique_ptr<EnvironmentLight> light) {
+  m_environmentLight = std::move(light);
+  m_environmentKey = 0;
+
+  if (m_environmentLight) {
+    std::span<const Float3> pixels = m_environmentLight->GetPixels();
+
+    Hasher hasher;
+    hasher.UpdateValue(m_environmentLight->GetWidth());
+    hasher.UpdateValue(m_environmentLight->GetHeight());
+    hasher.Update(pixels.data(), pixels.size_bytes());
+    m_environmentKey = hasher.Finish();
+  }
+}
+
+uint64_t RenderScene::GetContentKey() const {
+  Hasher hasher;
+  hasher.UpdateValue(m_geometryKey);
+  hasher.UpdateValue(m_environmentKey);
+  return hasher.Finish();
+}
+
+RenderScene::MeshGeometry RenderScene::GetMeshGeometry(const utils::Scene& scene,
+                                                       const utils::Primitive& prim) {
+  if (prim.Normals->ComponentType != utils::ComponentType::Float ||
+      prim.Normals->Type != utils::AccessorType::Vec3)
+    throw std::invalid_argument("Unsupported normal format.");
+
+  if (prim.MaterialIndex < 0 || static_cast<size_t>(prim.MaterialIndex) >= scene.Materials.size())
+    throw std::invalid_argument("Primitive has no material.");
+
+  const utils::BufferView* normalBufferView = prim.Normals->BufferView;
+  const utils::BufferView* indexBufferView = prim.Indices->BufferView;
+
+  const uint8_t* normalBuffer = scene.Buffers[normalBufferView->BufferIndex].data() +
+                                normalBufferView->Offset;
+  const uint8_t* indexBuffer = scene.Buffers[indexBufferView->BufferIndex].data() +
+                               indexBufferView->Offset;
+
+  MeshGeometry geometry;
+  geometry.MaterialIndex = static_cast<uint32_t>(prim.MaterialIndex);
+
+  geometry.Normals.resize(prim.Normals->Count);
+  for (size_t i = 0; i < geometry.Normals.size(); ++i) {
+    memcpy(&geometry.Normals[i], normalBuffer + i * *normalBufferView->Stride, sizeof(Float3));
+  }
+
+  geometry.Indices.resize(prim.Indices->Count);
+  memcpy(geometry.Indices.data(), indexBuffer, geometry.Indices.size() * sizeof(uint16_t));
+
+  return geometry;
+}
+
+void RenderScene::AddTriangleLights(const GeometryDesc& desc, const Float3& le,
+                                    MeshGeometry* geometry) {
+  const TrianglesDesc& triangles = desc.Triangles;
+
+  // Front faces wind counter-clockwise before the transform, and clockwise after one that
+  // mirrors them.
+  bool mirrored = triangles.Transform3x4 && GetDeterminant(*triangles.Transform3x4) < 0.f;
+
+  geometry->FirstLight = static_cast<uint32_t>(m_lights.size());
+
+  for (uint32_t i = 0; i + 2 < triangles.IndexCount; i += 3) {
+    Float3 v0 = LoadVertex(triangles, triangles.IndexBuffer[i]);
+    Float3 v1 = LoadVertex(triangles, triangles.IndexBuffer[i + 1]);
+    Float3 v2 = LoadVertex(triangles, triangles.IndexBuffer[i + 2]);
+
+    AreaLight light{};
+    light.P0 = v0;
+    light.Edge1 = mirrored ? v2 - v0 : v1 - v0;
+    light.Edge2 = mirrored ? v1 - v0 : v2 - v0;
+    light.Le = le;
+    light.IsParallelogram = false;
+    light.TwoSided = false;
+    m_lights.push_back(light);
+  }
+}
+
+Float3 RenderScene::GetShadingNormal(const HitInfo& hit) const {
+  const MeshGeometry& geometry = m_meshGeometries[hit.GeometryIndex];
+
+  const uint16_t* indices = &geometry.Indices[static_cast<size_t>(hit.PrimitiveIndex) * 3];
+  const Float3& n0 = geometry.Normals[indices[0]];
+  const Float3& n1 = geometry.Normals[indices[1]];
+  const Float3& n2 = geometry.Normals[indices[2]];
+
+  Float3 normal = Normalize(n0 + hit.Barycentrics[0] * (n1 - n0) +
+                            hit.Barycentrics[1] * (n2 - n0));
+  return Normalize(TransformVector(m_geometryTransform, normal));
+}
+
+} // namespace cpu_rt
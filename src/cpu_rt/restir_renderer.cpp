@@ -0,0 +1,374 @@
+#include "cpu_rt/restir_renderer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <utility>
+
+#include "cpu_rt/camera.h"
+#include "cpu_rt/parallel_for.h"
+#include "cpu_rt/rng.h"
+#include "cpu_rt/shading.h"
+
+namespace cpu_rt {
+
+namespace {
+
+// Same as PathTracer's.
+constexpr uint32_t k_rayFlags = k_rayFlagCullBackFacingTriangles;
+constexpr uint32_t k_shadowRayFlags = k_rayFlagCullBackFacingTriangles |
+                                      k_rayFlagAcceptFirstHitAndEndSearch |
+                                      k_rayFlagForceOpaque | k_rayFlagSkipClosestHitShader;
+
+// Spatial reuse skips neighbours whose normal is further off than this, or whose distance from
+// the camera differs by more than this fraction.
+constexpr float k_minNeighborNormalCos = 0.9f;
+constexpr float k_maxNeighborDistanceRatio = 0.1f;
+
+// Seeds the random numbers of each stage apart from the others.
+enum class Stage : uint32_t {
+  CameraRays,
+  TemporalReuse,
+  SpatialReuse
+};
+
+uint32_t InitStageRngSeed(uint32_t x, uint32_t y, uint32_t frame, Stage stage) {
+  return InitRngSeed(x, y, frame) ^ JenkinsHash(static_cast<uint32_t>(stage));
+}
+
+} // namespace
+
+void RestirRenderer::Reservoir::Update(const LightSample& sample, float weight,
+                                       float effectiveSampleCount, float u) {
+  if (!(weight > 0.f))
+    return;
+
+  WeightSum += weight;
+  WeightSquareSum += weight * weight / effectiveSampleCount;
+
+  if (u * WeightSum < weight)
+    Sample = sample;
+}
+
+RestirRenderer::RestirRenderer(const RenderScene& scene, uint32_t width, uint32_t height,
+                               const RestirSettings& settings)
+  : m_scene(scene), m_width(width), m_height(height), m_settings(settings),
+    m_lightSampler(scene.GetLights(), settings.LightSampler),
+    m_film(static_cast<size_t>(width) * height), m_frame(m_film.size()),
+    m_reservoirs(m_film.size()), m_prevReservoirs(m_film.size()), m_surfaces(m_film.size()),
+    m_prevSurfaces(m_film.size()), m_emission(m_film.size()) {}
+
+void RestirRenderer::Render() {
+  TraceCameraRays();
+
+  RestirReuse reuse = m_settings.Reuse;
+
+  if (m_frameCount > 0 &&
+      (reuse == RestirReuse::Temporal || reuse == RestirReuse::Spatiotemporal))
+    ReuseTemporally();
+
+  if (reuse == RestirReuse::Spatial || reuse == RestirReuse::Spatiotemporal) {
+    ReuseSpatially();
+    std::swap(m_reservoirs, m_prevReservoirs);
+  }
+
+  Shade();
+
+  auto n = static_cast<float>(m_frameCount);
+  for (size_t i = 0; i < m_film.size(); ++i) {
+    m_film[i] = (1.f / (n + 1.f)) * (n * m_film[i] + m_frame[i]);
+  }
+
+  double candidateSum = 0.0;
+  double effectiveSampleSum = 0.0;
+  uint32_t surfaceCount = 0;
+
+  for (size_t i = 0; i < m_film.size(); ++i) {
+    if (!m_surfaces[i].IsValid)
+      continue;
+
+    candidateSum += m_reservoirs[i].M;
+    effectiveSampleSum += m_reservoirs[i].EffectiveSampleCount;
+    ++surfaceCount;
+  }
+
+  double count = std::max(1u, surfaceCount);
+  m_frameStats.CandidateCount = static_cast<float>(candidateSum / count);
+  m_frameStats.EffectiveSampleCount = static_cast<float>(effectiveSampleSum / count);
+
+  // The next frame reuses what this one shaded with.
+  std::swap(m_reservoirs, m_prevReservoirs);
+  std::swap(m_surfaces, m_prevSurfaces);
+
+  ++m_frameCount;
+}
+
+Float3 RestirRenderer::GetUnshadowedContribution(const Surface& surface,
+                                                 const LightSample& sample) const {
+  const AreaLight& light = m_scene.GetLights()[sample.Light];
+
+  Float3 toLight = sample.Position - surface.Position;
+  float distSq = Dot(toLight, toLight);
+  Float3 wi = toLight / std::sqrt(distSq);
+
+  float cosSurface = Dot(wi, surface.Normal);
+  float cosLight = -Dot(light.GetNormal(), wi);
+  if (light.TwoSided)
+    cosLight = std::abs(cosLight);
+
+  if (!(cosSurface > 0.f && cosLight > 0.f))
+    return Float3{0.f, 0.f, 0.f};
+
+  const Material& material = m_scene.GetMaterials()[surface.MaterialIndex];
+  Float3 brdf = Brdf(surface.Wo, wi, surface.Normal, material);
+
+  return brdf * light.Le * (cosSurface * cosLight / distSq);
+}
+
+float RestirRenderer::GetTargetFunction(const Surface& surface, const LightSample& sample) const {
+  return Luminance(GetUnshadowedContribution(surface, sample));
+}
+
+RestirRenderer::Reservoir RestirRenderer::SampleLights(const Surface& surface,
+                                                       uint32_t* rngState) const {
+  Reservoir reservoir{};
+
+  auto candidateCount = static_cast<float>(m_settings.InitialCandidates);
+
+  for (uint32_t i = 0; i < m_settings.InitialCandidates; ++i) {
+    float selectU = Rand(rngState);
+    float lightU = Rand(rngState);
+    float lightV = Rand(rngState);
+    float resampleU = Rand(rngState);
+
+    // A light sampler that finds no light draws a candidate that contributes nothing.
+    uint32_t light;
+    float lightPmf;
+    if (!m_lightSampler.Sample(surface.Position, surface.Normal, selectU, &light, &lightPmf))
+      continue;
+
+    const AreaLight& areaLight = m_scene.GetLights()[light];
+    LightSample sample{areaLight.SamplePoint(lightU, lightV), light};
+
+    // Candidates share the reservoir equally, so each has an MIS weight of 1 / M.
+    float sourcePdf = lightPmf / areaLight.GetArea();
+    float weight = GetTargetFunction(surface, sample) / (sourcePdf * candidateCount);
+
+    reservoir.Update(sample, weight, 1.f, resampleU);
+  }
+
+  reservoir.M = candidateCount;
+
+  if (reservoir.WeightSum > 0.f) {
+    reservoir.W = reservoir.WeightSum / GetTargetFunction(surface, reservoir.Sample);
+    reservoir.EffectiveSampleCount =
+        reservoir.WeightSum * reservoir.WeightSum / reservoir.WeightSquareSum;
+  }
+
+  return reservoir;
+}
+
+RestirRenderer::Reservoir RestirRenderer::CombineReservoirs(
+    std::span<const Surface* const> surfaces, std::span<const Reservoir* const> reservoirs,
+    uint32_t* rngState) const {
+  Reservoir result{};
+
+  for (size_t i = 0; i < reservoirs.size(); ++i) {
+    const Reservoir& reservoir = *reservoirs[i];
+    result.M += reservoir.M;
+
+    float resampleU = Rand(rngState);
+    if (!(reservoir.W > 0.f))
+      continue;
+
+    // The generalized balance heuristic: the reservoirs share the sample in proportion to how
+    // likely each was to pick it, i.e. to their M and target function. Reservoirs that could
+    // not have picked it get none of it, so the weights of the reservoirs that could sum to 1.
+    float mis = 0.f;
+    float misSum = 0.f;
+
+    for (size_t j = 0; j < reservoirs.size(); ++j) {
+      float share = reservoirs[j]->M * GetTargetFunction(*surfaces[j], reservoir.Sample);
+      misSum += share;
+      if (j == i)
+        mis = share;
+    }
+
+    float weight = (mis / misSum) * GetTargetFunction(*surfaces[0], reservoir.Sample) *
+                   reservoir.W;
+
+    result.Update(reservoir.Sample, weight, reservoir.EffectiveSampleCount, resampleU);
+  }
+
+  if (result.WeightSum > 0.f) {
+    result.W = result.WeightSum / GetTargetFunction(*surfaces[0], result.Sample);
+    result.EffectiveSampleCount = result.WeightSum * result.WeightSum / result.WeightSquareSum;
+  }
+
+  return result;
+}
+
+void RestirRenderer::TraceCameraRays() {
+  std::atomic<uint64_t> rayCount = 0;
+
+  ParallelFor(m_film.size(), [&](size_t begin, size_t end) {
+    for (size_t pixel = begin; pixel < end; ++pixel) {
+      auto x = static_cast<uint32_t>(pixel % m_width);
+      auto y = static_cast<uint32_t>(pixel / m_width);
+
+      uint32_t rngState = InitStageRngSeed(x, y, m_frameCount, Stage::CameraRays);
+
+      float jitterX = Rand(&rngState);
+      float jitterY = Rand(&rngState);
+      Ray ray = GetCameraRay(m_width, m_height, x, y, jitterX, jitterY);
+
+      Surface& surface = m_surfaces[pixel];
+      surface = Surface{};
+      m_reservoirs[pixel] = Reservoir{};
+      m_emission[pixel] = Float3{0.f, 0.f, 0.f};
+
+      HitInfo hit;
+      if (!m_scene.GetTlas().TraceRay(ray, k_rayFlags, ~0u, 0, 1, &hit,
+                                      m_scene.GetIntersectionTable()))
+        continue;
+
+      // The quad is the first light.
+      if (hit.HitGroupIndex == m_scene.GetLightHitGroupIndex()) {
+        m_emission[pixel] = m_scene.GetLights()[0].Le;
+        continue;
+      }
+
+      uint32_t light = m_scene.GetTriangleLight(hit);
+      if (light != k_invalidIndex)
+        m_emission[pixel] = m_scene.GetLights()[light].Le;
+
+      surface.Position = ray.Origin + hit.T * ray.Direction;
+      surface.Normal = m_scene.GetShadingNormal(hit);
+      surface.Wo = -Normalize(ray.Direction);
+      surface.Distance = hit.T * Length(ray.Direction);
+      surface.MaterialIndex = m_scene.GetMaterialIndex(hit.HitGroupIndex);
+      surface.IsValid = true;
+
+      m_reservoirs[pixel] = SampleLights(surface, &rngState);
+    }
+
+    rayCount.fetch_add(end - begin, std::memory_order_relaxed);
+  });
+
+  m_rayCount += rayCount;
+}
+
+void RestirRenderer::ReuseTemporally() {
+  // The camera does not move, so a pixel's previous reservoir is the one it had.
+  float maxHistory = static_cast<float>(m_settings.TemporalHistoryLimit *
+                                        m_settings.InitialCandidates);
+
+  ParallelFor(m_film.size(), [&](size_t begin, size_t end) {
+    for (size_t pixel = begin; pixel < end; ++pixel) {
+      if (!m_surfaces[pixel].IsValid || !m_prevSurfaces[pixel].IsValid)
+        continue;
+
+      auto x = static_cast<uint32_t>(pixel % m_width);
+      auto y = static_cast<uint32_t>(pixel / m_width);
+      uint32_t rngState = InitStageRngSeed(x, y, m_frameCount, Stage::TemporalReuse);
+
+      Reservoir prevReservoir = m_prevReservoirs[pixel];
+      if (prevReservoir.M > maxHistory) {
+        prevReservoir.EffectiveSampleCount *= maxHistory / prevReservoir.M;
+        prevReservoir.M = maxHistory;
+      }
+
+      const Surface* surfaces[] = {&m_surfaces[pixel], &m_prevSurfaces[pixel]};
+      const Reservoir* reservoirs[] = {&m_reservoirs[pixel], &prevReservoir};
+
+      m_reservoirs[pixel] = CombineReservoirs(surfaces, reservoirs, &rngState);
+    }
+  });
+}
+
+void RestirRenderer::ReuseSpatially() {
+  ParallelFor(m_film.size(), [&](size_t begin, size_t end) {
+    std::vector<const Surface*> surfaces;
+    std::vector<const Reservoir*> reservoirs;
+
+    for (size_t pixel = begin; pixel < end; ++pixel) {
+      m_prevReservoirs[pixel] = m_reservoirs[pixel];
+
+      const Surface& surface = m_surfaces[pixel];
+      if (!surface.IsValid)
+        continue;
+
+      auto x = static_cast<uint32_t>(pixel % m_width);
+      auto y = static_cast<uint32_t>(pixel / m_width);
+      uint32_t rngState = InitStageRngSeed(x, y, m_frameCount, Stage::SpatialReuse);
+
+      surfaces.assign(1, &surface);
+      reservoirs.assign(1, &m_reservoirs[pixel]);
+
+      // Neighbours are picked by their surfaces alone, never by their samples, which keeps the
+      // MIS weights unbiased.
+      for (uint32_t i = 0; i < m_settings.SpatialNeighbors; ++i) {
+        float offsetX, offsetY;
+        ConcentricSampleDisk(Rand(&rngState), Rand(&rngState), &offsetX, &offsetY);
+
+        int64_t neighborX = x + std::lround(offsetX * m_settings.SpatialRadius);
+        int64_t neighborY = y + std::lround(offsetY * m_settings.SpatialRadius);
+        if (neighborX < 0 || neighborX >= m_width || neighborY < 0 || neighborY >= m_height)
+          continue;
+
+        size_t neighbor = static_cast<size_t>(neighborY) * m_width +
+                          static_cast<size_t>(neighborX);
+        if (neighbor == pixel)
+          continue;
+
+        const Surface& neighborSurface = m_surfaces[neighbor];
+        if (!neighborSurface.IsValid ||
+            Dot(neighborSurface.Normal, surface.Normal) < k_minNeighborNormalCos ||
+            std::abs(neighborSurface.Distance - surface.Distance) >
+                k_maxNeighborDistanceRatio * surface.Distance)
+          continue;
+
+        surfaces.push_back(&neighborSurface);
+        reservoirs.push_back(&m_reservoirs[neighbor]);
+      }
+
+      m_prevReservoirs[pixel] = CombineReservoirs(surfaces, reservoirs, &rngState);
+    }
+  });
+}
+
+void RestirRenderer::Shade() {
+  std::atomic<uint64_t> rayCount = 0;
+
+  ParallelFor(m_film.size(), [&](size_t begin, size_t end) {
+    uint64_t chunkRayCount = 0;
+
+    for (size_t pixel = begin; pixel < end; ++pixel) {
+      Float3 L = m_emission[pixel];
+
+      const Surface& surface = m_surfaces[pixel];
+      const Reservoir& reservoir = m_reservoirs[pixel];
+
+      if (surface.IsValid && reservoir.W > 0.f) {
+        Float3 toLight = reservoir.Sample.Position - surface.Position;
+        float lightDist = Length(toLight);
+
+        Ray shadowRay{surface.Position, 0.0001f, toLight / lightDist,
+                      lightDist * (1.f - k_shadowRayShortening)};
+        ++chunkRayCount;
+
+        if (!m_scene.GetTlas().Occluded(shadowRay, shadowRay.TMax, ~k_lightInstanceMask,
+                                        k_shadowRayFlags))
+          L += GetUnshadowedContribution(surface, reservoir.Sample) * reservoir.W;
+      }
+
+      m_frame[pixel] = L;
+    }
+
+    rayCount.fetch_add(chunkRayCount, std::memory_order_relaxed);
+  });
+
+  m_rayCount += rayCount;
+}
+
+} // namespace cpu_rt
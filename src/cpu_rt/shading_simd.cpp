@@ -0,0 +1,156 @@
+#include "cpu_rt/shading_simd.h"
+
+#include <algorithm>
+
+namespace cpu_rt {
+
+namespace {
+
+// Loads and stores of the first lanes entries of an array, so the last, partial group of a batch
+// stays within its arrays. The unused lanes are computed on zeros and dropped.
+
+SimdFloat LoadLanes(const float* p, size_t lanes) {
+  if (lanes == k_simdWidth)
+    return SimdLoadU(p);
+
+  alignas(k_simdWidth * sizeof(float)) float block[k_simdWidth] = {};
+  std::copy_n(p, lanes, block);
+  return SimdLoad(block);
+}
+
+void StoreLanes(float* p, SimdFloat v, size_t lanes) {
+  if (lanes == k_simdWidth) {
+    SimdStoreU(p, v);
+    return;
+  }
+
+  alignas(k_simdWidth * sizeof(float)) float block[k_simdWidth];
+  SimdStore(block, v);
+  std::copy_n(block, lanes, p);
+}
+
+SimdInt LoadLanes(const uint32_t* p, size_t lanes) {
+  if (lanes == k_simdWidth)
+    return SimdLoadIntU(p);
+
+  uint32_t block[k_simdWidth] = {};
+  std::copy_n(p, lanes, block);
+  return SimdLoadIntU(block);
+}
+
+void StoreLanes(uint32_t* p, SimdInt v, size_t lanes) {
+  if (lanes == k_simdWidth) {
+    SimdStoreIntU(p, v);
+    return;
+  }
+
+  uint32_t block[k_simdWidth];
+  SimdStoreIntU(block, v);
+  std::copy_n(block, lanes, p);
+}
+
+SimdFloat3 LoadLanes(const ConstFloat3Soa& soa, size_t offset, size_t lanes) {
+  return SimdFloat3{LoadLanes(soa.X + offset, lanes), LoadLanes(soa.Y + offset, lanes),
+                    LoadLanes(soa.Z + offset, lanes)};
+}
+
+void StoreLanes(const Float3Soa& soa, size_t offset, const SimdFloat3& v, size_t lanes) {
+  StoreLanes(soa.X + offset, v.x, lanes);
+  StoreLanes(soa.Y + offset, v.y, lanes);
+  StoreLanes(soa.Z + offset, v.z, lanes);
+}
+
+// Calls fn(offset, lanes) for each group of up to k_simdWidth entries of [0, count).
+template<typename Fn>
+void ForEachGroup(size_t count, Fn&& fn) {
+  for (size_t offset = 0; offset < count; offset += k_simdWidth) {
+    fn(offset, std::min<size_t>(k_simdWidth, count - offset));
+  }
+}
+
+} // namespace
+
+void BatchInitRngSeed(size_t count, const uint32_t* pixelX, const uint32_t* pixelY,
+                      const uint32_t* sampleVal, uint32_t* rngStates) {
+  ForEachGroup(count, [&](size_t offset, size_t lanes) {
+    SimdInt rngState = SimdInitRngSeed(LoadLanes(pixelX + offset, lanes),
+                                       LoadLanes(pixelY + offset, lanes),
+                                       LoadLanes(sampleVal + offset, lanes));
+    StoreLanes(rngStates + offset, rngState, lanes);
+  });
+}
+
+void BatchRand(size_t count, uint32_t* rngStates, float* values) {
+  ForEachGroup(count, [&](size_t offset, size_t lanes) {
+    SimdInt rngState = LoadLanes(rngStates + offset, lanes);
+    StoreLanes(values + offset, SimdRand(&rngState), lanes);
+    StoreLanes(rngStates + offset, rngState, lanes);
+  });
+}
+
+void BatchBrdf(size_t count, const ConstFloat3Soa& wo, const ConstFloat3Soa& wi,
+               const ConstFloat3Soa& n, const MaterialSoa& materials, const Float3Soa& brdf) {
+  ForEachGroup(count, [&](size_t offset, size_t lanes) {
+    SimdMaterial material{};
+    material.BaseColor = LoadLanes(materials.BaseColor, offset, lanes);
+    material.Metallic = LoadLanes(materials.Metallic + offset, lanes);
+    material.Roughness = LoadLanes(materials.Roughness + offset, lanes);
+
+    SimdFloat3 result = SimdBrdf(LoadLanes(wo, offset, lanes), LoadLanes(wi, offset, lanes),
+                                 LoadLanes(n, offset, lanes), material);
+    StoreLanes(brdf, offset, result, lanes);
+  });
+}
+
+template<MaterialClass materialClass>
+void BatchBrdf(size_t count, const ConstFloat3Soa& wo, const ConstFloat3Soa& wi,
+               const ConstFloat3Soa& n, const ShadingMaterial& material, const Float3Soa& brdf) {
+  ForEachGroup(count, [&](size_t offset, size_t lanes) {
+    SimdFloat3 result = SimdBrdf<materialClass>(LoadLanes(wo, offset, lanes),
+                                                LoadLanes(wi, offset, lanes),
+                                                LoadLanes(n, offset, lanes), material);
+    StoreLanes(brdf, offset, result, lanes);
+  });
+}
+
+template void BatchBrdf<MaterialClass::Diffuse>(size_t, const ConstFloat3Soa&,
+                                                const ConstFloat3Soa&, const ConstFloat3Soa&,
+                                                const ShadingMaterial&, const Float3Soa&);
+template void BatchBrdf<MaterialClass::Metal>(size_t, const ConstFloat3Soa&,
+                                              const ConstFloat3Soa&, const ConstFloat3Soa&,
+                                              const ShadingMaterial&, const Float3Soa&);
+template void BatchBrdf<MaterialClass::Mixed>(size_t, const ConstFloat3Soa&,
+                                              const ConstFloat3Soa&, const ConstFloat3Soa&,
+                                              const ShadingMaterial&, const Float3Soa&);
+
+void BatchConcentricSampleDisk(size_t count, const float* randU, const float* randV, float* x,
+                               float* y) {
+  ForEachGroup(count, [&](size_t offset, size_t lanes) {
+    SimdFloat diskX, diskY;
+    SimdConcentricSampleDisk(LoadLanes(randU + offset, lanes), LoadLanes(randV + offset, lanes),
+                             &diskX, &diskY);
+    StoreLanes(x + offset, diskX, lanes);
+    StoreLanes(y + offset, diskY, lanes);
+  });
+}
+
+void BatchCosineSampleHemisphere(size_t count, const float* randU, const float* randV,
+                                 const Float3Soa& directions) {
+  ForEachGroup(count, [&](size_t offset, size_t lanes) {
+    SimdFloat3 direction = SimdCosineSampleHemisphere(LoadLanes(randU + offset, lanes),
+                                                      LoadLanes(randV + offset, lanes));
+    StoreLanes(directions, offset, direction, lanes);
+  });
+}
+
+void BatchTrowbridgeReitzGGX_Sample_wh(size_t count, const float* randU, const float* randV,
+                                       const float* roughness, const Float3Soa& wh) {
+  ForEachGroup(count, [&](size_t offset, size_t lanes) {
+    SimdFloat3 h = SimdTrowbridgeReitzGGX_Sample_wh(LoadLanes(randU + offset, lanes),
+                                                    LoadLanes(randV + offset, lanes),
+                                                    LoadLanes(roughness + offset, lanes));
+    StoreLanes(wh, offset, h, lanes);
+  });
+}
+
+} // namespace cpu_rt
@@ -0,0 +1,567 @@
+#include "cpu_rt/sppm_renderer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <stdexcept>
+
+#include "cpu_rt/camera.h"
+#include "cpu_rt/parallel_for.h"
+#include "cpu_rt/rng.h"
+#include "cpu_rt/shading.h"
+#include "cpu_rt/simd.h"
+
+namespace cpu_rt {
+
+namespace {
+
+// Same as PathTracer's.
+constexpr uint32_t k_rayFlags = k_rayFlagCullBackFacingTriangles;
+constexpr uint32_t k_shadowRayFlags = k_rayFlagCullBackFacingTriangles |
+                                      k_rayFlagAcceptFirstHitAndEndSearch |
+                                      k_rayFlagForceOpaque | k_rayFlagSkipClosestHitShader;
+
+// Photon paths per ParallelFor chunk, each of which stores its photons in a list of its own.
+constexpr size_t k_photonsPerTask = 1024;
+
+// BuildPhotonGrid sorts the photons into ranges of buckets first, counting each chunk of
+// k_photonsPerSortTask photons on its own, and then sorts each range by bucket.
+constexpr uint32_t k_photonsPerSortTask = 1 << 14;
+constexpr uint32_t k_bucketRangeCount = 1024;
+
+// Seeds the random numbers of each stage apart from the others.
+enum class Stage : uint32_t {
+  CameraPaths,
+  Photons
+};
+
+uint32_t InitStageRngSeed(uint32_t x, uint32_t y, uint32_t iteration, Stage stage) {
+  return InitRngSeed(x, y, iteration) ^ JenkinsHash(static_cast<uint32_t>(stage));
+}
+
+std::vector<float> GetLightPowers(std::span<const AreaLight> lights) {
+  std::vector<float> powers(lights.size());
+  for (size_t i = 0; i < lights.size(); ++i) {
+    powers[i] = lights[i].GetPower();
+  }
+  return powers;
+}
+
+} // namespace
+
+SppmRenderer::SppmRenderer(const RenderScene& scene, uint32_t width, uint32_t height,
+                           const SppmSettings& settings)
+  : m_scene(scene), m_width(width), m_height(height), m_settings(settings),
+    m_lightSampler(scene.GetLights(), settings.LightSampler),
+    m_photonLights(GetLightPowers(scene.GetLights())),
+    m_film(static_cast<size_t>(width) * height), m_pixels(m_film.size()),
+    m_visiblePoints(m_film.size()) {
+  if (!(settings.Alpha > 0.f && settings.Alpha <= 1.f) || !(settings.InitialRadius > 0.f))
+    throw std::invalid_argument("SPPM needs an alpha in (0, 1] and a positive radius.");
+
+  for (PixelState& pixel : m_pixels) {
+    pixel.Radius = settings.InitialRadius;
+  }
+}
+
+void SppmRenderer::Render() {
+  TraceCameraPaths();
+  TracePhotons();
+  BuildPhotonGrid();
+  GatherPhotons();
+
+  ++m_iterationCount;
+}
+
+Float3 SppmRenderer::SampleDirectLight(const Float3& p, const Float3& n, const Float3& wo,
+                                       uint32_t materialIndex, bool weighBounce,
+                                       uint32_t* rngState, uint32_t* rayCount) const {
+  float selectU = Rand(rngState);
+  float lightU = Rand(rngState);
+  float lightV = Rand(rngState);
+
+  uint32_t lightIndex;
+  float lightPmf;
+  if (!m_lightSampler.Sample(p, n, selectU, &lightIndex, &lightPmf))
+    return Float3{0.f, 0.f, 0.f};
+
+  const AreaLight& light = m_scene.GetLights()[lightIndex];
+
+  Float3 lightSamplePos = light.SamplePoint(lightU, lightV);
+  float lightDist = Length(lightSamplePos - p);
+  Float3 wi = Normalize(lightSamplePos - p);
+
+  float pdf = lightPmf * light.GetPdf(lightDist, wi);
+  float cosTheta = Dot(wi, n);
+  if (!(pdf > 0.f && cosTheta > 0.f))
+    return Float3{0.f, 0.f, 0.f};
+
+  Ray shadowRay{p, 0.0001f, wi, lightDist * (1.f - k_shadowRayShortening)};
+  ++*rayCount;
+  if (m_scene.GetTlas().Occluded(shadowRay, shadowRay.TMax, ~k_lightInstanceMask,
+                                 k_shadowRayFlags, m_scene.GetIntersectionTable()))
+    return Float3{0.f, 0.f, 0.f};
+
+  float misWeight = 1.f;
+  if (weighBounce) {
+    misWeight = PowerHeuristic(
+        pdf, GetBsdfPdf(wo, wi, n, m_scene.GetShadingMaterials()[materialIndex]));
+  }
+
+  Float3 brdf = Brdf(wo, wi, n, m_scene.GetMaterials()[materialIndex]);
+  return brdf * cosTheta * (light.Le * (misWeight / pdf));
+}
+
+void SppmRenderer::TraceCameraPaths() {
+  std::atomic<uint64_t> rayCount = 0;
+
+  ParallelFor(m_film.size(), [&](size_t begin, size_t end) {
+    uint32_t chunkRayCount = 0;
+
+    for (size_t pixel = begin; pixel < end; ++pixel) {
+      auto x = static_cast<uint32_t>(pixel % m_width);
+      auto y = static_cast<uint32_t>(pixel / m_width);
+
+      uint32_t rngState = InitStageRngSeed(x, y, m_iterationCount, Stage::CameraPaths);
+
+      float jitterX = Rand(&rngState);
+      float jitterY = Rand(&rngState);
+      Ray ray = GetCameraRay(m_width, m_height, x, y, jitterX, jitterY);
+
+      VisiblePoint& visiblePoint = m_visiblePoints[pixel];
+      visiblePoint = VisiblePoint{};
+
+      Float3 direct{0.f, 0.f, 0.f};
+      Float3 throughput{1.f, 1.f, 1.f};
+      float bsdfPdf = 0.f;
+      Float3 bsdfNormal{};
+
+      // Metals reflect the path on, and anything with a diffuse lobe ends it.
+      for (uint32_t bounces = 0;; ++bounces) {
+        ++chunkRayCount;
+
+        HitInfo hit;
+        if (!m_scene.GetTlas().TraceRay(ray, k_rayFlags, ~0u, 0, 1, &hit,
+                                        m_scene.GetIntersectionTable()))
+          break;
+
+        bool isQuadLight = hit.HitGroupIndex == m_scene.GetLightHitGroupIndex();
+
+        // The quad is the first light. Only bounces off metals find light here, whose light
+        // samples weigh it as in PathTracer.
+        uint32_t light = isQuadLight ? 0 : m_scene.GetTriangleLight(hit);
+        if (light != k_invalidIndex) {
+          const AreaLight& areaLight = m_scene.GetLights()[light];
+
+          float misWeight = 1.f;
+          if (bounces > 0) {
+            float lightPdf = m_lightSampler.GetPmf(ray.Origin, bsdfNormal, light) *
+                             areaLight.GetPdf(hit.T, ray.Direction);
+            misWeight = PowerHeuristic(bsdfPdf, lightPdf);
+          }
+
+          direct += throughput * (areaLight.Le * misWeight);
+        }
+
+        if (isQuadLight)
+          break;
+
+        uint32_t materialIndex = m_scene.GetMaterialIndex(hit.HitGroupIndex);
+        const ShadingMaterial& material = m_scene.GetShadingMaterials()[materialIndex];
+
+        Float3 hitPos = ray.Origin + hit.T * ray.Direction;
+        Float3 normal = m_scene.GetShadingNormal(hit);
+        Float3 wo = -Normalize(ray.Direction);
+
+        bool isVisiblePoint = material.Class != MaterialClass::Metal;
+        bool bounce = !isVisiblePoint && bounces < m_settings.NumBounces;
+
+        direct += throughput * SampleDirectLight(hitPos, normal, wo, materialIndex, bounce,
+                                                 &rngState, &chunkRayCount);
+
+        if (isVisiblePoint) {
+          visiblePoint = VisiblePoint{hitPos, normal, wo, throughput, materialIndex, true};
+          break;
+        }
+
+        if (!bounce)
+          break;
+
+        float randU = Rand(&rngState);
+        float randV = Rand(&rngState);
+
+        Float3 wi;
+        float pdf;
+        if (!SampleBsdf(wo, normal, material, randU, randV, &wi, &pdf))
+          break;
+
+        Float3 brdf = Brdf(wo, wi, normal, m_scene.GetMaterials()[materialIndex]);
+        throughput = throughput * brdf * Dot(wi, normal) / pdf;
+        bsdfPdf = pdf;
+        bsdfNormal = normal;
+
+        ray = Ray{hitPos, 0.f, wi, k_rayTMax};
+      }
+
+      m_pixels[pixel].DirectSum += direct;
+    }
+
+    rayCount.fetch_add(chunkRayCount, std::memory_order_relaxed);
+  });
+
+  m_rayCount += rayCount;
+}
+
+void SppmRenderer::TracePhotons() {
+  uint32_t photonPathCount = m_settings.PhotonsPerIteration;
+  std::vector<std::vector<Photon>> chunkPhotons((photonPathCount + k_photonsPerTask - 1) /
+                                                k_photonsPerTask);
+
+  std::atomic<uint64_t> rayCount = 0;
+
+  ParallelFor(photonPathCount, [&](size_t begin, size_t end) {
+    std::vector<Photon>& photons = chunkPhotons[begin / k_photonsPerTask];
+    uint32_t chunkRayCount = 0;
+
+    for (size_t i = begin; i < end; ++i) {
+      uint32_t rngState = InitStageRngSeed(static_cast<uint32_t>(i), 0, m_iterationCount,
+                                           Stage::Photons);
+
+      float lightPmf;
+      uint32_t lightIndex = m_photonLights.Sample(Rand(&rngState), &lightPmf);
+      const AreaLight& light = m_scene.GetLights()[lightIndex];
+
+      float pointU = Rand(&rngState);
+      float pointV = Rand(&rngState);
+      Float3 origin = light.SamplePoint(pointU, pointV);
+
+      Float3 lightNormal = light.GetNormal();
+      float sidePmf = 1.f;
+      if (light.TwoSided) {
+        if (Rand(&rngState) < 0.5f)
+          lightNormal = -lightNormal;
+        sidePmf = 0.5f;
+      }
+
+      Float3 b1, b2;
+      GetCoordinateSystem(lightNormal, &b1, &b2);
+
+      float dirU = Rand(&rngState);
+      float dirV = Rand(&rngState);
+      Float3 local = CosineSampleHemisphere(dirU, dirV);
+      Float3 dir = Normalize(local.x * b1 + local.y * lightNormal + local.z * b2);
+
+      // Le cos / (pmf pdfArea pdfDir), where the cosine pdf cancels the cosine.
+      Float3 flux = light.Le * (light.GetArea() * k_pi / (lightPmf * sidePmf));
+
+      Ray ray{origin, 0.0001f, dir, k_rayTMax};
+
+      for (uint32_t bounces = 0; bounces <= m_settings.NumBounces; ++bounces) {
+        ++chunkRayCount;
+
+        HitInfo hit;
+        if (!m_scene.GetTlas().TraceRay(ray, k_rayFlags, ~0u, 0, 1, &hit,
+                                        m_scene.GetIntersectionTable()) ||
+            hit.HitGroupIndex == m_scene.GetLightHitGroupIndex())
+          break;
+
+        uint32_t materialIndex = m_scene.GetMaterialIndex(hit.HitGroupIndex);
+        const ShadingMaterial& material = m_scene.GetShadingMaterials()[materialIndex];
+
+        Float3 hitPos = ray.Origin + hit.T * ray.Direction;
+        Float3 normal = m_scene.GetShadingNormal(hit);
+        Float3 wo = -Normalize(ray.Direction);
+
+        // Light samples of the camera paths take care of the first hits. Metals never hold a
+        // visible point.
+        if (bounces > 0 && material.Class != MaterialClass::Metal)
+          photons.push_back(Photon{hitPos, wo, flux});
+
+        if (bounces == m_settings.NumBounces)
+          break;
+
+        float randU = Rand(&rngState);
+        float randV = Rand(&rngState);
+
+        Float3 wi;
+        float pdf;
+        if (!SampleBsdf(wo, normal, material, randU, randV, &wi, &pdf))
+          break;
+
+        Float3 brdf = Brdf(wo, wi, normal, m_scene.GetMaterials()[materialIndex]);
+        Float3 bounceFlux = flux * brdf * Dot(wi, normal) / pdf;
+
+        // Russian roulette by the luminance the bounce keeps, so that photons carry similar
+        // flux.
+        float survival = std::min(1.f, Luminance(bounceFlux) / Luminance(flux));
+        if (!(Rand(&rngState) < survival))
+          break;
+
+        flux = bounceFlux / survival;
+        ray = Ray{hitPos, 0.f, wi, k_rayTMax};
+      }
+    }
+
+    rayCount.fetch_add(chunkRayCount, std::memory_order_relaxed);
+  }, k_photonsPerTask);
+
+  m_rayCount += rayCount;
+
+  std::vector<size_t> chunkStart(chunkPhotons.size() + 1, 0);
+  for (size_t chunk = 0; chunk < chunkPhotons.size(); ++chunk) {
+    chunkStart[chunk + 1] = chunkStart[chunk] + chunkPhotons[chunk].size();
+  }
+
+  m_photons.resize(chunkStart.back());
+  ParallelFor(chunkPhotons.size(), [&](size_t begin, size_t end) {
+    for (size_t chunk = begin; chunk < end; ++chunk) {
+      std::copy(chunkPhotons[chunk].begin(), chunkPhotons[chunk].end(),
+                m_photons.begin() + chunkStart[chunk]);
+    }
+  }, 1);
+}
+
+uint32_t SppmRenderer::GetBucket(int32_t x, int32_t y, int32_t z) const {
+  auto hash = static_cast<uint32_t>(x) * 73856093u ^ static_cast<uint32_t>(y) * 19349663u ^
+              static_cast<uint32_t>(z) * 83492791u;
+  return hash & static_cast<uint32_t>(m_grid.BucketStart.size() - 2);
+}
+
+void SppmRenderer::BuildPhotonGrid() {
+  float maxRadius = 0.f;
+  for (size_t pixel = 0; pixel < m_pixels.size(); ++pixel) {
+    if (m_visiblePoints[pixel].IsValid)
+      maxRadius = std::max(maxRadius, m_pixels[pixel].Radius);
+  }
+
+  // A gather of up to maxRadius then reaches at most half a cell from its center.
+  m_grid.CellSize = 2.f * std::max(maxRadius, m_settings.InitialRadius * 1e-3f);
+
+  auto photonCount = static_cast<uint32_t>(m_photons.size());
+  uint32_t bucketCount = std::bit_ceil(std::max(photonCount, 1u));
+
+  m_grid.BucketStart.resize(bucketCount + 1);
+  m_grid.BucketStart[bucketCount] = photonCount;
+
+  size_t paddedCount = photonCount + k_simdWidth;
+  m_grid.PositionX.assign(paddedCount, 0.f);
+  m_grid.PositionY.assign(paddedCount, 0.f);
+  m_grid.PositionZ.assign(paddedCount, 0.f);
+  m_grid.Wi.resize(paddedCount);
+  m_grid.Flux.resize(paddedCount);
+
+  // A counting sort, which keeps the photons of a bucket in the order they were traced. Both
+  // passes are stable: the first counts the photons of each chunk by range of buckets so that
+  // the chunks can scatter them side by side, and the second sorts each range on its own.
+  uint32_t rangeCount = std::min(bucketCount, k_bucketRangeCount);
+  int rangeShift = std::countr_zero(bucketCount) - std::countr_zero(rangeCount);
+  uint32_t chunkCount = (photonCount + k_photonsPerSortTask - 1) / k_photonsPerSortTask;
+
+  std::vector<uint32_t> buckets(photonCount);
+  std::vector<uint32_t> chunkRangeStart(size_t{chunkCount} * rangeCount, 0);
+  ParallelFor(chunkCount, [&](size_t begin, size_t end) {
+    for (size_t chunk = begin; chunk < end; ++chunk) {
+      uint32_t* rangeCounts = &chunkRangeStart[chunk * rangeCount];
+      size_t photonEnd = std::min<size_t>(photonCount, (chunk + 1) * k_photonsPerSortTask);
+
+      for (size_t i = chunk * k_photonsPerSortTask; i < photonEnd; ++i) {
+        Float3 cell = m_photons[i].Position / m_grid.CellSize;
+        buckets[i] = GetBucket(static_cast<int32_t>(std::floor(cell.x)),
+                               static_cast<int32_t>(std::floor(cell.y)),
+                               static_cast<int32_t>(std::floor(cell.z)));
+        ++rangeCounts[buckets[i] >> rangeShift];
+      }
+    }
+  }, 1);
+
+  // Turns the counts into where each chunk's photons of a range start: the ranges in order, and
+  // the chunks in order within each.
+  std::vector<uint32_t> rangeStart(rangeCount + 1);
+  uint32_t photonStart = 0;
+  for (uint32_t range = 0; range < rangeCount; ++range) {
+    rangeStart[range] = photonStart;
+    for (uint32_t chunk = 0; chunk < chunkCount; ++chunk) {
+      uint32_t& start = chunkRangeStart[size_t{chunk} * rangeCount + range];
+      uint32_t count = start;
+      start = photonStart;
+      photonStart += count;
+    }
+  }
+  rangeStart[rangeCount] = photonCount;
+
+  std::vector<uint32_t> rangeOrder(photonCount);
+  ParallelFor(chunkCount, [&](size_t begin, size_t end) {
+    for (size_t chunk = begin; chunk < end; ++chunk) {
+      uint32_t* next = &chunkRangeStart[chunk * rangeCount];
+      size_t photonEnd = std::min<size_t>(photonCount, (chunk + 1) * k_photonsPerSortTask);
+
+      for (size_t i = chunk * k_photonsPerSortTask; i < photonEnd; ++i) {
+        rangeOrder[next[buckets[i] >> rangeShift]++] = static_cast<uint32_t>(i);
+      }
+    }
+  }, 1);
+
+  uint32_t bucketsPerRange = bucketCount / rangeCount;
+  ParallelFor(rangeCount, [&](size_t begin, size_t end) {
+    std::vector<uint32_t> next(bucketsPerRange);
+
+    for (size_t range = begin; range < end; ++range) {
+      uint32_t firstBucket = static_cast<uint32_t>(range) * bucketsPerRange;
+
+      std::fill(next.begin(), next.end(), 0);
+      for (uint32_t j = rangeStart[range]; j < rangeStart[range + 1]; ++j) {
+        ++next[buckets[rangeOrder[j]] - firstBucket];
+      }
+
+      uint32_t bucketStart = rangeStart[range];
+      for (uint32_t bucket = 0; bucket < bucketsPerRange; ++bucket) {
+        m_grid.BucketStart[firstBucket + bucket] = bucketStart;
+        uint32_t count = next[bucket];
+        next[bucket] = bucketStart;
+        bucketStart += count;
+      }
+
+      for (uint32_t j = rangeStart[range]; j < rangeStart[range + 1]; ++j) {
+        uint32_t i = rangeOrder[j];
+        uint32_t slot = next[buckets[i] - firstBucket]++;
+
+        const Photon& photon = m_photons[i];
+        m_grid.PositionX[slot] = photon.Position.x;
+        m_grid.PositionY[slot] = photon.Position.y;
+        m_grid.PositionZ[slot] = photon.Position.z;
+        m_grid.Wi[slot] = photon.Wi;
+        m_grid.Flux[slot] = photon.Flux;
+      }
+    }
+  }, 16);
+
+  m_iterationStats.StoredPhotonCount = photonCount;
+}
+
+void SppmRenderer::GatherPhotons() {
+  auto photonPathCount = static_cast<float>(m_settings.PhotonsPerIteration);
+  auto iterationCount = static_cast<float>(m_iterationCount + 1);
+
+  std::atomic<uint64_t> gatheredPhotonCount = 0;
+
+  ParallelFor(m_film.size(), [&](size_t begin, size_t end) {
+    uint64_t chunkGatheredPhotonCount = 0;
+
+    for (size_t pixel = begin; pixel < end; ++pixel) {
+      const VisiblePoint& visiblePoint = m_visiblePoints[pixel];
+      PixelState& state = m_pixels[pixel];
+
+      if (visiblePoint.IsValid) {
+        float radius = state.Radius;
+        const Float3& p = visiblePoint.Position;
+
+        // The cell of p and its neighbours on the side of p's half of it along each axis,
+        // which hold every photon within half a cell of p. Taking these rather than the cells
+        // that p +- radius rounds into keeps them at 2 x 2 x 2. The buckets are taken once each,
+        // since cells can share one.
+        Float3 cell = p / m_grid.CellSize;
+
+        int32_t base[3];
+        int32_t step[3];
+        for (int axis = 0; axis < 3; ++axis) {
+          float cellMin = std::floor(cell[axis]);
+          base[axis] = static_cast<int32_t>(cellMin);
+          step[axis] = cell[axis] - cellMin < 0.5f ? -1 : 1;
+        }
+
+        uint32_t buckets[8];
+        uint32_t bucketCount = 0;
+
+        for (uint32_t corner = 0; corner < 8; ++corner) {
+          uint32_t bucket = GetBucket(base[0] + ((corner & 1) ? step[0] : 0),
+                                      base[1] + ((corner & 2) ? step[1] : 0),
+                                      base[2] + ((corner & 4) ? step[2] : 0));
+          if (std::find(buckets, buckets + bucketCount, bucket) == buckets + bucketCount)
+            buckets[bucketCount++] = bucket;
+        }
+
+        const Material& material = m_scene.GetMaterials()[visiblePoint.MaterialIndex];
+
+        SimdFloat px = SimdSet(p.x);
+        SimdFloat py = SimdSet(p.y);
+        SimdFloat pz = SimdSet(p.z);
+        SimdFloat radiusSq = SimdSet(radius * radius);
+
+        Float3 phi{0.f, 0.f, 0.f};
+        uint32_t photonCount = 0;
+
+        for (uint32_t b = 0; b < bucketCount; ++b) {
+          uint32_t first = m_grid.BucketStart[buckets[b]];
+          uint32_t last = m_grid.BucketStart[buckets[b] + 1];
+
+          for (uint32_t i = first; i < last; i += k_simdWidth) {
+            SimdFloat dx = SimdSub(SimdLoadU(&m_grid.PositionX[i]), px);
+            SimdFloat dy = SimdSub(SimdLoadU(&m_grid.PositionY[i]), py);
+            SimdFloat dz = SimdSub(SimdLoadU(&m_grid.PositionZ[i]), pz);
+            SimdFloat distSq = SimdAdd(SimdAdd(SimdMul(dx, dx), SimdMul(dy, dy)),
+                                       SimdMul(dz, dz));
+
+            uint32_t mask = SimdMoveMask(SimdLt(distSq, radiusSq));
+            if (last - i < k_simdWidth)
+              mask &= (1u << (last - i)) - 1;
+
+            for (; mask != 0; mask &= mask - 1) {
+              uint32_t photon = i + static_cast<uint32_t>(std::countr_zero(mask));
+
+              // Photons from behind the surface, e.g. the other side of a wall, are not its
+              // light.
+              const Float3& wi = m_grid.Wi[photon];
+              if (!(Dot(wi, visiblePoint.Normal) > 0.f))
+                continue;
+
+              phi += Brdf(visiblePoint.Wo, wi, visiblePoint.Normal, material) *
+                     m_grid.Flux[photon];
+              ++photonCount;
+            }
+          }
+        }
+
+        // The radius shrinks so that the pixel keeps Alpha of the new photons, whose flux
+        // then counts over the smaller area.
+        if (photonCount > 0) {
+          auto newCount = static_cast<float>(photonCount);
+          float count = state.PhotonCount + m_settings.Alpha * newCount;
+          float newRadius = radius * std::sqrt(count / (state.PhotonCount + newCount));
+
+          state.Tau = (state.Tau + visiblePoint.Throughput * phi) *
+                      (newRadius * newRadius / (radius * radius));
+          state.PhotonCount = count;
+          state.Radius = newRadius;
+        }
+
+        chunkGatheredPhotonCount += photonCount;
+      }
+
+      m_film[pixel] = state.DirectSum / iterationCount +
+                      state.Tau / (iterationCount * photonPathCount * k_pi * state.Radius *
+                                   state.Radius);
+    }
+
+    gatheredPhotonCount.fetch_add(chunkGatheredPhotonCount, std::memory_order_relaxed);
+  });
+
+  uint32_t visiblePointCount = 0;
+  double radiusSum = 0.0;
+
+  for (size_t pixel = 0; pixel < m_pixels.size(); ++pixel) {
+    if (!m_visiblePoints[pixel].IsValid)
+      continue;
+
+    ++visiblePointCount;
+    radiusSum += m_pixels[pixel].Radius;
+  }
+
+  double count = std::max(1u, visiblePointCount);
+  m_iterationStats.VisiblePointCount = visiblePointCount;
+  m_iterationStats.GatheredPhotonCount = static_cast<float>(
+      static_cast<double>(gatheredPhotonCount) / count);
+  m_iterationStats.Radius = static_cast<float>(radiusSum / count);
+}
+
+} // namespace cpu_rt
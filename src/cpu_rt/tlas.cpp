@@ -0,0 +1,50 @@
+#include "cpu_rt/tlas.h"
+
+#include <atomic>
+#include <stdexcept>
+
+namespace cpu_rt {
+
+static std::atomic<uint64_t> s_nextTlasId = 1;
+
+Tlas::Tlas(std::span<const InstanceDesc> instanceDescs, const BvhBuildSettings& settings)
+  : m_id(s_nextTlasId.fetch_add(1, std::memory_order_relaxed)) {
+  std::vector<Aabb> instanceBounds;
+  instanceBounds.reserve(instanceDescs.size());
+
+  m_instances.reserve(instanceDescs.size());
+
+  for (const InstanceDesc& desc : instanceDescs) {
+    if (!desc.AccelerationStructure)
+      throw std::invalid_argument("Instance has no acceleration structure.");
+
+    Instance instance{};
+    instance.ObjectToWorld = desc.Transform;
+    instance.WorldToObject = Inverse(desc.Transform);
+    instance.AccelerationStructure = desc.AccelerationStructure;
+    instance.InstanceID = desc.InstanceID;
+    instance.InstanceContributionToHitGroupIndex = desc.InstanceContributionToHitGroupIndex;
+    instance.InstanceMask = desc.InstanceMask;
+    instance.Flags = static_cast<uint8_t>(desc.Flags);
+
+    m_instances.push_back(instance);
+
+    instanceBounds.push_back(TransformAabb(desc.Transform,
+                                           desc.AccelerationStructure->GetBounds()));
+  }
+
+  m_bvh = BuildBvh(instanceBounds, settings);
+}
+
+size_t Tlas::GetMemoryUsage() const {
+  return sizeof(*this) + m_bvh.Nodes.capacity() * sizeof(BvhNode) +
+         m_bvh.PrimIndices.capacity() * sizeof(uint32_t) +
+         m_instances.capacity() * sizeof(Instance);
+}
+
+Tlas::OccluderCache& Tlas::GetOccluderCache() {
+  thread_local OccluderCache cache;
+  return cache;
+}
+
+} // namespace cpu_rt
@@ -0,0 +1,83 @@
+#include "cpu_rt/traversal_stats.h"
+
+namespace cpu_rt {
+
+namespace {
+
+constexpr size_t k_traversalCounterCount = static_cast<size_t>(TraversalCounter::Count);
+
+struct CounterBlock {
+  std::atomic<uint64_t> Counts[k_traversalCounterCount] = {};
+  std::atomic<bool> InUse = true;
+  CounterBlock* Next = nullptr;
+};
+
+// Every block ever allocated. Blocks are never freed or unlinked, so readers walk the list
+// without locks.
+std::atomic<CounterBlock*> s_counterBlocks = nullptr;
+
+// Claims a block for the lifetime of a thread. A block released by an exiting thread keeps its
+// counts and is handed to the next new thread, so the list only grows to the largest number of
+// threads that traced at the same time.
+class CounterBlockClaim {
+public:
+  CounterBlockClaim() {
+    for (CounterBlock* block = s_counterBlocks.load(std::memory_order_acquire); block;
+         block = block->Next) {
+      bool inUse = false;
+      if (block->InUse.compare_exchange_strong(inUse, true, std::memory_order_acquire)) {
+        m_block = block;
+        return;
+      }
+    }
+
+    m_block = new CounterBlock();
+    m_block->Next = s_counterBlocks.load(std::memory_order_relaxed);
+    while (!s_counterBlocks.compare_exchange_weak(m_block->Next, m_block,
+                                                  std::memory_order_release,
+                                                  std::memory_order_relaxed)) {
+    }
+  }
+
+  ~CounterBlockClaim() { m_block->InUse.store(false, std::memory_order_release); }
+
+  CounterBlockClaim(const CounterBlockClaim&) = delete;
+  CounterBlockClaim& operator=(const CounterBlockClaim&) = delete;
+
+  CounterBlock* GetBlock() const { return m_block; }
+
+private:
+  CounterBlock* m_block;
+};
+
+} // namespace
+
+std::atomic<uint64_t>* GetThreadTraversalCounters() {
+  thread_local CounterBlockClaim claim;
+  return claim.GetBlock()->Counts;
+}
+
+TraversalStats GetTraversalStats() {
+  uint64_t counts[k_traversalCounterCount] = {};
+
+  for (CounterBlock* block = s_counterBlocks.load(std::memory_order_acquire); block;
+       block = block->Next) {
+    for (size_t i = 0; i < k_traversalCounterCount; ++i) {
+      counts[i] += block->Counts[i].load(std::memory_order_relaxed);
+    }
+  }
+
+  auto get = [&](TraversalCounter counter) { return counts[static_cast<size_t>(counter)]; };
+
+  TraversalStats stats{};
+  stats.Rays = get(TraversalCounter::Rays);
+  stats.ShadowRays = get(TraversalCounter::ShadowRays);
+  stats.ShadowRaysOccluded = get(TraversalCounter::ShadowRaysOccluded);
+  stats.OccluderCacheHits = get(TraversalCounter::OccluderCacheHits);
+  stats.NodesVisited = get(TraversalCounter::NodesVisited);
+  stats.TrianglesTested = get(TraversalCounter::TrianglesTested);
+  stats.ProceduralPrimitivesTested = get(TraversalCounter::ProceduralPrimitivesTested);
+  return stats;
+}
+
+} // namespace cpu_rt
@@ -0,0 +1,351 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+#include <cpu_rt/parallel_for.h>
+#include <cpu_rt/rng.h>
+#include <cpu_rt/shading.h>
+#include <cpu_rt/shading_simd.h>
+
+using namespace cpu_rt;
+
+static constexpr size_t k_count = 1 << 22;
+
+static constexpr int k_numRuns = 10;
+
+// Draws per RNG in the RNG check, more than the longest path of the shader uses.
+static constexpr int k_numDraws = 64;
+
+// Bounds on the difference between the SIMD kernels and the scalar ports, absolute on disk
+// positions and unit directions. CosineSampleHemisphere takes y = sqrt(1 - x^2 - z^2), which near
+// the rim of the disk turns an error of 1e-7 in x and z into up to 5e-4 in y, as float rounding
+// already does in the scalar port. The BRDF bound is relative to the larger of the scalar value
+// and 1.
+static constexpr float k_maxSampleError = 1e-6f;
+static constexpr float k_maxHemisphereError = 1e-3f;
+static constexpr float k_maxBrdfError = 1e-5f;
+
+// Returns the best M/s over k_numRuns runs.
+static double Benchmark(size_t count, const std::function<void(size_t, size_t)>& fn) {
+  double bestSeconds = 0.0;
+
+  for (int run = 0; run < k_numRuns; ++run) {
+    auto start = std::chrono::steady_clock::now();
+    ParallelFor(count, fn);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    if (run == 0 || elapsed.count() < bestSeconds)
+      bestSeconds = elapsed.count();
+  }
+
+  return static_cast<double>(count) / bestSeconds * 1e-6;
+}
+
+// SoA arrays of k_count vectors.
+struct Float3Arrays {
+  std::vector<float> X = std::vector<float>(k_count);
+  std::vector<float> Y = std::vector<float>(k_count);
+  std::vector<float> Z = std::vector<float>(k_count);
+
+  Float3 Get(size_t i) const { return Float3{X[i], Y[i], Z[i]}; }
+
+  void Set(size_t i, const Float3& v) {
+    X[i] = v.x;
+    Y[i] = v.y;
+    Z[i] = v.z;
+  }
+
+  Float3Soa GetSoa(size_t offset) { return Float3Soa{&X[offset], &Y[offset], &Z[offset]}; }
+
+  ConstFloat3Soa GetConstSoa(size_t offset) const {
+    return ConstFloat3Soa{&X[offset], &Y[offset], &Z[offset]};
+  }
+};
+
+static Float3 GetUniformDirection(uint32_t* rngState) {
+  float z = 2.f * Rand(rngState) - 1.f;
+  float phi = 2.f * k_pi * Rand(rngState);
+  float r = std::sqrt(std::max(0.f, 1.f - z * z));
+
+  return Float3{r * std::cos(phi), r * std::sin(phi), z};
+}
+
+// Flips v into the hemisphere around n.
+static Float3 FaceForward(const Float3& v, const Float3& n) {
+  return Dot(v, n) < 0.f ? -v : v;
+}
+
+// Returns the largest difference between the components of expected and actual, or NaN if any
+// difference is NaN. With relative, differences are divided by the larger of the expected value
+// and 1.
+static float GetMaxDifference(const Float3Arrays& expected, const Float3Arrays& actual,
+                              bool relative) {
+  float maxDifference = 0.f;
+
+  for (size_t i = 0; i < k_count; ++i) {
+    for (int axis = 0; axis < 3; ++axis) {
+      float e = expected.Get(i)[axis];
+      float difference = std::abs(actual.Get(i)[axis] - e);
+      if (relative)
+        difference /= std::max(std::abs(e), 1.f);
+
+      if (std::isnan(difference))
+        return difference;
+
+      maxDifference = std::max(maxDifference, difference);
+    }
+  }
+
+  return maxDifference;
+}
+
+static bool Report(const char* name, double scalarM, double simdM, float error, float bound) {
+  bool passed = error <= bound;
+
+  printf("%s: scalar %.1f M/s, SIMD %.1f M/s (%.1fx), max error %g%s\n", name, scalarM, simdM,
+         simdM / scalarM, error, passed ? "" : " FAILED");
+
+  return passed;
+}
+
+// Times the generic Brdf against the one specialized for materialClass on hits that all have
+// the given material, as the path tracer shades them after sorting by material. The scalar
+// specialization must match the generic Brdf bit for bit.
+template<MaterialClass materialClass>
+static bool BenchmarkMaterialClass(const char* name, const Material& material,
+                                   const Float3Arrays& wo, const Float3Arrays& wi,
+                                   const Float3Arrays& n) {
+  ShadingMaterial shadingMaterial = ClassifyMaterial(material);
+  if (shadingMaterial.Class != materialClass) {
+    printf("Brdf<%s>: misclassified FAILED\n", name);
+    return false;
+  }
+
+  Float3Arrays generic, specialized, simdGeneric, simdSpecialized;
+
+  double genericM = Benchmark(k_count, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      generic.Set(i, Brdf(wo.Get(i), wi.Get(i), n.Get(i), material));
+    }
+  });
+
+  double specializedM = Benchmark(k_count, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      specialized.Set(i, Brdf<materialClass>(wo.Get(i), wi.Get(i), n.Get(i), shadingMaterial));
+    }
+  });
+
+  // The generic batch takes per-hit materials.
+  Float3Arrays baseColor;
+  std::vector<float> metallic(k_count, material.Metallic);
+  std::vector<float> roughness(k_count, material.Roughness);
+  for (size_t i = 0; i < k_count; ++i) {
+    baseColor.Set(i, material.BaseColor);
+  }
+
+  double simdGenericM = Benchmark(k_count, [&](size_t begin, size_t end) {
+    MaterialSoa materials{baseColor.GetConstSoa(begin), &metallic[begin], &roughness[begin]};
+    BatchBrdf(end - begin, wo.GetConstSoa(begin), wi.GetConstSoa(begin), n.GetConstSoa(begin),
+              materials, simdGeneric.GetSoa(begin));
+  });
+
+  double simdSpecializedM = Benchmark(k_count, [&](size_t begin, size_t end) {
+    BatchBrdf<materialClass>(end - begin, wo.GetConstSoa(begin), wi.GetConstSoa(begin),
+                             n.GetConstSoa(begin), shadingMaterial,
+                             simdSpecialized.GetSoa(begin));
+  });
+
+  size_t numMismatches = 0;
+  for (size_t i = 0; i < k_count; ++i) {
+    for (int axis = 0; axis < 3; ++axis) {
+      if (generic.Get(i)[axis] != specialized.Get(i)[axis])
+        ++numMismatches;
+    }
+  }
+
+  float error = GetMaxDifference(generic, simdSpecialized, true);
+  bool passed = numMismatches == 0 && error <= k_maxBrdfError;
+
+  printf("Brdf<%s>: scalar %.1f -> %.1f M/s (%.2fx), %zu mismatches, SIMD %.1f -> %.1f M/s "
+         "(%.2fx), max error %g%s\n", name, genericM, specializedM, specializedM / genericM,
+         numMismatches, simdGenericM, simdSpecializedM, simdSpecializedM / simdGenericM, error,
+         passed ? "" : " FAILED");
+
+  return passed;
+}
+
+// Usage: shading_bench
+//
+// Checks the SIMD shading kernels of shading_simd.h against the scalar ports of shading.h and
+// rng.h, which follow shader.hlsl, and prints the throughput of both. Then times the Brdf
+// specialized for each MaterialClass against the generic one. Returns 1 if a kernel is off by
+// more than its bound, an RNG lane draws a different sequence or a specialization differs.
+int main() {
+  printf("%u lanes, %zu samples\n", k_simdWidth, k_count);
+
+  uint32_t inputRng = InitRngSeed(0, 0, 1);
+
+  std::vector<float> randU(k_count);
+  std::vector<float> randV(k_count);
+  std::vector<float> roughness(k_count);
+
+  Float3Arrays wo, wi, n, baseColor;
+  std::vector<float> metallic(k_count);
+
+  for (size_t i = 0; i < k_count; ++i) {
+    randU[i] = Rand(&inputRng);
+    randV[i] = Rand(&inputRng);
+    roughness[i] = 0.05f + 0.95f * Rand(&inputRng);
+
+    Float3 normal = GetUniformDirection(&inputRng);
+    n.Set(i, normal);
+    wo.Set(i, FaceForward(GetUniformDirection(&inputRng), normal));
+    wi.Set(i, FaceForward(GetUniformDirection(&inputRng), normal));
+
+    float r = Rand(&inputRng);
+    float g = Rand(&inputRng);
+    float b = Rand(&inputRng);
+    baseColor.Set(i, Float3{r, g, b});
+    metallic[i] = Rand(&inputRng) < 0.5f ? 0.f : 1.f;
+  }
+
+  bool passed = true;
+
+  // RNG, seeded per pixel like RayGenShader.
+  {
+    std::vector<uint32_t> pixelX(k_count);
+    std::vector<uint32_t> pixelY(k_count);
+    std::vector<uint32_t> sampleVal(k_count);
+
+    for (size_t i = 0; i < k_count; ++i) {
+      pixelX[i] = static_cast<uint32_t>(i % 1920);
+      pixelY[i] = static_cast<uint32_t>(i / 1920);
+      sampleVal[i] = static_cast<uint32_t>(i % 1000);
+    }
+
+    std::vector<uint32_t> scalarStates(k_count);
+    std::vector<uint32_t> simdStates(k_count);
+    std::vector<float> scalarValues(k_count);
+    std::vector<float> simdValues(k_count);
+
+    size_t numMismatches = 0;
+
+    double scalarM = Benchmark(k_count, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        uint32_t rngState = InitRngSeed(pixelX[i], pixelY[i], sampleVal[i]);
+        for (int draw = 0; draw < k_numDraws; ++draw) {
+          scalarValues[i] = Rand(&rngState);
+        }
+        scalarStates[i] = rngState;
+      }
+    });
+
+    double simdM = Benchmark(k_count, [&](size_t begin, size_t end) {
+      size_t count = end - begin;
+      BatchInitRngSeed(count, &pixelX[begin], &pixelY[begin], &sampleVal[begin],
+                       &simdStates[begin]);
+      for (int draw = 0; draw < k_numDraws; ++draw) {
+        BatchRand(count, &simdStates[begin], &simdValues[begin]);
+      }
+    });
+
+    for (size_t i = 0; i < k_count; ++i) {
+      if (scalarStates[i] != simdStates[i] || scalarValues[i] != simdValues[i])
+        ++numMismatches;
+    }
+
+    printf("Rand: scalar %.1f M/s, SIMD %.1f M/s (%.1fx), %zu sequences differ%s\n",
+           scalarM * k_numDraws, simdM * k_numDraws, simdM / scalarM, numMismatches,
+           numMismatches == 0 ? "" : " FAILED");
+
+    passed &= numMismatches == 0;
+  }
+
+  // ConcentricSampleDisk, compared through its z = 0 embedding.
+  {
+    Float3Arrays scalar, simd;
+
+    double scalarM = Benchmark(k_count, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        ConcentricSampleDisk(randU[i], randV[i], &scalar.X[i], &scalar.Y[i]);
+      }
+    });
+
+    double simdM = Benchmark(k_count, [&](size_t begin, size_t end) {
+      BatchConcentricSampleDisk(end - begin, &randU[begin], &randV[begin], &simd.X[begin],
+                                &simd.Y[begin]);
+    });
+
+    passed &= Report("ConcentricSampleDisk", scalarM, simdM,
+                     GetMaxDifference(scalar, simd, false), k_maxSampleError);
+  }
+
+  {
+    Float3Arrays scalar, simd;
+
+    double scalarM = Benchmark(k_count, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        scalar.Set(i, CosineSampleHemisphere(randU[i], randV[i]));
+      }
+    });
+
+    double simdM = Benchmark(k_count, [&](size_t begin, size_t end) {
+      BatchCosineSampleHemisphere(end - begin, &randU[begin], &randV[begin],
+                                  simd.GetSoa(begin));
+    });
+
+    passed &= Report("CosineSampleHemisphere", scalarM, simdM,
+                     GetMaxDifference(scalar, simd, false), k_maxHemisphereError);
+  }
+
+  {
+    Float3Arrays scalar, simd;
+
+    double scalarM = Benchmark(k_count, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        scalar.Set(i, TrowbridgeReitzGGX_Sample_wh(randU[i], randV[i], roughness[i]));
+      }
+    });
+
+    double simdM = Benchmark(k_count, [&](size_t begin, size_t end) {
+      BatchTrowbridgeReitzGGX_Sample_wh(end - begin, &randU[begin], &randV[begin],
+                                        &roughness[begin], simd.GetSoa(begin));
+    });
+
+    passed &= Report("TrowbridgeReitzGGX_Sample_wh", scalarM, simdM,
+                     GetMaxDifference(scalar, simd, false), k_maxSampleError);
+  }
+
+  {
+    Float3Arrays scalar, simd;
+
+    double scalarM = Benchmark(k_count, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        Material material{baseColor.Get(i), metallic[i], roughness[i]};
+        scalar.Set(i, Brdf(wo.Get(i), wi.Get(i), n.Get(i), material));
+      }
+    });
+
+    double simdM = Benchmark(k_count, [&](size_t begin, size_t end) {
+      MaterialSoa materials{baseColor.GetConstSoa(begin), &metallic[begin], &roughness[begin]};
+      BatchBrdf(end - begin, wo.GetConstSoa(begin), wi.GetConstSoa(begin), n.GetConstSoa(begin),
+                materials, simd.GetSoa(begin));
+    });
+
+    passed &= Report("Brdf", scalarM, simdM, GetMaxDifference(scalar, simd, true),
+                     k_maxBrdfError);
+  }
+
+  passed &= BenchmarkMaterialClass<MaterialClass::Diffuse>(
+      "Diffuse", Material{Float3{0.7f, 0.5f, 0.3f}, 0.f, 0.9f}, wo, wi, n);
+  passed &= BenchmarkMaterialClass<MaterialClass::Metal>(
+      "Metal", Material{Float3{0.9f, 0.6f, 0.2f}, 1.f, 0.3f}, wo, wi, n);
+  passed &= BenchmarkMaterialClass<MaterialClass::Mixed>(
+      "Mixed", Material{Float3{0.5f, 0.5f, 0.5f}, 0.4f, 0.5f}, wo, wi, n);
+
+  return passed ? 0 : 1;
+}
@@ -1,8 +1,6 @@
 #include "utils/gltf_loader.h"
 
-#include <d3d12.h>
 #include <nlohmann/json.hpp>
-#include <winrt/base.h>
 
 #include <filesystem>
 #include <fstream>
@@ -125,6 +123,20 @@ Scene LoadGltf(const char* path) {
       Material material{};
       material.PbrMetallicRoughness = roughness;
 
+      if (materialJson.contains("emissiveFactor")) {
+        material.EmissiveFactor[0] = materialJson["emissiveFactor"][0];
+        material.EmissiveFactor[1] = materialJson["emissiveFactor"][1];
+        material.EmissiveFactor[2] = materialJson["emissiveFactor"][2];
+      }
+
+      material.EmissiveStrength = 1.f;
+
+      if (materialJson.contains("extensions") &&
+          materialJson["extensions"].contains("KHR_materials_emissive_strength")) {
+        material.EmissiveStrength =
+            materialJson["extensions"]["KHR_materials_emissive_strength"]["emissiveStrength"];
+      }
+
       scene.Materials.push_back(material);
     }
   }
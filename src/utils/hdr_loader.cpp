@@ -0,0 +1,140 @@
+#include "utils/hdr_loader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+namespace utils {
+
+namespace {
+
+// Reads the bytes of a file and keeps track of how far they have been parsed.
+class ByteReader {
+public:
+  explicit ByteReader(const char* path) {
+    std::ifstream strm(path, std::ios::in | std::ios::binary);
+
+    if (!strm.is_open())
+      throw std::runtime_error("Could not open file: " + std::string(path));
+
+    m_data.assign(std::istreambuf_iterator<char>(strm), std::istreambuf_iterator<char>());
+  }
+
+  bool AtEnd() const { return m_offset >= m_data.size(); }
+
+  uint8_t Read() {
+    if (AtEnd())
+      throw std::runtime_error("Unexpected end of HDR file.");
+
+    return static_cast<uint8_t>(m_data[m_offset++]);
+  }
+
+  std::string ReadLine() {
+    std::string line;
+    for (char c = static_cast<char>(Read()); c != '\n'; c = static_cast<char>(Read())) {
+      line += c;
+    }
+    return line;
+  }
+
+private:
+  std::string m_data;
+  size_t m_offset = 0;
+};
+
+// Reads one scanline of RGBE pixels, run-length encoded channel by channel if it starts with
+// the 2, 2 marker and the width, and flat otherwise.
+void ReadScanline(ByteReader* reader, uint32_t width, uint8_t* rgbe) {
+  uint8_t header[4];
+  for (uint8_t& byte : header) {
+    byte = reader->Read();
+  }
+
+  bool isRle = width >= 8 && width < 32768 && header[0] == 2 && header[1] == 2 &&
+               (header[2] << 8 | header[3]) == static_cast<int>(width);
+
+  if (!isRle) {
+    std::copy(header, header + 4, rgbe);
+    for (uint32_t i = 4; i < width * 4; ++i) {
+      rgbe[i] = reader->Read();
+    }
+    return;
+  }
+
+  for (uint32_t channel = 0; channel < 4; ++channel) {
+    for (uint32_t x = 0; x < width;) {
+      uint32_t count = reader->Read();
+
+      // Counts above 128 repeat the next byte count - 128 times, the others are followed by
+      // that many bytes.
+      bool isRun = count > 128;
+      if (isRun)
+        count -= 128;
+
+      if (count == 0 || x + count > width)
+        throw std::runtime_error("Invalid run length in HDR file.");
+
+      uint8_t value = isRun ? reader->Read() : 0;
+      for (uint32_t i = 0; i < count; ++i, ++x) {
+        rgbe[x * 4 + channel] = isRun ? value : reader->Read();
+      }
+    }
+  }
+}
+
+} // namespace
+
+HdrImage LoadHdr(const char* path) {
+  ByteReader reader(path);
+
+  std::string magic = reader.ReadLine();
+  if (magic != "#?RADIANCE" && magic != "#?RGBE")
+    throw std::runtime_error("Not a Radiance HDR file: " + std::string(path));
+
+  // Header lines run up to an empty line. Of them only the pixel format matters.
+  for (std::string line = reader.ReadLine(); !line.empty(); line = reader.ReadLine()) {
+    if (line.starts_with("FORMAT=") && line != "FORMAT=32-bit_rle_rgbe")
+      throw std::runtime_error("Unsupported HDR format: " + line);
+  }
+
+  int height = 0;
+  int width = 0;
+  char trailing = 0;
+  std::string resolution = reader.ReadLine();
+  if (std::sscanf(resolution.c_str(), "-Y %d +X %d%c", &height, &width, &trailing) != 2 ||
+      height <= 0 || width <= 0) {
+    throw std::runtime_error("Unsupported HDR resolution: " + resolution);
+  }
+
+  HdrImage image{};
+  image.Width = static_cast<uint32_t>(width);
+  image.Height = static_cast<uint32_t>(height);
+  image.Pixels.resize(static_cast<size_t>(image.Width) * image.Height * 3);
+
+  std::vector<uint8_t> rgbe(image.Width * 4);
+
+  for (uint32_t y = 0; y < image.Height; ++y) {
+    ReadScanline(&reader, image.Width, rgbe.data());
+
+    float* row = &image.Pixels[static_cast<size_t>(y) * image.Width * 3];
+
+    for (uint32_t x = 0; x < image.Width; ++x) {
+      const uint8_t* pixel = &rgbe[x * 4];
+
+      // The mantissas are fractions of 256 scaled by 2^(exponent - 128).
+      float scale = pixel[3] == 0 ? 0.f : std::ldexp(1.f, pixel[3] - 136);
+
+      for (uint32_t c = 0; c < 3; ++c) {
+        row[x * 3 + c] = static_cast<float>(pixel[c]) * scale;
+      }
+    }
+  }
+
+  return image;
+}
+
+} // namespace utils
@@ -24,9 +24,10 @@ enum class AccessorType {
   Vec3
 };
 
+// Members named after their types qualify the type with utils::, as GCC requires.
 struct Accessor {
-  BufferView* BufferView;
-  ComponentType ComponentType;
+  utils::BufferView* BufferView;
+  utils::ComponentType ComponentType;
   int Count;
   AccessorType Type;
 };
@@ -38,7 +39,12 @@ struct PbrMetallicRoughness {
 };
 
 struct Material {
-  PbrMetallicRoughness PbrMetallicRoughness;
+  utils::PbrMetallicRoughness PbrMetallicRoughness;
+
+  // The emitted radiance is EmissiveFactor times EmissiveStrength, which comes from
+  // KHR_materials_emissive_strength and is 1 without it.
+  float EmissiveFactor[3];
+  float EmissiveStrength;
 };
 
 struct Primitive {
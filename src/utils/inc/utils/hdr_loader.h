@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace utils {
+
+struct HdrImage {
+  uint32_t Width;
+  uint32_t Height;
+
+  // Linear RGB, three floats per pixel, row-major from the top row.
+  std::vector<float> Pixels;
+};
+
+// Loads a Radiance RGBE image (.hdr), with flat or run-length encoded scanlines. Only the usual
+// "-Y height +X width" orientation is supported.
+HdrImage LoadHdr(const char* path);
+
+} // namespace utils